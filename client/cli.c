@@ -4,11 +4,19 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
 #include "../common/net.h"
 #include "../common/jsonl.h"
+#include "../common/proto.h"
+#include "../common/token.h"
+#include "cli_routes.h"
 
 static const char *NM_HOST = "192.168.1.102";
 static int NM_PORT = 5050;
+#define NM_REDIRECTS 10 // leaders followed per request, covering an election
+#define CONTROL_ATTEMPTS 2 // a stale cached token is fetched again once
+
+static NMTarget g_nm; // NM_HOST:NM_PORT, or the NM_PEERS cluster
 
 extern int cli_readline(char *, int);
 
@@ -25,23 +33,32 @@ static void handle_sigint(int signo)
 
 static int nm_request(const char *line, char *out, int outlen)
 {
-  int fd = tcp_connect(NM_HOST, NM_PORT);
-  if (fd < 0)
-  {
-    perror("cli connect nm");
-    return -1;
-  }
-  send_line(fd, line);
-  char *resp = NULL;
-  if (recv_line(fd, &resp, 8192) <= 0)
+  // A follower NM answers writes with the leader's address
+  for (int attempt = 1;; attempt++)
   {
+    int fd = nm_target_connect(&g_nm);
+    if (fd < 0)
+    {
+      perror("cli connect nm");
+      return -1;
+    }
+    send_line(fd, line);
+    char *resp = NULL;
+    if (recv_line(fd, &resp, 8192) <= 0)
+    {
+      close(fd);
+      return -1;
+    }
     close(fd);
-    return -1;
+    if (attempt < NM_REDIRECTS && nm_target_redirect(&g_nm, resp))
+    {
+      free(resp);
+      continue;
+    }
+    snprintf(out, outlen, "%s", resp);
+    free(resp);
+    return 0;
   }
-  snprintf(out, outlen, "%s", resp);
-  free(resp);
-  close(fd);
-  return 0;
 }
 
 static void unescape_json_inplace(char *s)
@@ -105,6 +122,127 @@ static int ss_request(const char *host, int port, const char *line, char *out, i
   return 0;
 }
 
+// Resolve file to its storage server, from the route cache unless refresh
+// is set. Returns 1 for a cached route, 0 for one just fetched from the NM
+// with route_op, and -1 after printing why there is none.
+static int resolve_route(const char *route_op, const char *file, const char *user, int refresh,
+                         char *host, int *port)
+{
+  if (!refresh && cli_routes_get(file, host, 64, port) == 0)
+    return 1;
+
+  // Reads may be balanced onto a replica, which must have our last write
+  char out[8192] = "";
+  nm_request(jsonl_build("{\"op\":\"%s\",\"file\":\"%s\",\"user\":\"%s\",\"min_version\":%lu}",
+                         route_op, file, user, cli_routes_written(file)),
+             out, sizeof out);
+
+  int status = 1;
+  json_get_int(out, "status", &status);
+  if (status != 0)
+  {
+    printf("❌ Error: %s\n\n", out);
+    return -1;
+  }
+
+  host[0] = '\0';
+  *port = 0;
+  json_get_str(out, "ss_host", host, 64);
+  json_get_int(out, "ss_port", port);
+  if (*port <= 0 || strlen(host) == 0)
+  {
+    printf("❌ Error: Could not route to storage server\n\n");
+    return -1;
+  }
+
+  // Balanced and failover routes are good for one request only
+  int epoch = 0, cache = 1;
+  json_get_int(out, "epoch", &epoch);
+  json_get_int(out, "cache", &cache);
+  if (cache)
+    cli_routes_put(file, host, *port, (unsigned long)epoch);
+  else
+    cli_routes_drop(file);
+  return 0;
+}
+
+// A storage server that is gone or does not have the file means the
+// cached route is stale (other ERR_NOT_FOUND replies, e.g. "no undo
+// history", are real answers)
+static int route_is_stale(const char *resp)
+{
+  if (!resp)
+    return 1;
+  int status = OK;
+  char msg[64] = "";
+  json_get_int(resp, "status", &status);
+  json_get_str(resp, "msg", msg, sizeof msg);
+  return status == ERR_NOT_FOUND && !strcmp(msg, "file not found");
+}
+
+// Run a control op on file at its storage server with a token from the NM,
+// which then only hears about the outcome from the SS. Falls back to
+// having the NM run it when the NM hands out no token or the SS will not
+// take it. extra holds more request fields, each with a leading comma.
+// Returns 0 with the reply in out, -1 if the NM is unreachable.
+static int control_request(const char *op, const char *file, const char *user, const char *extra,
+                           char *out, int outlen)
+{
+  int create = !strcmp(op, "CREATE");
+  char request[2048];
+  snprintf(request, sizeof request, "{\"op\":\"%s\",\"file\":\"%s\",\"user\":\"%s\"%s}", op, file, user, extra);
+
+  for (int attempt = 0; attempt < CONTROL_ATTEMPTS; attempt++)
+  {
+    char host[64] = "", token[TOKEN_MAX] = "";
+    int port = 0;
+    long long epoch = 0, expires = 0;
+    int cached = !create && attempt == 0 &&
+                 cli_routes_get_token(file, host, sizeof host, &port, token, sizeof token) == 0;
+    if (!cached)
+    {
+      char route[8192] = "";
+      if (nm_request(jsonl_build("{\"op\":\"%s\",\"file\":\"%s\",\"user\":\"%s\"}",
+                                 create ? "CREATE_ROUTE" : "CONTROL_ROUTE", file, user),
+                     route, sizeof route) != 0)
+        return -1;
+      int status = 1;
+      json_get_int(route, "status", &status);
+      json_get_str(route, "ss_host", host, sizeof host);
+      json_get_int(route, "ss_port", &port);
+      json_get_long(route, "epoch", &epoch);
+      json_get_long(route, "expires", &expires);
+      // An NM without control routes answers ERR_BAD_REQUEST
+      if (status != 0 && status != ERR_BAD_REQUEST)
+      {
+        snprintf(out, outlen, "%s", route);
+        return 0;
+      }
+      if (status != 0 || json_get_str(route, "token", token, sizeof token) != 0 || port <= 0)
+        break;
+      if (!create)
+        cli_routes_put_token(file, host, port, (unsigned long)epoch, token, (long)expires);
+    }
+
+    char line[sizeof request + TOKEN_MAX + 16];
+    snprintf(line, sizeof line, "%.*s,\"token\":\"%s\"}", (int)strlen(request) - 1, request, token);
+    char resp[8192] = "", code[32] = "";
+    int rc = ss_request(host, port, line, resp, sizeof resp);
+    json_get_str(resp, "code", code, sizeof code);
+    if (rc == 0 && strcmp(code, "ERR_TOKEN") && !(cached && route_is_stale(resp)))
+    {
+      int status = 1;
+      json_get_int(resp, "status", &status);
+      if (create && status == 0)
+        cli_routes_put(file, host, port, (unsigned long)epoch);
+      snprintf(out, outlen, "%s", resp);
+      return 0;
+    }
+    cli_routes_drop(file);
+  }
+  return nm_request(request, out, outlen);
+}
+
 static void send_deregister(void)
 {
   if (!user_registered || user_deregistered || !current_user[0])
@@ -139,6 +277,7 @@ int main(int argc, char **argv)
   current_user[sizeof current_user - 1] = 0;
 
   char out[8192];
+  nm_target_init(&g_nm, NM_HOST, NM_PORT);
   nm_request(jsonl_build("{\"op\":\"CLI_REGISTER\",\"user\":\"%s\"}", user), out, sizeof out);
   printf("[NM] %s\n", out);
   user_registered = 1;
@@ -157,8 +296,12 @@ int main(int argc, char **argv)
   printf("  DELETE <file>             - Delete file\n");
   printf("  INFO <file>               - Show file details\n");
   printf("  UNDO <file>               - Undo last edit\n");
-  printf("  STREAM <file>             - Stream content\n");
-  printf("  LIST                      - List users\n");
+  printf("  STREAM <file> [ms]        - Stream content (word interval)\n");
+  printf("  LIST [-a]                 - List connected users (-a: everyone seen)\n");
+  printf("  STATS                     - Name server statistics\n");
+  printf("  SERVERS                   - Storage server load\n");
+  printf("  SEARCH <words...>         - Find files containing all words\n");
+  printf("  GREP [-i] [-F] <pattern>  - Find regex/substring matches\n");
   printf("  ADDACCESS -R/-W <file> <user> - Grant access\n");
   printf("  REMACCESS <file> <user>   - Remove access\n");
   printf("  REQUESTACCESS <file> <owner> - Request access to file\n");
@@ -206,18 +349,10 @@ int main(int argc, char **argv)
         }
       }
       
-      // Route through NM to get SS
-      nm_request(jsonl_build("{\"op\":\"VIEW_ROUTE\",\"user\":\"%s\"}", user), out, sizeof out);
-      char host[64] = "";
-      int port = 0;
-      json_get_str(out, "ss_host", host, sizeof host);
-      json_get_int(out, "ss_port", &port);
-      
-      if (port > 0)
+      // The NM gathers the listing from every storage server
+      char resp[8192] = "";
+      if (nm_request(jsonl_build("{\"op\":\"LIST\",\"flags\":\"%s\",\"user\":\"%s\"}", flags, user), resp, sizeof resp) == 0)
       {
-        char resp[8192];
-        ss_request(host, port, jsonl_build("{\"op\":\"LIST\",\"flags\":\"%s\",\"user\":\"%s\"}", flags, user), resp, sizeof resp);
-        
         char files[8192];
         if (json_get_str(resp, "files", files, sizeof files) == 0)
         {
@@ -248,35 +383,31 @@ int main(int argc, char **argv)
       }
       else
       {
-        printf("❌ Error: No storage server available\n\n");
+        printf("❌ Error: Name server unreachable\n\n");
       }
     }
     else if (!strncmp(line, "READ ", 5))
     {
       const char *file = line + 5;
-      nm_request(jsonl_build("{\"op\":\"READ_ROUTE\",\"file\":\"%s\",\"user\":\"%s\"}", file, user), out, sizeof out);
-
-      int status = 1;
-      json_get_int(out, "status", &status);
-      if (status != 0)
-      {
-        printf("❌ Error: %s\n\n", out);
-        continue;
-      }
-      
       char host[64] = "";
       int port = 0;
-      json_get_str(out, "ss_host", host, sizeof host);
-      json_get_int(out, "ss_port", &port);
-      
-      if (port <= 0 || strlen(host) == 0)
+      char resp[8192] = "";
+      int routed = 0;
+
+      // A cached route gets one retry through the NM if it turns out stale
+      for (int attempt = 0; attempt < 2; attempt++)
       {
-        printf("❌ Error: Could not route to storage server\n\n");
-        continue;
+        int cached = resolve_route("READ_ROUTE", file, user, attempt > 0, host, &port);
+        routed = cached >= 0;
+        if (!routed)
+          break;
+        int rc = ss_request(host, port, jsonl_build("{\"op\":\"READ\",\"user\":\"%s\",\"file\":\"%s\"}", user, file), resp, sizeof resp);
+        if (!cached || !route_is_stale(rc == 0 ? resp : NULL))
+          break;
+        cli_routes_drop(file);
       }
-      
-      char resp[8192];
-      ss_request(host, port, jsonl_build("{\"op\":\"READ\",\"user\":\"%s\",\"file\":\"%s\"}", user, file), resp, sizeof resp);
+      if (!routed)
+        continue;
       
       char content[8192];
       if (json_get_str(resp, "content", content, sizeof content) == 0)
@@ -299,47 +430,53 @@ int main(int argc, char **argv)
         continue;
       }
       
-      nm_request(jsonl_build("{\"op\":\"WRITE_ROUTE\",\"file\":\"%s\",\"user\":\"%s\"}", file, user), out, sizeof out);
-      
-      int route_status = 1;
-      json_get_int(out, "status", &route_status);
-      if (route_status != 0)
-      {
-        printf("❌ Error: %s\n\n", out);
-        continue;
-      }
-      
       char host[64] = "";
       int port = 0;
-      json_get_str(out, "ss_host", host, sizeof host);
-      json_get_int(out, "ss_port", &port);
-      
-      if (port <= 0 || strlen(host) == 0)
+      int ss_fd = -1;
+      char *resp = NULL;
+      int routed = 0;
+
+      for (int attempt = 0; attempt < 2; attempt++)
       {
-        printf("❌ Error: Could not route to storage server\n\n");
-        continue;
+        int cached = resolve_route("WRITE_ROUTE", file, user, attempt > 0, host, &port);
+        routed = cached >= 0;
+        if (!routed)
+          break;
+
+        ss_fd = tcp_connect(host, port);
+        if (ss_fd >= 0)
+        {
+          send_line(ss_fd, jsonl_build(
+            "{\"op\":\"WRITE_BEGIN\",\"user\":\"%s\",\"file\":\"%s\",\"sentence_idx\":%d}",
+            user, file, sent_idx));
+          recv_line(ss_fd, &resp, 8192);
+        }
+        if (!cached || (ss_fd >= 0 && !route_is_stale(resp)))
+          break;
+
+        if (ss_fd >= 0)
+          close(ss_fd);
+        ss_fd = -1;
+        free(resp);
+        resp = NULL;
+        cli_routes_drop(file);
       }
-      
-      int ss_fd = tcp_connect(host, port);
+      if (!routed)
+        continue;
+
       if (ss_fd < 0)
       {
         printf("❌ Failed to connect to storage server\n\n");
         continue;
       }
       
-      send_line(ss_fd, jsonl_build(
-        "{\"op\":\"WRITE_BEGIN\",\"user\":\"%s\",\"file\":\"%s\",\"sentence_idx\":%d}",
-        user, file, sent_idx));
-      
-      char *resp = NULL;
-      recv_line(ss_fd, &resp, 8192);
-      
       int status = 1;
-      json_get_int(resp, "status", &status);
+      if (resp)
+        json_get_int(resp, "status", &status);
       
       if (status != 0)
       {
-        printf("❌ Failed to acquire lock: %s\n\n", resp);
+        printf("❌ Failed to acquire lock: %s\n\n", resp ? resp : "no reply");
         free(resp);
         close(ss_fd);
         continue;
@@ -358,7 +495,10 @@ int main(int argc, char **argv)
         if (!strcmp(edit_line, "ETIRW"))
         {
           send_line(ss_fd, jsonl_build("{\"op\":\"WRITE_COMMIT\",\"file\":\"%s\",\"user\":\"%s\"}", file, user));
-          recv_line(ss_fd, &resp, 8192);
+          resp = NULL;
+          long long version = 0;
+          if (recv_line(ss_fd, &resp, 8192) > 0 && json_get_long(resp, "version", &version) == 0)
+            cli_routes_note_write(file, (unsigned long)version);
           printf("✅ Changes committed!\n\n");
           free(resp);
           committed = 1;
@@ -391,7 +531,7 @@ int main(int argc, char **argv)
     else if (!strncmp(line, "CREATE ", 7))
     {
       const char *file = line + 7;
-      nm_request(jsonl_build("{\"op\":\"CREATE\",\"file\":\"%s\",\"user\":\"%s\"}", file, user), out, sizeof out);
+      control_request("CREATE", file, user, "", out, sizeof out);
       
       int status = 1;
       json_get_int(out, "status", &status);
@@ -400,7 +540,8 @@ int main(int argc, char **argv)
     else if (!strncmp(line, "DELETE ", 7))
     {
       const char *file = line + 7;
-      nm_request(jsonl_build("{\"op\":\"DELETE\",\"file\":\"%s\",\"user\":\"%s\"}", file, user), out, sizeof out);
+      control_request("DELETE", file, user, "", out, sizeof out);
+      cli_routes_drop(file);
       
       int status = 1;
       json_get_int(out, "status", &status);
@@ -409,7 +550,7 @@ int main(int argc, char **argv)
     else if (!strncmp(line, "INFO ", 5))
     {
       const char *file = line + 5;
-      nm_request(jsonl_build("{\"op\":\"INFO\",\"file\":\"%s\",\"user\":\"%s\"}", file, user), out, sizeof out);
+      control_request("INFO", file, user, "", out, sizeof out);
       
       char info[2048];
       if (json_get_str(out, "info", info, sizeof info) == 0)
@@ -487,44 +628,40 @@ int main(int argc, char **argv)
         printf("❌ Error: %s\n\n", out);
       }
     }
-    else if (!strcmp(line, "LIST"))
+    else if (!strncmp(line, "SEARCH ", 7))
     {
-      nm_request(jsonl_build("{\"op\":\"LIST_USERS\",\"user\":\"%s\"}", user), out, sizeof out);
-      
-      char users[4096];
-      if (json_get_str(out, "users", users, sizeof users) == 0)
+      const char *query = line + 7;
+      nm_request(jsonl_build("{\"op\":\"SEARCH\",\"query\":\"%s\",\"user\":\"%s\"}", query, user), out, sizeof out);
+
+      char results[8192];
+      if (json_get_str(out, "results", results, sizeof results) == 0)
       {
-        printf("\n👥 Users:\n");
-        if (strlen(users) == 0)
+        if (strlen(results) == 0)
         {
-          printf("(none)\n\n");
+          printf("\n🔎 No matches for \"%s\".\n\n", query);
         }
         else
         {
-          char users_copy[4096];
-          strncpy(users_copy, users, sizeof users_copy - 1);
-          users_copy[sizeof users_copy - 1] = '\0';
-          char *tok = strtok(users_copy, ",");
-          int printed = 0;
-          while (tok)
+          printf("\n🔎 Matches for \"%s\":\n", query);
+          char *p = results;
+          char *delim;
+          int rank = 0;
+          while ((delim = strstr(p, ";;")) != NULL)
           {
-            while (*tok == ' ')
-              tok++;
-            char *end = tok + strlen(tok) - 1;
-            while (end >= tok && (*end == ' ' || *end == '\n'))
-            {
-              *end = '\0';
-              end--;
-            }
-            if (*tok)
+            *delim = '\0';
+            // file|score|sentence|snippet
+            char *score = strchr(p, '|');
+            char *sentence = score ? strchr(score + 1, '|') : NULL;
+            char *snippet = sentence ? strchr(sentence + 1, '|') : NULL;
+            if (snippet)
             {
-              printf("%s\n", tok);
-              printed = 1;
+              *score++ = '\0';
+              *sentence++ = '\0';
+              *snippet++ = '\0';
+              printf("%2d. %s (score %s, sentence %s)\n    %s\n", ++rank, p, score, sentence, snippet);
             }
-            tok = strtok(NULL, ",");
+            p = delim + 2;
           }
-          if (!printed)
-            printf("(none)\n");
           printf("\n");
         }
       }
@@ -533,49 +670,291 @@ int main(int argc, char **argv)
         printf("❌ Error: %s\n\n", out);
       }
     }
+    else if (!strncmp(line, "GREP ", 5))
+    {
+      // GREP [-i] [-F] <pattern>: the pattern is the rest of the line
+      char gflags[8] = "";
+      const char *pattern = line + 5;
+      for (;;)
+      {
+        while (*pattern == ' ')
+          pattern++;
+        if (strncmp(pattern, "-i ", 3) && strncmp(pattern, "-F ", 3))
+          break;
+        if (!strchr(gflags, pattern[1]))
+          strncat(gflags, pattern + 1, 1);
+        pattern += 3;
+      }
+      if (!*pattern)
+      {
+        printf("❌ Usage: GREP [-i] [-F] <pattern>\n\n");
+        continue;
+      }
+
+      int nm_fd = nm_target_connect(&g_nm);
+      if (nm_fd < 0)
+      {
+        printf("❌ Failed to connect\n\n");
+        continue;
+      }
+      send_line(nm_fd, jsonl_build("{\"op\":\"GREP\",\"pattern\":\"%s\",\"flags\":\"%s\",\"user\":\"%s\"}",
+                                   pattern, gflags, user));
+
+      printf("\n🔍 Matches for /%s/:\n", pattern);
+      int hits = 0, status = 0;
+      char *resp = NULL;
+      while (recv_line(nm_fd, &resp, 8192) > 0)
+      {
+        char op[16] = "";
+        json_get_str(resp, "op", op, sizeof op);
+        if (!strcmp(op, "STOP"))
+        {
+          json_get_int(resp, "status", &status);
+          free(resp);
+          break;
+        }
+        char file[256] = "", text[256] = "";
+        int sentence = 0, word = 0;
+        json_get_str(resp, "file", file, sizeof file);
+        json_get_int(resp, "sentence", &sentence);
+        json_get_int(resp, "word", &word);
+        json_get_str(resp, "text", text, sizeof text);
+        printf("  %s:%d:%d: %s\n", file, sentence, word, text);
+        hits++;
+        free(resp);
+        resp = NULL;
+      }
+      close(nm_fd);
+
+      if (status != 0)
+        printf("❌ Invalid pattern\n\n");
+      else if (hits == 0)
+        printf("  (no matches)\n\n");
+      else
+        printf("\n");
+    }
+    else if (!strcmp(line, "LIST") || !strcmp(line, "LIST -a"))
+    {
+      int nm_fd = nm_target_connect(&g_nm);
+      if (nm_fd < 0)
+      {
+        printf("❌ Failed to connect\n\n");
+        continue;
+      }
+      send_line(nm_fd, jsonl_build("{\"op\":\"LIST_USERS\",\"flags\":\"%s\",\"user\":\"%s\"}",
+                                   line[4] ? "a" : "", user));
+
+      // Pages of "name|sessions|last_seen|host:port;..." until STOP
+      printf("\n👥 Users:\n");
+      printf("%-20s %8s %8s  %s\n", "USER", "SESSIONS", "IDLE_S", "ADDRESS");
+      int count = 0, stopped = 0;
+      time_t now = time(NULL);
+      char *resp = NULL;
+      while (recv_line(nm_fd, &resp, 8192) > 0)
+      {
+        char op[16] = "";
+        json_get_str(resp, "op", op, sizeof op);
+        if (!strcmp(op, "STOP"))
+        {
+          stopped = 1;
+          break;
+        }
+        char users[8192] = "";
+        json_get_str(resp, "users", users, sizeof users);
+        char *save = NULL;
+        for (char *entry = strtok_r(users, ";", &save); entry; entry = strtok_r(NULL, ";", &save))
+        {
+          char name[64] = "", address[80] = "";
+          int sessions = 0;
+          long last_seen = 0;
+          if (sscanf(entry, "%63[^|]|%d|%ld|%79s", name, &sessions, &last_seen, address) < 3)
+            continue;
+          printf("%-20s %8d %8ld  %s\n", name, sessions, last_seen ? (long)now - last_seen : -1L, address);
+          count++;
+        }
+        free(resp);
+        resp = NULL;
+      }
+      free(resp);
+      close(nm_fd);
+
+      if (!stopped)
+        printf("❌ Connection to Name Server lost\n\n");
+      else if (count == 0)
+        printf("(none)\n\n");
+      else
+        printf("\n");
+    }
+    else if (!strcmp(line, "STATS"))
+    {
+      nm_request(jsonl_build("{\"op\":\"STATS\",\"user\":\"%s\"}", user), out, sizeof out);
+
+      int status = 1, files = 0, entries = 0, capacity = 0, hits = 0, negative = 0, misses = 0, evictions = 0;
+      json_get_int(out, "status", &status);
+      if (status == 0)
+      {
+        json_get_int(out, "files", &files);
+        json_get_int(out, "route_cache_entries", &entries);
+        json_get_int(out, "route_cache_capacity", &capacity);
+        json_get_int(out, "route_cache_hits", &hits);
+        json_get_int(out, "route_cache_negative_hits", &negative);
+        json_get_int(out, "route_cache_misses", &misses);
+        json_get_int(out, "route_cache_evictions", &evictions);
+        printf("\n📈 Name Server:\n");
+        printf("Files: %d\n", files);
+        printf("Route cache: %d/%d entries\n", entries, capacity);
+        printf("Hits: %d (not found: %d)  Misses: %d  Evictions: %d\n\n", hits, negative, misses, evictions);
+      }
+      else
+      {
+        printf("❌ Error: %s\n\n", out);
+      }
+    }
+    else if (!strcmp(line, "SERVERS"))
+    {
+      nm_request(jsonl_build("{\"op\":\"SERVERS\",\"user\":\"%s\"}", user), out, sizeof out);
+
+      char servers[4096];
+      int status = 1;
+      json_get_int(out, "status", &status);
+      if (status == 0 && json_get_str(out, "servers", servers, sizeof servers) == 0)
+      {
+        printf("\n🖥  Storage Servers:\n");
+        if (!servers[0])
+          printf("(none)\n");
+        else
+          printf("%-10s %-21s %-5s %7s %12s %6s %8s %8s %9s %12s %6s %9s %9s\n", "ID", "ADDRESS", "STATE", "FILES",
+                 "BYTES", "CONNS", "QPS", "QPS_AVG", "P99_US", "FREE_DISK", "AGE_S", "REPL_PEND", "REPL_MS");
+
+        char *record = servers;
+        while (record && *record)
+        {
+          char *next = strstr(record, ";;");
+          if (next)
+          {
+            *next = '\0';
+            next += 2;
+          }
+          char *fields[13] = {0};
+          int nf = 0;
+          for (char *tok = strtok(record, "|"); tok && nf < 13; tok = strtok(NULL, "|"))
+            fields[nf++] = tok;
+          if (nf == 13)
+            printf("%-10s %-21s %-5s %7s %12s %6s %8s %8s %9s %12s %6s %9s %9s\n", fields[0], fields[1], fields[2],
+                   fields[3], fields[4], fields[5], fields[6], fields[7], fields[8], fields[9], fields[10],
+                   fields[11], fields[12]);
+          record = next;
+        }
+        printf("\n");
+      }
+      else
+      {
+        printf("❌ Error: %s\n\n", out);
+      }
+    }
     else if (!strncmp(line, "UNDO ", 5))
     {
       const char *file = line + 5;
-      
-      nm_request(jsonl_build("{\"op\":\"WRITE_ROUTE\",\"file\":\"%s\",\"user\":\"%s\"}", file, user), out, sizeof out);
       char host[64] = "";
       int port = 0;
-      json_get_str(out, "ss_host", host, sizeof host);
-      json_get_int(out, "ss_port", &port);
-      
-      char resp[8192];
-      ss_request(host, port, jsonl_build("{\"op\":\"UNDO\",\"user\":\"%s\",\"file\":\"%s\"}", user, file), resp, sizeof resp);
+      char resp[8192] = "";
+      int routed = 0;
+
+      for (int attempt = 0; attempt < 2; attempt++)
+      {
+        int cached = resolve_route("WRITE_ROUTE", file, user, attempt > 0, host, &port);
+        routed = cached >= 0;
+        if (!routed)
+          break;
+        int rc = ss_request(host, port, jsonl_build("{\"op\":\"UNDO\",\"user\":\"%s\",\"file\":\"%s\"}", user, file), resp, sizeof resp);
+        if (!cached || !route_is_stale(rc == 0 ? resp : NULL))
+          break;
+        cli_routes_drop(file);
+      }
+      if (!routed)
+        continue;
       
       int status = 1;
       json_get_int(resp, "status", &status);
-      printf("%s\n\n", status == 0 ? "↩️  Undo successful!" : "❌ Undo failed");
+      if (status == 0)
+      {
+        long long version = 0;
+        if (json_get_long(resp, "version", &version) == 0)
+          cli_routes_note_write(file, (unsigned long)version);
+        printf("↩️  Undo successful!\n\n");
+      }
+      else
+      {
+        char msg[256] = "";
+        json_get_str(resp, "msg", msg, sizeof msg);
+        printf("❌ Undo failed%s%s\n\n", msg[0] ? ": " : "", msg);
+      }
     }
     else if (!strncmp(line, "STREAM ", 7))
     {
-      const char *file = line + 7;
-      
-      nm_request(jsonl_build("{\"op\":\"STREAM_ROUTE\",\"file\":\"%s\",\"user\":\"%s\"}", file, user), out, sizeof out);
+      // STREAM <file> [interval_ms]; 0 streams without delay
+      char file[256] = "";
+      int interval_ms = 100;
+      if (sscanf(line + 7, "%255s %d", file, &interval_ms) < 1)
+      {
+        printf("❌ Usage: STREAM <file> [interval_ms]\n\n");
+        continue;
+      }
+
       char host[64] = "";
       int port = 0;
-      json_get_str(out, "ss_host", host, sizeof host);
-      json_get_int(out, "ss_port", &port);
-      
-      int ss_fd = tcp_connect(host, port);
+      int ss_fd = -1;
+      char *resp = NULL;
+      int routed = 0;
+
+      for (int attempt = 0; attempt < 2; attempt++)
+      {
+        int cached = resolve_route("STREAM_ROUTE", file, user, attempt > 0, host, &port);
+        routed = cached >= 0;
+        if (!routed)
+          break;
+
+        ss_fd = tcp_connect(host, port);
+        if (ss_fd >= 0)
+        {
+          send_line(ss_fd, jsonl_build("{\"op\":\"STREAM\",\"user\":\"%s\",\"file\":\"%s\",\"interval_ms\":%d}",
+                                       user, file, interval_ms));
+          recv_line(ss_fd, &resp, 8192);
+        }
+        if (!cached || (ss_fd >= 0 && !route_is_stale(resp)))
+          break;
+
+        if (ss_fd >= 0)
+          close(ss_fd);
+        ss_fd = -1;
+        free(resp);
+        resp = NULL;
+        cli_routes_drop(file);
+      }
+      if (!routed)
+        continue;
+
       if (ss_fd < 0)
       {
         printf("❌ Failed to connect\n\n");
         continue;
       }
-      
-      send_line(ss_fd, jsonl_build("{\"op\":\"STREAM\",\"user\":\"%s\",\"file\":\"%s\"}", user, file));
+
+      char op[64] = "";
+      if (resp && json_get_str(resp, "op", op, sizeof op) != 0)
+      {
+        // Refused before streaming started
+        printf("❌ Error: %s\n", resp);
+        free(resp);
+        close(ss_fd);
+        continue;
+      }
       
       printf("\n🎬 Streaming %s:\n", file);
       printf("━━━━━━━━━━━━━━━━━━━━━━━━━━━\n");
       
-      char *resp = NULL;
-      while (recv_line(ss_fd, &resp, 8192) > 0)
+      while (resp)
       {
-        char op[64];
         json_get_str(resp, "op", op, sizeof op);
         
         if (!strcmp(op, "STOP"))
@@ -593,6 +972,8 @@ int main(int argc, char **argv)
         }
         
         free(resp);
+        resp = NULL;
+        recv_line(ss_fd, &resp, 8192);
       }
       
       printf("\n━━━━━━━━━━━━━━━━━━━━━━━━━━━\n\n");
@@ -614,9 +995,8 @@ int main(int argc, char **argv)
           continue;
         }
         
-        nm_request(jsonl_build("{\"op\":\"ADDACCESS\",\"file\":\"%s\",\"mode\":\"%s\",\"target_user\":\"%s\",\"user\":\"%s\"}",
-                               file, mode, target_user, user),
-                   out, sizeof out);
+        control_request("ADDACCESS", file, user,
+                        jsonl_build(",\"mode\":\"%s\",\"target_user\":\"%s\"", mode, target_user), out, sizeof out);
         
         int status = 1;
         json_get_int(out, "status", &status);
@@ -634,9 +1014,7 @@ int main(int argc, char **argv)
       char file[256], target_user[64];
       if (sscanf(line + 10, "%s %s", file, target_user) == 2)
       {
-        nm_request(jsonl_build("{\"op\":\"REMACCESS\",\"file\":\"%s\",\"target_user\":\"%s\",\"user\":\"%s\"}",
-                               file, target_user, user),
-                   out, sizeof out);
+        control_request("REMACCESS", file, user, jsonl_build(",\"target_user\":\"%s\"", target_user), out, sizeof out);
 
         int status = 1;
         json_get_int(out, "status", &status);
@@ -680,7 +1058,8 @@ int main(int argc, char **argv)
       char file[256], folder[256];
       if (sscanf(line + 5, "%s %s", file, folder) == 2)
       {
-        nm_request(jsonl_build("{\"op\":\"MOVE\",\"file\":\"%s\",\"folder\":\"%s\",\"user\":\"%s\"}", file, folder, user), out, sizeof out);
+        control_request("MOVE", file, user, jsonl_build(",\"folder\":\"%s\"", folder), out, sizeof out);
+        cli_routes_drop(file);
         int status = 1;
         json_get_int(out, "status", &status);
         printf("%s\n\n", status == 0 ? "✅ File moved" : "❌ Failed to move file");
@@ -729,7 +1108,7 @@ int main(int argc, char **argv)
       char file[256], tag[128];
       if (sscanf(line + 11, "%s %s", file, tag) == 2)
       {
-      nm_request(jsonl_build("{\"op\":\"CHECKPOINT\",\"file\":\"%s\",\"tag\":\"%s\",\"user\":\"%s\"}", file, tag, user), out, sizeof out);
+        control_request("CHECKPOINT", file, user, jsonl_build(",\"tag\":\"%s\"", tag), out, sizeof out);
         int status = 1;
         json_get_int(out, "status", &status);
         printf("%s\n\n", status == 0 ? "✅ Checkpoint created" : "❌ Failed to create checkpoint");
@@ -767,7 +1146,7 @@ int main(int argc, char **argv)
       char file[256], tag[128];
       if (sscanf(line + 7, "%s %s", file, tag) == 2)
       {
-        nm_request(jsonl_build("{\"op\":\"REVERT\",\"file\":\"%s\",\"tag\":\"%s\",\"user\":\"%s\"}", file, tag, user), out, sizeof out);
+        control_request("REVERT", file, user, jsonl_build(",\"tag\":\"%s\"", tag), out, sizeof out);
         int status = 1;
         json_get_int(out, "status", &status);
         printf("%s\n\n", status == 0 ? "✅ File reverted" : "❌ Failed to revert");
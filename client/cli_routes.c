@@ -0,0 +1,114 @@
+#include "cli_routes.h"
+#include "../common/token.h"
+#include <string.h>
+#include <time.h>
+
+typedef struct
+{
+  char file[256];
+  char host[64];
+  int port;
+  unsigned long epoch;
+  int used;
+  char token[TOKEN_MAX]; // "" if none
+  long expires;
+} Route;
+
+typedef struct
+{
+  char file[256];
+  unsigned long version;
+} Written;
+
+// Direct-mapped: a file lives in one slot and a colliding file replaces it
+static Route g_routes[CLI_ROUTE_SLOTS];
+static Written g_written[CLI_ROUTE_SLOTS];
+static unsigned long g_epoch = 0; // newest epoch seen from the NM
+
+static unsigned long slot_index(const char *file)
+{
+  unsigned long hash = 5381;
+  int c;
+  while ((c = (unsigned char)*file++))
+    hash = ((hash << 5) + hash) + c;
+  return hash % CLI_ROUTE_SLOTS;
+}
+
+static Route *slot_for(const char *file)
+{
+  return &g_routes[slot_index(file)];
+}
+
+int cli_routes_get(const char *file, char *host, size_t hostlen, int *port)
+{
+  Route *r = slot_for(file);
+  if (!r->used || strcmp(r->file, file) || r->epoch < g_epoch)
+    return -1;
+  strncpy(host, r->host, hostlen - 1);
+  host[hostlen - 1] = '\0';
+  *port = r->port;
+  return 0;
+}
+
+void cli_routes_put(const char *file, const char *host, int port, unsigned long epoch)
+{
+  if (epoch > g_epoch)
+    g_epoch = epoch;
+
+  Route *r = slot_for(file);
+  strncpy(r->file, file, sizeof r->file - 1);
+  r->file[sizeof r->file - 1] = '\0';
+  strncpy(r->host, host, sizeof r->host - 1);
+  r->host[sizeof r->host - 1] = '\0';
+  r->port = port;
+  r->epoch = epoch;
+  r->used = 1;
+  r->token[0] = '\0';
+}
+
+int cli_routes_get_token(const char *file, char *host, size_t hostlen, int *port, char *token, size_t tokenlen)
+{
+  Route *r = slot_for(file);
+  if (cli_routes_get(file, host, hostlen, port) != 0 || !r->token[0] ||
+      r->expires - CLI_TOKEN_MARGIN <= (long)time(NULL))
+    return -1;
+  strncpy(token, r->token, tokenlen - 1);
+  token[tokenlen - 1] = '\0';
+  return 0;
+}
+
+void cli_routes_put_token(const char *file, const char *host, int port, unsigned long epoch,
+                          const char *token, long expires)
+{
+  cli_routes_put(file, host, port, epoch);
+  Route *r = slot_for(file);
+  strncpy(r->token, token, sizeof r->token - 1);
+  r->token[sizeof r->token - 1] = '\0';
+  r->expires = expires;
+}
+
+void cli_routes_drop(const char *file)
+{
+  Route *r = slot_for(file);
+  if (r->used && !strcmp(r->file, file))
+    r->used = 0;
+}
+
+void cli_routes_note_write(const char *file, unsigned long version)
+{
+  Written *w = &g_written[slot_index(file)];
+  if (strcmp(w->file, file))
+  {
+    strncpy(w->file, file, sizeof w->file - 1);
+    w->file[sizeof w->file - 1] = '\0';
+    w->version = 0;
+  }
+  if (version > w->version)
+    w->version = version;
+}
+
+unsigned long cli_routes_written(const char *file)
+{
+  Written *w = &g_written[slot_index(file)];
+  return strcmp(w->file, file) ? 0 : w->version;
+}
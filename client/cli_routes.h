@@ -0,0 +1,32 @@
+#ifndef CLI_ROUTES_H
+#define CLI_ROUTES_H
+#include <stddef.h>
+
+// Client-side route cache: file -> storage server endpoint, so repeated
+// READ/WRITE/STREAM/UNDO on a file skip the Name Server round trip.
+// Every route carries the NM routing epoch it was issued under; once a
+// newer epoch is seen, routes issued earlier are no longer trusted.
+
+#define CLI_ROUTE_SLOTS 256
+
+// Returns 0 and fills host/port on a hit, -1 on a miss
+int cli_routes_get(const char *file, char *host, size_t hostlen, int *port);
+void cli_routes_put(const char *file, const char *host, int port, unsigned long epoch);
+void cli_routes_drop(const char *file);
+
+// Control routes also carry the NM's token for running control ops on the
+// file at that SS (see common/token.h). get_token misses when the route
+// has no token or it expires within CLI_TOKEN_MARGIN seconds; a plain put
+// for the file forgets the token.
+#define CLI_TOKEN_MARGIN 2
+int cli_routes_get_token(const char *file, char *host, size_t hostlen, int *port, char *token, size_t tokenlen);
+void cli_routes_put_token(const char *file, const char *host, int port, unsigned long epoch,
+                          const char *token, long expires);
+
+// File version of this client's last committed write to file (0 if none),
+// sent as min_version so a read never lands on a replica that lacks it.
+// Kept per slot like routes; a colliding file forgets it.
+void cli_routes_note_write(const char *file, unsigned long version);
+unsigned long cli_routes_written(const char *file);
+
+#endif
@@ -4,7 +4,7 @@
 #include <string.h>
 
 char *jsonl_build(const char *fmt, ...) {
-  static char buf[8192];
+  static _Thread_local char buf[8192];
   va_list ap; va_start(ap, fmt);
   vsnprintf(buf, sizeof buf, fmt, ap);
   va_end(ap);
@@ -12,7 +12,7 @@ char *jsonl_build(const char *fmt, ...) {
 }
 
 static const char *find_key(const char *json, const char *key) {
-  static char pat[256];
+  char pat[256];
   snprintf(pat, sizeof pat, "\"%s\"", key);
   return strstr(json, pat);
 }
@@ -42,3 +42,15 @@ int json_get_int(const char *json, const char *key, int *out) {
   return 0;
 }
 
+int json_get_long(const char *json, const char *key, long long *out) {
+  const char *p = find_key(json, key);
+  if (!p) return -1;
+  p = strchr(p, ':'); if (!p) return -1; p++;
+  while (*p==' '){p++;}
+  long long val=0; int sign=1;
+  if (*p=='-'){ sign=-1; p++; }
+  if (*p<'0' || *p>'9') return -1;
+  while (*p>='0' && *p<='9'){ val = val*10 + (*p-'0'); p++; }
+  *out = sign*val;
+  return 0;
+}
@@ -1,5 +1,7 @@
 #define _POSIX_C_SOURCE 200809L
 #include "net.h"
+#include "jsonl.h"
+#include "proto.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -9,6 +11,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdio.h>
+#include <time.h>
 
 static int tcp_socket_addr(const char *host, const char *port, int passive, struct addrinfo **res) {
   struct addrinfo hints = {0};
@@ -90,3 +93,62 @@ int set_cloexec(int fd) {
   return fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
 }
 
+
+int nm_peers_parse(const char *list, NMPeer *out, int max) {
+  int n=0;
+  while (list && *list && n<max) {
+    size_t len = strcspn(list, ",");
+    char entry[128];
+    if (len < sizeof entry) {
+      memcpy(entry, list, len); entry[len]=0;
+      NMPeer *p = &out[n];
+      if (sscanf(entry, "%d=%63[^:]:%d", &p->id, p->host, &p->port) == 3 && p->id > 0 && p->port > 0) n++;
+    }
+    list += len;
+    if (*list==',') list++;
+  }
+  return n;
+}
+
+void nm_target_init(NMTarget *t, const char *host, int port) {
+  memset(t, 0, sizeof *t);
+  t->count = nm_peers_parse(getenv("NM_PEERS"), t->peers, NM_TARGET_MAX_PEERS);
+  if (t->count) { memcpy(t->host, t->peers[0].host, sizeof t->host); t->port = t->peers[0].port; }
+  else { strncpy(t->host, host, sizeof t->host - 1); t->port = port; }
+}
+
+// Point t at the peer after the current one
+static void nm_target_next(NMTarget *t) {
+  if (!t->count) return;
+  int i=0;
+  while (i<t->count && !(t->peers[i].port==t->port && !strcmp(t->peers[i].host, t->host))) i++;
+  const NMPeer *p = &t->peers[i<t->count ? (i+1) % t->count : 0];
+  memcpy(t->host, p->host, sizeof t->host);
+  t->port = p->port;
+}
+
+int nm_target_connect(NMTarget *t) {
+  int fd = tcp_connect(t->host, t->port);
+  for (int i=0; fd<0 && i<t->count; i++) {
+    nm_target_next(t);
+    fd = tcp_connect(t->host, t->port);
+  }
+  return fd;
+}
+
+int nm_target_redirect(NMTarget *t, const char *reply) {
+  int status=0; char leader[96]="";
+  if (!reply || json_get_int(reply, "status", &status)!=0 || status!=ERR_NOT_LEADER) return 0;
+  json_get_str(reply, "leader", leader, sizeof leader);
+  char *colon = strrchr(leader, ':');
+  if (colon && atoi(colon+1)>0) {
+    *colon=0;
+    snprintf(t->host, sizeof t->host, "%s", leader);
+    t->port = atoi(colon+1);
+  } else {
+    struct timespec pause = {0, 200000000L}; // elections take a timeout or two
+    nanosleep(&pause, NULL);
+    nm_target_next(t);
+  }
+  return 1;
+}
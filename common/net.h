@@ -16,5 +16,29 @@ ssize_t recv_line(int fd, char **out, size_t max);
 
 // Set CLOEXEC + nonblocking helpers (optional)
 int set_cloexec(int fd);
+
+// One Name Server of a cluster, as listed in NM_PEERS
+// ("1=host:port,2=host:port,..."; port is the client port)
+typedef struct { int id; char host[64]; int port; } NMPeer;
+
+// Parse an NM_PEERS list into out. Returns the number of peers read, at
+// most max; malformed entries are skipped.
+int nm_peers_parse(const char *list, NMPeer *out, int max);
+
+// Where a client of the Name Server sends requests: the leader as last
+// learned, starting at host:port, or the first NM in NM_PEERS if set
+#define NM_TARGET_MAX_PEERS 8
+typedef struct { char host[64]; int port; NMPeer peers[NM_TARGET_MAX_PEERS]; int count; } NMTarget;
+
+void nm_target_init(NMTarget *t, const char *host, int port);
+
+// Connect to the target, moving on through the peers while they refuse.
+// Returns fd or -1.
+int nm_target_connect(NMTarget *t);
+
+// If reply is ERR_NOT_LEADER, retarget at the leader it names, or at the
+// next peer after a pause while an election is on, and return 1: the
+// request should be sent again. Returns 0 for any other reply.
+int nm_target_redirect(NMTarget *t, const char *reply);
 #endif
 
@@ -12,5 +12,14 @@
 #define ERR_BUSY 7
 #define ERR_OOSCOPE 8
 #define ERR_ALREADY_EXISTS 9
+#define ERR_NOT_LEADER 10 // this NM is a follower; the reply names the leader
+
+// Leaves of the Merkle trees storage servers keep for anti-entropy; the NM
+// walks the trees with the same shape
+#define MERKLE_LEAVES 1024
+
+// Limits of one page of an SS's registration file list
+#define REG_PAGE_BYTES 6000 // "files" value; the NM reads lines of up to 8192
+#define REG_PAGE_NAMES 1024
 
 #endif
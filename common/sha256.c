@@ -0,0 +1,94 @@
+#include "sha256.h"
+#include <string.h>
+
+static const unsigned int K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void compress(Sha256 *s, const unsigned char *p) {
+  unsigned int w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = (unsigned int)p[4*i] << 24 | (unsigned int)p[4*i+1] << 16 | (unsigned int)p[4*i+2] << 8 | p[4*i+3];
+  for (int i = 16; i < 64; i++) {
+    unsigned int s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3);
+    unsigned int s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10);
+    w[i] = w[i-16] + s0 + w[i-7] + s1;
+  }
+  unsigned int a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3];
+  unsigned int e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+  for (int i = 0; i < 64; i++) {
+    unsigned int t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+    unsigned int t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+  s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+void sha256_init(Sha256 *s) {
+  static const unsigned int H0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                     0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  memcpy(s->h, H0, sizeof H0);
+  s->used = 0; s->total = 0;
+}
+
+void sha256_update(Sha256 *s, const void *data, size_t len) {
+  const unsigned char *p = data;
+  s->total += len;
+  while (len > 0) {
+    size_t n = 64 - s->used < len ? 64 - s->used : len;
+    memcpy(s->block + s->used, p, n);
+    s->used += n; p += n; len -= n;
+    if (s->used == 64) { compress(s, s->block); s->used = 0; }
+  }
+}
+
+void sha256_final(Sha256 *s, unsigned char out[SHA256_BYTES]) {
+  unsigned long long bits = s->total * 8;
+  unsigned char pad = 0x80;
+  sha256_update(s, &pad, 1);
+  pad = 0;
+  while (s->used != 56) sha256_update(s, &pad, 1);
+  unsigned char len[8];
+  for (int i = 0; i < 8; i++) len[i] = (unsigned char)(bits >> (56 - 8*i));
+  sha256_update(s, len, 8);
+  for (int i = 0; i < 8; i++) {
+    out[4*i] = (unsigned char)(s->h[i] >> 24); out[4*i+1] = (unsigned char)(s->h[i] >> 16);
+    out[4*i+2] = (unsigned char)(s->h[i] >> 8); out[4*i+3] = (unsigned char)s->h[i];
+  }
+}
+
+void sha256(const void *data, size_t len, unsigned char out[SHA256_BYTES]) {
+  Sha256 s; sha256_init(&s); sha256_update(&s, data, len); sha256_final(&s, out);
+}
+
+void hmac_sha256_init(HmacSha256 *h, const unsigned char *key, size_t keylen) {
+  unsigned char k[64] = {0}, ipad[64];
+  if (keylen > 64) sha256(key, keylen, k);
+  else memcpy(k, key, keylen);
+  for (int i = 0; i < 64; i++) { ipad[i] = k[i] ^ 0x36; h->opad[i] = k[i] ^ 0x5c; }
+  sha256_init(&h->inner);
+  sha256_update(&h->inner, ipad, sizeof ipad);
+}
+
+void hmac_sha256_update(HmacSha256 *h, const void *data, size_t len) {
+  sha256_update(&h->inner, data, len);
+}
+
+void hmac_sha256_final(HmacSha256 *h, unsigned char out[SHA256_BYTES]) {
+  unsigned char inner[SHA256_BYTES];
+  sha256_final(&h->inner, inner);
+  Sha256 outer; sha256_init(&outer);
+  sha256_update(&outer, h->opad, sizeof h->opad);
+  sha256_update(&outer, inner, sizeof inner);
+  sha256_final(&outer, out);
+}
@@ -0,0 +1,22 @@
+#ifndef SHA256_H
+#define SHA256_H
+#include <stddef.h>
+
+// SHA-256 (FIPS 180-4) and HMAC-SHA256 (RFC 2104), enough to sign the
+// capability tokens the NM hands to clients
+#define SHA256_BYTES 32
+
+typedef struct { unsigned int h[8]; unsigned char block[64]; size_t used; unsigned long long total; } Sha256;
+
+void sha256_init(Sha256 *s);
+void sha256_update(Sha256 *s, const void *data, size_t len);
+void sha256_final(Sha256 *s, unsigned char out[SHA256_BYTES]);
+void sha256(const void *data, size_t len, unsigned char out[SHA256_BYTES]);
+
+// Incremental HMAC: init with the key, feed the message, final
+typedef struct { Sha256 inner; unsigned char opad[64]; } HmacSha256;
+
+void hmac_sha256_init(HmacSha256 *h, const unsigned char *key, size_t keylen);
+void hmac_sha256_update(HmacSha256 *h, const void *data, size_t len);
+void hmac_sha256_final(HmacSha256 *h, unsigned char out[SHA256_BYTES]);
+#endif
@@ -0,0 +1,103 @@
+#include "token.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+char token_op(const char *op) {
+  static const struct { const char *op; char letter; } ops[] = {
+    {"CREATE", 'C'}, {"DELETE", 'D'}, {"INFO", 'I'}, {"ADDACCESS", 'A'}, {"REMACCESS", 'A'},
+    {"CHECKPOINT", 'K'}, {"MOVE", 'M'}, {"REVERT", 'R'}, {"VIEWCHECKPOINT", 'V'}, {"LISTCHECKPOINTS", 'V'},
+    {"MERKLE", 'T'}, {"MERKLE_LEAVES", 'T'}, {"RESYNC", 'S'}};
+  for (size_t i = 0; i < sizeof ops / sizeof ops[0]; i++)
+    if (!strcmp(op, ops[i].op)) return ops[i].letter;
+  return 0;
+}
+
+static void hex(const unsigned char *bytes, size_t n, char *out) {
+  static const char digits[] = "0123456789abcdef";
+  for (size_t i = 0; i < n; i++) { out[2*i] = digits[bytes[i] >> 4]; out[2*i+1] = digits[bytes[i] & 15]; }
+  out[2*n] = '\0';
+}
+
+// The MAC covers the token's own fields and what it is bound to; fields
+// are NUL-separated so no two bindings hash alike
+static void mac(const unsigned char *key, const char *fields, const char *file, const char *user,
+                const char *ss_id, char out[TOKEN_KEY_HEX]) {
+  HmacSha256 h;
+  hmac_sha256_init(&h, key, SHA256_BYTES);
+  const char *parts[] = {fields, file, user, ss_id};
+  for (int i = 0; i < 4; i++) hmac_sha256_update(&h, parts[i], strlen(parts[i]) + 1);
+  unsigned char digest[SHA256_BYTES];
+  hmac_sha256_final(&h, digest);
+  hex(digest, sizeof digest, out);
+}
+
+// Compare in constant time so the MAC cannot be guessed a byte at a time
+static int same_mac(const char *given, const char expected[TOKEN_KEY_HEX]) {
+  unsigned char diff = strlen(given) != strlen(expected);
+  for (size_t i = 0; i < TOKEN_KEY_HEX - 1 && given[i]; i++) diff |= given[i] ^ expected[i];
+  return !diff;
+}
+
+int token_sign(const unsigned char key[SHA256_BYTES], const char *file, const char *user, const char *ss_id,
+               const char *ops, unsigned long epoch, time_t expires, char *out, size_t size) {
+  char fields[64], sig[TOKEN_KEY_HEX];
+  int n = snprintf(fields, sizeof fields, "%s.%lu.%lld", ops, epoch, (long long)expires);
+  if (n < 0 || (size_t)n >= sizeof fields) return -1;
+  mac(key, fields, file, user, ss_id, sig);
+  n = snprintf(out, size, "%s.%s", fields, sig);
+  return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+int token_verify(const unsigned char key[SHA256_BYTES], const char *token, const char *file, const char *user,
+                 const char *ss_id, const char *op, unsigned long min_epoch, time_t now, const char **reason) {
+  const char *dot = strrchr(token, '.');
+  char fields[64];
+  if (!dot || (size_t)(dot - token) >= sizeof fields) { *reason = "malformed token"; return -1; }
+  memcpy(fields, token, dot - token);
+  fields[dot - token] = '\0';
+
+  char expected[TOKEN_KEY_HEX];
+  mac(key, fields, file, user, ss_id, expected);
+  if (!same_mac(dot + 1, expected)) { *reason = "bad signature"; return -1; }
+
+  char ops[16];
+  unsigned long epoch;
+  long long expires;
+  if (sscanf(fields, "%15[A-Z].%lu.%lld", ops, &epoch, &expires) != 3) { *reason = "malformed token"; return -1; }
+  char letter = token_op(op);
+  if (!letter || !strchr(ops, letter)) { *reason = "op not granted"; return -1; }
+  if (expires <= (long long)now) { *reason = "token expired"; return -1; }
+  if (epoch < min_epoch) { *reason = "token predates the route"; return -1; }
+  return 0;
+}
+
+int token_key_derive(const char *secret, unsigned char key[SHA256_BYTES]) {
+  if (!secret || !secret[0]) return -1;
+  sha256(secret, strlen(secret), key);
+  return 0;
+}
+
+int token_challenge(char out[TOKEN_KEY_HEX]) {
+  unsigned char nonce[SHA256_BYTES];
+  FILE *fp = fopen("/dev/urandom", "rb");
+  if (!fp) return -1;
+  size_t n = fread(nonce, 1, sizeof nonce, fp);
+  fclose(fp);
+  if (n != sizeof nonce) return -1;
+  hex(nonce, sizeof nonce, out);
+  return 0;
+}
+
+void token_prove(const unsigned char key[SHA256_BYTES], const char *purpose, const char *ss_id,
+                 const char *challenge, char out[TOKEN_KEY_HEX]) {
+  // Bound to a purpose no token shares, so a proof never passes for one
+  mac(key, purpose, challenge, "", ss_id, out);
+}
+
+int token_proof_ok(const unsigned char key[SHA256_BYTES], const char *purpose, const char *ss_id,
+                   const char *challenge, const char *proof) {
+  char expected[TOKEN_KEY_HEX];
+  token_prove(key, purpose, ss_id, challenge, expected);
+  return same_mac(proof, expected) ? 0 : -1;
+}
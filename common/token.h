@@ -0,0 +1,56 @@
+#ifndef TOKEN_H
+#define TOKEN_H
+#include <stddef.h>
+#include <time.h>
+#include "sha256.h"
+
+// Capability tokens: the NM hands a client, with the route to a file's
+// storage server, a token that lets that user run some control ops on that
+// file at that SS until it expires, so the client can go to the SS
+// directly. A token reads "<ops>.<epoch>.<expires>.<mac>": the op letters
+// below, the NM's routing epoch, the expiry in seconds since the epoch and
+// HMAC-SHA256 (hex) over those and the file, user and SS id, which the
+// request and the SS supply themselves. NM and SSes share the key. The NM
+// also signs the requests it sends an SS itself for a client (NM_CREATE,
+// NM_MOVE, ...), so nothing else can pass for the NM.
+#define TOKEN_MAX 128
+#define TOKEN_KEY_HEX (SHA256_BYTES * 2 + 1)
+
+#define TOKEN_OPS_CREATE "C"
+#define TOKEN_OPS_CONTROL "DIAKMR" // DELETE INFO ADD/REMACCESS CHECKPOINT MOVE REVERT
+// 'V' (VIEWCHECKPOINT, LISTCHECKPOINTS), 'T' (MERKLE, MERKLE_LEAVES) and
+// 'S' (RESYNC) only go on the NM's own requests
+
+// The letter a token grants op by, 0 for ops that take no token
+char token_op(const char *op);
+
+// Sign a token for user to run ops on file at ss_id. Returns 0, or -1 if
+// out is too small.
+int token_sign(const unsigned char key[SHA256_BYTES], const char *file, const char *user, const char *ss_id,
+               const char *ops, unsigned long epoch, time_t expires, char *out, size_t size);
+
+// Check that token lets user run op on file at ss_id at time now and was
+// issued at min_epoch or later. Returns 0, or -1 with why in *reason.
+int token_verify(const unsigned char key[SHA256_BYTES], const char *token, const char *file, const char *user,
+                 const char *ss_id, const char *op, unsigned long min_epoch, time_t now, const char **reason);
+
+// The key NM and SSes share, derived from the NM_TOKEN_KEY secret they are
+// all started with. Returns 0, or -1 if secret is unset or empty.
+int token_key_derive(const char *secret, unsigned char key[SHA256_BYTES]);
+
+// An SS proves it holds the key before the NM takes its registration or
+// control channel, and a primary before its replica takes its replication
+// stream: the other side sends a fresh random challenge (hex) and the SS
+// answers with a MAC over it, its id and the purpose, so the key never
+// crosses the wire and a proof for one never passes for the other.
+// token_challenge returns 0, or -1 if no randomness was to be had;
+// token_proof_ok returns 0 if proof is right.
+#define TOKEN_PROOF_NM "ss-auth"     // an SS to the NM
+#define TOKEN_PROOF_REPL "repl-auth" // a primary to its replica
+
+int token_challenge(char out[TOKEN_KEY_HEX]);
+void token_prove(const unsigned char key[SHA256_BYTES], const char *purpose, const char *ss_id,
+                 const char *challenge, char out[TOKEN_KEY_HEX]);
+int token_proof_ok(const unsigned char key[SHA256_BYTES], const char *purpose, const char *ss_id,
+                   const char *challenge, const char *proof);
+#endif
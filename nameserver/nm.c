@@ -7,6 +7,8 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include "../common/net.h"
 #include "../common/jsonl.h"
 #include "../common/proto.h"
@@ -14,6 +16,12 @@
 #include "nm_state.h"
 #include "nm_access_req.h"
 #include "nm_replication.h"
+#include "nm_search.h"
+#include "nm_catalog.h"
+#include "nm_journal.h"
+#include "nm_users.h"
+#include "nm_raft.h"
+#include "nm_token.h"
 
 #define NM_LOGFILE "nameserver/nm.log"
 
@@ -60,6 +68,872 @@ static void json_escape(const char *src, char *dst, size_t dst_size)
   dst[j] = 0;
 }
 
+// ==================== SEARCH FAN-OUT ====================
+
+#define SEARCH_MAX_SS 32
+#define SEARCH_MAX_RESULTS 100
+
+typedef struct
+{
+  char host[64];
+  int port;
+  char request[1024];
+  char *response;
+} SearchTarget;
+
+typedef struct
+{
+  char file[256];
+  double score;
+  int sentence;
+  char snippet[128];
+} SearchResult;
+
+static void *search_target_thread(void *arg)
+{
+  SearchTarget *t = arg;
+  int fd = tcp_connect(t->host, t->port);
+  if (fd < 0)
+    return NULL;
+  send_line(fd, t->request);
+  if (recv_line(fd, &t->response, 8192) <= 0)
+  {
+    free(t->response);
+    t->response = NULL;
+  }
+  close(fd);
+  return NULL;
+}
+
+// Parse "file|score|sentence|snippet;;..." into results, keeping the best
+// score per file (replicas answer for the same files)
+static int merge_search_results(const char *list, SearchResult *results, int count, int max)
+{
+  char entry[512];
+  const char *p = list;
+  while (*p)
+  {
+    const char *end = strstr(p, ";;");
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    if (len >= sizeof entry)
+      len = sizeof entry - 1;
+    memcpy(entry, p, len);
+    entry[len] = '\0';
+    p = end ? end + 2 : p + strlen(p);
+
+    char *score = strchr(entry, '|');
+    char *sentence = score ? strchr(score + 1, '|') : NULL;
+    char *snippet = sentence ? strchr(sentence + 1, '|') : NULL;
+    if (!snippet)
+      continue;
+    *score++ = '\0';
+    *sentence++ = '\0';
+    *snippet++ = '\0';
+
+    // A name too long for the catalog cannot be one of its files
+    SearchResult r;
+    int n = snprintf(r.file, sizeof r.file, "%s", entry);
+    if (n < 0 || (size_t)n >= sizeof r.file)
+      continue;
+    r.score = strtod(score, NULL);
+    r.sentence = atoi(sentence);
+    snprintf(r.snippet, sizeof r.snippet, "%s", snippet);
+
+    int found = 0;
+    for (int i = 0; i < count; i++)
+    {
+      if (!strcmp(results[i].file, r.file))
+      {
+        if (r.score > results[i].score)
+          results[i] = r;
+        found = 1;
+        break;
+      }
+    }
+    if (!found && count < max)
+      results[count++] = r;
+  }
+  return count;
+}
+
+static int compare_search_results(const void *a, const void *b)
+{
+  const SearchResult *ra = a, *rb = b;
+  if (ra->score < rb->score)
+    return 1;
+  if (ra->score > rb->score)
+    return -1;
+  return strcmp(ra->file, rb->file);
+}
+
+// Query every alive SS in parallel and return one ranked list
+static void handle_search(int cfd, const char *line, const char *user)
+{
+  char query[512] = "";
+  int limit = 20;
+  json_get_str(line, "query", query, sizeof query);
+  json_get_int(line, "limit", &limit);
+  if (limit <= 0 || limit > SEARCH_MAX_RESULTS)
+    limit = SEARCH_MAX_RESULTS;
+  if (!query[0])
+  {
+    send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"empty query\"}", ERR_BAD_REQUEST));
+    return;
+  }
+
+  SSNode nodes[SEARCH_MAX_SS];
+  int n = nm_replication_list_alive(nodes, SEARCH_MAX_SS);
+  if (n == 0)
+  {
+    send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"no SS available\"}", ERR_INTERNAL));
+    return;
+  }
+
+  SearchTarget targets[SEARCH_MAX_SS];
+  pthread_t threads[SEARCH_MAX_SS];
+  int started[SEARCH_MAX_SS];
+  for (int i = 0; i < n; i++)
+  {
+    memset(&targets[i], 0, sizeof targets[i]);
+    snprintf(targets[i].host, sizeof targets[i].host, "%s", nodes[i].host);
+    targets[i].port = nodes[i].client_port;
+    snprintf(targets[i].request, sizeof targets[i].request,
+             "{\"op\":\"SEARCH\",\"user\":\"%s\",\"query\":\"%s\",\"limit\":%d}", user, query, limit);
+    started[i] = pthread_create(&threads[i], NULL, search_target_thread, &targets[i]) == 0;
+  }
+
+  SearchResult *results = calloc(SEARCH_MAX_RESULTS * SEARCH_MAX_SS, sizeof(SearchResult));
+  int count = 0;
+  char list[8192];
+  for (int i = 0; i < n; i++)
+  {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    if (targets[i].response && results &&
+        json_get_str(targets[i].response, "results", list, sizeof list) == 0)
+    {
+      count = merge_search_results(list, results, count, SEARCH_MAX_RESULTS * SEARCH_MAX_SS);
+    }
+    free(targets[i].response);
+  }
+
+  if (count > 1)
+    qsort(results, count, sizeof(SearchResult), compare_search_results);
+
+  char out[7680];
+  int pos = 0;
+  out[0] = '\0';
+  for (int i = 0; i < count && i < limit; i++)
+  {
+    int room = (int)sizeof out - pos;
+    int w = snprintf(out + pos, room, "%s|%.4f|%d|%s;;",
+                     results[i].file, results[i].score, results[i].sentence, results[i].snippet);
+    if (w >= room)
+    {
+      out[pos] = '\0';
+      break;
+    }
+    pos += w;
+  }
+  free(results);
+
+  send_line(cfd, jsonl_build("{\"status\":0,\"results\":\"%s\"}", out));
+}
+
+// ==================== GREP RELAY ====================
+
+#define GREP_MAX_HITS 500
+#define GREP_MAX_FILES 1024
+
+static int name_in(char (*names)[256], int count, const char *name)
+{
+  for (int i = 0; i < count; i++)
+  {
+    if (!strcmp(names[i], name))
+      return 1;
+  }
+  return 0;
+}
+
+// Relay GREP hits from every alive SS to the client as they arrive. Replicas
+// hold the same files, so a file already reported by an earlier SS is
+// skipped. The stream ends with a single STOP line.
+static void handle_grep(int cfd, const char *line, const char *user, const char *flags)
+{
+  char pattern[512] = "";
+  json_get_str(line, "pattern", pattern, sizeof pattern);
+  if (!pattern[0])
+  {
+    send_line(cfd, jsonl_build("{\"op\":\"STOP\",\"status\":%d,\"msg\":\"empty pattern\"}", ERR_BAD_REQUEST));
+    return;
+  }
+
+  SSNode nodes[SEARCH_MAX_SS];
+  int n = nm_replication_list_alive(nodes, SEARCH_MAX_SS);
+  char (*done)[256] = malloc(GREP_MAX_FILES * sizeof *done);
+  char (*current)[256] = malloc(GREP_MAX_FILES * sizeof *current);
+  if (n == 0 || !done || !current)
+  {
+    free(done);
+    free(current);
+    send_line(cfd, jsonl_build("{\"op\":\"STOP\",\"status\":%d,\"msg\":\"no SS available\"}", ERR_INTERNAL));
+    return;
+  }
+
+  char request[1024];
+  snprintf(request, sizeof request, "{\"op\":\"GREP\",\"user\":\"%s\",\"pattern\":\"%s\",\"flags\":\"%s\"}",
+           user, pattern, flags);
+
+  int ndone = 0, total = 0, status = 0;
+  for (int i = 0; i < n && total < GREP_MAX_HITS; i++)
+  {
+    int fd = tcp_connect(nodes[i].host, nodes[i].client_port);
+    if (fd < 0)
+      continue;
+    send_line(fd, request);
+
+    int ncurrent = 0;
+    char *resp = NULL;
+    while (recv_line(fd, &resp, 8192) > 0)
+    {
+      char op[16] = "", file[256] = "";
+      json_get_str(resp, "op", op, sizeof op);
+      if (!strcmp(op, "STOP"))
+      {
+        int rc = 0;
+        json_get_int(resp, "status", &rc);
+        if (rc != 0 && status == 0)
+          status = rc;
+        free(resp);
+        resp = NULL;
+        break;
+      }
+      json_get_str(resp, "file", file, sizeof file);
+      if (!name_in(done, ndone, file) && total < GREP_MAX_HITS)
+      {
+        send_all(cfd, resp, strlen(resp)); // already newline-terminated
+        total++;
+        if (!name_in(current, ncurrent, file) && ncurrent < GREP_MAX_FILES)
+          snprintf(current[ncurrent++], sizeof current[0], "%s", file);
+      }
+      free(resp);
+      resp = NULL;
+    }
+    free(resp);
+    close(fd);
+
+    for (int j = 0; j < ncurrent && ndone < GREP_MAX_FILES; j++)
+      snprintf(done[ndone++], sizeof done[0], "%s", current[j]);
+  }
+  free(done);
+  free(current);
+
+  if (status != 0 && total == 0)
+    send_line(cfd, jsonl_build("{\"op\":\"STOP\",\"status\":%d,\"msg\":\"invalid pattern\"}", status));
+  else
+    send_line(cfd, jsonl_build("{\"op\":\"STOP\",\"status\":0,\"hits\":%d}", total));
+}
+
+// ==================== STORAGE FAN-OUT ====================
+
+// New files are spread over storage servers by the placement strategy, so
+// folders and listings have to visit every live SS.
+
+// Whether merged already has an entry for the file that entry names (the
+// text before any " | " details)
+static int entry_listed(const char *merged, const char *entry, size_t name_len)
+{
+  for (const char *p = merged; *p;)
+  {
+    const char *end = strstr(p, ";;");
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    const char *details = strstr(p, " | ");
+    size_t plen = details && details < p + len ? (size_t)(details - p) : len;
+    if (plen == name_len && !strncmp(p, entry, name_len))
+      return 1;
+    if (!end)
+      break;
+    p = end + 2;
+  }
+  return 0;
+}
+
+// Append the ";;"-separated entries of value to merged, each ";;"-terminated.
+// Replicas list the files they hold copies of, so names already in merged
+// are skipped.
+static void merge_entries(char *merged, size_t merged_size, const char *value)
+{
+  size_t used = strlen(merged);
+  for (const char *p = value; *p;)
+  {
+    const char *end = strstr(p, ";;");
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    const char *details = strstr(p, " | ");
+    size_t name_len = details && details < p + len ? (size_t)(details - p) : len;
+    if (len > 0 && !entry_listed(merged, p, name_len) && used + len + 3 < merged_size)
+    {
+      memcpy(merged + used, p, len);
+      memcpy(merged + used + len, ";;", 3);
+      used += len + 2;
+    }
+    if (!end)
+      break;
+    p = end + 2;
+  }
+}
+
+// Send line to every alive SS. When field is set, the values of that field
+// in successful replies are joined into merged as ";;"-terminated entries;
+// the first reply is kept in first. Returns how many SSes reported status 0.
+static int fanout_request(const char *line, const char *field, char *merged, size_t merged_size,
+                          char *first, size_t first_size)
+{
+  SSNode nodes[SEARCH_MAX_SS];
+  int count = nm_replication_list_alive(nodes, SEARCH_MAX_SS);
+  int ok = 0;
+  if (merged)
+    merged[0] = '\0';
+  if (first)
+    first[0] = '\0';
+
+  for (int i = 0; i < count; i++)
+  {
+    int fd = tcp_connect(nodes[i].host, nodes[i].client_port);
+    if (fd < 0)
+      continue;
+    send_line(fd, line);
+    char *resp = NULL;
+    if (recv_line(fd, &resp, 8192) > 0)
+    {
+      if (first && !first[0])
+        snprintf(first, first_size, "%s", resp);
+      int status = 1;
+      json_get_int(resp, "status", &status);
+      if (status == 0)
+      {
+        ok++;
+        char value[8192];
+        if (field && merged && json_get_str(resp, field, value, sizeof value) == 0 && value[0])
+          merge_entries(merged, merged_size, value);
+      }
+      free(resp);
+    }
+    close(fd);
+  }
+  return ok;
+}
+
+// LIST, CREATEFOLDER and VIEWFOLDER across all storage servers
+static void handle_storage_fanout(int cfd, const char *line, const char *op)
+{
+  char merged[7680]; // leaves room for the reply envelope
+  char first[8192];
+  int ok = fanout_request(line, strcmp(op, "CREATEFOLDER") ? "files" : NULL, merged, sizeof merged,
+                          first, sizeof first);
+
+  if (!first[0])
+  {
+    send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"no SS available\"}", ERR_INTERNAL));
+  }
+  else if (!ok)
+  {
+    send_all(cfd, first, strlen(first)); // relay the first failure as-is
+  }
+  else if (!strcmp(op, "CREATEFOLDER"))
+  {
+    send_line(cfd, "{\"status\":0,\"msg\":\"folder created\"}");
+  }
+  else
+  {
+    send_line(cfd, jsonl_build("{\"op\":\"%s\",\"status\":0,\"files\":\"%s\"}", op, merged));
+  }
+}
+
+// ==================== TOKENS ====================
+
+// Control routes come with a capability token (common/token.h) so the
+// client can send DELETE, MOVE and the like straight to the SS, which
+// reports catalog changes back on its control channel. The NM signs the
+// requests it sends an SS for a client the same way (nm_token.h). NM and
+// SSes derive the key from the NM_TOKEN_KEY secret they are started with;
+// an SS proves it holds it (authenticate_ss) and never receives it.
+#define SS_AUTH_TIMEOUT_S 5 // for an SS to answer the challenge
+
+// Send ss_fd the request (NM_CREATE, NM_MOVE, ...) that carries out user's
+// op (CREATE, MOVE, ...) on file at ss_id, with a token for it: the SS
+// takes these from no one else. fields are the request's other fields,
+// each with a leading comma.
+static void send_ss_request(int ss_fd, const char *ss_op, const char *op, const char *file, const char *user,
+                            const char *ss_id, const char *fields)
+{
+  char request[2048];
+  if (nm_token_request(request, sizeof request, ss_op, op, file, user, ss_id, fields) == 0)
+    send_line(ss_fd, request);
+}
+
+// Send ss_fd, signed, the client's MOVE, CHECKPOINT, VIEWCHECKPOINT, REVERT
+// or LISTCHECKPOINTS request line for file at ss_id
+static void send_file_op(int ss_fd, const char *line, const char *op, const char *file, const char *user,
+                         const char *ss_id)
+{
+  char ss_op[32], value[256] = "", fields[300] = "";
+  snprintf(ss_op, sizeof ss_op, "NM_%s", op);
+  if (!strcmp(op, "MOVE"))
+  {
+    json_get_str(line, "folder", value, sizeof value);
+    snprintf(fields, sizeof fields, ",\"folder\":\"%s\"", value);
+  }
+  else if (strcmp(op, "LISTCHECKPOINTS"))
+  {
+    json_get_str(line, "tag", value, sizeof value);
+    snprintf(fields, sizeof fields, ",\"tag\":\"%s\"", value);
+  }
+  send_ss_request(ss_fd, ss_op, op, file, user, ss_id, fields);
+}
+
+// Like send_line, but in one write, since after the challenge round trip
+// a trailing "\n" of its own would wait out the SS's delayed ACK, and an
+// SS that goes away must not raise SIGPIPE in the NM
+static void ss_send(int fd, const char *line)
+{
+  char buf[512];
+  int len = snprintf(buf, sizeof buf, "%s\n", line);
+  if (len > 0 && (size_t)len < sizeof buf)
+    send(fd, buf, (size_t)len, MSG_NOSIGNAL);
+}
+
+// Make the SS opening a registration or control channel on fd prove it
+// holds the token key. Returns 0 if it does; otherwise the SS has been
+// told why.
+static int authenticate_ss(int fd, const char *ss_id, const char *ip, int port)
+{
+  char challenge[TOKEN_KEY_HEX];
+  if (token_challenge(challenge) != 0)
+  {
+    ss_send(fd, jsonl_build("{\"status\":%d,\"msg\":\"no challenge\"}", ERR_INTERNAL));
+    return -1;
+  }
+  ss_send(fd, jsonl_build("{\"op\":\"NM_CHALLENGE\",\"status\":0,\"challenge\":\"%s\"}", challenge));
+
+  // A peer that never answers must not hold the thread
+  struct timeval timeout = {SS_AUTH_TIMEOUT_S, 0}, none = {0, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  char *line = NULL, proof[TOKEN_KEY_HEX] = "";
+  if (recv_line(fd, &line, 1024) > 0)
+    json_get_str(line, "proof", proof, sizeof proof);
+  free(line);
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof none);
+
+  if (token_proof_ok(nm_token_key(), TOKEN_PROOF_NM, ss_id, challenge, proof) != 0)
+  {
+    log_message("NM", "SS_AUTH_FAILED", ip, port, ss_id, "Storage server could not prove it holds NM_TOKEN_KEY");
+    ss_send(fd, jsonl_build("{\"status\":%d,\"code\":\"ERR_UNAUTHORIZED\",\"msg\":\"bad proof of the token key\"}",
+                            ERR_UNAUTHORIZED));
+    return -1;
+  }
+  return 0;
+}
+
+// Route to the SS that runs control ops on file, or for CREATE_ROUTE to
+// the one a new file goes to, with a token for user to run them there
+static void handle_control_route(int cfd, const char *op, const char *file, const char *user)
+{
+  char host[64], ss_id[64];
+  int port = 0;
+  int create = !strcmp(op, "CREATE_ROUTE");
+  if (create && nm_replication_place_file(file, host, &port, ss_id) != OK)
+  {
+    send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"no SS available\"}", ERR_INTERNAL));
+    return;
+  }
+  if (!create && nm_replication_get_ss_id(file, host, &port, ss_id) != OK)
+  {
+    send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"file not found\"}", ERR_NOT_FOUND));
+    return;
+  }
+
+  unsigned long epoch = nm_catalog_epoch();
+  time_t expires;
+  char token[TOKEN_MAX];
+  if (nm_token_sign(file, user, ss_id, create ? TOKEN_OPS_CREATE : TOKEN_OPS_CONTROL, epoch, token, sizeof token,
+                    &expires) != 0)
+  {
+    send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"could not sign a token\"}", ERR_INTERNAL));
+    return;
+  }
+  send_line(cfd, jsonl_build("{\"op\":\"ROUTE\",\"status\":0,\"ss_host\":\"%s\",\"ss_port\":%d,\"epoch\":%lu,"
+                             "\"token\":\"%s\",\"expires\":%ld}",
+                             host, port, epoch, token, (long)expires));
+}
+
+// ==================== ROUTES ====================
+
+// Writes always go to the primary. Reads are balanced between the primary
+// and an up-to-date replica; such routes (and failover routes) are marked
+// "cache":0 so the client asks again next time instead of pinning one copy.
+static void handle_route(int cfd, const char *line, const char *op, const char *file, const char *user)
+{
+  char host[64];
+  int port = 0;
+  if (!strcmp(op, "CONTROL_ROUTE") || !strcmp(op, "CREATE_ROUTE"))
+  {
+    handle_control_route(cfd, op, file, user);
+    return;
+  }
+  if (!strcmp(op, "WRITE_ROUTE"))
+  {
+    if (nm_state_get_route(file, host, &port) == 0)
+      send_line(cfd, jsonl_build("{\"op\":\"ROUTE\",\"status\":0,\"ss_host\":\"%s\",\"ss_port\":%d,\"epoch\":%lu}", host, port, nm_catalog_epoch()));
+    else
+      send_line(cfd, jsonl_build("{\"status\":%d,\"code\":\"ERR_NOT_FOUND\",\"msg\":\"file route not found\"}", ERR_NOT_FOUND));
+    return;
+  }
+
+  long long min_version = 0;
+  json_get_long(line, "min_version", &min_version);
+  int is_replica = 0, balanced = 0;
+  int rc = nm_replication_route_read(file, min_version > 0 ? (unsigned long)min_version : 0, host, &port, &is_replica, &balanced);
+  if (rc == OK)
+  {
+    send_line(cfd, jsonl_build("{\"op\":\"ROUTE\",\"status\":0,\"ss_host\":\"%s\",\"ss_port\":%d,\"epoch\":%lu,\"replica\":%d,\"cache\":%d}",
+                               host, port, nm_catalog_epoch(), is_replica, !is_replica && !balanced));
+  }
+  else if (rc == ERR_BUSY)
+  {
+    send_line(cfd, jsonl_build("{\"status\":%d,\"code\":\"ERR_BUSY\",\"msg\":\"replica has not caught up with your last write\"}", ERR_BUSY));
+  }
+  else
+  {
+    send_line(cfd, jsonl_build("{\"status\":%d,\"code\":\"ERR_NOT_FOUND\",\"msg\":\"file route not found\"}", ERR_NOT_FOUND));
+  }
+}
+
+// ==================== STATS ====================
+
+static void handle_stats(int cfd)
+{
+  SearchStats st;
+  nm_search_stats(&st);
+  send_line(cfd, jsonl_build("{\"status\":0,\"files\":%zu,\"route_cache_entries\":%d,\"route_cache_capacity\":%d,"
+                             "\"route_cache_hits\":%lu,\"route_cache_negative_hits\":%lu,\"route_cache_misses\":%lu,"
+                             "\"route_cache_evictions\":%lu}",
+                             nm_catalog_count(), st.entries, st.capacity, st.hits, st.negative_hits, st.misses,
+                             st.evictions));
+}
+
+// ==================== SERVERS ====================
+
+// One ";;"-separated record per SS: id|host:port|state|primary files|bytes|
+// open connections|qps now|qps over the history|p99 us|free disk|seconds
+// since the last report
+static void handle_servers(int cfd)
+{
+  SSNode nodes[SEARCH_MAX_SS];
+  int count = nm_replication_list_all(nodes, SEARCH_MAX_SS);
+
+  char buf[4096] = "";
+  size_t used = 0;
+  time_t now = time(NULL);
+  for (int i = 0; i < count && used < sizeof buf; i++)
+  {
+    LoadSample history[LOAD_HISTORY];
+    int samples = nm_replication_load_history(nodes[i].ss_id, history, LOAD_HISTORY);
+    LoadSample last;
+    memset(&last, 0, sizeof last);
+    last.free_disk = -1;
+    double qps_sum = 0;
+    for (int j = 0; j < samples; j++)
+      qps_sum += history[j].qps;
+    if (samples > 0)
+      last = history[samples - 1];
+
+    int n = snprintf(buf + used, sizeof buf - used, "%s%s|%s:%d|%s|%ld|%lld|%d|%.1f|%.1f|%ld|%lld|%ld|%ld|%ld",
+                     i ? ";;" : "", nodes[i].ss_id, nodes[i].host, nodes[i].client_port,
+                     nodes[i].alive ? "up" : "down", nodes[i].files, nodes[i].bytes, last.active, last.qps,
+                     samples ? qps_sum / samples : 0.0, last.p99_us, last.free_disk,
+                     samples ? (long)(now - last.at) : -1L, nodes[i].repl_pending, nodes[i].repl_lag_ms);
+    if (n < 0 || (size_t)n >= sizeof buf - used)
+    {
+      buf[used] = '\0';
+      break;
+    }
+    used += (size_t)n;
+  }
+  send_line(cfd, jsonl_build("{\"status\":0,\"servers\":\"%s\"}", buf));
+}
+
+// ==================== SS REGISTRATION ====================
+
+// An SS registers its files in pages after SS_REGISTER:
+//   {"op":"REG_FILES","cursor":N,"files":"a,b"}   files it is primary for
+//   {"op":"REG_REMOVE","cursor":N,"files":"c"}    delta only: files now gone
+//   {"op":"REG_END","cursor":N}                   -> {"status":0,"version":V}
+// cursor counts the names sent so far; each page is acked with the new
+// cursor. With "since" equal to the version of its last complete
+// registration the SS sends only what changed since (mode "delta"),
+// otherwise its whole list, after which files no longer listed are
+// unmapped (mode "full").
+
+#define REG_LINE_MAX 8192
+
+typedef struct
+{
+  int fd;
+  char *line; // the SS_REGISTER or SS_CONTROL request
+  char ip[INET_ADDRSTRLEN];
+  int port;
+} Registration;
+
+// A page is acknowledged once the placements it changed are journaled and
+// committed
+static int reg_reply(int fd, int status, long long cursor, const char *extra)
+{
+  if (nm_journal_wait() != OK && status == OK)
+    status = ERR_NOT_LEADER;
+  char buf[256];
+  int len = snprintf(buf, sizeof buf, "{\"status\":%d,\"cursor\":%lld%s}", status, cursor, extra ? extra : "");
+  if (len < 0 || (size_t)len >= sizeof buf)
+    return -1;
+  return send_line(fd, buf);
+}
+
+// Split a page's comma-separated names in place
+static int split_names(char *list, char **names, int max)
+{
+  int count = 0;
+  char *save = NULL;
+  for (char *tok = strtok_r(list, ",", &save); tok && count < max; tok = strtok_r(NULL, ",", &save))
+    names[count++] = tok;
+  return count;
+}
+
+static void *ss_register_thread(void *arg)
+{
+  Registration *reg = arg;
+  char ssid[64] = "", advertised_host[64] = "";
+  int client_port = 0, nm_port = 0;
+  long long since = 0;
+  json_get_str(reg->line, "ss_id", ssid, sizeof ssid);
+  json_get_int(reg->line, "ss_client_port", &client_port);
+  json_get_int(reg->line, "ss_nm_port", &nm_port);
+  json_get_str(reg->line, "ss_host", advertised_host, sizeof advertised_host);
+  json_get_long(reg->line, "since", &since);
+  const char *register_host = advertised_host[0] ? advertised_host : reg->ip;
+  if (authenticate_ss(reg->fd, ssid, reg->ip, reg->port) != 0)
+  {
+    close(reg->fd);
+    free(reg->line);
+    free(reg);
+    return NULL;
+  }
+
+  unsigned long version;
+  unsigned long current = nm_replication_registration(ssid, &version);
+  int delta = since > 0 && (unsigned long)since == current;
+  nm_replication_register_ss(ssid, register_host, client_port, nm_port);
+  nm_state_add_ss(ssid, register_host, client_port);
+
+  char buf[256];
+  snprintf(buf, sizeof buf, "{\"op\":\"NM_ACK\",\"status\":0,\"mode\":\"%s\"}", delta ? "delta" : "full");
+  ss_send(reg->fd, buf);
+
+  char *files = malloc(REG_LINE_MAX);
+  char **names = malloc(REG_PAGE_NAMES * sizeof *names);
+  long long cursor = 0;
+  long added = 0, removed = 0, swept = 0;
+  int done = 0;
+  while (files && names && !done)
+  {
+    char *line = NULL;
+    if (recv_line(reg->fd, &line, REG_LINE_MAX) <= 0)
+    {
+      free(line);
+      break;
+    }
+    char op[32] = "";
+    long long at = -1;
+    json_get_str(line, "op", op, sizeof op);
+    json_get_long(line, "cursor", &at);
+    files[0] = '\0';
+    int listed = json_get_str(line, "files", files, REG_LINE_MAX) == 0;
+    free(line);
+
+    if (at != cursor)
+    {
+      reg_reply(reg->fd, ERR_CONFLICT, cursor, NULL);
+      break;
+    }
+    if (!strcmp(op, "REG_FILES") && listed)
+    {
+      int count = split_names(files, names, REG_PAGE_NAMES);
+      added += nm_replication_register_files(ssid, names, count, version);
+      cursor += count;
+      reg_reply(reg->fd, OK, cursor, NULL);
+    }
+    else if (!strcmp(op, "REG_REMOVE") && listed && delta)
+    {
+      int count = split_names(files, names, REG_PAGE_NAMES);
+      removed += nm_replication_unregister_files(ssid, names, count);
+      cursor += count;
+      reg_reply(reg->fd, OK, cursor, NULL);
+    }
+    else if (!strcmp(op, "REG_END"))
+    {
+      if (!delta)
+        swept = nm_replication_sweep_files(ssid, version);
+      nm_replication_registration_done(ssid, version);
+      snprintf(buf, sizeof buf, ",\"version\":%lu", version);
+      reg_reply(reg->fd, OK, cursor, buf);
+      done = 1;
+    }
+    else
+    {
+      reg_reply(reg->fd, ERR_BAD_REQUEST, cursor, NULL);
+      break;
+    }
+  }
+  free(files);
+  free(names);
+
+  char details[256];
+  if (done)
+  {
+    snprintf(details, sizeof details, "%s registration: %lld names, %ld mapped, %ld unmapped, version %lu",
+             delta ? "Delta" : "Full", cursor, added, removed + swept, version);
+  }
+  else
+  {
+    // Heartbeats are refused until the SS registers again
+    nm_replication_registration_done(ssid, 0);
+    snprintf(details, sizeof details, "Registration aborted after %lld names", cursor);
+  }
+  log_message("NM", "SS_REGISTER", reg->ip, reg->port, ssid, details);
+
+  close(reg->fd);
+  free(reg->line);
+  free(reg);
+  return NULL;
+}
+
+// Long-lived SS connection for heartbeats and load reports, opened by a
+// registered SS that holds the token key
+static void *ss_control_thread(void *arg)
+{
+  Registration *reg = arg;
+  char ssid[64] = "";
+  int heartbeat_ms = 0;
+  json_get_str(reg->line, "ss_id", ssid, sizeof ssid);
+  json_get_int(reg->line, "heartbeat_ms", &heartbeat_ms);
+  free(reg->line);
+
+  int ok = 0;
+  if (!nm_replication_is_registered(ssid))
+    // Registering first lets the SS open the channel again
+    ss_send(reg->fd, jsonl_build("{\"status\":%d,\"code\":\"ERR_NOT_FOUND\",\"msg\":\"not registered\"}",
+                                 ERR_NOT_FOUND));
+  else if (authenticate_ss(reg->fd, ssid, reg->ip, reg->port) == 0)
+  {
+    // Tokens handed out before the SS (re)joined predate the new epoch and
+    // are refused
+    nm_catalog_bump_epoch();
+    ss_send(reg->fd, jsonl_build("{\"op\":\"NM_ACK\",\"status\":0,\"epoch\":%lu}", nm_catalog_epoch()));
+    ok = nm_replication_control_channel(reg->fd, ssid, heartbeat_ms) == OK;
+  }
+  if (!ok)
+    close(reg->fd);
+  free(reg);
+  return NULL;
+}
+
+// ==================== CLUSTER ====================
+
+// Requests a follower answers from its own copy of the state
+static int read_only_op(const char *op)
+{
+  static const char *const ops[] = {"VIEW", "LIST_USERS", "STATS", "SERVERS", "SEARCH",
+                                    "GREP", "VIEW_ROUTE", "READ_ROUTE", "STREAM_ROUTE"};
+  for (size_t i = 0; i < sizeof ops / sizeof ops[0]; i++)
+  {
+    if (!strcmp(op, ops[i]))
+      return 1;
+  }
+  return 0;
+}
+
+// Answer with ERR_NOT_LEADER and the leader's address ("" while an
+// election is on), which sends the client on to the leader
+static void send_not_leader(int cfd, const char *msg)
+{
+  char host[64], leader[96] = "";
+  int port;
+  nm_raft_leader(host, sizeof host, &port);
+  if (port)
+    snprintf(leader, sizeof leader, "%s:%d", host, port);
+  send_line(cfd, jsonl_build("{\"op\":\"NM_ACK\",\"status\":%d,\"code\":\"ERR_NOT_LEADER\",\"msg\":\"%s\",\"leader\":\"%s\"}",
+                             ERR_NOT_LEADER, msg, leader));
+}
+
+// Unless this NM may serve op, answer with ERR_NOT_LEADER. Returns 1 if op
+// was turned away.
+static int redirect_to_leader(int cfd, const char *op)
+{
+  if (read_only_op(op) || nm_raft_is_leader())
+    return 0;
+  send_not_leader(cfd, "not the leader");
+  return 1;
+}
+
+// Send line, the reply to a request that changed state, once the change
+// is durable and committed. A change that may not have committed is
+// answered like a follower would, so the client retries with the leader.
+static int reply_committed(int cfd, const char *line)
+{
+  if (nm_journal_wait() == OK)
+    return send_line(cfd, line);
+  send_not_leader(cfd, "change not committed");
+  return -1;
+}
+
+// ==================== USERS ====================
+
+#define USERS_PAGE 32 // users per streamed line
+
+// Stream users to the client a page per line, {"op":"USERS","users":
+// "name|sessions|last_seen|host:port;..."}, ending with a STOP line that
+// carries the count. Only connected users unless flags has 'a'.
+static void handle_list_users(int cfd, const char *flags)
+{
+  int connected_only = !strchr(flags, 'a');
+  UserInfo users[USERS_PAGE];
+  char page[USERS_PAGE * 192];
+  char line[sizeof page + 64];
+  size_t cursor = 0;
+  long total = 0;
+  int n;
+  while ((n = nm_users_page(&cursor, connected_only, users, USERS_PAGE)) > 0)
+  {
+    size_t used = 0;
+    page[0] = '\0';
+    for (int i = 0; i < n; i++)
+    {
+      char address[96] = "-"; // restored from the journal: not known
+      if (users[i].host[0])
+        snprintf(address, sizeof address, "%s:%d", users[i].host, users[i].port);
+      int len = snprintf(page + used, sizeof page - used, "%s%s|%d|%ld|%s", i ? ";" : "", users[i].name,
+                         users[i].sessions, (long)users[i].last_seen, address);
+      if (len < 0 || (size_t)len >= sizeof page - used)
+        break;
+      used += (size_t)len;
+    }
+    snprintf(line, sizeof line, "{\"op\":\"USERS\",\"users\":\"%s\"}", page);
+    if (send_line(cfd, line) < 0)
+      return;
+    total += n;
+  }
+  snprintf(line, sizeof line, "{\"op\":\"STOP\",\"status\":0,\"count\":%ld}", total);
+  send_line(cfd, line);
+}
+
 static void handle_client(int cfd, const char *session_user)
 {
   // Get client address for logging
@@ -111,27 +985,32 @@ static void handle_client(int cfd, const char *session_user)
     
     // Log incoming request
     log_message("NM", op, client_ip, client_port, user, file[0] ? file : "N/A");
+    nm_users_touch(user);
     log_to_file(NM_LOGFILE, jsonl_build("REQ: %s", line));
 
-    if (!strcmp(op, "CLI_REGISTER"))
+    if (redirect_to_leader(cfd, op))
+    {
+      log_to_file(NM_LOGFILE, jsonl_build("RESPONSE: %s redirected to the leader", op));
+    }
+    else if (!strcmp(op, "CLI_REGISTER"))
     {
       log_message("NM", "CLI_REGISTER", client_ip, client_port, user, "Client connected");
       log_to_file(NM_LOGFILE, jsonl_build("REQUEST: op=%s user=%s from %s:%d", op, user, client_ip, client_port));
-      nm_state_add_user(user);
-      send_line(cfd, jsonl_build("{\"status\":0,\"msg\":\"hello %s\"}", user));
+      nm_users_connect(user, client_ip, client_port);
+      reply_committed(cfd, jsonl_build("{\"status\":0,\"msg\":\"hello %s\"}", user));
       log_to_file(NM_LOGFILE, jsonl_build("RESPONSE: status=0 msg=\"hello %s\"", user));
     }
     else if (!strcmp(op, "CLI_DEREGISTER"))
     {
       if (user[0])
       {
-        if (nm_state_remove_user(user) == 0)
+        if (nm_users_disconnect(user) == OK)
         {
           log_message("NM", "CLI_DEREGISTER", client_ip, client_port, user, "Client disconnected");
           log_to_file(NM_LOGFILE, jsonl_build("DISCONNECT: user=%s from %s:%d", user, client_ip, client_port));
         }
       }
-      send_line(cfd, jsonl_build("{\"status\":0,\"msg\":\"goodbye\"}"));
+      reply_committed(cfd, jsonl_build("{\"status\":0,\"msg\":\"goodbye\"}"));
     }
     else if (!strcmp(op, "VIEW"))
     {
@@ -141,9 +1020,23 @@ static void handle_client(int cfd, const char *session_user)
     }
     else if (!strcmp(op, "LIST_USERS"))
     {
-      char buf[4096];
-      nm_state_list_users(buf, sizeof buf);
-      send_line(cfd, jsonl_build("{\"status\":0,\"users\":\"%s\"}", buf));
+      handle_list_users(cfd, flags);
+    }
+    else if (!strcmp(op, "STATS"))
+    {
+      handle_stats(cfd);
+    }
+    else if (!strcmp(op, "SERVERS"))
+    {
+      handle_servers(cfd);
+    }
+    else if (!strcmp(op, "SEARCH"))
+    {
+      handle_search(cfd, line, user);
+    }
+    else if (!strcmp(op, "GREP"))
+    {
+      handle_grep(cfd, line, user, flags);
     }
     else if (!strcmp(op, "VIEW_ROUTE"))
     {
@@ -158,42 +1051,33 @@ static void handle_client(int cfd, const char *session_user)
         send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"no SS available\"}", ERR_INTERNAL));
       }
     }
-    else if (!strcmp(op, "READ_ROUTE") || !strcmp(op, "WRITE_ROUTE") || !strcmp(op, "STREAM_ROUTE"))
+    else if (!strcmp(op, "READ_ROUTE") || !strcmp(op, "WRITE_ROUTE") || !strcmp(op, "STREAM_ROUTE") ||
+             !strcmp(op, "CONTROL_ROUTE") || !strcmp(op, "CREATE_ROUTE"))
     {
-      char host[64];
-      int port;
-      if (nm_state_get_route(file, host, &port) == 0)
-      {
-        send_line(cfd, jsonl_build("{\"op\":\"ROUTE\",\"status\":0,\"ss_host\":\"%s\",\"ss_port\":%d}", host, port));
-      }
-      else
-      {
-        send_line(cfd, jsonl_build("{\"status\":%d,\"code\":\"ERR_NOT_FOUND\",\"msg\":\"file route not found\"}", ERR_NOT_FOUND));
-      }
+      handle_route(cfd, line, op, file, user);
     }
       else if (!strcmp(op, "CREATE"))
     {
         char host[64];
         int port;
         char ss_id[64] = "";
-        if (nm_state_get_any_ss(host, &port) == 0 &&
-            nm_state_get_ss_id_by_endpoint(host, port, ss_id, sizeof ss_id) == 0)
+        if (nm_replication_place_file(file, host, &port, ss_id) == OK)
       {
         int ss_fd = tcp_connect(host, port);
         if (ss_fd >= 0)
         {
-          send_line(ss_fd, jsonl_build("{\"op\":\"NM_CREATE\",\"file\":\"%s\",\"owner\":\"%s\"}", file, user));
+          send_ss_request(ss_fd, "NM_CREATE", "CREATE", file, user, ss_id, "");
           char *resp = NULL;
           if (recv_line(ss_fd, &resp, 8192) > 0)
           {
-            send_line(cfd, resp);
-            int status;
+            int status = 1;
             json_get_int(resp, "status", &status);
-              if (status == 0)
-              {
-                nm_state_map_file(file, ss_id);
-                nm_replication_map_file(file, ss_id);
-              }
+            if (status == 0)
+            {
+              nm_replication_map_file(file, ss_id);
+            }
+            // Reply once the new route is journaled
+            reply_committed(cfd, resp);
             free(resp);
           }
           close(ss_fd);
@@ -210,18 +1094,24 @@ static void handle_client(int cfd, const char *session_user)
     }
     else if (!strcmp(op, "DELETE"))
     {
-      char host[64];
+      char host[64], ss_id[64];
       int port;
-      if (nm_state_get_route(file, host, &port) == 0)
+      if (nm_search_lookup(file, ss_id, sizeof ss_id) == 0 && nm_state_get_route(file, host, &port) == 0)
       {
         int ss_fd = tcp_connect(host, port);
         if (ss_fd >= 0)
         {
-          send_line(ss_fd, jsonl_build("{\"op\":\"NM_DELETE\",\"file\":\"%s\",\"user\":\"%s\"}", file, user));
+          send_ss_request(ss_fd, "NM_DELETE", "DELETE", file, user, ss_id, "");
           char *resp = NULL;
           if (recv_line(ss_fd, &resp, 8192) > 0)
           {
-            send_line(cfd, resp);
+            int status = 1;
+            json_get_int(resp, "status", &status);
+            if (status == 0)
+            {
+              nm_replication_unmap_file(file);
+            }
+            reply_committed(cfd, resp);
             free(resp);
           }
           close(ss_fd);
@@ -234,14 +1124,14 @@ static void handle_client(int cfd, const char *session_user)
     }
     else if (!strcmp(op, "INFO"))
     {
-      char host[64];
+      char host[64], ss_id[64];
       int port;
-      if (nm_state_get_route(file, host, &port) == 0)
+      if (nm_search_lookup(file, ss_id, sizeof ss_id) == 0 && nm_state_get_route(file, host, &port) == 0)
       {
         int ss_fd = tcp_connect(host, port);
         if (ss_fd >= 0)
         {
-          send_line(ss_fd, jsonl_build("{\"op\":\"INFO\",\"file\":\"%s\",\"user\":\"%s\"}", file, user));
+          send_ss_request(ss_fd, "NM_INFO", "INFO", file, user, ss_id, "");
           char *resp = NULL;
           if (recv_line(ss_fd, &resp, 8192) > 0)
           {
@@ -262,15 +1152,17 @@ static void handle_client(int cfd, const char *session_user)
       json_get_str(line, "mode", mode, sizeof mode);
       json_get_str(line, "target_user", target_user, sizeof target_user);
       
-      char host[64];
+      char host[64], ss_id[64];
       int port;
-      if (nm_state_get_route(file, host, &port) == 0)
+      if (nm_search_lookup(file, ss_id, sizeof ss_id) == 0 && nm_state_get_route(file, host, &port) == 0)
       {
         int ss_fd = tcp_connect(host, port);
         if (ss_fd >= 0)
         {
-          send_line(ss_fd, jsonl_build("{\"op\":\"NM_ACCESS\",\"file\":\"%s\",\"cmd\":\"%s\",\"mode\":\"%s\",\"target_user\":\"%s\",\"actor\":\"%s\"}",
-                                       file, !strcmp(op, "ADDACCESS") ? "ADD" : "REM", mode, target_user, user));
+          char fields[160];
+          snprintf(fields, sizeof fields, ",\"cmd\":\"%s\",\"mode\":\"%s\",\"target_user\":\"%s\"",
+                   !strcmp(op, "ADDACCESS") ? "ADD" : "REM", mode, target_user);
+          send_ss_request(ss_fd, "NM_ACCESS", op, file, user, ss_id, fields);
           char *resp = NULL;
           if (recv_line(ss_fd, &resp, 8192) > 0)
           {
@@ -331,48 +1223,23 @@ static void handle_client(int cfd, const char *session_user)
         send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"file not found\"}", ERR_NOT_FOUND));
       }
     }
-    else if (!strcmp(op, "CREATEFOLDER") || !strcmp(op, "VIEWFOLDER"))
+    else if (!strcmp(op, "LIST") || !strcmp(op, "CREATEFOLDER") || !strcmp(op, "VIEWFOLDER"))
     {
-      char folder[256];
-      json_get_str(line, "folder", folder, sizeof folder);
-      char host[64];
-      int port;
-      if (nm_state_get_any_ss(host, &port) == 0)
-      {
-        int ss_fd = tcp_connect(host, port);
-        if (ss_fd >= 0)
-        {
-          send_line(ss_fd, line);
-          char *resp = NULL;
-          if (recv_line(ss_fd, &resp, 8192) > 0)
-          {
-            send_line(cfd, resp);
-            free(resp);
-          }
-          close(ss_fd);
-        }
-      }
-      else
-      {
-        send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"no SS available\"}", ERR_INTERNAL));
-      }
+      handle_storage_fanout(cfd, line, op);
     }
       else if (!strcmp(op, "MOVE") || !strcmp(op, "CHECKPOINT") || !strcmp(op, "VIEWCHECKPOINT") || !strcmp(op, "REVERT") || !strcmp(op, "LISTCHECKPOINTS"))
     {
-      char host[64];
+      char host[64], ss_id[64];
       int port;
-      int is_replica = 0;
-      if (nm_replication_get_ss(file, host, &port, &is_replica) == 0)
+      if (nm_replication_get_ss_id(file, host, &port, ss_id) == 0)
       {
         int ss_fd = tcp_connect(host, port);
         if (ss_fd >= 0)
         {
-          send_line(ss_fd, line);
+          send_file_op(ss_fd, line, op, file, user, ss_id);
           char *resp = NULL;
           if (recv_line(ss_fd, &resp, 8192) > 0)
           {
-            send_line(cfd, resp);
-
               int status = 1;
               json_get_int(resp, "status", &status);
               if (!strcmp(op, "MOVE") && status == 0)
@@ -384,12 +1251,13 @@ static void handle_client(int cfd, const char *session_user)
                   snprintf(new_name, sizeof new_name, "%s/%s", folder, file);
                 else
                   snprintf(new_name, sizeof new_name, "%s", file);
-                nm_state_rename_file(file, new_name);
                 nm_replication_rename_file(file, new_name);
               }
+              reply_committed(cfd, resp);
 
-            // If it's a write operation, replicate asynchronously
-              if ((!strcmp(op, "MOVE") || !strcmp(op, "CHECKPOINT") || !strcmp(op, "REVERT")) && status == 0)
+            // Content changes reach the replica through the SS replication
+            // stream; checkpoints are not part of it
+              if (!strcmp(op, "CHECKPOINT") && status == 0)
             {
               nm_replication_async_write(file, line);
             }
@@ -411,7 +1279,11 @@ static void handle_client(int cfd, const char *session_user)
       json_get_str(line, "owner", owner, sizeof(owner));
 
       int rc = nm_access_req_request(target_file, user, owner);
-      if (rc == OK)
+      if (nm_journal_wait() != OK)
+      {
+        send_not_leader(cfd, "change not committed");
+      }
+      else if (rc == OK)
       {
         send_line(cfd, jsonl_build("{\"status\":0,\"msg\":\"access request sent\"}"));
       }
@@ -446,18 +1318,24 @@ static void handle_client(int cfd, const char *session_user)
       json_get_int(line, "approve", &approve);
 
       int rc = nm_access_req_respond(target_file, requester, user, approve);
-      if (rc == OK && approve)
+      if (nm_journal_wait() != OK)
+      {
+        send_not_leader(cfd, "change not committed");
+      }
+      else if (rc == OK && approve)
       {
         // Grant access on the storage server
-        char host[64];
+        char host[64], ss_id[64];
         int port;
-        int is_replica = 0;
-        if (nm_replication_get_ss(target_file, host, &port, &is_replica) == 0)
+        if (nm_replication_get_ss_id(target_file, host, &port, ss_id) == 0)
         {
           int ss_fd = tcp_connect(host, port);
           if (ss_fd >= 0)
           {
-            send_line(ss_fd, jsonl_build("{\"op\":\"NM_ACCESS\",\"file\":\"%s\",\"user\":\"%s\",\"mode\":\"R\",\"cmd\":\"ADD\"}", target_file, requester));
+            // The owner grants the requester read access
+            char fields[128];
+            snprintf(fields, sizeof fields, ",\"cmd\":\"ADD\",\"mode\":\"R\",\"target_user\":\"%s\"", requester);
+            send_ss_request(ss_fd, "NM_ACCESS", "ADDACCESS", target_file, user, ss_id, fields);
             char *resp = NULL;
             if (recv_line(ss_fd, &resp, 8192) > 0)
             {
@@ -496,22 +1374,91 @@ static void handle_client(int cfd, const char *session_user)
 int main(void)
 {
   nm_state_init();
+  nm_users_init();
   nm_access_req_init();
+
+  // Seconds an access request stays pending (0 = until answered)
+  const char *request_ttl = getenv("NM_REQUEST_TTL");
+  if (request_ttl)
+    nm_access_req_set_ttl(atol(request_ttl));
+
+  // Number of file routes kept in the NM lookup cache
+  const char *route_cache = getenv("NM_ROUTE_CACHE");
+  if (route_cache)
+    nm_search_init(atoi(route_cache));
+
+  // Where CREATE puts new files: hash, bytes, load or p2c
+  const char *placement = getenv("NM_PLACEMENT");
+  PlacementStrategy strategy;
+  if (placement && nm_placement_parse(placement, &strategy) == 0)
+    nm_replication_set_placement(strategy);
+  else if (placement)
+    fprintf(stderr, "[NM] Unknown NM_PLACEMENT '%s', using %s\n", placement, nm_placement_name(PLACEMENT_DEFAULT));
   nm_replication_init();
 
+  // Key and lifetime of the tokens that let clients go to an SS directly
+  if (nm_token_init() != 0)
+  {
+    fprintf(stderr, "[NM] Set NM_TOKEN_KEY to the secret shared with the storage servers\n");
+    return 1;
+  }
+
+  // Failure detector suspicion level at which an SS is declared down
+  const char *phi = getenv("NM_PHI_THRESHOLD");
+  if (phi && atof(phi) > 0)
+    nm_replication_set_phi_threshold(atof(phi));
+
+  // High availability: this NM's id among the cluster in NM_PEERS
+  // ("1=host:port,2=host:port,..."); without them the NM runs alone
+  NMPeer peers[NM_RAFT_MAX_PEERS + 1];
+  int peer_count = nm_peers_parse(getenv("NM_PEERS"), peers, NM_RAFT_MAX_PEERS + 1);
+  const char *id = getenv("NM_ID");
+  int self_id = id ? atoi(id) : 0;
+  int port = 5050;
+  for (int i = 0; i < peer_count; i++)
+  {
+    if (peers[i].id == self_id)
+      port = peers[i].port;
+  }
+  const char *port_env = getenv("NM_PORT");
+  if (port_env && atoi(port_env) > 0)
+    port = atoi(port_env);
+
+  // Restore the catalog, users, access requests and SS pairings, then
+  // journal changes to them. NMs of one cluster on one host keep their
+  // state apart.
+  const char *compact = getenv("NM_JOURNAL_COMPACT");
+  const char *sync = getenv("NM_JOURNAL_SYNC");
+  const char *state_dir = getenv("NM_STATE_DIR");
+  char member_dir[64];
+  if (!state_dir && self_id > 0)
+  {
+    mkdir(NM_STATE_DIR_DEFAULT, 0755);
+    snprintf(member_dir, sizeof member_dir, "%s/nm-%d", NM_STATE_DIR_DEFAULT, self_id);
+    state_dir = member_dir;
+  }
+  nm_journal_open(state_dir, compact ? atol(compact) : 0, sync ? atoi(sync) != 0 : 1);
+  if (peer_count > 1 && nm_raft_start(self_id, peers, peer_count, state_dir) != OK)
+    return 1;
+
   // Start heartbeat checker thread
   pthread_t heartbeat_thread;
   extern void *nm_replication_heartbeat_checker(void *);
   pthread_create(&heartbeat_thread, NULL, nm_replication_heartbeat_checker, NULL);
   pthread_detach(heartbeat_thread);
 
-  int lfd = tcp_listen(NULL, 5050, 128);
+  // One sender drains the replication queues
+  pthread_t queue_thread;
+  pthread_create(&queue_thread, NULL, nm_replication_queue_sender, NULL);
+  pthread_detach(queue_thread);
+
+  int lfd = tcp_listen(NULL, port, 128);
   if (lfd < 0)
   {
     perror("nm listen");
     return 1;
   }
-  printf("[NM] Listening on :5050\n");
+  printf("[NM] Listening on :%d\n", port);
   printf("[NM] Fault tolerance enabled - heartbeat monitoring active\n");
 
   for (;;)
@@ -540,58 +1487,49 @@ int main(void)
       close(cfd);
       continue;
     }
-    // If SS_REGISTER, handle as SS; else treat as CLI with pre-read line
-    if (!strcmp(op, "SS_REGISTER"))
+    // Storage servers register with and report to the leader only
+    if ((!strcmp(op, "SS_REGISTER") || !strcmp(op, "SS_CONTROL")) && redirect_to_leader(cfd, op))
     {
-      // Get peer info for logging
+      free(line);
+      close(cfd);
+      continue;
+    }
+    // If SS_REGISTER or SS_CONTROL, handle as SS; else treat as CLI with
+    // pre-read line
+    if (!strcmp(op, "SS_REGISTER") || !strcmp(op, "SS_CONTROL"))
+    {
+      // The file list arrives in pages and the control channel lives on;
+      // take both off the accept thread
+      Registration *reg = calloc(1, sizeof *reg);
+      if (!reg)
+      {
+        free(line);
+        close(cfd);
+        continue;
+      }
+      reg->fd = cfd;
+      reg->line = line;
+      snprintf(reg->ip, sizeof reg->ip, "127.0.0.1");
       struct sockaddr_in addr;
       socklen_t addr_len = sizeof(addr);
-      char ss_ip[INET_ADDRSTRLEN] = "127.0.0.1";
-      int ss_port = 0;
-      
       if (getpeername(cfd, (struct sockaddr *)&addr, &addr_len) == 0)
       {
-        inet_ntop(AF_INET, &addr.sin_addr, ss_ip, sizeof(ss_ip));
-        ss_port = ntohs(addr.sin_port);
+        inet_ntop(AF_INET, &addr.sin_addr, reg->ip, sizeof reg->ip);
+        reg->port = ntohs(addr.sin_port);
       }
-      
-      char ssid[64] = "";
-      int client_port = 0, nm_port = 0;
-      char files[4096] = "";
-      char advertised_host[64] = "";
-      json_get_str(line, "ss_id", ssid, sizeof ssid);
-      json_get_int(line, "ss_client_port", &client_port);
-      json_get_int(line, "ss_nm_port", &nm_port);
-      json_get_str(line, "files", files, sizeof files);
-      json_get_str(line, "ss_host", advertised_host, sizeof advertised_host);
-
-      const char *register_host = advertised_host[0] ? advertised_host : ss_ip;
-      
-      log_message("NM", "SS_REGISTER", ss_ip, ss_port, ssid, files);
-      log_to_file(NM_LOGFILE, jsonl_build("REQ: %s", line));
-      
-      // Register with replication system
-      nm_replication_register_ss(ssid, register_host, client_port, nm_port);
-
-      // Also add to old state system for compatibility
-      nm_state_add_ss(ssid, register_host, client_port);
+      int control = !strcmp(op, "SS_CONTROL");
+      if (!control)
+        log_to_file(NM_LOGFILE, jsonl_build("REQ: %s", line));
 
-      // Map files with replication
-      char files_copy[4096];
-      strncpy(files_copy, files, sizeof(files_copy) - 1);
-      char *tok = strtok(files_copy, ", ");
-      while (tok)
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, control ? ss_control_thread : ss_register_thread, reg) != 0)
       {
-        nm_state_map_file(tok, ssid);
-        nm_replication_map_file(tok, ssid);
-        tok = strtok(NULL, ", ");
+        free(reg);
+        free(line);
+        close(cfd);
+        continue;
       }
-      
-      send_line(cfd, jsonl_build("{\"op\":\"NM_ACK\",\"status\":0}"));
-      log_to_file(NM_LOGFILE, jsonl_build("RESP: NM_ACK status=0 to ss_id=%s", ssid));
-      
-      free(line);
-      close(cfd);
+      pthread_detach(thread);
     }
     else
     {
@@ -619,26 +1557,31 @@ int main(void)
       }
       
       log_message("NM", op, cli_ip, cli_port, user, file[0] ? file : "N/A");
+      nm_users_touch(user);
       log_to_file(NM_LOGFILE, jsonl_build("REQ: %s", line));
       
       // Process the first command
-      if (!strcmp(op, "CLI_REGISTER"))
+      if (redirect_to_leader(cfd, op))
       {
-        nm_state_add_user(user);
-        send_line(cfd, jsonl_build("{\"status\":0,\"msg\":\"hello %s\"}", user));
+        log_to_file(NM_LOGFILE, jsonl_build("RESP: %s redirected to the leader", op));
+      }
+      else if (!strcmp(op, "CLI_REGISTER"))
+      {
+        nm_users_connect(user, cli_ip, cli_port);
+        reply_committed(cfd, jsonl_build("{\"status\":0,\"msg\":\"hello %s\"}", user));
         log_to_file(NM_LOGFILE, jsonl_build("RESP: status=0 user=%s", user));
       }
       else if (!strcmp(op, "CLI_DEREGISTER"))
       {
         if (user[0])
         {
-          if (nm_state_remove_user(user) == 0)
+          if (nm_users_disconnect(user) == OK)
           {
             log_message("NM", "CLI_DEREGISTER", cli_ip, cli_port, user, "Client disconnected");
             log_to_file(NM_LOGFILE, jsonl_build("DISCONNECT: user=%s from %s:%d", user, cli_ip, cli_port));
           }
         }
-        send_line(cfd, jsonl_build("{\"status\":0,\"msg\":\"goodbye\"}"));
+        reply_committed(cfd, jsonl_build("{\"status\":0,\"msg\":\"goodbye\"}"));
       }
       else if (!strcmp(op, "VIEW"))
       {
@@ -648,9 +1591,23 @@ int main(void)
       }
       else if (!strcmp(op, "LIST_USERS"))
       {
-        char buf[4096];
-        nm_state_list_users(buf, sizeof buf);
-        send_line(cfd, jsonl_build("{\"status\":0,\"users\":\"%s\"}", buf));
+        handle_list_users(cfd, flags);
+      }
+      else if (!strcmp(op, "STATS"))
+      {
+        handle_stats(cfd);
+      }
+      else if (!strcmp(op, "SERVERS"))
+      {
+        handle_servers(cfd);
+      }
+      else if (!strcmp(op, "SEARCH"))
+      {
+        handle_search(cfd, line, user);
+      }
+      else if (!strcmp(op, "GREP"))
+      {
+        handle_grep(cfd, line, user, flags);
       }
       else if (!strcmp(op, "VIEW_ROUTE"))
       {
@@ -665,42 +1622,33 @@ int main(void)
           send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"no SS available\"}", ERR_INTERNAL));
         }
       }
-      else if (!strcmp(op, "READ_ROUTE") || !strcmp(op, "WRITE_ROUTE") || !strcmp(op, "STREAM_ROUTE"))
+      else if (!strcmp(op, "READ_ROUTE") || !strcmp(op, "WRITE_ROUTE") || !strcmp(op, "STREAM_ROUTE") ||
+               !strcmp(op, "CONTROL_ROUTE") || !strcmp(op, "CREATE_ROUTE"))
       {
-        char host[64];
-        int port;
-        if (nm_state_get_route(file, host, &port) == 0)
-        {
-          send_line(cfd, jsonl_build("{\"op\":\"ROUTE\",\"status\":0,\"ss_host\":\"%s\",\"ss_port\":%d}", host, port));
-        }
-        else
-        {
-          send_line(cfd, jsonl_build("{\"status\":%d,\"code\":\"ERR_NOT_FOUND\",\"msg\":\"file route not found\"}", ERR_NOT_FOUND));
-        }
+        handle_route(cfd, line, op, file, user);
       }
       else if (!strcmp(op, "CREATE"))
       {
         char host[64];
         int port;
         char ss_id[64] = "";
-        if (nm_state_get_any_ss(host, &port) == 0 &&
-            nm_state_get_ss_id_by_endpoint(host, port, ss_id, sizeof ss_id) == 0)
+        if (nm_replication_place_file(file, host, &port, ss_id) == OK)
         {
           int ss_fd = tcp_connect(host, port);
           if (ss_fd >= 0)
           {
-            send_line(ss_fd, jsonl_build("{\"op\":\"NM_CREATE\",\"file\":\"%s\",\"owner\":\"%s\"}", file, user));
+            send_ss_request(ss_fd, "NM_CREATE", "CREATE", file, user, ss_id, "");
             char *resp = NULL;
             if (recv_line(ss_fd, &resp, 8192) > 0)
             {
-              send_line(cfd, resp);
-              int status;
+              int status = 1;
               json_get_int(resp, "status", &status);
               if (status == 0)
               {
-                nm_state_map_file(file, ss_id);
                 nm_replication_map_file(file, ss_id);
               }
+              // Reply once the new route is journaled
+              reply_committed(cfd, resp);
               free(resp);
             }
             close(ss_fd);
@@ -717,25 +1665,24 @@ int main(void)
       }
       else if (!strcmp(op, "DELETE") || !strcmp(op, "INFO"))
       {
-        char host[64];
+        char host[64], ss_id[64];
         int port;
-        if (nm_state_get_route(file, host, &port) == 0)
+        if (nm_search_lookup(file, ss_id, sizeof ss_id) == 0 && nm_state_get_route(file, host, &port) == 0)
         {
           int ss_fd = tcp_connect(host, port);
           if (ss_fd >= 0)
           {
-            if (!strcmp(op, "DELETE"))
-            {
-              send_line(ss_fd, jsonl_build("{\"op\":\"NM_DELETE\",\"file\":\"%s\",\"user\":\"%s\"}", file, user));
-            }
-            else
-            {
-              send_line(ss_fd, jsonl_build("{\"op\":\"INFO\",\"file\":\"%s\",\"user\":\"%s\"}", file, user));
-            }
+            send_ss_request(ss_fd, !strcmp(op, "DELETE") ? "NM_DELETE" : "NM_INFO", op, file, user, ss_id, "");
             char *resp = NULL;
             if (recv_line(ss_fd, &resp, 8192) > 0)
             {
-              send_line(cfd, resp);
+              int status = 1;
+              json_get_int(resp, "status", &status);
+              if (!strcmp(op, "DELETE") && status == 0)
+              {
+                nm_replication_unmap_file(file);
+              }
+              reply_committed(cfd, resp);
               free(resp);
             }
             close(ss_fd);
@@ -752,15 +1699,17 @@ int main(void)
         json_get_str(line, "mode", mode, sizeof mode);
         json_get_str(line, "target_user", target_user, sizeof target_user);
         
-        char host[64];
+        char host[64], ss_id[64];
         int port;
-        if (nm_state_get_route(file, host, &port) == 0)
+        if (nm_search_lookup(file, ss_id, sizeof ss_id) == 0 && nm_state_get_route(file, host, &port) == 0)
         {
           int ss_fd = tcp_connect(host, port);
           if (ss_fd >= 0)
           {
-            send_line(ss_fd, jsonl_build("{\"op\":\"NM_ACCESS\",\"file\":\"%s\",\"cmd\":\"%s\",\"mode\":\"%s\",\"target_user\":\"%s\",\"actor\":\"%s\"}",
-                                         file, !strcmp(op, "ADDACCESS") ? "ADD" : "REM", mode, target_user, user));
+            char fields[160];
+            snprintf(fields, sizeof fields, ",\"cmd\":\"%s\",\"mode\":\"%s\",\"target_user\":\"%s\"",
+                     !strcmp(op, "ADDACCESS") ? "ADD" : "REM", mode, target_user);
+            send_ss_request(ss_fd, "NM_ACCESS", op, file, user, ss_id, fields);
             char *resp = NULL;
             if (recv_line(ss_fd, &resp, 8192) > 0)
             {
@@ -821,51 +1770,25 @@ int main(void)
           send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"file not found\"}", ERR_NOT_FOUND));
         }
       }
-      else if (!strcmp(op, "CREATEFOLDER") || !strcmp(op, "VIEWFOLDER"))
+      else if (!strcmp(op, "LIST") || !strcmp(op, "CREATEFOLDER") || !strcmp(op, "VIEWFOLDER"))
       {
-        char folder[256];
-        json_get_str(line, "folder", folder, sizeof folder);
-        char host[64];
-        int port;
-        if (nm_state_get_any_ss(host, &port) == 0)
-        {
-          int ss_fd = tcp_connect(host, port);
-          if (ss_fd >= 0)
-          {
-            send_line(ss_fd, line);
-            char *resp = NULL;
-            if (recv_line(ss_fd, &resp, 8192) > 0)
-            {
-              send_line(cfd, resp);
-              free(resp);
-            }
-            close(ss_fd);
-          }
-        }
-        else
-        {
-          send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"no SS available\"}", ERR_INTERNAL));
-        }
+        handle_storage_fanout(cfd, line, op);
       }
       else if (!strcmp(op, "MOVE") || !strcmp(op, "CHECKPOINT") || !strcmp(op, "VIEWCHECKPOINT") || !strcmp(op, "REVERT") || !strcmp(op, "LISTCHECKPOINTS"))
       {
-        char host[64];
+        char host[64], ss_id[64];
         int port;
-        int is_replica = 0;
-        if (nm_replication_get_ss(file, host, &port, &is_replica) == 0)
+        if (nm_replication_get_ss_id(file, host, &port, ss_id) == 0)
         {
           int ss_fd = tcp_connect(host, port);
           if (ss_fd >= 0)
           {
-            send_line(ss_fd, line);
+            send_file_op(ss_fd, line, op, file, user, ss_id);
             char *resp = NULL;
             if (recv_line(ss_fd, &resp, 8192) > 0)
             {
-              send_line(cfd, resp);
-
               int status = 1;
               json_get_int(resp, "status", &status);
-
               if (!strcmp(op, "MOVE") && status == 0)
               {
                 char folder[256];
@@ -875,12 +1798,13 @@ int main(void)
                   snprintf(new_name, sizeof new_name, "%s/%s", folder, file);
                 else
                   snprintf(new_name, sizeof new_name, "%s", file);
-                nm_state_rename_file(file, new_name);
                 nm_replication_rename_file(file, new_name);
               }
+              reply_committed(cfd, resp);
 
-              // If it's a write operation, replicate asynchronously
-              if ((!strcmp(op, "MOVE") || !strcmp(op, "CHECKPOINT") || !strcmp(op, "REVERT")) && status == 0)
+              // Content changes reach the replica through the SS replication
+              // stream; checkpoints are not part of it
+              if (!strcmp(op, "CHECKPOINT") && status == 0)
               {
                 nm_replication_async_write(file, line);
               }
@@ -902,7 +1826,11 @@ int main(void)
         json_get_str(line, "owner", owner, sizeof(owner));
 
         int rc = nm_access_req_request(target_file, user, owner);
-        if (rc == OK)
+        if (nm_journal_wait() != OK)
+        {
+          send_not_leader(cfd, "change not committed");
+        }
+        else if (rc == OK)
         {
           send_line(cfd, jsonl_build("{\"status\":0,\"msg\":\"access request sent\"}"));
         }
@@ -939,18 +1867,24 @@ int main(void)
         json_get_int(line, "approve", &approve);
 
         int rc = nm_access_req_respond(target_file, requester, user, approve);
-        if (rc == OK && approve)
+        if (nm_journal_wait() != OK)
+        {
+          send_not_leader(cfd, "change not committed");
+        }
+        else if (rc == OK && approve)
         {
           // Grant access on the storage server
-          char host[64];
+          char host[64], ss_id[64];
           int port;
-          int is_replica = 0;
-          if (nm_replication_get_ss(target_file, host, &port, &is_replica) == 0)
+          if (nm_replication_get_ss_id(target_file, host, &port, ss_id) == 0)
           {
             int ss_fd = tcp_connect(host, port);
             if (ss_fd >= 0)
             {
-              send_line(ss_fd, jsonl_build("{\"op\":\"NM_ACCESS\",\"file\":\"%s\",\"user\":\"%s\",\"mode\":\"R\",\"cmd\":\"ADD\"}", target_file, requester));
+              // The owner grants the requester read access
+              char fields[128];
+              snprintf(fields, sizeof fields, ",\"cmd\":\"ADD\",\"mode\":\"R\",\"target_user\":\"%s\"", requester);
+              send_ss_request(ss_fd, "NM_ACCESS", "ADDACCESS", target_file, user, ss_id, fields);
               char *resp = NULL;
               if (recv_line(ss_fd, &resp, 8192) > 0)
               {
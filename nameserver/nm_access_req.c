@@ -1,86 +1,334 @@
 #include "nm_access_req.h"
+#include "nm_journal.h"
 #include "../common/proto.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
 
-#define MAX_REQUESTS 1000
+#define INITIAL_REQUESTS 64 // power of two
 
-static AccessRequest g_requests[MAX_REQUESTS];
-static int g_request_count = 0;
+// Pending requests live in a pool of slots; resolved and expired ones are
+// freed at once and their slots reused. Each pending slot is on three
+// lists: its (file, requester) hash chain, its owner's hash chain (in
+// request order, so VIEWREQUESTS walks only that owner's requests plus any
+// sharing the bucket) and the age list, oldest first, that expiry trims.
+// Links are slot indices, -1 for none, so the pool can be reallocated.
+typedef struct
+{
+    AccessRequest req;
+    unsigned long key_hash; // of file and requester
+    unsigned long owner_hash;
+    int key_next;
+    int owner_prev, owner_next;
+    int age_prev, age_next; // doubles as the free list link
+} Slot;
 
-void nm_access_req_init(void)
+typedef struct
+{
+    int head;
+    int tail;
+} Chain;
+
+static Slot *g_slots = NULL;
+static int g_capacity = 0;
+static int g_count = 0;  // pending requests
+static int g_free = -1;  // first free slot
+static int *g_by_key = NULL;
+static Chain *g_by_owner = NULL;
+static int g_buckets = 0; // for both indexes, power of two
+static Chain g_age = {-1, -1};
+static long g_ttl = ACCESS_REQ_TTL_DEFAULT;
+static pthread_mutex_t g_request_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// djb2, same as the rest of the NM; the key hash continues over the
+// requester after the file's terminator
+static unsigned long hash_more(unsigned long hash, const char *s)
 {
-    g_request_count = 0;
-    memset(g_requests, 0, sizeof(g_requests));
+    int c;
+    while ((c = (unsigned char)*s++))
+        hash = ((hash << 5) + hash) + c;
+    return hash;
 }
 
-int nm_access_req_request(const char *file, const char *requester, const char *owner)
+static unsigned long key_hash(const char *file, const char *requester)
+{
+    return hash_more(hash_more(5381, file) * 33, requester);
+}
+
+static void journal_request(const AccessRequest *req)
 {
-    // Check if request already exists
-    for (int i = 0; i < g_request_count; i++)
+    nm_journal_record("{\"t\":\"access\",\"file\":\"%s\",\"requester\":\"%s\",\"owner\":\"%s\",\"pending\":%d,\"created\":%ld}",
+                      req->file, req->requester, req->owner, req->pending, (long)req->created);
+}
+
+static void link_indexes(int i)
+{
+    Slot *s = &g_slots[i];
+    int *key = &g_by_key[s->key_hash & (g_buckets - 1)];
+    s->key_next = *key;
+    *key = i;
+
+    Chain *owner = &g_by_owner[s->owner_hash & (g_buckets - 1)];
+    s->owner_prev = owner->tail;
+    s->owner_next = -1;
+    if (owner->tail >= 0)
+        g_slots[owner->tail].owner_next = i;
+    else
+        owner->head = i;
+    owner->tail = i;
+}
+
+// Size both indexes for the pool and relink every pending request, oldest
+// first so owner chains stay in request order
+static int rebuild_indexes(int buckets)
+{
+    int *by_key = malloc(buckets * sizeof *by_key);
+    Chain *by_owner = malloc(buckets * sizeof *by_owner);
+    if (!by_key || !by_owner)
     {
-        if (strcmp(g_requests[i].file, file) == 0 &&
-            strcmp(g_requests[i].requester, requester) == 0 &&
-            g_requests[i].pending)
+        free(by_key);
+        free(by_owner);
+        return -1;
+    }
+    for (int b = 0; b < buckets; b++)
+    {
+        by_key[b] = -1;
+        by_owner[b].head = by_owner[b].tail = -1;
+    }
+    free(g_by_key);
+    free(g_by_owner);
+    g_by_key = by_key;
+    g_by_owner = by_owner;
+    g_buckets = buckets;
+    for (int i = g_age.head; i >= 0; i = g_slots[i].age_next)
+        link_indexes(i);
+    return 0;
+}
+
+// Take a free slot, growing the pool and the indexes when none is left
+static int alloc_slot(void)
+{
+    if (g_free < 0)
+    {
+        int capacity = g_capacity ? g_capacity * 2 : INITIAL_REQUESTS;
+        Slot *slots = realloc(g_slots, capacity * sizeof *slots);
+        if (!slots)
+            return -1;
+        g_slots = slots;
+        for (int i = capacity - 1; i >= g_capacity; i--)
         {
-            return ERR_ALREADY_EXISTS; // Request already pending
+            g_slots[i].age_next = g_free;
+            g_free = i;
         }
+        g_capacity = capacity;
+        if (rebuild_indexes(capacity) != 0)
+            return -1;
     }
+    int i = g_free;
+    g_free = g_slots[i].age_next;
+    return i;
+}
+
+static void release_slot(int i)
+{
+    Slot *s = &g_slots[i];
+
+    int *link = &g_by_key[s->key_hash & (g_buckets - 1)];
+    while (*link != i)
+        link = &g_slots[*link].key_next;
+    *link = s->key_next;
+
+    Chain *owner = &g_by_owner[s->owner_hash & (g_buckets - 1)];
+    if (s->owner_prev >= 0)
+        g_slots[s->owner_prev].owner_next = s->owner_next;
+    else
+        owner->head = s->owner_next;
+    if (s->owner_next >= 0)
+        g_slots[s->owner_next].owner_prev = s->owner_prev;
+    else
+        owner->tail = s->owner_prev;
+
+    if (s->age_prev >= 0)
+        g_slots[s->age_prev].age_next = s->age_next;
+    else
+        g_age.head = s->age_next;
+    if (s->age_next >= 0)
+        g_slots[s->age_next].age_prev = s->age_prev;
+    else
+        g_age.tail = s->age_prev;
 
-    if (g_request_count >= MAX_REQUESTS)
+    s->req.pending = 0;
+    s->age_next = g_free;
+    g_free = i;
+    g_count--;
+}
+
+// Drop requests older than the TTL from the front of the age list
+static void expire(time_t now)
+{
+    while (g_ttl > 0 && g_age.head >= 0 && g_slots[g_age.head].req.created + g_ttl <= now)
     {
-        return ERR_INTERNAL;
+        int i = g_age.head;
+        release_slot(i);
+        journal_request(&g_slots[i].req);
     }
+}
+
+static int find_request(const char *file, const char *requester)
+{
+    unsigned long hash = key_hash(file, requester);
+    for (int i = g_by_key[hash & (g_buckets - 1)]; i >= 0; i = g_slots[i].key_next)
+    {
+        if (g_slots[i].key_hash == hash && strcmp(g_slots[i].req.file, file) == 0 &&
+            strcmp(g_slots[i].req.requester, requester) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Add a pending request created at created. Caller holds g_request_mutex.
+static int add_request(const char *file, const char *requester, const char *owner, time_t created)
+{
+    int i = alloc_slot();
+    if (i < 0)
+        return ERR_INTERNAL;
+    Slot *s = &g_slots[i];
+    memset(&s->req, 0, sizeof s->req);
+    strncpy(s->req.file, file, sizeof(s->req.file) - 1);
+    strncpy(s->req.requester, requester, sizeof(s->req.requester) - 1);
+    strncpy(s->req.owner, owner, sizeof(s->req.owner) - 1);
+    s->req.pending = 1;
+    s->req.created = created;
+    s->key_hash = key_hash(s->req.file, s->req.requester);
+    s->owner_hash = hash_more(5381, s->req.owner);
+    link_indexes(i);
 
-    AccessRequest *req = &g_requests[g_request_count++];
-    strncpy(req->file, file, sizeof(req->file) - 1);
-    strncpy(req->requester, requester, sizeof(req->requester) - 1);
-    strncpy(req->owner, owner, sizeof(req->owner) - 1);
-    req->pending = 1;
+    // Restored requests may be older than the newest ones; keep the age
+    // list sorted so expiry can stop at the first live request
+    int after = g_age.tail;
+    while (after >= 0 && g_slots[after].req.created > created)
+        after = g_slots[after].age_prev;
+    s->age_prev = after;
+    s->age_next = after >= 0 ? g_slots[after].age_next : g_age.head;
+    if (after >= 0)
+        g_slots[after].age_next = i;
+    else
+        g_age.head = i;
+    if (s->age_next >= 0)
+        g_slots[s->age_next].age_prev = i;
+    else
+        g_age.tail = i;
 
+    g_count++;
+    journal_request(&s->req);
     return OK;
 }
 
+void nm_access_req_init(void)
+{
+    pthread_mutex_lock(&g_request_mutex);
+    free(g_slots);
+    free(g_by_key);
+    free(g_by_owner);
+    g_slots = NULL;
+    g_by_key = NULL;
+    g_by_owner = NULL;
+    g_capacity = g_count = g_buckets = 0;
+    g_free = -1;
+    g_age.head = g_age.tail = -1;
+    pthread_mutex_unlock(&g_request_mutex);
+}
+
+void nm_access_req_set_ttl(long seconds)
+{
+    pthread_mutex_lock(&g_request_mutex);
+    g_ttl = seconds;
+    pthread_mutex_unlock(&g_request_mutex);
+}
+
+int nm_access_req_request(const char *file, const char *requester, const char *owner)
+{
+    pthread_mutex_lock(&g_request_mutex);
+    time_t now = time(NULL);
+    expire(now);
+
+    int rc;
+    if (g_buckets && find_request(file, requester) >= 0)
+        rc = ERR_ALREADY_EXISTS; // Request already pending
+    else
+        rc = add_request(file, requester, owner, now);
+
+    pthread_mutex_unlock(&g_request_mutex);
+    return rc;
+}
+
+int nm_access_req_restore(const char *file, const char *requester, const char *owner, time_t created, int pending)
+{
+    pthread_mutex_lock(&g_request_mutex);
+    int i = g_buckets ? find_request(file, requester) : -1;
+    int rc = OK;
+    if (i >= 0)
+        release_slot(i);
+    if (pending && (g_ttl <= 0 || created + g_ttl > time(NULL)))
+        rc = add_request(file, requester, owner, created);
+    pthread_mutex_unlock(&g_request_mutex);
+    return rc;
+}
+
 int nm_access_req_list_pending(const char *owner, char *buf, size_t buflen)
 {
     buf[0] = '\0';
-    int pos = 0;
+    size_t pos = 0;
     int found = 0;
 
-    for (int i = 0; i < g_request_count; i++)
+    pthread_mutex_lock(&g_request_mutex);
+    expire(time(NULL));
+    unsigned long hash = hash_more(5381, owner);
+    int i = g_buckets ? g_by_owner[hash & (g_buckets - 1)].head : -1;
+    for (; i >= 0; i = g_slots[i].owner_next)
     {
-        if (strcmp(g_requests[i].owner, owner) == 0 && g_requests[i].pending)
+        const Slot *s = &g_slots[i];
+        if (s->owner_hash != hash || strcmp(s->req.owner, owner) != 0)
+            continue;
+        int n = snprintf(buf + pos, buflen - pos, "%s%s:%s", found ? ";;" : "", s->req.file, s->req.requester);
+        if (n < 0 || (size_t)n >= buflen - pos)
         {
-            if (found > 0)
-            {
-                pos += snprintf(buf + pos, buflen - pos, ";;");
-            }
-            pos += snprintf(buf + pos, buflen - pos, "%s:%s",
-                            g_requests[i].file, g_requests[i].requester);
-            found++;
-
-            if (pos >= (int)buflen - 1)
-                break;
+            buf[pos] = '\0';
+            break;
         }
+        pos += (size_t)n;
+        found++;
     }
+    pthread_mutex_unlock(&g_request_mutex);
 
     return found > 0 ? OK : ERR_NOT_FOUND;
 }
 
 int nm_access_req_respond(const char *file, const char *requester, const char *owner, int approve)
 {
-    for (int i = 0; i < g_request_count; i++)
+    pthread_mutex_lock(&g_request_mutex);
+    expire(time(NULL));
+    int i = g_buckets ? find_request(file, requester) : -1;
+    if (i < 0 || strcmp(g_slots[i].req.owner, owner) != 0)
     {
-        if (strcmp(g_requests[i].file, file) == 0 &&
-            strcmp(g_requests[i].requester, requester) == 0 &&
-            strcmp(g_requests[i].owner, owner) == 0 &&
-            g_requests[i].pending)
-        {
-
-            g_requests[i].pending = 0;
-            return approve ? OK : ERR_UNAUTHORIZED;
-        }
+        pthread_mutex_unlock(&g_request_mutex);
+        return ERR_NOT_FOUND;
     }
 
-    return ERR_NOT_FOUND;
+    release_slot(i);
+    journal_request(&g_slots[i].req);
+    pthread_mutex_unlock(&g_request_mutex);
+    return approve ? OK : ERR_UNAUTHORIZED;
+}
+
+void nm_access_req_foreach_pending(int (*fn)(const AccessRequest *req, void *arg), void *arg)
+{
+    pthread_mutex_lock(&g_request_mutex);
+    for (int i = g_age.head; i >= 0; i = g_slots[i].age_next)
+    {
+        if (fn(&g_slots[i].req, arg))
+            break;
+    }
+    pthread_mutex_unlock(&g_request_mutex);
 }
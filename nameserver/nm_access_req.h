@@ -2,6 +2,7 @@
 #define NM_ACCESS_REQ_H
 
 #include <stddef.h>
+#include <time.h>
 
 // Access request management
 typedef struct
@@ -10,18 +11,33 @@ typedef struct
     char requester[64];
     char owner[64];
     int pending; // 1 if pending, 0 if resolved
+    time_t created;
 } AccessRequest;
 
+// Pending requests expire after this long unless set otherwise (seconds)
+#define ACCESS_REQ_TTL_DEFAULT (7L * 24 * 3600)
+
 // Initialize access request system
 void nm_access_req_init(void);
 
+// Expire pending requests this many seconds old; 0 keeps them forever
+void nm_access_req_set_ttl(long seconds);
+
 // User requests access to a file
 int nm_access_req_request(const char *file, const char *requester, const char *owner);
 
+// Set a request's state from the journal or snapshot: pending since
+// created, or resolved. Requests already past the TTL are dropped.
+int nm_access_req_restore(const char *file, const char *requester, const char *owner, time_t created, int pending);
+
 // Owner views pending requests for their files
 int nm_access_req_list_pending(const char *owner, char *buf, size_t buflen);
 
 // Owner approves/denies a request
 int nm_access_req_respond(const char *file, const char *requester, const char *owner, int approve);
 
+// Call fn on every pending request, oldest first; stops early when fn
+// returns non-zero. fn must not call back into this module.
+void nm_access_req_foreach_pending(int (*fn)(const AccessRequest *req, void *arg), void *arg);
+
 #endif
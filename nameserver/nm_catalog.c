@@ -0,0 +1,446 @@
+#include "nm_catalog.h"
+#include "nm_journal.h"
+#include "../common/proto.h"
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define INITIAL_SLOTS 1024 // power of two
+#define MAX_LOAD_PERCENT 70
+#define MAX_SS_NAMES 255 // distinct storage server ids the catalog can name
+
+// Entries are kept compact: storage server ids are interned in g_ss_names
+// and the name is allocated to length, so a file costs tens of bytes
+// rather than a whole CatalogEntry. Callers only ever see CatalogEntry.
+typedef struct
+{
+  unsigned long version;
+  unsigned long primary_version;
+  unsigned long replica_version;
+  unsigned long mark;
+  unsigned char primary; // index into g_ss_names, 0 for none
+  unsigned char replica;
+  char file[];
+} Entry;
+
+typedef struct
+{
+  unsigned long hash;
+  Entry *entry; // NULL marks an empty slot
+} Slot;
+
+static Slot *g_slots = NULL;
+static size_t g_capacity = 0;
+static size_t g_count = 0;
+static unsigned long g_epoch = 1;
+static char g_ss_names[MAX_SS_NAMES + 1][64]; // [0] is "", no server
+static int g_ss_name_count = 1;
+static pthread_mutex_t g_catalog_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// djb2, same as the rest of the NM
+static unsigned long hash_name(const char *name)
+{
+  unsigned long hash = 5381;
+  int c;
+  while ((c = (unsigned char)*name++))
+    hash = ((hash << 5) + hash) + c;
+  return hash;
+}
+
+static void copy_field(char *dst, size_t size, const char *src)
+{
+  strncpy(dst, src ? src : "", size - 1);
+  dst[size - 1] = '\0';
+}
+
+// Index of ss_id in g_ss_names, adding it if add is set; -1 if unknown or
+// the table is full. Caller holds g_catalog_mutex.
+static int ss_index(const char *ss_id, int add)
+{
+  if (!ss_id || !ss_id[0])
+    return 0;
+  for (int i = 1; i < g_ss_name_count; i++)
+  {
+    if (!strncmp(g_ss_names[i], ss_id, sizeof g_ss_names[i] - 1))
+      return i;
+  }
+  if (!add || g_ss_name_count > MAX_SS_NAMES)
+    return -1;
+  copy_field(g_ss_names[g_ss_name_count], sizeof g_ss_names[0], ss_id);
+  return g_ss_name_count++;
+}
+
+static Entry *new_entry(const char *file)
+{
+  size_t len = strnlen(file, sizeof(((CatalogEntry *)0)->file) - 1);
+  Entry *entry = calloc(1, sizeof(Entry) + len + 1);
+  if (entry)
+    memcpy(entry->file, file, len);
+  return entry;
+}
+
+static void to_public(const Entry *entry, CatalogEntry *out)
+{
+  copy_field(out->file, sizeof out->file, entry->file);
+  memcpy(out->primary_ss, g_ss_names[entry->primary], sizeof out->primary_ss);
+  memcpy(out->replica_ss, g_ss_names[entry->replica], sizeof out->replica_ss);
+  out->version = entry->version;
+  out->primary_version = entry->primary_version;
+  out->replica_version = entry->replica_version;
+  out->mark = entry->mark;
+}
+
+// Index of the slot holding file, or of the empty slot where it would go
+static size_t probe(const char *file, unsigned long hash, int *found)
+{
+  size_t mask = g_capacity - 1;
+  size_t i = hash & mask;
+  while (g_slots[i].entry)
+  {
+    if (g_slots[i].hash == hash && !strcmp(g_slots[i].entry->file, file))
+    {
+      *found = 1;
+      return i;
+    }
+    i = (i + 1) & mask;
+  }
+  *found = 0;
+  return i;
+}
+
+static int grow(void)
+{
+  size_t new_capacity = g_capacity ? g_capacity * 2 : INITIAL_SLOTS;
+  Slot *slots = calloc(new_capacity, sizeof(Slot));
+  if (!slots)
+    return -1;
+
+  size_t mask = new_capacity - 1;
+  for (size_t i = 0; i < g_capacity; i++)
+  {
+    if (!g_slots[i].entry)
+      continue;
+    size_t j = g_slots[i].hash & mask;
+    while (slots[j].entry)
+      j = (j + 1) & mask;
+    slots[j] = g_slots[i];
+  }
+
+  free(g_slots);
+  g_slots = slots;
+  g_capacity = new_capacity;
+  return 0;
+}
+
+static void place(Entry *entry, unsigned long hash)
+{
+  int found;
+  size_t i = probe(entry->file, hash, &found);
+  g_slots[i].hash = hash;
+  g_slots[i].entry = entry;
+}
+
+// Empty slot i and shift later members of its probe run back, so lookups
+// never need tombstones
+static void vacate(size_t i)
+{
+  size_t mask = g_capacity - 1;
+  g_slots[i].entry = NULL;
+  size_t j = i;
+  for (;;)
+  {
+    j = (j + 1) & mask;
+    if (!g_slots[j].entry)
+      break;
+    size_t home = g_slots[j].hash & mask;
+    // The entry at j may move into the hole only if its home slot is not
+    // cyclically within (i, j]
+    int stays = (i <= j) ? (home > i && home <= j) : (home > i || home <= j);
+    if (stays)
+      continue;
+    g_slots[i] = g_slots[j];
+    g_slots[j].entry = NULL;
+    i = j;
+  }
+}
+
+static int ensure_room(void)
+{
+  if (g_capacity && (g_count + 1) * 100 <= g_capacity * MAX_LOAD_PERCENT)
+    return 0;
+  return grow();
+}
+
+// Caller holds g_catalog_mutex
+static void journal_entry(const Entry *entry)
+{
+  nm_journal_record("{\"t\":\"file\",\"file\":\"%s\",\"primary\":\"%s\",\"replica\":\"%s\"}",
+                    entry->file, g_ss_names[entry->primary], g_ss_names[entry->replica]);
+}
+
+int nm_catalog_init(void)
+{
+  pthread_mutex_lock(&g_catalog_mutex);
+  for (size_t i = 0; i < g_capacity; i++)
+    free(g_slots[i].entry);
+  free(g_slots);
+  g_slots = NULL;
+  g_capacity = 0;
+  g_count = 0;
+  g_ss_name_count = 1;
+  int rc = grow();
+  pthread_mutex_unlock(&g_catalog_mutex);
+  return rc == 0 ? OK : ERR_INTERNAL;
+}
+
+int nm_catalog_reserve(size_t files)
+{
+  pthread_mutex_lock(&g_catalog_mutex);
+  int rc = OK;
+  while (rc == OK && files * 100 > g_capacity * MAX_LOAD_PERCENT)
+    rc = grow() == 0 ? OK : ERR_INTERNAL;
+  pthread_mutex_unlock(&g_catalog_mutex);
+  return rc;
+}
+
+int nm_catalog_put(const char *file, const char *primary_ss, const char *replica_ss)
+{
+  if (!file || !file[0])
+    return ERR_BAD_REQUEST;
+
+  pthread_mutex_lock(&g_catalog_mutex);
+
+  int primary = ss_index(primary_ss, 1);
+  int replica = ss_index(replica_ss, 1);
+  if (primary < 0 || replica < 0)
+  {
+    pthread_mutex_unlock(&g_catalog_mutex);
+    return ERR_INTERNAL;
+  }
+
+  unsigned long hash = hash_name(file);
+  int found = 0;
+  size_t i = g_capacity ? probe(file, hash, &found) : 0;
+  Entry *entry;
+  int changed = 1;
+  if (found)
+  {
+    entry = g_slots[i].entry;
+    int new_primary = entry->primary != primary;
+    int new_replica = entry->replica != replica;
+    changed = new_primary || new_replica;
+    if (changed)
+      g_epoch++;
+    // A new holder has reported nothing yet
+    if (new_primary)
+      entry->primary_version = 0;
+    if (new_replica)
+      entry->replica_version = 0;
+  }
+  else
+  {
+    entry = new_entry(file);
+    if (!entry || ensure_room() != 0)
+    {
+      free(entry);
+      pthread_mutex_unlock(&g_catalog_mutex);
+      return ERR_INTERNAL;
+    }
+    place(entry, hash);
+    g_count++;
+  }
+
+  entry->primary = (unsigned char)primary;
+  entry->replica = (unsigned char)replica;
+  entry->version++;
+  if (changed)
+    journal_entry(entry);
+
+  pthread_mutex_unlock(&g_catalog_mutex);
+  return OK;
+}
+
+int nm_catalog_mark(const char *file, unsigned long mark)
+{
+  if (!file)
+    return ERR_BAD_REQUEST;
+
+  pthread_mutex_lock(&g_catalog_mutex);
+  int found = 0;
+  size_t i = g_capacity ? probe(file, hash_name(file), &found) : 0;
+  if (found)
+    g_slots[i].entry->mark = mark;
+  pthread_mutex_unlock(&g_catalog_mutex);
+  return found ? OK : ERR_NOT_FOUND;
+}
+
+int nm_catalog_get(const char *file, CatalogEntry *out)
+{
+  if (!file)
+    return ERR_BAD_REQUEST;
+
+  pthread_mutex_lock(&g_catalog_mutex);
+  int found = 0;
+  size_t i = g_capacity ? probe(file, hash_name(file), &found) : 0;
+  if (found && out)
+    to_public(g_slots[i].entry, out);
+  pthread_mutex_unlock(&g_catalog_mutex);
+  return found ? OK : ERR_NOT_FOUND;
+}
+
+int nm_catalog_rename(const char *old_file, const char *new_file)
+{
+  if (!old_file || !new_file || !new_file[0])
+    return ERR_BAD_REQUEST;
+
+  pthread_mutex_lock(&g_catalog_mutex);
+
+  int found = 0;
+  size_t i = g_capacity ? probe(old_file, hash_name(old_file), &found) : 0;
+  Entry *renamed = found ? new_entry(new_file) : NULL;
+  if (!renamed)
+  {
+    pthread_mutex_unlock(&g_catalog_mutex);
+    return found ? ERR_INTERNAL : ERR_NOT_FOUND;
+  }
+  Entry *entry = g_slots[i].entry;
+  vacate(i);
+
+  unsigned long hash = hash_name(new_file);
+  size_t j = probe(new_file, hash, &found);
+  if (found)
+  {
+    free(g_slots[j].entry);
+    vacate(j);
+    g_count--;
+  }
+
+  renamed->version = entry->version + 1;
+  renamed->primary_version = entry->primary_version;
+  renamed->replica_version = entry->replica_version;
+  renamed->mark = entry->mark;
+  renamed->primary = entry->primary;
+  renamed->replica = entry->replica;
+  free(entry);
+  place(renamed, hash);
+  g_epoch++;
+  nm_journal_record("{\"t\":\"unfile\",\"file\":\"%s\"}", old_file);
+  journal_entry(renamed);
+
+  pthread_mutex_unlock(&g_catalog_mutex);
+  return OK;
+}
+
+int nm_catalog_remove(const char *file)
+{
+  if (!file)
+    return ERR_BAD_REQUEST;
+
+  pthread_mutex_lock(&g_catalog_mutex);
+  int found = 0;
+  size_t i = g_capacity ? probe(file, hash_name(file), &found) : 0;
+  if (found)
+  {
+    free(g_slots[i].entry);
+    vacate(i);
+    g_count--;
+    g_epoch++;
+    nm_journal_record("{\"t\":\"unfile\",\"file\":\"%s\"}", file);
+  }
+  pthread_mutex_unlock(&g_catalog_mutex);
+  return found ? OK : ERR_NOT_FOUND;
+}
+
+int nm_catalog_note_version(const char *file, const char *ss_id, unsigned long file_version)
+{
+  if (!file || !ss_id || !ss_id[0])
+    return ERR_BAD_REQUEST;
+
+  pthread_mutex_lock(&g_catalog_mutex);
+  int found = 0;
+  size_t i = g_capacity ? probe(file, hash_name(file), &found) : 0;
+  int holder = ss_index(ss_id, 0);
+  int rc = ERR_NOT_FOUND;
+  if (found && holder > 0)
+  {
+    Entry *entry = g_slots[i].entry;
+    if (entry->primary == holder)
+    {
+      entry->primary_version = file_version;
+      rc = OK;
+    }
+    else if (entry->replica == holder)
+    {
+      entry->replica_version = file_version;
+      rc = OK;
+    }
+  }
+  pthread_mutex_unlock(&g_catalog_mutex);
+  return rc;
+}
+
+size_t nm_catalog_set_replica(const char *primary_ss, const char *replica_ss)
+{
+  if (!primary_ss || !replica_ss)
+    return 0;
+
+  pthread_mutex_lock(&g_catalog_mutex);
+  int primary = ss_index(primary_ss, 0);
+  int replica = ss_index(replica_ss, 1);
+  size_t changed = 0;
+  for (size_t i = 0; primary > 0 && replica >= 0 && i < g_capacity; i++)
+  {
+    Entry *entry = g_slots[i].entry;
+    if (!entry || entry->primary != primary || entry->replica == replica)
+      continue;
+    entry->replica = (unsigned char)replica;
+    entry->replica_version = 0;
+    entry->version++;
+    changed++;
+  }
+  if (changed)
+  {
+    g_epoch++;
+    nm_journal_record("{\"t\":\"replica\",\"primary\":\"%s\",\"replica\":\"%s\"}", primary_ss, replica_ss);
+  }
+  pthread_mutex_unlock(&g_catalog_mutex);
+  return changed;
+}
+
+size_t nm_catalog_count(void)
+{
+  pthread_mutex_lock(&g_catalog_mutex);
+  size_t n = g_count;
+  pthread_mutex_unlock(&g_catalog_mutex);
+  return n;
+}
+
+unsigned long nm_catalog_epoch(void)
+{
+  pthread_mutex_lock(&g_catalog_mutex);
+  unsigned long epoch = g_epoch;
+  pthread_mutex_unlock(&g_catalog_mutex);
+  return epoch;
+}
+
+void nm_catalog_bump_epoch(void)
+{
+  pthread_mutex_lock(&g_catalog_mutex);
+  g_epoch++;
+  pthread_mutex_unlock(&g_catalog_mutex);
+}
+
+void nm_catalog_foreach(int (*fn)(const CatalogEntry *entry, void *arg), void *arg)
+{
+  CatalogEntry current;
+  pthread_mutex_lock(&g_catalog_mutex);
+  for (size_t i = 0; i < g_capacity; i++)
+  {
+    if (!g_slots[i].entry)
+      continue;
+    to_public(g_slots[i].entry, &current);
+    if (fn(&current, arg))
+      break;
+  }
+  pthread_mutex_unlock(&g_catalog_mutex);
+}
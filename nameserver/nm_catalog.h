@@ -0,0 +1,66 @@
+#ifndef NM_CATALOG_H
+#define NM_CATALOG_H
+#include <stddef.h>
+
+// File catalog: the single file -> storage server mapping kept by the NM.
+// An open-addressing hash table (linear probing, backward-shift deletion)
+// that doubles and rehashes as it fills, so routing, rename and delete stay
+// O(1) on average however many files are registered. Placement changes
+// are journaled (nm_journal.h); versions are not, holders report them.
+
+typedef struct
+{
+  char file[256];
+  char primary_ss[64];
+  char replica_ss[64];
+  unsigned long version; // bumped whenever the placement or name changes
+  // Latest committed file version reported by each holder (0 = none yet).
+  // The replica may serve reads only while it has caught up.
+  unsigned long primary_version;
+  unsigned long replica_version;
+  unsigned long mark; // when the primary last registered or was given the file (ms)
+} CatalogEntry;
+
+int nm_catalog_init(void);
+
+// Make room for files entries without rehashing along the way
+int nm_catalog_reserve(size_t files);
+
+// Insert or update the placement of file. Returns OK, or ERR_INTERNAL when
+// the table could not grow.
+int nm_catalog_put(const char *file, const char *primary_ss, const char *replica_ss);
+
+// Tag file's entry with mark (see CatalogEntry.mark). Returns OK or
+// ERR_NOT_FOUND.
+int nm_catalog_mark(const char *file, unsigned long mark);
+
+// Copy the entry for file into out. Returns OK or ERR_NOT_FOUND.
+int nm_catalog_get(const char *file, CatalogEntry *out);
+
+// Move an entry to a new name, replacing any entry already there
+int nm_catalog_rename(const char *old_file, const char *new_file);
+
+int nm_catalog_remove(const char *file);
+
+// Record the file version ss_id reports holding, as primary or replica.
+// Returns OK, or ERR_NOT_FOUND when the file is unknown or ss_id holds
+// no copy of it.
+int nm_catalog_note_version(const char *file, const char *ss_id, unsigned long file_version);
+
+// Make replica_ss the replica of every file primary_ss is primary for.
+// Returns how many entries changed.
+size_t nm_catalog_set_replica(const char *primary_ss, const char *replica_ss);
+
+size_t nm_catalog_count(void);
+
+// Routing epoch: advances whenever a route handed out earlier may have
+// gone stale (a file renamed, removed or re-placed, or a storage server
+// coming or going). Clients cache routes until they see a newer epoch.
+unsigned long nm_catalog_epoch(void);
+void nm_catalog_bump_epoch(void);
+
+// Call fn on every entry under the catalog lock; stops early when fn
+// returns non-zero. fn must not call back into the catalog.
+void nm_catalog_foreach(int (*fn)(const CatalogEntry *entry, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,741 @@
+#include "nm_journal.h"
+#include "nm_catalog.h"
+#include "nm_users.h"
+#include "nm_access_req.h"
+#include "nm_replication.h"
+#include "nm_search.h"
+#include "nm_raft.h"
+#include "../common/proto.h"
+#include "../common/jsonl.h"
+#include "../common/log.h"
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define JOURNAL_LINE_MAX 1024
+#define SNAPSHOT_MAGIC "NMSNAP3\n"
+#define SNAPSHOT_MAGIC_V2 "NMSNAP2\n" // requests without a creation time
+#define SNAPSHOT_MAGIC_V1 "NMSNAP1\n" // and SS entries without a registration version
+#define SNAPSHOT_BUFFER (1 << 20)
+#define MAX_SNAPSHOT_SS 64
+
+// Snapshot layout: this header, then the SS, user, request and file
+// sections in that order. Strings are a uint16 length and the bytes, ints
+// are int32 and versions and times uint64, all in host byte order.
+typedef struct
+{
+  char magic[8];
+  uint64_t journal_gen; // first journal generation not covered
+  uint64_t ss_count;
+  uint64_t user_count;
+  uint64_t request_count;
+  uint64_t file_count;
+} SnapshotHeader;
+
+static char g_dir[256];
+static int g_fd = -1;              // current journal, -1 if none
+static unsigned long g_gen = 0;    // its generation
+static long g_records = 0;         // records in journals since the last snapshot
+static long g_compact_every = NM_JOURNAL_COMPACT_DEFAULT;
+static int g_replaying = 0;
+static int g_compact_wanted = 0;
+static pthread_mutex_t g_journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_journal_cond = PTHREAD_COND_INITIALIZER;
+
+// Group commit: records are numbered as they are written, and one waiting
+// thread at a time syncs the journal for every record written so far
+static int g_sync = 1;                 // sync before replying (NM_JOURNAL_SYNC)
+static unsigned long g_written = 0;    // records written
+static unsigned long g_synced = 0;     // records known to be on disk
+static int g_syncing = 0;              // a thread is in fdatasync
+static pthread_cond_t g_synced_cond = PTHREAD_COND_INITIALIZER;
+static _Thread_local unsigned long t_written = 0; // this thread's last record
+
+// Raft log position of the last record journaled, and of this thread's
+// last record since it waited
+static unsigned long g_position = 0;
+static unsigned long g_position_term = 0;
+static _Thread_local unsigned long t_index = 0;
+static _Thread_local unsigned long t_term = 0;
+
+static long long now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void journal_path(unsigned long gen, char *out, size_t size)
+{
+  snprintf(out, size, "%s/journal.%06lu", g_dir, gen);
+}
+
+// One journal line: the record, led by its log position when it has one.
+// Returns the length, or -1 if it does not fit.
+static int format_line(char *buf, size_t size, const char *record, unsigned long index, unsigned long term)
+{
+  int len;
+  if (index && record[0] == '{')
+    len = snprintf(buf, size, "{\"raft_index\":%lu,\"raft_term\":%lu,%s\n", index, term, record + 1);
+  else
+    len = snprintf(buf, size, "%s\n", record);
+  return len < 0 || (size_t)len >= size ? -1 : len;
+}
+
+// Caller holds g_journal_mutex
+static int open_generation(unsigned long gen)
+{
+  char path[300];
+  journal_path(gen, path, sizeof path);
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+  // The old journal stays the only copy of its records until the snapshot
+  // is written, so it is synced before anything waits on the new one
+  while (g_syncing)
+    pthread_cond_wait(&g_synced_cond, &g_journal_mutex);
+  if (g_fd >= 0)
+  {
+    if (!g_sync || fdatasync(g_fd) == 0)
+      g_synced = g_written;
+    close(g_fd);
+  }
+  g_fd = fd;
+  g_gen = gen;
+  // Journals before this one may be deleted once a snapshot covers them
+  char buf[128];
+  int len = format_line(buf, sizeof buf, "{\"t\":\"raft\"}", g_position, g_position_term);
+  if (g_position && len > 0 && write(g_fd, buf, (size_t)len) == len)
+    g_written++;
+  return 0;
+}
+
+// Append line (without its newline), log entry index of term or 0, to the
+// current journal
+static void journal_write(const char *line, unsigned long index, unsigned long term)
+{
+  char buf[JOURNAL_LINE_MAX + 64];
+  int len = format_line(buf, sizeof buf, line, index, term);
+  if (len < 0)
+    return;
+
+  pthread_mutex_lock(&g_journal_mutex);
+  if (index)
+  {
+    g_position = index;
+    g_position_term = term;
+  }
+  // O_APPEND writes of one short line land whole
+  if (g_fd >= 0 && write(g_fd, buf, (size_t)len) == len)
+  {
+    t_written = ++g_written;
+    if (++g_records >= g_compact_every && !g_compact_wanted)
+    {
+      g_compact_wanted = 1;
+      pthread_cond_signal(&g_journal_cond);
+    }
+  }
+  pthread_mutex_unlock(&g_journal_mutex);
+}
+
+void nm_journal_record(const char *fmt, ...)
+{
+  if (g_replaying)
+    return;
+
+  char line[JOURNAL_LINE_MAX];
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(line, sizeof line, fmt, ap);
+  va_end(ap);
+  if (len < 0 || len >= (int)sizeof line)
+    return;
+
+  // Followers get the record even when this NM journals nothing itself
+  unsigned long term;
+  unsigned long index = nm_raft_append(line, &term);
+  journal_write(line, index, term);
+  if (index)
+  {
+    t_index = index;
+    t_term = term;
+  }
+}
+
+int nm_journal_wait(void)
+{
+  unsigned long index = t_index, term = t_term;
+  t_index = t_term = 0;
+  if (!g_sync)
+    return nm_raft_wait(index, term);
+  pthread_mutex_lock(&g_journal_mutex);
+  while (g_synced < t_written)
+  {
+    if (g_syncing)
+    {
+      pthread_cond_wait(&g_synced_cond, &g_journal_mutex);
+      continue;
+    }
+    // Sync for every thread that has written so far, not just this one
+    unsigned long upto = g_written;
+    int fd = g_fd;
+    g_syncing = 1;
+    pthread_mutex_unlock(&g_journal_mutex);
+    int rc = fdatasync(fd);
+    pthread_mutex_lock(&g_journal_mutex);
+    g_syncing = 0;
+    if (rc == 0 && upto > g_synced)
+      g_synced = upto;
+    pthread_cond_broadcast(&g_synced_cond);
+    if (rc != 0)
+    {
+      perror("nm journal fdatasync");
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_journal_mutex);
+  return nm_raft_wait(index, term);
+}
+
+// ==================== REPLAY ====================
+
+static void apply_record(const char *line)
+{
+  char type[16], a[256], b[64], c[64], d[64];
+  int flag = 0, port = 0, nm_port = 0;
+  if (json_get_str(line, "t", type, sizeof type) != 0)
+    return;
+
+  if (!strcmp(type, "file"))
+  {
+    if (json_get_str(line, "file", a, sizeof a) == 0 && json_get_str(line, "primary", b, sizeof b) == 0 &&
+        json_get_str(line, "replica", c, sizeof c) == 0)
+      nm_catalog_put(a, b, c);
+  }
+  else if (!strcmp(type, "unfile"))
+  {
+    if (json_get_str(line, "file", a, sizeof a) == 0)
+      nm_catalog_remove(a);
+  }
+  else if (!strcmp(type, "replica"))
+  {
+    if (json_get_str(line, "primary", b, sizeof b) == 0 && json_get_str(line, "replica", c, sizeof c) == 0)
+      nm_catalog_set_replica(b, c);
+  }
+  else if (!strcmp(type, "user"))
+  {
+    if (json_get_str(line, "user", b, sizeof b) == 0 && json_get_int(line, "on", &flag) == 0)
+      nm_users_restore(b, flag);
+  }
+  else if (!strcmp(type, "access"))
+  {
+    if (json_get_str(line, "file", a, sizeof a) == 0 && json_get_str(line, "requester", b, sizeof b) == 0 &&
+        json_get_str(line, "owner", c, sizeof c) == 0 && json_get_int(line, "pending", &flag) == 0)
+    {
+      long long created = 0;
+      if (json_get_long(line, "created", &created) != 0)
+        created = time(NULL);
+      nm_access_req_restore(a, b, c, (time_t)created, flag);
+    }
+  }
+  else if (!strcmp(type, "ss"))
+  {
+    if (json_get_str(line, "ss_id", b, sizeof b) == 0 && json_get_str(line, "host", c, sizeof c) == 0 &&
+        json_get_int(line, "client_port", &port) == 0 && json_get_int(line, "nm_port", &nm_port) == 0 &&
+        json_get_str(line, "replica_of", d, sizeof d) == 0)
+    {
+      long long version = 0;
+      json_get_long(line, "reg_version", &version);
+      nm_replication_restore_ss(b, c, port, nm_port, d, (unsigned long)version);
+    }
+  }
+}
+
+// Apply every complete line of a journal; a torn final line is ignored
+static long replay_journal(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+  char line[JOURNAL_LINE_MAX + 1];
+  long applied = 0;
+  while (fgets(line, sizeof line, f))
+  {
+    size_t len = strlen(line);
+    if (len == 0 || line[len - 1] != '\n')
+      continue;
+    long long index, term;
+    if (json_get_long(line, "raft_index", &index) == 0 && json_get_long(line, "raft_term", &term) == 0)
+    {
+      g_position = (unsigned long)index;
+      g_position_term = (unsigned long)term;
+    }
+    apply_record(line);
+    applied++;
+  }
+  fclose(f);
+  return applied;
+}
+
+typedef struct
+{
+  const unsigned char *p;
+  const unsigned char *end;
+} Cursor;
+
+static int read_str(Cursor *cur, char *out, size_t size)
+{
+  uint16_t len;
+  if (cur->end - cur->p < (long)sizeof len)
+    return -1;
+  memcpy(&len, cur->p, sizeof len);
+  cur->p += sizeof len;
+  if (cur->end - cur->p < len)
+    return -1;
+  size_t n = len < size - 1 ? len : size - 1;
+  memcpy(out, cur->p, n);
+  out[n] = '\0';
+  cur->p += len;
+  return 0;
+}
+
+static int read_u64(Cursor *cur, uint64_t *out)
+{
+  if (cur->end - cur->p < (long)sizeof *out)
+    return -1;
+  memcpy(out, cur->p, sizeof *out);
+  cur->p += sizeof *out;
+  return 0;
+}
+
+static int read_int(Cursor *cur, int *out)
+{
+  int32_t v;
+  if (cur->end - cur->p < (long)sizeof v)
+    return -1;
+  memcpy(&v, cur->p, sizeof v);
+  cur->p += sizeof v;
+  *out = v;
+  return 0;
+}
+
+// Load the snapshot, if any; returns the first journal generation it does
+// not cover (0 without a snapshot) and sets *loaded to the files restored
+static unsigned long load_snapshot(size_t *loaded)
+{
+  char path[300];
+  snprintf(path, sizeof path, "%s/snapshot", g_dir);
+  *loaded = 0;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader))
+  {
+    close(fd);
+    return 0;
+  }
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 0;
+  posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+  SnapshotHeader header;
+  memcpy(&header, map, sizeof header);
+  int format = !memcmp(header.magic, SNAPSHOT_MAGIC, sizeof header.magic)      ? 3
+               : !memcmp(header.magic, SNAPSHOT_MAGIC_V2, sizeof header.magic) ? 2
+               : !memcmp(header.magic, SNAPSHOT_MAGIC_V1, sizeof header.magic) ? 1
+                                                                                : 0;
+  if (!format)
+  {
+    munmap(map, (size_t)st.st_size);
+    fprintf(stderr, "[NM] %s is not a snapshot; ignoring it\n", path);
+    return 0;
+  }
+
+  Cursor cur = {(const unsigned char *)map + sizeof header, (const unsigned char *)map + st.st_size};
+  char file[256], a[64], b[64], c[64];
+  int port, nm_port, ok = 1;
+  for (uint64_t i = 0; ok && i < header.ss_count; i++)
+  {
+    ok = read_str(&cur, a, sizeof a) == 0 && read_str(&cur, b, sizeof b) == 0 && read_int(&cur, &port) == 0 &&
+         read_int(&cur, &nm_port) == 0 && read_str(&cur, c, sizeof c) == 0;
+    uint64_t version = 0;
+    if (ok && format >= 2)
+      ok = read_u64(&cur, &version) == 0;
+    if (ok)
+      nm_replication_restore_ss(a, b, port, nm_port, c, (unsigned long)version);
+  }
+  for (uint64_t i = 0; ok && i < header.user_count; i++)
+  {
+    ok = read_str(&cur, a, sizeof a) == 0;
+    if (ok)
+      nm_users_restore(a, 1);
+  }
+  for (uint64_t i = 0; ok && i < header.request_count; i++)
+  {
+    ok = read_str(&cur, file, sizeof file) == 0 && read_str(&cur, a, sizeof a) == 0 &&
+         read_str(&cur, b, sizeof b) == 0;
+    uint64_t created = (uint64_t)time(NULL);
+    if (ok && format >= 3)
+      ok = read_u64(&cur, &created) == 0;
+    if (ok)
+      nm_access_req_restore(file, a, b, (time_t)created, 1);
+  }
+  nm_catalog_reserve(header.file_count);
+  for (uint64_t i = 0; ok && i < header.file_count; i++)
+  {
+    ok = read_str(&cur, file, sizeof file) == 0 && read_str(&cur, a, sizeof a) == 0 &&
+         read_str(&cur, b, sizeof b) == 0;
+    if (ok && nm_catalog_put(file, a, b) == OK)
+      (*loaded)++;
+  }
+  munmap(map, (size_t)st.st_size);
+  if (!ok)
+    fprintf(stderr, "[NM] Snapshot %s is truncated; restored what it holds\n", path);
+  return (unsigned long)header.journal_gen;
+}
+
+static int compare_gens(const void *a, const void *b)
+{
+  unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Generations of the journals in g_dir, ascending; caller frees *out
+static int list_generations(unsigned long **out)
+{
+  *out = NULL;
+  DIR *dir = opendir(g_dir);
+  if (!dir)
+    return 0;
+  int count = 0, cap = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    char *end;
+    if (strncmp(entry->d_name, "journal.", 8) != 0)
+      continue;
+    unsigned long gen = strtoul(entry->d_name + 8, &end, 10);
+    if (*end)
+      continue;
+    if (count == cap)
+    {
+      cap = cap ? cap * 2 : 16;
+      unsigned long *bigger = realloc(*out, cap * sizeof **out);
+      if (!bigger)
+        break;
+      *out = bigger;
+    }
+    (*out)[count++] = gen;
+  }
+  closedir(dir);
+  qsort(*out, count, sizeof **out, compare_gens);
+  return count;
+}
+
+// ==================== SNAPSHOT ====================
+
+static int write_str(FILE *f, const char *s)
+{
+  size_t len = strlen(s);
+  uint16_t n = len > UINT16_MAX ? UINT16_MAX : (uint16_t)len;
+  return fwrite(&n, sizeof n, 1, f) == 1 && fwrite(s, 1, n, f) == n ? 0 : -1;
+}
+
+static int write_int(FILE *f, int v)
+{
+  int32_t n = v;
+  return fwrite(&n, sizeof n, 1, f) == 1 ? 0 : -1;
+}
+
+static int write_u64(FILE *f, uint64_t v)
+{
+  return fwrite(&v, sizeof v, 1, f) == 1 ? 0 : -1;
+}
+
+typedef struct
+{
+  FILE *f;
+  uint64_t count;
+  int failed;
+} SnapshotWriter;
+
+static int write_request(const AccessRequest *req, void *arg)
+{
+  SnapshotWriter *w = arg;
+  if (write_str(w->f, req->file) || write_str(w->f, req->requester) || write_str(w->f, req->owner) ||
+      write_u64(w->f, (uint64_t)req->created))
+    w->failed = 1;
+  w->count++;
+  return w->failed;
+}
+
+static int write_file(const CatalogEntry *entry, void *arg)
+{
+  SnapshotWriter *w = arg;
+  if (write_str(w->f, entry->file) || write_str(w->f, entry->primary_ss) || write_str(w->f, entry->replica_ss))
+    w->failed = 1;
+  w->count++;
+  return w->failed;
+}
+
+// Write the state as of now to the snapshot, covering journals before gen
+static int write_snapshot(unsigned long gen)
+{
+  char tmp[300], path[300];
+  snprintf(tmp, sizeof tmp, "%s/snapshot.tmp", g_dir);
+  snprintf(path, sizeof path, "%s/snapshot", g_dir);
+  FILE *f = fopen(tmp, "wb");
+  if (!f)
+    return -1;
+  char *buffer = malloc(SNAPSHOT_BUFFER);
+  if (buffer)
+    setvbuf(f, buffer, _IOFBF, SNAPSHOT_BUFFER);
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof header);
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof header.magic);
+  header.journal_gen = gen;
+  int failed = fwrite(&header, sizeof header, 1, f) != 1;
+
+  SSNode nodes[MAX_SNAPSHOT_SS];
+  int n = nm_replication_list_all(nodes, MAX_SNAPSHOT_SS);
+  for (int i = 0; i < n && !failed; i++)
+  {
+    failed = write_str(f, nodes[i].ss_id) || write_str(f, nodes[i].host) || write_int(f, nodes[i].client_port) ||
+             write_int(f, nodes[i].nm_port) || write_str(f, nodes[i].replica_of) ||
+             write_u64(f, nodes[i].reg_version);
+    header.ss_count++;
+  }
+
+  UserInfo users[64];
+  size_t cursor = 0;
+  int page;
+  while (!failed && (page = nm_users_page(&cursor, 1, users, 64)) > 0)
+  {
+    for (int i = 0; i < page && !failed; i++)
+    {
+      failed = write_str(f, users[i].name) != 0;
+      header.user_count++;
+    }
+  }
+
+  SnapshotWriter requests = {f, 0, failed};
+  if (!failed)
+    nm_access_req_foreach_pending(write_request, &requests);
+  header.request_count = requests.count;
+
+  SnapshotWriter files = {f, 0, requests.failed};
+  if (!files.failed)
+    nm_catalog_foreach(write_file, &files);
+  header.file_count = files.count;
+
+  failed = files.failed || fflush(f) != 0 || fseek(f, 0, SEEK_SET) != 0 ||
+           fwrite(&header, sizeof header, 1, f) != 1 || fflush(f) != 0 || fsync(fileno(f)) != 0;
+  fclose(f);
+  free(buffer);
+  if (failed || rename(tmp, path) != 0)
+  {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+// Start a new journal generation, snapshot the state, and drop the
+// journals the snapshot covers
+static void compact(void)
+{
+  long long started = now_ms();
+  pthread_mutex_lock(&g_journal_mutex);
+  unsigned long gen = g_gen + 1;
+  int rotated = open_generation(gen) == 0;
+  if (rotated)
+    g_records = 0;
+  pthread_mutex_unlock(&g_journal_mutex);
+  if (!rotated || write_snapshot(gen) != 0)
+  {
+    log_message("NM", "SNAPSHOT", "127.0.0.1", 5050, "system", "Snapshot failed; journals kept");
+    return;
+  }
+
+  unsigned long *gens;
+  int count = list_generations(&gens);
+  for (int i = 0; i < count && gens[i] < gen; i++)
+  {
+    char old[300];
+    journal_path(gens[i], old, sizeof old);
+    unlink(old);
+  }
+  free(gens);
+
+  char details[128];
+  snprintf(details, sizeof details, "Snapshot of %zu files written in %lld ms", nm_catalog_count(),
+           now_ms() - started);
+  log_message("NM", "SNAPSHOT", "127.0.0.1", 5050, "system", details);
+}
+
+static void *compactor_thread(void *arg)
+{
+  (void)arg;
+  for (;;)
+  {
+    pthread_mutex_lock(&g_journal_mutex);
+    while (!g_compact_wanted)
+      pthread_cond_wait(&g_journal_cond, &g_journal_mutex);
+    pthread_mutex_unlock(&g_journal_mutex);
+
+    compact();
+
+    pthread_mutex_lock(&g_journal_mutex);
+    g_compact_wanted = 0;
+    pthread_mutex_unlock(&g_journal_mutex);
+  }
+  return NULL;
+}
+
+// ==================== REPLICATION ====================
+
+void nm_journal_apply(const char *record, unsigned long index, unsigned long term)
+{
+  char file[256];
+  g_replaying = 1;
+  apply_record(record);
+  g_replaying = 0;
+  if (json_get_str(record, "file", file, sizeof file) == 0)
+    nm_search_invalidate(file);
+  journal_write(record, index, term);
+}
+
+void nm_journal_mark(unsigned long index, unsigned long term)
+{
+  journal_write("{\"t\":\"raft\"}", index, term);
+}
+
+void nm_journal_position(unsigned long *index, unsigned long *term)
+{
+  pthread_mutex_lock(&g_journal_mutex);
+  *index = g_position;
+  *term = g_position_term;
+  pthread_mutex_unlock(&g_journal_mutex);
+}
+
+void nm_journal_reset(void)
+{
+  SearchStats stats;
+  nm_search_stats(&stats);
+  nm_catalog_init();
+  nm_users_init();
+  nm_access_req_init();
+  nm_search_init(stats.capacity);
+}
+
+static int dump_request(const AccessRequest *req, void *arg)
+{
+  return fprintf(arg, "{\"t\":\"access\",\"file\":\"%s\",\"requester\":\"%s\",\"owner\":\"%s\",\"pending\":1,\"created\":%ld}\n",
+                 req->file, req->requester, req->owner, (long)req->created) < 0;
+}
+
+static int dump_file(const CatalogEntry *entry, void *arg)
+{
+  return fprintf(arg, "{\"t\":\"file\",\"file\":\"%s\",\"primary\":\"%s\",\"replica\":\"%s\"}\n",
+                 entry->file, entry->primary_ss, entry->replica_ss) < 0;
+}
+
+int nm_journal_dump(FILE *out)
+{
+  SSNode nodes[MAX_SNAPSHOT_SS];
+  int n = nm_replication_list_all(nodes, MAX_SNAPSHOT_SS);
+  for (int i = 0; i < n; i++)
+    fprintf(out, "{\"t\":\"ss\",\"ss_id\":\"%s\",\"host\":\"%s\",\"client_port\":%d,\"nm_port\":%d,\"replica_of\":\"%s\",\"reg_version\":%lu}\n",
+            nodes[i].ss_id, nodes[i].host, nodes[i].client_port, nodes[i].nm_port, nodes[i].replica_of,
+            nodes[i].reg_version);
+
+  UserInfo users[64];
+  size_t cursor = 0;
+  int page;
+  while ((page = nm_users_page(&cursor, 1, users, 64)) > 0)
+  {
+    for (int i = 0; i < page; i++)
+      fprintf(out, "{\"t\":\"user\",\"user\":\"%s\",\"on\":1}\n", users[i].name);
+  }
+
+  nm_access_req_foreach_pending(dump_request, out);
+  nm_catalog_foreach(dump_file, out);
+  return fflush(out) == 0 && !ferror(out) ? 0 : -1;
+}
+
+void nm_journal_compact(void)
+{
+  pthread_mutex_lock(&g_journal_mutex);
+  if (g_fd >= 0 && !g_compact_wanted)
+  {
+    g_compact_wanted = 1;
+    pthread_cond_signal(&g_journal_cond);
+  }
+  pthread_mutex_unlock(&g_journal_mutex);
+}
+
+int nm_journal_open(const char *dir, long compact_every, int sync)
+{
+  snprintf(g_dir, sizeof g_dir, "%s", dir && dir[0] ? dir : NM_STATE_DIR_DEFAULT);
+  if (compact_every > 0)
+    g_compact_every = compact_every;
+  g_sync = sync;
+  mkdir(g_dir, 0755);
+
+  long long started = now_ms();
+  g_replaying = 1;
+  size_t files = 0;
+  unsigned long first = load_snapshot(&files);
+  unsigned long *gens;
+  int count = list_generations(&gens);
+  unsigned long next = first;
+  long replayed = 0;
+  for (int i = 0; i < count; i++)
+  {
+    if (gens[i] < first)
+      continue;
+    char path[300];
+    journal_path(gens[i], path, sizeof path);
+    replayed += replay_journal(path);
+    next = gens[i] + 1;
+  }
+  free(gens);
+  nm_replication_recount();
+  g_replaying = 0;
+
+  char details[256];
+  snprintf(details, sizeof details, "Restored %zu files (%zu from snapshot), %ld journal records replayed in %lld ms",
+           nm_catalog_count(), files, replayed, now_ms() - started);
+  log_message("NM", "STATE_RESTORE", "127.0.0.1", 5050, "system", details);
+
+  pthread_mutex_lock(&g_journal_mutex);
+  int rc = open_generation(next);
+  // Fold a long replayed tail into a snapshot so the next start is quick
+  g_records = replayed;
+  if (rc == 0 && g_records >= g_compact_every)
+    g_compact_wanted = 1;
+  pthread_mutex_unlock(&g_journal_mutex);
+  if (rc != 0)
+  {
+    fprintf(stderr, "[NM] Could not open a journal in %s; state will not survive a restart\n", g_dir);
+    return ERR_INTERNAL;
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, compactor_thread, NULL) == 0)
+    pthread_detach(thread);
+  return OK;
+}
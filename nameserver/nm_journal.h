@@ -0,0 +1,78 @@
+#ifndef NM_JOURNAL_H
+#define NM_JOURNAL_H
+
+#include <stdio.h>
+
+// Durable Name Server state: file placements, connected users, pending
+// access requests and storage server pairings.
+//
+// Every mutation appends one JSON line to the current journal
+// (<dir>/journal.<gen>). Records carry the resulting state of one item (a
+// file's placement, a user's presence, a request's pending flag), never a
+// delta, so replaying a journal over state that already contains some of
+// it is harmless. After NM_JOURNAL_COMPACT records a background thread
+// starts a new journal generation, writes the whole state to a compact
+// binary snapshot (<dir>/snapshot) and deletes the journals it covers.
+//
+// Startup maps the snapshot and replays the journals written since, then
+// journals to a fresh generation.
+//
+// In a cluster each record also carries the index and term of its Raft
+// log entry (nameserver/nm_raft.h), and every journal generation starts
+// with the position reached so far, so a restart knows which entries the
+// state holds.
+//
+// Crash model: a record is in the OS page cache once written, so it
+// survives the NM process crashing. With syncing on (NM_JOURNAL_SYNC=1,
+// the default) it also survives the host losing power once
+// nm_journal_wait returns; records written concurrently share one
+// fdatasync. With syncing off a power loss can drop the last few seconds
+// of records, including ones a client was told succeeded.
+
+#define NM_STATE_DIR_DEFAULT "nameserver/data"
+#define NM_JOURNAL_COMPACT_DEFAULT 100000 // records between snapshots
+
+// Restore state from dir and start journaling there; call once, after the
+// state modules are initialized and before serving requests. sync turns
+// on syncing records before replies. Returns OK, or ERR_INTERNAL if the
+// journal could not be opened (the NM then runs without durability).
+int nm_journal_open(const char *dir, long compact_every, int sync);
+
+// Append one record, a JSON object built like jsonl_build. Call while
+// holding the lock that orders the change, so records for one item land
+// in the order the changes were made. Does nothing while replaying or
+// when no journal is open. A clustered leader also appends the record to
+// the replicated log (nameserver/nm_raft.h).
+void nm_journal_record(const char *fmt, ...);
+
+// Block until every record this thread journaled since its last wait is
+// on disk (unless syncing is off) and, on a clustered leader, committed.
+// Call before replying to a request that changed state, with no state
+// lock held, so other threads' records join the same sync. Returns OK, or
+// an error (see nm_raft_wait) if the change may not have committed.
+int nm_journal_wait(void);
+
+// Apply a record a follower received from the leader as log entry index
+// of term, or with index 0 as part of a state transfer, and journal it
+void nm_journal_apply(const char *record, unsigned long index, unsigned long term);
+
+// Journal that the state holds the log through index of term, after a
+// state transfer
+void nm_journal_mark(unsigned long index, unsigned long term);
+
+// Log position the restored state holds, 0 and 0 if none
+void nm_journal_position(unsigned long *index, unsigned long *term);
+
+// Empty the catalog, users, access requests and route cache, ahead of a
+// state transfer from the leader. SS entries are kept; the transfer
+// updates them.
+void nm_journal_reset(void);
+
+// Write the whole state to out as records, one per line, that
+// nm_journal_apply rebuilds it from. Returns 0, or -1 on a write error.
+int nm_journal_dump(FILE *out);
+
+// Snapshot the state soon and drop the journals it covers
+void nm_journal_compact(void);
+
+#endif
@@ -0,0 +1,113 @@
+#include "nm_placement.h"
+#include <string.h>
+
+static const char *g_names[] = {"hash", "bytes", "load", "p2c"};
+
+// djb2 followed by a 64-bit finalizer, so nearby names spread over the ring
+static unsigned long long hash_name(const char *name)
+{
+  unsigned long long h = 5381;
+  int c;
+  while ((c = (unsigned char)*name++))
+    h = ((h << 5) + h) + c;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static unsigned long long mix(unsigned long long x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+int nm_placement_parse(const char *name, PlacementStrategy *out)
+{
+  for (int i = 0; i < (int)(sizeof g_names / sizeof g_names[0]); i++)
+  {
+    if (!strcmp(name, g_names[i]))
+    {
+      *out = (PlacementStrategy)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const char *nm_placement_name(PlacementStrategy strategy)
+{
+  return g_names[strategy];
+}
+
+// Negative when a is the better home for a new file
+static int compare_nodes(PlacementStrategy strategy, const PlacementNode *a, const PlacementNode *b)
+{
+  if (strategy == PLACE_LEAST_LOAD || strategy == PLACE_TWO_CHOICES)
+  {
+    if (a->load != b->load)
+      return a->load < b->load ? -1 : 1;
+  }
+  if (strategy == PLACE_LEAST_BYTES || strategy == PLACE_TWO_CHOICES)
+  {
+    if (a->bytes != b->bytes)
+      return a->bytes < b->bytes ? -1 : 1;
+  }
+  if (a->files != b->files)
+    return a->files < b->files ? -1 : 1;
+  return 0;
+}
+
+// First virtual node clockwise from the file's position on the ring
+static int choose_hash(const char *file, const PlacementNode *nodes, int count)
+{
+  unsigned long long point = hash_name(file);
+  unsigned long long best_distance = 0;
+  int best = -1;
+  for (int i = 0; i < count; i++)
+  {
+    unsigned long long base = hash_name(nodes[i].ss_id);
+    for (int v = 0; v < PLACEMENT_VNODES; v++)
+    {
+      unsigned long long distance = mix(base + v) - point;
+      if (best < 0 || distance < best_distance)
+      {
+        best = i;
+        best_distance = distance;
+      }
+    }
+  }
+  return best;
+}
+
+int nm_placement_choose(PlacementStrategy strategy, const char *file,
+                        const PlacementNode *nodes, int count)
+{
+  if (count <= 0)
+    return -1;
+  if (count == 1)
+    return 0;
+
+  if (strategy == PLACE_HASH)
+    return choose_hash(file, nodes, count);
+
+  if (strategy == PLACE_TWO_CHOICES)
+  {
+    unsigned long long h = hash_name(file);
+    int a = (int)(h % count);
+    int b = (int)((a + 1 + (h >> 32) % (count - 1)) % count);
+    return compare_nodes(strategy, &nodes[b], &nodes[a]) < 0 ? b : a;
+  }
+
+  int best = 0;
+  for (int i = 1; i < count; i++)
+  {
+    if (compare_nodes(strategy, &nodes[i], &nodes[best]) < 0)
+      best = i;
+  }
+  return best;
+}
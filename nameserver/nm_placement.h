@@ -0,0 +1,36 @@
+#ifndef NM_PLACEMENT_H
+#define NM_PLACEMENT_H
+
+// Placement of new files on storage servers. Strategies are pure
+// functions of the file name and a snapshot of per-SS stats, so the NM and
+// the placement simulator (make placement-sim) share the same code.
+
+typedef enum
+{
+  PLACE_HASH,        // consistent hashing over virtual nodes
+  PLACE_LEAST_BYTES, // fewest bytes stored
+  PLACE_LEAST_LOAD,  // lowest reported load
+  PLACE_TWO_CHOICES  // better of two servers picked by the file's hash
+} PlacementStrategy;
+
+#define PLACEMENT_DEFAULT PLACE_TWO_CHOICES
+#define PLACEMENT_VNODES 64
+
+typedef struct
+{
+  char ss_id[64];
+  long files;      // files this SS is primary for
+  long long bytes; // bytes stored, as reported by the SS (0 if unknown)
+  double load;     // requests per second, as reported by the SS (0 if unknown)
+} PlacementNode;
+
+// Strategy names: "hash", "bytes", "load", "p2c". Returns 0 or -1.
+int nm_placement_parse(const char *name, PlacementStrategy *out);
+const char *nm_placement_name(PlacementStrategy strategy);
+
+// Index of the node that should hold a new file, or -1 when count is 0.
+// Ties, and stats that are not reported yet, fall back to file counts.
+int nm_placement_choose(PlacementStrategy strategy, const char *file,
+                        const PlacementNode *nodes, int count);
+
+#endif
@@ -0,0 +1,124 @@
+// Placement simulator: places a synthetic workload with every strategy in
+// nm_placement.c and reports how evenly files, bytes and load end up spread.
+// Built with `make placement-sim`, not part of `all`.
+//
+// Usage: ./nm_placement_sim [servers] [files]    (defaults: 8 servers, 100000 files)
+//
+// File sizes and per-file request rates are heavy-tailed (Pareto), the way a
+// few large or hot documents dominate a real deployment.
+#include "nm_placement.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define MAX_SERVERS 1024
+
+static unsigned long long g_rng = 0x2545f4914f6cdd1dULL;
+
+static double uniform(void)
+{
+  g_rng ^= g_rng << 13;
+  g_rng ^= g_rng >> 7;
+  g_rng ^= g_rng << 17;
+  return ((g_rng >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static double pareto(double scale, double alpha, double cap)
+{
+  double x = scale / pow(uniform(), 1.0 / alpha);
+  return x < cap ? x : cap;
+}
+
+typedef struct
+{
+  double max_over_mean;
+  double cv; // standard deviation / mean
+} Skew;
+
+static Skew skew_of(const double *values, int n)
+{
+  double sum = 0, max = 0;
+  for (int i = 0; i < n; i++)
+  {
+    sum += values[i];
+    if (values[i] > max)
+      max = values[i];
+  }
+  double mean = sum / n;
+  double var = 0;
+  for (int i = 0; i < n; i++)
+    var += (values[i] - mean) * (values[i] - mean);
+  Skew s = {0, 0};
+  if (mean > 0)
+  {
+    s.max_over_mean = max / mean;
+    s.cv = sqrt(var / n) / mean;
+  }
+  return s;
+}
+
+static void simulate(PlacementStrategy strategy, int servers, int files)
+{
+  PlacementNode *nodes = calloc(servers, sizeof(PlacementNode));
+  double *values = calloc(servers, sizeof(double));
+  if (!nodes || !values)
+  {
+    free(nodes);
+    free(values);
+    return;
+  }
+  for (int i = 0; i < servers; i++)
+    snprintf(nodes[i].ss_id, sizeof nodes[i].ss_id, "ss-%d", i + 1);
+
+  // Same workload for every strategy
+  g_rng = 0x2545f4914f6cdd1dULL;
+  char name[64];
+  for (int f = 0; f < files; f++)
+  {
+    snprintf(name, sizeof name, "doc-%d.txt", f);
+    double bytes = pareto(2048, 1.2, 64.0 * 1024 * 1024);
+    double rate = pareto(0.01, 1.1, 100.0);
+    int chosen = nm_placement_choose(strategy, name, nodes, servers);
+    nodes[chosen].files++;
+    nodes[chosen].bytes += (long long)bytes;
+    nodes[chosen].load += rate;
+  }
+
+  Skew skew[3];
+  for (int i = 0; i < servers; i++)
+    values[i] = nodes[i].files;
+  skew[0] = skew_of(values, servers);
+  for (int i = 0; i < servers; i++)
+    values[i] = (double)nodes[i].bytes;
+  skew[1] = skew_of(values, servers);
+  for (int i = 0; i < servers; i++)
+    values[i] = nodes[i].load;
+  skew[2] = skew_of(values, servers);
+
+  printf("%-8s %10.3f %8.3f %10.3f %8.3f %10.3f %8.3f\n", nm_placement_name(strategy),
+         skew[0].max_over_mean, skew[0].cv, skew[1].max_over_mean, skew[1].cv,
+         skew[2].max_over_mean, skew[2].cv);
+
+  free(nodes);
+  free(values);
+}
+
+int main(int argc, char **argv)
+{
+  int servers = argc > 1 ? atoi(argv[1]) : 8;
+  int files = argc > 2 ? atoi(argv[2]) : 100000;
+  if (servers < 1 || servers > MAX_SERVERS || files < 1)
+  {
+    fprintf(stderr, "usage: %s [servers 1-%d] [files]\n", argv[0], MAX_SERVERS);
+    return 1;
+  }
+
+  printf("%d servers, %d files (max/mean and coefficient of variation)\n", servers, files);
+  printf("%-8s %10s %8s %10s %8s %10s %8s\n", "strategy",
+         "files_max", "files_cv", "bytes_max", "bytes_cv", "load_max", "load_cv");
+  PlacementStrategy all[] = {PLACE_HASH, PLACE_LEAST_BYTES, PLACE_LEAST_LOAD, PLACE_TWO_CHOICES};
+  for (int i = 0; i < (int)(sizeof all / sizeof all[0]); i++)
+    simulate(all[i], servers, files);
+  return 0;
+}
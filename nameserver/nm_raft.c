@@ -0,0 +1,1275 @@
+#include "nm_raft.h"
+#include "nm_journal.h"
+#include "nm_replication.h"
+#include "../common/proto.h"
+#include "../common/jsonl.h"
+#include "../common/log.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define RAFT_HEARTBEAT_MS 100
+#define RAFT_ELECTION_MIN_MS 500 // election timeouts are drawn from [min, max)
+#define RAFT_ELECTION_MAX_MS 1000
+#define RAFT_TICK_MS 20
+#define RAFT_IO_TIMEOUT_MS 1000 // leader side; a silent follower is retried
+#define RAFT_FOLLOWER_TIMEOUT_S 10
+#define RAFT_BATCH 256       // entries per RAFT_APPEND, and applied per pass
+#define RAFT_LOG_KEEP 65536  // applied entries kept for followers that lag
+#define RAFT_LINE_MAX 8192
+#define RAFT_RECOUNT_MS 1000 // how often a follower refreshes SS file counts
+#define RAFT_COMMIT_TIMEOUT_MS 3000 // a change not committed by then is reported as failed
+#define MAX_ALIVE_SS 32
+
+// Wire protocol, one JSON line per message on the Raft port:
+//   {"op":"RAFT_VOTE","term":T,"candidate":ID,"last_index":I,"last_term":LT}
+//     -> {"term":T,"granted":0|1}
+//   {"op":"RAFT_APPEND","term":T,"leader":ID,"prev_index":P,"prev_term":PT,
+//    "commit":C,"alive":"ss-1,ss-2","n":N} and N lines "TERM RECORD"
+//     -> {"term":T,"ok":0|1,"last":L,"state":0|1}
+//   {"op":"RAFT_STATE","term":T,"leader":ID,"index":I,"index_term":IT},
+//   the state as journal records, then {"op":"RAFT_STATE_END"}
+//     -> {"term":T,"ok":0|1,"last":I}
+// On a rejected append "last" is where the follower's log can continue;
+// "state" asks for the whole state instead.
+//
+// The log persists in <state_dir>/raftlog, one line per change:
+//   "base I T"    the log starts after index I of term T (first line)
+//   "I T RECORD"  an entry
+//   "truncate I"  the entries after I were dropped
+// Lines reach the OS as they are appended and are synced before a follower
+// acknowledges them or the leader counts itself among their holders. The
+// file is rewritten when applied entries are trimmed from the front.
+
+typedef enum
+{
+  RAFT_FOLLOWER,
+  RAFT_CANDIDATE,
+  RAFT_LEADER
+} RaftRole;
+
+typedef struct
+{
+  unsigned long term;
+  char *record;
+} LogEntry;
+
+typedef struct
+{
+  NMPeer addr;
+  // Leader only
+  unsigned long next_index;  // next entry to send
+  unsigned long match_index; // last entry known to be on the peer
+  int needs_state;           // send the whole state before more entries
+  long long acked_ms;        // latest reply in the current term
+} Peer;
+
+typedef struct
+{
+  int peer;
+  unsigned long term;
+  unsigned long last_index;
+  unsigned long last_term;
+} VoteRequest;
+
+static int g_enabled = 0;
+static NMPeer g_self;
+static Peer g_peers[NM_RAFT_MAX_PEERS]; // the other members
+static int g_peer_count = 0;
+static char g_meta_path[300];
+static char g_log_path[300];
+
+// Under g_raft_mutex
+static RaftRole g_role = RAFT_FOLLOWER;
+static unsigned long g_term = 0;
+static int g_voted_for = 0;
+static int g_leader_id = 0; // 0 while unknown
+static int g_votes = 0;
+static int g_synced = 0;     // the state matches the log up to g_applied
+static int g_installing = 0; // a state transfer is in progress
+static long long g_election_at = 0;
+
+// The log holds entries g_base_index + 1 .. g_base_index + g_log_count;
+// earlier ones were applied and dropped
+static LogEntry *g_log = NULL;
+static size_t g_log_count = 0;
+static size_t g_log_capacity = 0;
+static unsigned long g_base_index = 0;
+static unsigned long g_base_term = 0;
+static unsigned long g_commit = 0;
+static unsigned long g_applied = 0;
+
+// The persisted log, NULL if it could not be opened
+static FILE *g_log_file = NULL;
+static unsigned long g_durable = 0;    // entries known to be on disk
+static unsigned long g_truncations = 0; // bumped when entries are dropped from the end
+static int g_log_syncing = 0;          // a thread is in fdatasync
+
+static pthread_mutex_t g_raft_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_raft_cond; // role, log or commit changed
+// Held while applying to the NM state, so entries and state transfers
+// never interleave. Taken before g_raft_mutex.
+static pthread_mutex_t g_apply_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static long long now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Like send_all, but a peer that goes away must not raise SIGPIPE
+static int send_quietly(int fd, const char *buf, size_t len)
+{
+  size_t sent = 0;
+  while (sent < len)
+  {
+    ssize_t n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+    if (n <= 0)
+      return -1;
+    sent += (size_t)n;
+  }
+  return 0;
+}
+
+static int peer_connect(const NMPeer *peer)
+{
+  int fd = tcp_connect(peer->host, peer->port + NM_RAFT_PORT_OFFSET);
+  if (fd < 0)
+    return -1;
+  struct timeval timeout = {RAFT_IO_TIMEOUT_MS / 1000, (RAFT_IO_TIMEOUT_MS % 1000) * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+  return fd;
+}
+
+// ==================== LOG ====================
+//
+// Callers hold g_raft_mutex.
+
+static unsigned long last_index(void)
+{
+  return g_base_index + g_log_count;
+}
+
+// Term of the entry at index, 0 if the log does not hold it
+static unsigned long term_at(unsigned long index)
+{
+  if (index == g_base_index)
+    return g_base_term;
+  if (index < g_base_index || index > last_index())
+    return 0;
+  return g_log[index - g_base_index - 1].term;
+}
+
+static int log_append(unsigned long term, const char *record)
+{
+  if (g_log_count == g_log_capacity)
+  {
+    size_t capacity = g_log_capacity ? g_log_capacity * 2 : 1024;
+    LogEntry *log = realloc(g_log, capacity * sizeof *log);
+    if (!log)
+      return -1;
+    g_log = log;
+    g_log_capacity = capacity;
+  }
+  char *copy = strdup(record);
+  if (!copy)
+    return -1;
+  g_log[g_log_count].term = term;
+  g_log[g_log_count].record = copy;
+  g_log_count++;
+  if (g_log_file)
+  {
+    fprintf(g_log_file, "%lu %lu %s\n", last_index(), term, record);
+    fflush(g_log_file);
+  }
+  return 0;
+}
+
+// Drop the entries after index
+static void log_truncate(unsigned long index)
+{
+  if (last_index() <= index)
+    return;
+  while (last_index() > index)
+    free(g_log[--g_log_count].record);
+  g_truncations++;
+  if (g_durable > index)
+    g_durable = index;
+  if (g_log_file)
+  {
+    fprintf(g_log_file, "truncate %lu\n", index);
+    fflush(g_log_file);
+  }
+}
+
+// Write the log from its base to a new file and swap it in; the old file
+// stays in use if that fails
+static void log_rewrite(void)
+{
+  if (!g_log_file)
+    return;
+  char tmp[310];
+  snprintf(tmp, sizeof tmp, "%s.tmp", g_log_path);
+  FILE *f = fopen(tmp, "w");
+  if (!f)
+    return;
+  int ok = fprintf(f, "base %lu %lu\n", g_base_index, g_base_term) > 0;
+  for (size_t i = 0; ok && i < g_log_count; i++)
+    ok = fprintf(f, "%lu %lu %s\n", g_base_index + i + 1, g_log[i].term, g_log[i].record) > 0;
+  ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+  fclose(f);
+  if (!ok || rename(tmp, g_log_path) != 0)
+  {
+    unlink(tmp);
+    return;
+  }
+  g_durable = last_index();
+  FILE *next = fopen(g_log_path, "a");
+  if (next)
+  {
+    fclose(g_log_file);
+    g_log_file = next;
+  }
+}
+
+// Once the log holds twice RAFT_LOG_KEEP entries, drop applied ones from
+// the front; a follower that still needs them gets the whole state
+static void log_trim(void)
+{
+  if (g_log_count < 2 * RAFT_LOG_KEEP)
+    return;
+  unsigned long done = g_applied < g_commit ? g_applied : g_commit;
+  if (done <= g_base_index)
+    return;
+  size_t drop = g_log_count - RAFT_LOG_KEEP;
+  if (drop > done - g_base_index)
+    drop = done - g_base_index;
+  for (size_t i = 0; i < drop; i++)
+    free(g_log[i].record);
+  g_base_term = g_log[drop - 1].term;
+  g_base_index += drop;
+  g_log_count -= drop;
+  memmove(g_log, g_log + drop, g_log_count * sizeof *g_log);
+  log_rewrite();
+}
+
+// ==================== TERMS AND ROLES ====================
+//
+// Callers hold g_raft_mutex.
+
+// Term and vote must survive a restart, or a node could vote twice in one
+// term
+static void save_meta(void)
+{
+  char tmp[310];
+  snprintf(tmp, sizeof tmp, "%s.tmp", g_meta_path);
+  FILE *f = fopen(tmp, "w");
+  if (!f)
+    return;
+  int ok = fprintf(f, "%lu %d\n", g_term, g_voted_for) > 0 && fflush(f) == 0 && fsync(fileno(f)) == 0;
+  fclose(f);
+  if (!ok || rename(tmp, g_meta_path) != 0)
+    unlink(tmp);
+}
+
+static void load_meta(void)
+{
+  FILE *f = fopen(g_meta_path, "r");
+  if (!f)
+    return;
+  if (fscanf(f, "%lu %d", &g_term, &g_voted_for) != 2)
+    g_term = 0, g_voted_for = 0;
+  fclose(f);
+}
+
+static void reset_election_timer(void)
+{
+  g_election_at = now_ms() + RAFT_ELECTION_MIN_MS + rand() % (RAFT_ELECTION_MAX_MS - RAFT_ELECTION_MIN_MS);
+}
+
+static void raft_log(const char *operation, const char *details)
+{
+  log_message("NM", operation, g_self.host, g_self.port, "system", details);
+}
+
+// Follow the leader of term (at least the current one)
+static void step_down(unsigned long term)
+{
+  if (term > g_term)
+  {
+    g_term = term;
+    g_voted_for = 0;
+    save_meta();
+  }
+  if (g_role == RAFT_LEADER)
+  {
+    // Its state may hold entries the next leader never got
+    g_synced = 0;
+    char details[64];
+    snprintf(details, sizeof details, "Stepped down in term %lu", g_term);
+    raft_log("RAFT_FOLLOWER", details);
+  }
+  g_role = RAFT_FOLLOWER;
+  reset_election_timer();
+  pthread_cond_broadcast(&g_raft_cond);
+}
+
+static int has_quorum(void)
+{
+  long long now = now_ms();
+  int heard = 1;
+  for (int i = 0; i < g_peer_count; i++)
+  {
+    if (now - g_peers[i].acked_ms < RAFT_ELECTION_MIN_MS)
+      heard++;
+  }
+  return heard * 2 > g_peer_count + 1;
+}
+
+// Whether the leader may commit index: a majority holds it
+static void advance_commit(void)
+{
+  // Entries of earlier terms commit along with one of this term
+  for (unsigned long n = last_index(); n > g_commit && term_at(n) == g_term; n--)
+  {
+    int holders = !g_log_file || g_durable >= n;
+    for (int i = 0; i < g_peer_count; i++)
+    {
+      if (g_peers[i].match_index >= n)
+        holders++;
+    }
+    if (holders * 2 > g_peer_count + 1)
+    {
+      g_commit = n;
+      log_trim();
+      break;
+    }
+  }
+}
+
+// Sync the persisted log through its last entry; threads that ask at the
+// same time share one fdatasync. Returns 0, or -1 if the sync failed.
+static int sync_log(void)
+{
+  int rc = 0;
+  pthread_mutex_lock(&g_raft_mutex);
+  unsigned long target = last_index();
+  while (g_log_file && g_durable < target && rc == 0)
+  {
+    if (g_log_syncing)
+    {
+      pthread_cond_wait(&g_raft_cond, &g_raft_mutex);
+      continue;
+    }
+    // A duplicate stays valid if log_rewrite swaps the file meanwhile
+    unsigned long upto = last_index(), truncations = g_truncations;
+    int fd = dup(fileno(g_log_file));
+    g_log_syncing = 1;
+    pthread_mutex_unlock(&g_raft_mutex);
+    rc = fd >= 0 && fdatasync(fd) == 0 ? 0 : -1;
+    if (fd >= 0)
+      close(fd);
+    pthread_mutex_lock(&g_raft_mutex);
+    g_log_syncing = 0;
+    // Entries appended after a truncation were not part of this sync
+    if (rc == 0 && truncations == g_truncations && upto > g_durable)
+      g_durable = upto;
+    if (g_role == RAFT_LEADER)
+      advance_commit();
+    pthread_cond_broadcast(&g_raft_cond);
+    if (target > last_index())
+      target = last_index();
+  }
+  pthread_mutex_unlock(&g_raft_mutex);
+  return rc;
+}
+
+static void become_leader(void)
+{
+  g_role = RAFT_LEADER;
+  g_leader_id = g_self.id;
+  g_synced = 1;
+  long long now = now_ms();
+  for (int i = 0; i < g_peer_count; i++)
+  {
+    g_peers[i].next_index = last_index() + 1;
+    g_peers[i].match_index = 0;
+    g_peers[i].needs_state = 0;
+    g_peers[i].acked_ms = now; // the votes just counted
+  }
+  // An entry of its own term lets the leader commit what it inherited
+  log_append(g_term, "{\"t\":\"noop\"}");
+  g_applied = last_index();
+
+  char details[96];
+  snprintf(details, sizeof details, "Leader for term %lu with %lu log entries", g_term, last_index() - g_base_index);
+  raft_log("RAFT_LEADER", details);
+  pthread_cond_broadcast(&g_raft_cond);
+}
+
+// ==================== APPLYING ====================
+
+// Apply up to RAFT_BATCH entries after g_applied, through upto. Caller
+// holds g_apply_mutex. Returns how many were applied.
+static int apply_entries(unsigned long upto)
+{
+  char *records[RAFT_BATCH];
+  unsigned long terms[RAFT_BATCH];
+  int count = 0;
+  pthread_mutex_lock(&g_raft_mutex);
+  unsigned long first = g_applied + 1;
+  while (count < RAFT_BATCH && first + count <= upto && first + count <= last_index())
+  {
+    const LogEntry *e = &g_log[first + count - g_base_index - 1];
+    records[count] = strdup(e->record);
+    if (!records[count])
+      break;
+    terms[count] = e->term;
+    count++;
+  }
+  pthread_mutex_unlock(&g_raft_mutex);
+
+  for (int i = 0; i < count; i++)
+  {
+    nm_journal_apply(records[i], first + i, terms[i]);
+    free(records[i]);
+  }
+
+  pthread_mutex_lock(&g_raft_mutex);
+  if (g_applied == first - 1)
+    g_applied += count;
+  log_trim();
+  pthread_mutex_unlock(&g_raft_mutex);
+  return count;
+}
+
+static int ready_to_apply(void)
+{
+  return g_role != RAFT_LEADER && g_synced && !g_installing && g_applied < g_commit;
+}
+
+static void *applier_thread(void *arg)
+{
+  (void)arg;
+  long long recounted = 0;
+  int stale = 0; // entries applied since the SS file counts were refreshed
+  for (;;)
+  {
+    pthread_mutex_lock(&g_raft_mutex);
+    if (!ready_to_apply())
+    {
+      if (stale)
+      {
+        long long wake = recounted + RAFT_RECOUNT_MS;
+        struct timespec deadline = {wake / 1000, (wake % 1000) * 1000000L};
+        pthread_cond_timedwait(&g_raft_cond, &g_raft_mutex, &deadline);
+      }
+      else
+      {
+        pthread_cond_wait(&g_raft_cond, &g_raft_mutex);
+      }
+    }
+    pthread_mutex_unlock(&g_raft_mutex);
+
+    pthread_mutex_lock(&g_apply_mutex);
+    pthread_mutex_lock(&g_raft_mutex);
+    int ready = ready_to_apply();
+    unsigned long upto = g_commit;
+    pthread_mutex_unlock(&g_raft_mutex);
+    if (ready && apply_entries(upto) > 0)
+      stale = 1;
+    pthread_mutex_unlock(&g_apply_mutex);
+
+    // File counts per SS are for display; keep them roughly current
+    if (stale && now_ms() - recounted >= RAFT_RECOUNT_MS)
+    {
+      nm_replication_recount();
+      recounted = now_ms();
+      stale = 0;
+    }
+  }
+  return NULL;
+}
+
+// ==================== ELECTIONS ====================
+
+static void *vote_thread(void *arg)
+{
+  VoteRequest *req = arg;
+  int fd = peer_connect(&g_peers[req->peer].addr);
+  char line[256];
+  snprintf(line, sizeof line, "{\"op\":\"RAFT_VOTE\",\"term\":%lu,\"candidate\":%d,\"last_index\":%lu,\"last_term\":%lu}\n",
+           req->term, g_self.id, req->last_index, req->last_term);
+  char *reply = NULL;
+  if (fd >= 0 && send_quietly(fd, line, strlen(line)) == 0 && recv_line(fd, &reply, RAFT_LINE_MAX) > 0)
+  {
+    long long term = 0;
+    int granted = 0;
+    json_get_long(reply, "term", &term);
+    json_get_int(reply, "granted", &granted);
+    pthread_mutex_lock(&g_raft_mutex);
+    if ((unsigned long)term > g_term)
+      step_down((unsigned long)term);
+    else if (granted && g_role == RAFT_CANDIDATE && g_term == req->term)
+      g_votes++;
+    pthread_mutex_unlock(&g_raft_mutex);
+  }
+  free(reply);
+  if (fd >= 0)
+    close(fd);
+  free(req);
+  return NULL;
+}
+
+// Caller holds g_raft_mutex
+static void start_election(void)
+{
+  g_term++;
+  g_role = RAFT_CANDIDATE;
+  g_voted_for = g_self.id;
+  g_votes = 1;
+  g_leader_id = 0;
+  save_meta();
+  reset_election_timer();
+
+  for (int i = 0; i < g_peer_count; i++)
+  {
+    VoteRequest *req = malloc(sizeof *req);
+    if (!req)
+      continue;
+    req->peer = i;
+    req->term = g_term;
+    req->last_index = last_index();
+    req->last_term = term_at(req->last_index);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, vote_thread, req) == 0)
+      pthread_detach(thread);
+    else
+      free(req);
+  }
+}
+
+// Runs elections: a follower or candidate that has not heard from a
+// leader within its timeout stands, and a candidate with a majority of
+// votes catches its state up with its log and takes office
+static void *ticker_thread(void *arg)
+{
+  (void)arg;
+  for (;;)
+  {
+    struct timespec delay = {0, RAFT_TICK_MS * 1000000L};
+    nanosleep(&delay, NULL);
+
+    pthread_mutex_lock(&g_raft_mutex);
+    if (g_role == RAFT_CANDIDATE && g_votes * 2 > g_peer_count + 1)
+    {
+      unsigned long term = g_term, upto = last_index();
+      int synced = g_synced;
+      pthread_mutex_unlock(&g_raft_mutex);
+
+      // A leader serves its whole log, so apply the uncommitted tail too
+      pthread_mutex_lock(&g_apply_mutex);
+      while (synced && apply_entries(upto) > 0)
+        ;
+      pthread_mutex_lock(&g_raft_mutex);
+      if (g_role == RAFT_CANDIDATE && g_term == term)
+        become_leader();
+      else if (g_applied > g_commit)
+        g_synced = 0; // lost the office holding entries that may not commit
+      pthread_mutex_unlock(&g_apply_mutex);
+    }
+    else if (g_role != RAFT_LEADER && !g_installing && now_ms() >= g_election_at)
+    {
+      start_election();
+    }
+    pthread_mutex_unlock(&g_raft_mutex);
+  }
+  return NULL;
+}
+
+// ==================== LEADER ====================
+
+// The whole state, sent to a follower whose log cannot be continued
+static int send_state(int fd, unsigned long term, unsigned long index, unsigned long index_term)
+{
+  FILE *dump = tmpfile();
+  if (!dump)
+    return -1;
+  int rc = nm_journal_dump(dump);
+  char buf[65536];
+  int len = snprintf(buf, sizeof buf, "{\"op\":\"RAFT_STATE\",\"term\":%lu,\"leader\":%d,\"index\":%lu,\"index_term\":%lu}\n",
+                     term, g_self.id, index, index_term);
+  if (rc == 0)
+    rc = send_quietly(fd, buf, (size_t)len);
+  rewind(dump);
+  size_t n;
+  while (rc == 0 && (n = fread(buf, 1, sizeof buf, dump)) > 0)
+    rc = send_quietly(fd, buf, n);
+  fclose(dump);
+  const char *end = "{\"op\":\"RAFT_STATE_END\"}\n";
+  return rc == 0 ? send_quietly(fd, end, strlen(end)) : -1;
+}
+
+static void alive_list(char *out, size_t size)
+{
+  SSNode nodes[MAX_ALIVE_SS];
+  int n = nm_replication_list_alive(nodes, MAX_ALIVE_SS);
+  size_t used = 0;
+  out[0] = '\0';
+  for (int i = 0; i < n; i++)
+  {
+    int len = snprintf(out + used, size - used, "%s%s", i ? "," : "", nodes[i].ss_id);
+    if (len < 0 || (size_t)len >= size - used)
+    {
+      out[used] = '\0';
+      break;
+    }
+    used += (size_t)len;
+  }
+}
+
+// Keeps one follower's log in step with the leader's over a persistent
+// connection: a batch of entries when it is behind, an empty append as a
+// heartbeat otherwise, and the whole state when its log cannot continue
+static void *replicator_thread(void *arg)
+{
+  Peer *peer = arg;
+  int fd = -1;
+  long long sent_ms = 0, retry_at = 0;
+  for (;;)
+  {
+    pthread_mutex_lock(&g_raft_mutex);
+    for (;;)
+    {
+      long long now = now_ms();
+      if (g_role == RAFT_LEADER && now >= retry_at &&
+          (peer->needs_state || peer->next_index <= last_index() || now - sent_ms >= RAFT_HEARTBEAT_MS))
+        break;
+      long long wake = now + RAFT_HEARTBEAT_MS;
+      if (g_role == RAFT_LEADER)
+        wake = retry_at > now ? retry_at : sent_ms + RAFT_HEARTBEAT_MS;
+      struct timespec deadline = {wake / 1000, (wake % 1000) * 1000000L};
+      pthread_cond_timedwait(&g_raft_cond, &g_raft_mutex, &deadline);
+    }
+
+    unsigned long term = g_term, commit = g_commit;
+    unsigned long prev = 0, prev_term = 0, index = 0, index_term = 0;
+    int install = peer->needs_state || peer->next_index <= g_base_index;
+    char *entries = NULL;
+    size_t entries_len = 0;
+    int count = 0;
+    if (install)
+    {
+      // Entries after index may be in the dump already; replaying them
+      // over it is harmless
+      index = last_index();
+      index_term = term_at(index);
+    }
+    else
+    {
+      prev = peer->next_index - 1;
+      prev_term = term_at(prev);
+      size_t size = 0;
+      while (count < RAFT_BATCH && prev + count < last_index())
+        size += strlen(g_log[prev + count - g_base_index].record) + 24, count++;
+      entries = malloc(size + 1);
+      for (int i = 0; entries && i < count; i++)
+      {
+        const LogEntry *e = &g_log[prev + i - g_base_index];
+        entries_len += (size_t)sprintf(entries + entries_len, "%lu %s\n", e->term, e->record);
+      }
+      if (!entries)
+        count = 0;
+    }
+    pthread_mutex_unlock(&g_raft_mutex);
+
+    // The leader holds what it ships on disk too, or it could not count
+    // itself toward the majority
+    if (count)
+      sync_log();
+
+    sent_ms = now_ms();
+    if (fd < 0 && (fd = peer_connect(&peer->addr)) < 0)
+    {
+      free(entries);
+      retry_at = now_ms() + RAFT_HEARTBEAT_MS;
+      continue;
+    }
+
+    int rc;
+    if (install)
+    {
+      rc = send_state(fd, term, index, index_term);
+    }
+    else
+    {
+      char alive[1024], header[1280];
+      alive_list(alive, sizeof alive);
+      int len = snprintf(header, sizeof header,
+                         "{\"op\":\"RAFT_APPEND\",\"term\":%lu,\"leader\":%d,\"prev_index\":%lu,\"prev_term\":%lu,"
+                         "\"commit\":%lu,\"alive\":\"%s\",\"n\":%d}\n",
+                         term, g_self.id, prev, prev_term, commit, alive, count);
+      rc = send_quietly(fd, header, (size_t)len);
+      if (rc == 0 && count)
+        rc = send_quietly(fd, entries, entries_len);
+    }
+    free(entries);
+
+    char *reply = NULL;
+    if (rc != 0 || recv_line(fd, &reply, RAFT_LINE_MAX) <= 0)
+    {
+      free(reply);
+      close(fd);
+      fd = -1;
+      retry_at = now_ms() + RAFT_HEARTBEAT_MS;
+      continue;
+    }
+    long long reply_term = 0, last = 0;
+    int ok = 0, state = 0;
+    json_get_long(reply, "term", &reply_term);
+    json_get_int(reply, "ok", &ok);
+    json_get_long(reply, "last", &last);
+    json_get_int(reply, "state", &state);
+    free(reply);
+
+    pthread_mutex_lock(&g_raft_mutex);
+    if ((unsigned long)reply_term > g_term)
+    {
+      step_down((unsigned long)reply_term);
+    }
+    else if (g_role == RAFT_LEADER && g_term == term)
+    {
+      peer->acked_ms = now_ms();
+      if (ok)
+      {
+        peer->match_index = install ? index : prev + count;
+        peer->next_index = peer->match_index + 1;
+        peer->needs_state = 0;
+        advance_commit();
+        pthread_cond_broadcast(&g_raft_cond);
+      }
+      else if (state)
+      {
+        peer->needs_state = 1;
+      }
+      else if (!install)
+      {
+        // Continue where the follower's log does
+        unsigned long next = (unsigned long)last + 1;
+        peer->next_index = next <= last_index() + 1 ? next : last_index() + 1;
+      }
+    }
+    pthread_mutex_unlock(&g_raft_mutex);
+  }
+  return NULL;
+}
+
+// ==================== FOLLOWER ====================
+
+static void reply(int fd, const char *fmt, ...)
+{
+  char line[128];
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(line, sizeof line, fmt, ap);
+  va_end(ap);
+  if (len > 0 && len < (int)sizeof line)
+    send_quietly(fd, line, (size_t)len);
+}
+
+static void handle_vote(int fd, const char *line)
+{
+  long long term = 0, cand_last = 0, cand_last_term = 0;
+  int candidate = 0;
+  json_get_long(line, "term", &term);
+  json_get_int(line, "candidate", &candidate);
+  json_get_long(line, "last_index", &cand_last);
+  json_get_long(line, "last_term", &cand_last_term);
+
+  pthread_mutex_lock(&g_raft_mutex);
+  if ((unsigned long)term > g_term)
+    step_down((unsigned long)term);
+  unsigned long my_last = last_index(), my_last_term = term_at(my_last);
+  int up_to_date = (unsigned long)cand_last_term > my_last_term ||
+                   ((unsigned long)cand_last_term == my_last_term && (unsigned long)cand_last >= my_last);
+  int granted = (unsigned long)term == g_term && g_role == RAFT_FOLLOWER &&
+                (g_voted_for == 0 || g_voted_for == candidate) && up_to_date;
+  if (granted)
+  {
+    g_voted_for = candidate;
+    save_meta();
+    reset_election_timer();
+  }
+  unsigned long reply_term = g_term;
+  pthread_mutex_unlock(&g_raft_mutex);
+  reply(fd, "{\"term\":%lu,\"granted\":%d}\n", reply_term, granted);
+}
+
+// Strip the newline getline keeps
+static char *chomp(char *line)
+{
+  line[strcspn(line, "\r\n")] = '\0';
+  return line;
+}
+
+static int handle_append(int fd, FILE *in, const char *line)
+{
+  long long term = 0, prev = 0, prev_term = 0, commit = 0;
+  int leader = 0, n = 0;
+  char alive[1024] = "";
+  json_get_long(line, "term", &term);
+  json_get_int(line, "leader", &leader);
+  json_get_long(line, "prev_index", &prev);
+  json_get_long(line, "prev_term", &prev_term);
+  json_get_long(line, "commit", &commit);
+  json_get_str(line, "alive", alive, sizeof alive);
+  json_get_int(line, "n", &n);
+  if (n < 0 || n > RAFT_BATCH)
+    return -1;
+
+  // Read the entries even if they are refused, to stay in step
+  char *records[RAFT_BATCH];
+  unsigned long terms[RAFT_BATCH];
+  int read = 0, failed = 0;
+  for (; read < n; read++)
+  {
+    char *entry = NULL;
+    size_t cap = 0;
+    char *rest;
+    if (getline(&entry, &cap, in) <= 0)
+    {
+      free(entry);
+      failed = 1;
+      break;
+    }
+    terms[read] = strtoul(chomp(entry), &rest, 10);
+    if (*rest == ' ')
+      rest++;
+    memmove(entry, rest, strlen(rest) + 1);
+    records[read] = entry;
+  }
+
+  int ok = 0, state = 0, follow = 0;
+  unsigned long last = 0;
+  pthread_mutex_lock(&g_raft_mutex);
+  if (!failed && (unsigned long)term >= g_term)
+  {
+    if ((unsigned long)term > g_term || g_role != RAFT_FOLLOWER)
+      step_down((unsigned long)term);
+    g_leader_id = leader;
+    reset_election_timer();
+    follow = 1;
+
+    if (!g_synced)
+    {
+      state = 1;
+    }
+    else if ((unsigned long)prev > last_index() || (unsigned long)prev < g_base_index)
+    {
+      last = last_index();
+    }
+    else if (term_at((unsigned long)prev) != (unsigned long)prev_term)
+    {
+      // Committed entries never change unless this NM's state diverged,
+      // and the state cannot drop entries applied to it (a former
+      // leader's, restored from its journal)
+      if ((unsigned long)prev <= g_commit || (unsigned long)prev <= g_applied)
+        state = 1;
+      else
+        log_truncate((unsigned long)prev - 1);
+      last = (unsigned long)prev - 1;
+    }
+    else
+    {
+      unsigned long index = (unsigned long)prev;
+      int i = 0;
+      for (; i < n; i++)
+      {
+        index++;
+        if (index <= last_index())
+        {
+          if (term_at(index) == terms[i])
+            continue;
+          if (index <= g_commit || index <= g_applied)
+          {
+            state = 1;
+            break;
+          }
+          log_truncate(index - 1);
+        }
+        if (log_append(terms[i], records[i]) != 0)
+          break;
+      }
+      last = index - (i < n);
+      ok = i == n;
+      if (ok && (unsigned long)commit > g_commit)
+      {
+        g_commit = (unsigned long)commit < last ? (unsigned long)commit : last;
+        pthread_cond_broadcast(&g_raft_cond);
+      }
+    }
+    if (state)
+      g_synced = 0;
+  }
+  unsigned long reply_term = g_term;
+  pthread_mutex_unlock(&g_raft_mutex);
+
+  // Acknowledged entries must survive a restart of this NM
+  if (ok && n > 0 && sync_log() != 0)
+  {
+    ok = 0;
+    last = (unsigned long)prev;
+  }
+
+  for (int i = 0; i < read; i++)
+    free(records[i]);
+  if (failed)
+    return -1;
+  if (follow)
+    nm_replication_set_alive(alive);
+  reply(fd, "{\"term\":%lu,\"ok\":%d,\"last\":%lu,\"state\":%d}\n", reply_term, ok, last, state);
+  return 0;
+}
+
+// Replace the NM state with the leader's and restart the log after it
+static int handle_state(int fd, FILE *in, const char *line)
+{
+  long long term = 0, index = 0, index_term = 0;
+  int leader = 0;
+  json_get_long(line, "term", &term);
+  json_get_int(line, "leader", &leader);
+  json_get_long(line, "index", &index);
+  json_get_long(line, "index_term", &index_term);
+
+  pthread_mutex_lock(&g_raft_mutex);
+  int accept = (unsigned long)term >= g_term;
+  if (accept)
+  {
+    if ((unsigned long)term > g_term || g_role != RAFT_FOLLOWER)
+      step_down((unsigned long)term);
+    g_leader_id = leader;
+    g_installing = 1;
+  }
+  unsigned long reply_term = g_term;
+  pthread_mutex_unlock(&g_raft_mutex);
+
+  long long started = now_ms();
+  if (accept)
+  {
+    pthread_mutex_lock(&g_apply_mutex);
+    nm_journal_reset();
+  }
+  char *record = NULL;
+  size_t cap = 0;
+  long records = 0;
+  int complete = 0;
+  while (getline(&record, &cap, in) > 0)
+  {
+    char op[32] = "";
+    if (json_get_str(record, "op", op, sizeof op) == 0 && !strcmp(op, "RAFT_STATE_END"))
+    {
+      complete = 1;
+      break;
+    }
+    if (accept)
+      nm_journal_apply(chomp(record), 0, 0);
+    records++;
+  }
+  free(record);
+  if (!accept)
+  {
+    reply(fd, "{\"term\":%lu,\"ok\":0,\"last\":0}\n", reply_term);
+    return complete ? 0 : -1;
+  }
+
+  nm_replication_recount();
+  pthread_mutex_lock(&g_raft_mutex);
+  if (complete)
+  {
+    log_truncate(g_base_index);
+    g_base_index = g_commit = g_applied = (unsigned long)index;
+    g_base_term = (unsigned long)index_term;
+    g_synced = 1;
+    log_rewrite();
+  }
+  g_installing = 0;
+  reset_election_timer();
+  reply_term = g_term;
+  pthread_cond_broadcast(&g_raft_cond);
+  pthread_mutex_unlock(&g_raft_mutex);
+  // Before the applier journals entries after it
+  if (complete)
+    nm_journal_mark((unsigned long)index, (unsigned long)index_term);
+  pthread_mutex_unlock(&g_apply_mutex);
+  if (!complete)
+    return -1;
+
+  // The journals behind the state just replaced are stale
+  nm_journal_compact();
+  char details[128];
+  snprintf(details, sizeof details, "Installed the leader's state (%ld records, index %lld) in %lld ms", records,
+           index, now_ms() - started);
+  raft_log("RAFT_INSTALL", details);
+  reply(fd, "{\"term\":%lu,\"ok\":1,\"last\":%lld}\n", reply_term, index);
+  return 0;
+}
+
+static void *connection_thread(void *arg)
+{
+  int fd = (int)(intptr_t)arg;
+  struct timeval timeout = {RAFT_FOLLOWER_TIMEOUT_S, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  // Requests are answered before the next is sent, so buffered reads
+  // never take more than one request off the socket
+  int in_fd = dup(fd);
+  FILE *in = in_fd >= 0 ? fdopen(in_fd, "r") : NULL;
+  if (!in)
+  {
+    if (in_fd >= 0)
+      close(in_fd);
+    close(fd);
+    return NULL;
+  }
+
+  char *line = NULL;
+  size_t cap = 0;
+  while (getline(&line, &cap, in) > 0)
+  {
+    char op[32] = "";
+    json_get_str(line, "op", op, sizeof op);
+    int rc = 0;
+    if (!strcmp(op, "RAFT_VOTE"))
+      handle_vote(fd, line);
+    else if (!strcmp(op, "RAFT_APPEND"))
+      rc = handle_append(fd, in, line);
+    else if (!strcmp(op, "RAFT_STATE"))
+      rc = handle_state(fd, in, line);
+    else
+      rc = -1;
+    if (rc != 0)
+      break;
+  }
+  free(line);
+  fclose(in);
+  close(fd);
+  return NULL;
+}
+
+static void *server_thread(void *arg)
+{
+  int lfd = (int)(intptr_t)arg;
+  for (;;)
+  {
+    int fd = accept(lfd, NULL, NULL);
+    if (fd < 0)
+      continue;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, connection_thread, (void *)(intptr_t)fd) == 0)
+      pthread_detach(thread);
+    else
+      close(fd);
+  }
+  return NULL;
+}
+
+// ==================== API ====================
+
+// Load the persisted log, up to a line torn by a crash. Returns 1 if there
+// was one.
+static int load_log(void)
+{
+  FILE *f = fopen(g_log_path, "r");
+  if (!f)
+    return 0;
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, f)) > 0 && line[len - 1] == '\n')
+  {
+    unsigned long index, term;
+    int used = 0;
+    chomp(line);
+    if (sscanf(line, "base %lu %lu", &index, &term) == 2)
+    {
+      log_truncate(g_base_index);
+      g_base_index = index;
+      g_base_term = term;
+    }
+    else if (sscanf(line, "truncate %lu", &index) == 1)
+    {
+      log_truncate(index);
+    }
+    else if (sscanf(line, "%lu %lu %n", &index, &term, &used) == 2 && used > 0)
+    {
+      if (index != last_index() + 1 || log_append(term, line + used) != 0)
+        break;
+    }
+  }
+  free(line);
+  fclose(f);
+  return 1;
+}
+
+int nm_raft_start(int self_id, const NMPeer *peers, int count, const char *state_dir)
+{
+  if (count < 2)
+    return OK;
+  int found = 0;
+  for (int i = 0; i < count; i++)
+  {
+    if (peers[i].id == self_id)
+      g_self = peers[i], found = 1;
+    else if (g_peer_count < NM_RAFT_MAX_PEERS)
+      g_peers[g_peer_count++].addr = peers[i];
+  }
+  if (!found)
+  {
+    fprintf(stderr, "[NM] NM_ID %d is not in NM_PEERS\n", self_id);
+    return ERR_BAD_REQUEST;
+  }
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&g_raft_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  const char *dir = state_dir && state_dir[0] ? state_dir : NM_STATE_DIR_DEFAULT;
+  snprintf(g_meta_path, sizeof g_meta_path, "%s/raft", dir);
+  snprintf(g_log_path, sizeof g_log_path, "%s/raftlog", dir);
+  load_meta();
+  srand((unsigned)(time(NULL) ^ getpid() ^ (self_id << 16)));
+
+  int lfd = tcp_listen(NULL, g_self.port + NM_RAFT_PORT_OFFSET, 16);
+  if (lfd < 0)
+  {
+    perror("nm raft listen");
+    return ERR_INTERNAL;
+  }
+
+  // The state restored from the journal lines up with the persisted log
+  // when the last entry it applied is in the log; a leader then continues
+  // the log from there. Otherwise the state may be behind or ahead of the
+  // cluster's until a leader sends its own.
+  pthread_mutex_lock(&g_raft_mutex);
+  int had_log = load_log();
+  g_log_file = fopen(g_log_path, "a");
+  if (!g_log_file)
+    perror("nm raft log");
+  else if (!had_log)
+    log_rewrite();
+  g_durable = last_index();
+  unsigned long applied, applied_term;
+  nm_journal_position(&applied, &applied_term);
+  g_synced = had_log && applied >= g_base_index && applied <= last_index() && term_at(applied) == applied_term;
+  g_applied = g_synced ? applied : 0;
+  g_commit = g_base_index;
+  g_enabled = 1;
+  reset_election_timer();
+  pthread_mutex_unlock(&g_raft_mutex);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, server_thread, (void *)(intptr_t)lfd) == 0)
+    pthread_detach(thread);
+  if (pthread_create(&thread, NULL, ticker_thread, NULL) == 0)
+    pthread_detach(thread);
+  if (pthread_create(&thread, NULL, applier_thread, NULL) == 0)
+    pthread_detach(thread);
+  for (int i = 0; i < g_peer_count; i++)
+  {
+    if (pthread_create(&thread, NULL, replicator_thread, &g_peers[i]) == 0)
+      pthread_detach(thread);
+  }
+
+  char details[96];
+  snprintf(details, sizeof details, "Member %d of %d, term %lu, log index %lu, Raft port %d", self_id, count,
+           g_term, last_index(), g_self.port + NM_RAFT_PORT_OFFSET);
+  raft_log("RAFT_START", details);
+  return OK;
+}
+
+int nm_raft_is_leader(void)
+{
+  if (!g_enabled)
+    return 1;
+  pthread_mutex_lock(&g_raft_mutex);
+  int leader = g_role == RAFT_LEADER && has_quorum();
+  pthread_mutex_unlock(&g_raft_mutex);
+  return leader;
+}
+
+void nm_raft_leader(char *host_out, size_t size, int *port_out)
+{
+  host_out[0] = '\0';
+  *port_out = 0;
+  if (!g_enabled)
+    return;
+  pthread_mutex_lock(&g_raft_mutex);
+  const NMPeer *leader = NULL;
+  if (g_leader_id == g_self.id)
+    leader = g_role == RAFT_LEADER && has_quorum() ? &g_self : NULL;
+  for (int i = 0; i < g_peer_count && !leader && g_leader_id; i++)
+  {
+    if (g_peers[i].addr.id == g_leader_id)
+      leader = &g_peers[i].addr;
+  }
+  if (leader)
+  {
+    snprintf(host_out, size, "%s", leader->host);
+    *port_out = leader->port;
+  }
+  pthread_mutex_unlock(&g_raft_mutex);
+}
+
+unsigned long nm_raft_append(const char *record, unsigned long *term_out)
+{
+  *term_out = 0;
+  if (!g_enabled)
+    return 0;
+  unsigned long index = 0;
+  pthread_mutex_lock(&g_raft_mutex);
+  if (g_role == RAFT_LEADER && log_append(g_term, record) == 0)
+  {
+    index = g_applied = last_index();
+    *term_out = g_term;
+    pthread_cond_broadcast(&g_raft_cond);
+  }
+  pthread_mutex_unlock(&g_raft_mutex);
+  return index;
+}
+
+int nm_raft_wait(unsigned long index, unsigned long term)
+{
+  if (!g_enabled || !index)
+    return OK;
+  if (sync_log() != 0)
+    return ERR_INTERNAL;
+
+  long long deadline = now_ms() + RAFT_COMMIT_TIMEOUT_MS;
+  int rc = ERR_NOT_LEADER;
+  pthread_mutex_lock(&g_raft_mutex);
+  for (;;)
+  {
+    if (g_commit >= index)
+    {
+      // Committed, unless a later leader replaced the entry
+      rc = (index <= g_base_index ? g_term == term : term_at(index) == term) ? OK : ERR_NOT_LEADER;
+      break;
+    }
+    if (g_role != RAFT_LEADER || g_term != term || now_ms() >= deadline)
+      break;
+    struct timespec at = {deadline / 1000, (deadline % 1000) * 1000000L};
+    pthread_cond_timedwait(&g_raft_cond, &g_raft_mutex, &at);
+  }
+  pthread_mutex_unlock(&g_raft_mutex);
+  return rc;
+}
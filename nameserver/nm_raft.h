@@ -0,0 +1,54 @@
+#ifndef NM_RAFT_H
+#define NM_RAFT_H
+
+#include "../common/net.h"
+
+// Name Server high availability: a leader and followers agree on the NM
+// state through a small Raft-style replicated log.
+//
+// The log entries are the journal records (nameserver/nm_journal.h): the
+// leader applies a mutation as before, and nm_journal_record also appends
+// the record to the log, which a replicator thread per follower ships over
+// a persistent TCP connection to the follower's Raft port (its client port
+// + NM_RAFT_PORT_OFFSET). An entry commits once a majority holds it on
+// disk; followers then apply it and journal it locally, and the leader
+// answers the request that made it. The log persists next to the journal,
+// whose records carry the index and term of their entry, so a restarted
+// NM votes and continues the log from where it stopped. A follower whose
+// state does not line up with its log, or that fell behind the log the
+// leader keeps, is sent the whole state instead.
+//
+// Followers answer read-only requests from their copy and redirect the
+// rest to the leader. A follower that hears nothing from the leader for an
+// election timeout stands for election; the candidate with an up-to-date
+// log and a majority of votes becomes the next leader. Without peers the
+// NM runs alone and is always the leader.
+
+#define NM_RAFT_PORT_OFFSET 100
+#define NM_RAFT_MAX_PEERS 7
+
+// Start the Raft threads for the NM self_id among peers (which includes
+// self_id); term and vote persist under state_dir. Call after the journal
+// is open. With fewer than two peers the NM stays a standalone leader.
+// Returns OK, or ERR_INTERNAL if the Raft port could not be opened.
+int nm_raft_start(int self_id, const NMPeer *peers, int count, const char *state_dir);
+
+// Whether this NM may take writes: it is the leader and has heard from a
+// majority within an election timeout. Always true when standalone.
+int nm_raft_is_leader(void);
+
+// Client address of the leader this NM knows of, "" and 0 if none
+void nm_raft_leader(char *host_out, size_t size, int *port_out);
+
+// Append a journal record (without the newline) to the log. Returns its
+// index and sets *term_out, or returns 0 unless this NM is a clustered
+// leader.
+unsigned long nm_raft_append(const char *record, unsigned long *term_out);
+
+// Wait until the entry at index of term is committed. Returns OK at once
+// for index 0; ERR_NOT_LEADER if this NM lost the leadership or the entry
+// did not commit within a few seconds, in which case it may or may not
+// commit later; ERR_INTERNAL if the log could not be synced.
+int nm_raft_wait(unsigned long index, unsigned long term);
+
+#endif
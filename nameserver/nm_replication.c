@@ -1,36 +1,227 @@
 #include "nm_replication.h"
+#include "nm_catalog.h"
+#include "nm_search.h"
+#include "nm_journal.h"
+#include "nm_raft.h"
+#include "nm_token.h"
 #include "../common/proto.h"
 #include "../common/net.h"
 #include "../common/log.h"
+#include "../common/jsonl.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <math.h>
 
 #define MAX_SS 32
-#define MAX_FILE_REPLICAS 10000
-#define HEARTBEAT_TIMEOUT 15       // seconds
-#define HEARTBEAT_CHECK_INTERVAL 5 // seconds
+#define HEARTBEAT_TIMEOUT 15            // seconds, for SSes without an arrival history
+#define HEARTBEAT_CHECK_INTERVAL_MS 100
+#define ARRIVAL_WINDOW 100              // heartbeat intervals kept per SS
+#define PHI_MIN_STD_MS 50.0             // floor for the interval deviation
+#define PHI_ACCEPTABLE_PAUSE_MS 100.0   // added to the mean interval
+#define READ_LATENCY_FLOOR_US 1000      // latency weight of an SS with no recent requests
+#define CONTROL_LINE_MAX 8192
+#define LOAD_SMOOTHING 0.3         // weight of the newest qps sample in SSNode.load
 
 static SSNode g_ss_nodes[MAX_SS];
 static int g_ss_count = 0;
-static FileReplica g_file_replicas[MAX_FILE_REPLICAS];
-static int g_file_replica_count = 0;
 static pthread_mutex_t g_replication_mutex = PTHREAD_MUTEX_INITIALIZER;
+static PlacementStrategy g_placement = PLACEMENT_DEFAULT;
+
+// Load history ring per SS, indexed like g_ss_nodes
+typedef struct
+{
+    LoadSample samples[LOAD_HISTORY];
+    int head; // next slot to write
+    int count;
+} LoadHistory;
+
+static LoadHistory g_history[MAX_SS];
+
+// Recent heartbeat inter-arrival times per SS, indexed like g_ss_nodes,
+// for the phi-accrual failure detector
+typedef struct
+{
+    double intervals[ARRIVAL_WINDOW]; // ms
+    int head;
+    int count;
+    double sum;
+    double sum_sq;
+    long long last_ms; // arrival of the latest heartbeat, 0 if none
+} ArrivalWindow;
+
+static ArrivalWindow g_arrivals[MAX_SS];
+static unsigned long g_channel[MAX_SS]; // id of the SS's current control channel
+static unsigned long g_next_channel = 1;
+static double g_phi_threshold = PHI_DEFAULT_THRESHOLD;
+static unsigned long g_read_turn = 0; // alternates reads between equally busy copies
+
+// Operations waiting for a primary's replica; see REPLICATION QUEUE
+#define RESYNC_LINE_MAX 6000 // the SS reads request lines of up to 8192
+#define REPL_QUEUE_MAX 128   // queued operations per primary
+#define REPL_QUEUE_BATCH 32  // operations per round trip
+#define REPL_OP_MAX 512
+#define REPL_QUEUE_RETRY_MS 500
+#define REPL_QUEUE_TIMEOUT_S 10
+
+typedef struct
+{
+    char ops[REPL_QUEUE_MAX][REPL_OP_MAX];
+    int head;
+    int count;
+    char resync[RESYNC_LINE_MAX]; // ";"-separated files whose operations were dropped
+    int resync_all;               // too many to list; reconcile the whole tree
+    long long retry_at_ms;        // after a failed delivery
+    // Sender thread only
+    int fd; // connection to the replica, -1 if none
+    char host[64];
+    int port;
+} ReplQueue;
+
+static ReplQueue g_queues[MAX_SS];
+static pthread_mutex_t g_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_queue_cond = PTHREAD_COND_INITIALIZER;
+static int g_queue_turn = 0; // where the sender's next scan starts
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Registration versions and catalog marks: wall-clock ms, so versions stay
+// unique across NM restarts
+static unsigned long wall_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void arrival_push(ArrivalWindow *w, double interval)
+{
+    if (w->count == ARRIVAL_WINDOW)
+    {
+        double old = w->intervals[w->head];
+        w->sum -= old;
+        w->sum_sq -= old * old;
+    }
+    else
+    {
+        w->count++;
+    }
+    w->intervals[w->head] = interval;
+    w->head = (w->head + 1) % ARRIVAL_WINDOW;
+    w->sum += interval;
+    w->sum_sq += interval * interval;
+}
+
+// Start a fresh history. With an expected interval the window is seeded so
+// the detector works from the first beat (mean expected, deviation a quarter
+// of it); without one phi stays unknown until two beats have arrived.
+static void arrival_reset(ArrivalWindow *w, int expected_ms)
+{
+    memset(w, 0, sizeof *w);
+    w->last_ms = now_ms();
+    if (expected_ms > 0)
+    {
+        arrival_push(w, expected_ms * 0.75);
+        arrival_push(w, expected_ms * 1.25);
+    }
+}
+
+static void arrival_record(ArrivalWindow *w)
+{
+    long long now = now_ms();
+    if (w->last_ms)
+        arrival_push(w, (double)(now - w->last_ms));
+    w->last_ms = now;
+}
+
+// Suspicion that the SS has failed given no heartbeat since last_ms:
+// -log10 of the probability that a live SS would still be silent, with
+// intervals taken as normally distributed. Uses the logistic approximation
+// of the normal CDF. Negative when there is not enough history.
+static double arrival_phi(const ArrivalWindow *w, long long now)
+{
+    if (w->count < 2 || !w->last_ms)
+        return -1;
+    double mean = w->sum / w->count + PHI_ACCEPTABLE_PAUSE_MS;
+    double var = w->sum_sq / w->count - (w->sum / w->count) * (w->sum / w->count);
+    double std = var > 0 ? sqrt(var) : 0;
+    if (std < PHI_MIN_STD_MS)
+        std = PHI_MIN_STD_MS;
+
+    double elapsed = (double)(now - w->last_ms);
+    double y = (elapsed - mean) / std;
+    double e = exp(-y * (1.5976 + 0.070566 * y * y));
+    if (elapsed > mean)
+        return -log10(e / (1.0 + e));
+    return -log10(1.0 - 1.0 / (1.0 + e));
+}
+
+// Caller holds g_replication_mutex
+static void mark_failed(SSNode *node, const char *details)
+{
+    node->alive = 0;
+    nm_catalog_bump_epoch();
+    log_message("NM", "SS_FAILURE", node->host, node->client_port, node->ss_id, details);
+}
+
+static SSNode *find_node(const char *ss_id)
+{
+    for (int i = 0; i < g_ss_count; i++)
+    {
+        if (strcmp(g_ss_nodes[i].ss_id, ss_id) == 0)
+            return &g_ss_nodes[i];
+    }
+    return NULL;
+}
+
+// Move a file's primary count from one SS to another (either may be NULL)
+static void count_primary(const char *from_ss, const char *to_ss)
+{
+    pthread_mutex_lock(&g_replication_mutex);
+    SSNode *from = from_ss ? find_node(from_ss) : NULL;
+    SSNode *to = to_ss ? find_node(to_ss) : NULL;
+    if (from && from->files > 0)
+        from->files--;
+    if (to)
+        to->files++;
+    pthread_mutex_unlock(&g_replication_mutex);
+}
 
 void nm_replication_init(void)
 {
     pthread_mutex_lock(&g_replication_mutex);
     g_ss_count = 0;
-    g_file_replica_count = 0;
     memset(g_ss_nodes, 0, sizeof(g_ss_nodes));
-    memset(g_file_replicas, 0, sizeof(g_file_replicas));
+    memset(g_history, 0, sizeof(g_history));
+    memset(g_arrivals, 0, sizeof(g_arrivals));
+    memset(g_channel, 0, sizeof(g_channel));
     pthread_mutex_unlock(&g_replication_mutex);
 
+    pthread_mutex_lock(&g_queue_mutex);
+    memset(g_queues, 0, sizeof(g_queues));
+    for (int i = 0; i < MAX_SS; i++)
+        g_queues[i].fd = -1;
+    pthread_mutex_unlock(&g_queue_mutex);
+
     log_message("NM", "REPLICATION_INIT", "127.0.0.1", 5050, "system", "Replication system initialized");
 }
 
+// Caller holds g_replication_mutex
+static void journal_node(const SSNode *node)
+{
+    nm_journal_record("{\"t\":\"ss\",\"ss_id\":\"%s\",\"host\":\"%s\",\"client_port\":%d,\"nm_port\":%d,\"replica_of\":\"%s\",\"reg_version\":%lu}",
+                      node->ss_id, node->host, node->client_port, node->nm_port, node->replica_of, node->reg_version);
+}
+
 int nm_replication_register_ss(const char *ss_id, const char *host, int client_port, int nm_port)
 {
     pthread_mutex_lock(&g_replication_mutex);
@@ -41,14 +232,22 @@ int nm_replication_register_ss(const char *ss_id, const char *host, int client_p
         if (strcmp(g_ss_nodes[i].ss_id, ss_id) == 0)
         {
             // SS is recovering
+            int moved = strcmp(g_ss_nodes[i].host, host) != 0 || g_ss_nodes[i].client_port != client_port ||
+                        g_ss_nodes[i].nm_port != nm_port;
             g_ss_nodes[i].alive = 1;
+            g_ss_nodes[i].needs_register = 0;
             g_ss_nodes[i].last_heartbeat = time(NULL);
             strncpy(g_ss_nodes[i].host, host, sizeof(g_ss_nodes[i].host) - 1);
             g_ss_nodes[i].client_port = client_port;
             g_ss_nodes[i].nm_port = nm_port;
+            arrival_reset(&g_arrivals[i], 0);
+            if (moved)
+                journal_node(&g_ss_nodes[i]);
             pthread_mutex_unlock(&g_replication_mutex);
+            nm_catalog_bump_epoch();
 
             log_message("NM", "SS_RECOVERY", host, nm_port, ss_id, "Storage Server recovered and reconnected");
+            nm_replication_recover_ss(ss_id);
             return OK;
         }
     }
@@ -67,6 +266,7 @@ int nm_replication_register_ss(const char *ss_id, const char *host, int client_p
     node->alive = 1;
     node->last_heartbeat = time(NULL);
     node->replica_of[0] = '\0';
+    arrival_reset(&g_arrivals[node - g_ss_nodes], 0);
 
     // Assign replication pairs (simple strategy: pair consecutive SSes)
     if (g_ss_count >= 2)
@@ -82,7 +282,17 @@ int nm_replication_register_ss(const char *ss_id, const char *host, int client_p
         }
     }
 
+    journal_node(node);
+
+    // Files the primary registered before its replica did get the replica too
+    char primary_ss[64];
+    snprintf(primary_ss, sizeof primary_ss, "%s", node->replica_of);
     pthread_mutex_unlock(&g_replication_mutex);
+    if (primary_ss[0])
+    {
+        nm_catalog_set_replica(primary_ss, ss_id);
+        nm_replication_recover_ss(ss_id);
+    }
     char details[256];
     snprintf(details, sizeof(details), "Storage Server registered (NM port: %d)", nm_port);
     log_message("NM", "SS_REGISTER", host, client_port, ss_id, details);
@@ -95,15 +305,25 @@ int nm_replication_heartbeat(const char *ss_id)
 
     for (int i = 0; i < g_ss_count; i++)
     {
-        if (strcmp(g_ss_nodes[i].ss_id, ss_id) == 0)
+        if (strcmp(g_ss_nodes[i].ss_id, ss_id) == 0 && !g_ss_nodes[i].needs_register)
         {
             g_ss_nodes[i].last_heartbeat = time(NULL);
-            if (!g_ss_nodes[i].alive)
+            int recovered = !g_ss_nodes[i].alive;
+            if (recovered)
             {
+                // The silence before this beat is not an interval to learn from
                 g_ss_nodes[i].alive = 1;
+                arrival_reset(&g_arrivals[i], 0);
+                nm_catalog_bump_epoch();
                 log_message("NM", "SS_BACK_ONLINE", g_ss_nodes[i].host, g_ss_nodes[i].client_port, ss_id, "SS is back online");
             }
+            else
+            {
+                arrival_record(&g_arrivals[i]);
+            }
             pthread_mutex_unlock(&g_replication_mutex);
+            if (recovered)
+                nm_replication_recover_ss(ss_id);
             return OK;
         }
     }
@@ -112,255 +332,1497 @@ int nm_replication_heartbeat(const char *ss_id)
     return ERR_NOT_FOUND;
 }
 
-void nm_replication_check_failures(void)
+int nm_replication_restore_ss(const char *ss_id, const char *host, int client_port, int nm_port,
+                              const char *replica_of, unsigned long reg_version)
 {
     pthread_mutex_lock(&g_replication_mutex);
+    SSNode *node = find_node(ss_id);
+    if (!node && g_ss_count < MAX_SS)
+    {
+        node = &g_ss_nodes[g_ss_count++];
+        strncpy(node->ss_id, ss_id, sizeof(node->ss_id) - 1);
+        node->needs_register = 1;
+    }
+    if (node)
+    {
+        strncpy(node->host, host, sizeof(node->host) - 1);
+        node->client_port = client_port;
+        node->nm_port = nm_port;
+        snprintf(node->replica_of, sizeof node->replica_of, "%s", replica_of);
+        node->reg_version = reg_version;
+    }
+    pthread_mutex_unlock(&g_replication_mutex);
+    return node ? OK : ERR_INTERNAL;
+}
 
-    time_t now = time(NULL);
-    for (int i = 0; i < g_ss_count; i++)
+typedef struct
+{
+    char ss_ids[MAX_SS][64];
+    long files[MAX_SS];
+    int count;
+} PrimaryCounts;
+
+static int count_file(const CatalogEntry *entry, void *arg)
+{
+    PrimaryCounts *counts = arg;
+    for (int i = 0; i < counts->count; i++)
     {
-        if (g_ss_nodes[i].alive)
+        if (!strcmp(counts->ss_ids[i], entry->primary_ss))
         {
-            if (now - g_ss_nodes[i].last_heartbeat > HEARTBEAT_TIMEOUT)
-            {
-                g_ss_nodes[i].alive = 0;
-                char details[256];
-                snprintf(details, sizeof(details), "FAILURE DETECTED: SS is unresponsive (last heartbeat: %ld seconds ago)",
-                         (long)(now - g_ss_nodes[i].last_heartbeat));
-                log_message("NM", "SS_FAILURE", g_ss_nodes[i].host, g_ss_nodes[i].client_port, g_ss_nodes[i].ss_id, details);
-            }
+            counts->files[i]++;
+            break;
         }
     }
+    return 0;
+}
+
+void nm_replication_recount(void)
+{
+    // Walk the catalog without g_replication_mutex held; the heartbeat path
+    // takes the catalog lock inside it
+    static PrimaryCounts counts;
+    memset(&counts, 0, sizeof counts);
+    pthread_mutex_lock(&g_replication_mutex);
+    for (int i = 0; i < g_ss_count; i++)
+        memcpy(counts.ss_ids[i], g_ss_nodes[i].ss_id, sizeof counts.ss_ids[i]); // both 64-byte id arrays
+    counts.count = g_ss_count;
+    pthread_mutex_unlock(&g_replication_mutex);
+
+    nm_catalog_foreach(count_file, &counts);
 
+    pthread_mutex_lock(&g_replication_mutex);
+    for (int i = 0; i < counts.count; i++)
+    {
+        SSNode *node = find_node(counts.ss_ids[i]);
+        if (node)
+            node->files = counts.files[i];
+    }
     pthread_mutex_unlock(&g_replication_mutex);
 }
 
-int nm_replication_map_file(const char *file, const char *primary_ss)
+void nm_replication_set_phi_threshold(double threshold)
 {
     pthread_mutex_lock(&g_replication_mutex);
+    g_phi_threshold = threshold;
+    pthread_mutex_unlock(&g_replication_mutex);
+}
 
-    // Find replica SS for this primary
-    char replica_ss[64] = "";
-    for (int i = 0; i < g_ss_count; i++)
+int nm_replication_report(const char *ss_id, const LoadSample *sample)
+{
+    int rc = nm_replication_heartbeat(ss_id);
+    if (rc != OK)
+        return rc;
+
+    pthread_mutex_lock(&g_replication_mutex);
+    SSNode *node = find_node(ss_id);
+    if (node)
     {
-        if (g_ss_nodes[i].alive &&
-            strcmp(g_ss_nodes[i].replica_of, primary_ss) == 0)
-        {
-            strncpy(replica_ss, g_ss_nodes[i].ss_id, sizeof(replica_ss) - 1);
-            break;
-        }
+        LoadHistory *history = &g_history[node - g_ss_nodes];
+        node->bytes = sample->bytes;
+        node->load = history->count ? LOAD_SMOOTHING * sample->qps + (1 - LOAD_SMOOTHING) * node->load
+                                    : sample->qps;
+        history->samples[history->head] = *sample;
+        history->head = (history->head + 1) % LOAD_HISTORY;
+        if (history->count < LOAD_HISTORY)
+            history->count++;
+    }
+    pthread_mutex_unlock(&g_replication_mutex);
+    return OK;
+}
+
+int nm_replication_load_history(const char *ss_id, LoadSample *out, int max)
+{
+    pthread_mutex_lock(&g_replication_mutex);
+    SSNode *node = find_node(ss_id);
+    int n = 0;
+    if (node)
+    {
+        LoadHistory *history = &g_history[node - g_ss_nodes];
+        n = history->count < max ? history->count : max;
+        for (int i = 0; i < n; i++)
+            out[i] = history->samples[(history->head - n + i + LOAD_HISTORY) % LOAD_HISTORY];
+    }
+    pthread_mutex_unlock(&g_replication_mutex);
+    return n;
+}
+
+typedef struct
+{
+    int fd;
+    char ss_id[64];
+    unsigned long id;
+} ControlChannel;
+
+// Counters every heartbeat carries: open connections and replication lag
+static void note_counters(const char *line, const char *ss_id)
+{
+    int active = 0;
+    long long pending = 0, lag_ms = 0;
+    int has_active = json_get_int(line, "active", &active) == 0;
+    int has_lag = json_get_long(line, "repl_pending", &pending) == 0;
+    json_get_long(line, "repl_lag_ms", &lag_ms);
+
+    pthread_mutex_lock(&g_replication_mutex);
+    SSNode *node = find_node(ss_id);
+    if (node && has_active)
+        node->active = active;
+    if (node && has_lag)
+    {
+        node->repl_pending = (long)pending;
+        node->repl_lag_ms = (long)lag_ms;
     }
+    pthread_mutex_unlock(&g_replication_mutex);
+}
 
-    // Check if file already mapped
-    for (int i = 0; i < g_file_replica_count; i++)
+// Apply the "versions":"file:version,..." list of a heartbeat
+static void note_versions(const char *line, const char *ss_id)
+{
+    char *versions = malloc(CONTROL_LINE_MAX);
+    if (!versions)
+        return;
+    if (json_get_str(line, "versions", versions, CONTROL_LINE_MAX) == 0)
     {
-        if (strcmp(g_file_replicas[i].file, file) == 0)
+        char *save = NULL;
+        for (char *tok = strtok_r(versions, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
         {
-            // Update mapping
-            strncpy(g_file_replicas[i].primary_ss, primary_ss,
-                    sizeof(g_file_replicas[i].primary_ss) - 1);
-            strncpy(g_file_replicas[i].replica_ss, replica_ss,
-                    sizeof(g_file_replicas[i].replica_ss) - 1);
-            pthread_mutex_unlock(&g_replication_mutex);
-            return OK;
+            char *colon = strrchr(tok, ':');
+            if (!colon)
+                continue;
+            *colon = '\0';
+            nm_catalog_note_version(tok, ss_id, strtoul(colon + 1, NULL, 10));
         }
     }
+    free(versions);
+}
 
-    if (g_file_replica_count >= MAX_FILE_REPLICAS)
+// Apply a catalog change an SS made for a client that came with a token:
+//   {"op":"SS_NOTIFY","event":"create","file":F}
+//   {"op":"SS_NOTIFY","event":"delete","file":F}
+//   {"op":"SS_NOTIFY","event":"move","file":F,"to":G}
+//   {"op":"SS_NOTIFY","event":"checkpoint","file":F,"tag":T,"user":U}
+// The SS resends a notice until it is acknowledged, so each must be safe
+// to apply twice. Changes to files ss_id no longer holds are stale.
+static void apply_notice(const char *line, const char *ss_id)
+{
+    char event[16] = "", file[256] = "";
+    json_get_str(line, "event", event, sizeof event);
+    json_get_str(line, "file", file, sizeof file);
+    if (strcmp(event, "reconcile") == 0)
     {
-        pthread_mutex_unlock(&g_replication_mutex);
-        return ERR_INTERNAL;
+        // Its replication log overflowed; compare trees with its replica
+        log_message("NM", "SS_NOTIFY", "127.0.0.1", 5050, ss_id, "Replication records dropped; reconciling");
+        nm_replication_recover_ss(ss_id);
+        return;
+    }
+    if (!file[0])
+        return;
+    if (strcmp(event, "create") == 0)
+    {
+        nm_replication_map_file(file, ss_id);
+        return;
     }
 
-    FileReplica *fr = &g_file_replicas[g_file_replica_count++];
-    strncpy(fr->file, file, sizeof(fr->file) - 1);
-    strncpy(fr->primary_ss, primary_ss, sizeof(fr->primary_ss) - 1);
-    strncpy(fr->replica_ss, replica_ss, sizeof(fr->replica_ss) - 1);
+    CatalogEntry entry;
+    if (nm_catalog_get(file, &entry) != OK ||
+        (strcmp(entry.primary_ss, ss_id) != 0 && strcmp(entry.replica_ss, ss_id) != 0))
+        return;
+    if (strcmp(event, "delete") == 0)
+    {
+        nm_replication_unmap_file(file);
+    }
+    else if (strcmp(event, "move") == 0)
+    {
+        char to[512] = "";
+        if (json_get_str(line, "to", to, sizeof to) == 0 && to[0])
+            nm_replication_rename_file(file, to);
+    }
+    else if (strcmp(event, "checkpoint") == 0)
+    {
+        // Checkpoints are not part of the SS replication stream
+        char tag[128] = "", user[64] = "", op[512];
+        json_get_str(line, "tag", tag, sizeof tag);
+        json_get_str(line, "user", user, sizeof user);
+        snprintf(op, sizeof op, "{\"op\":\"CHECKPOINT\",\"file\":\"%s\",\"tag\":\"%s\",\"user\":\"%s\"}", file, tag, user);
+        nm_replication_async_write(file, op);
+    }
+    log_message("NM", "SS_NOTIFY", "127.0.0.1", 5050, ss_id, file);
+}
 
-    pthread_mutex_unlock(&g_replication_mutex);
-    char details[512];
-    snprintf(details, sizeof(details), "File %s mapped to primary=%s, replica=%s",
-             file, primary_ss, replica_ss[0] ? replica_ss : "none");
-    log_message("NM", "FILE_REPLICATION_MAP", "127.0.0.1", 5050, "system", details);
-    return OK;
+// Replies are short enough for one send; a vanished SS must not raise
+// SIGPIPE in the NM
+static void channel_reply(int fd, const char *reply)
+{
+    send(fd, reply, strlen(reply), MSG_NOSIGNAL);
 }
 
-int nm_replication_rename_file(const char *old_file, const char *new_file)
+// Acknowledge a heartbeat, naming the SS that replicates ss_id (whether or
+// not it is up, so the stream resumes where it stopped)
+static void heartbeat_reply(int fd, const char *ss_id, int rc)
 {
+    if (rc != OK)
+    {
+        channel_reply(fd, "{\"status\":1,\"code\":\"ERR_NOT_FOUND\"}\n");
+        return;
+    }
+
+    char replica[128] = "";
     pthread_mutex_lock(&g_replication_mutex);
-    for (int i = 0; i < g_file_replica_count; i++)
+    for (int i = 0; i < g_ss_count; i++)
     {
-        if (strcmp(g_file_replicas[i].file, old_file) == 0)
+        if (strcmp(g_ss_nodes[i].replica_of, ss_id) == 0)
         {
-            strncpy(g_file_replicas[i].file, new_file, sizeof(g_file_replicas[i].file) - 1);
-            g_file_replicas[i].file[sizeof(g_file_replicas[i].file) - 1] = '\0';
-            pthread_mutex_unlock(&g_replication_mutex);
-            return OK;
+            snprintf(replica, sizeof replica, "%s:%d", g_ss_nodes[i].host, g_ss_nodes[i].client_port);
+            break;
         }
     }
     pthread_mutex_unlock(&g_replication_mutex);
-    return ERR_NOT_FOUND;
+
+    char reply[256];
+    snprintf(reply, sizeof reply, "{\"status\":0,\"replica\":\"%s\"}\n", replica);
+    channel_reply(fd, reply);
 }
 
-int nm_replication_get_ss(const char *file, char *host_out, int *port_out, int *is_replica)
+// Reads heartbeats until the SS closes the channel
+static void *control_channel_thread(void *arg)
 {
-    pthread_mutex_lock(&g_replication_mutex);
-
-    *is_replica = 0;
+    ControlChannel *channel = arg;
+    int deposed = 0;
 
-    // Find file mapping
-    for (int i = 0; i < g_file_replica_count; i++)
+    for (;;)
     {
-        if (strcmp(g_file_replicas[i].file, file) == 0)
+        char *line = NULL;
+        if (recv_line(channel->fd, &line, CONTROL_LINE_MAX) <= 0)
         {
-            const char *primary_ss = g_file_replicas[i].primary_ss;
-            const char *replica_ss = g_file_replicas[i].replica_ss;
+            free(line);
+            break;
+        }
 
-            // Try primary first
-            for (int j = 0; j < g_ss_count; j++)
-            {
-                if (strcmp(g_ss_nodes[j].ss_id, primary_ss) == 0 && g_ss_nodes[j].alive)
-                {
-                    strncpy(host_out, g_ss_nodes[j].host, 63);
-                    *port_out = g_ss_nodes[j].client_port;
-                    pthread_mutex_unlock(&g_replication_mutex);
-                    return OK;
-                }
-            }
+        char op[32] = "";
+        json_get_str(line, "op", op, sizeof op);
+        int notice = strcmp(op, "SS_NOTIFY") == 0;
+        if (!notice && strcmp(op, "SS_HEARTBEAT") != 0)
+        {
+            free(line);
+            channel_reply(channel->fd, "{\"status\":4,\"code\":\"ERR_BAD_REQUEST\"}\n");
+            continue;
+        }
+
+        // An NM that lost the leadership sends its SSes on to the leader
+        if (!nm_raft_is_leader())
+        {
+            free(line);
+            channel_reply(channel->fd, "{\"status\":10,\"code\":\"ERR_NOT_LEADER\",\"leader\":\"\"}\n");
+            deposed = 1;
+            break;
+        }
 
-            // Primary failed, try replica
-            if (replica_ss[0] != '\0')
+        if (notice)
+        {
+            apply_notice(line, channel->ss_id);
+            free(line);
+            // The SS forgets a notice once it is acknowledged
+            if (nm_journal_wait() != OK)
             {
-                for (int j = 0; j < g_ss_count; j++)
-                {
-                    if (strcmp(g_ss_nodes[j].ss_id, replica_ss) == 0 && g_ss_nodes[j].alive)
-                    {
-                        strncpy(host_out, g_ss_nodes[j].host, 63);
-                        *port_out = g_ss_nodes[j].client_port;
-                        *is_replica = 1;
-                        pthread_mutex_unlock(&g_replication_mutex);
-                        char details[512];
-                        snprintf(details, sizeof(details), "FAILOVER: Using replica SS for file %s (primary %s is down)", file, primary_ss);
-                        log_message("NM", "FAILOVER", g_ss_nodes[j].host, g_ss_nodes[j].client_port, replica_ss, details);
-                        return OK;
-                    }
-                }
+                channel_reply(channel->fd, "{\"status\":10,\"code\":\"ERR_NOT_LEADER\",\"leader\":\"\"}\n");
+                deposed = 1;
+                break;
             }
+            channel_reply(channel->fd, "{\"status\":0}\n");
+            continue;
+        }
 
-            pthread_mutex_unlock(&g_replication_mutex);
-            return ERR_NOT_FOUND; // Both primary and replica are down
+        note_counters(line, channel->ss_id);
+        note_versions(line, channel->ss_id);
+
+        // Most beats are light; every few seconds one carries a load report
+        long long window_ms = 0;
+        if (json_get_long(line, "window_ms", &window_ms) != 0)
+        {
+            free(line);
+            heartbeat_reply(channel->fd, channel->ss_id, nm_replication_heartbeat(channel->ss_id));
+            continue;
         }
+
+        LoadSample sample;
+        memset(&sample, 0, sizeof sample);
+        sample.at = time(NULL);
+        sample.free_disk = -1;
+        long long requests = 0, p99_us = 0;
+        json_get_int(line, "active", &sample.active);
+        json_get_int(line, "files", &sample.files);
+        json_get_long(line, "bytes", &sample.bytes);
+        json_get_long(line, "free_disk", &sample.free_disk);
+        json_get_long(line, "requests", &requests);
+        json_get_long(line, "p99_us", &p99_us);
+        sample.p99_us = (long)p99_us;
+        sample.qps = window_ms > 0 ? requests * 1000.0 / window_ms : 0;
+        free(line);
+
+        heartbeat_reply(channel->fd, channel->ss_id, nm_replication_report(channel->ss_id, &sample));
     }
 
+    // A closed channel means the SS process is gone (or cut off): fail it
+    // now instead of waiting for the detector. Only the newest channel of
+    // an SS counts, since a reconnect may overtake the old one's close.
+    pthread_mutex_lock(&g_replication_mutex);
+    SSNode *node = find_node(channel->ss_id);
+    if (node && node->alive && !deposed && g_channel[node - g_ss_nodes] == channel->id)
+        mark_failed(node, "FAILURE DETECTED: control channel closed");
     pthread_mutex_unlock(&g_replication_mutex);
-    return ERR_NOT_FOUND;
+
+    log_message("NM", "SS_CONTROL_CLOSED", "127.0.0.1", 5050, channel->ss_id, "Control channel closed");
+    close(channel->fd);
+    free(channel);
+    return NULL;
 }
 
-int nm_replication_get_any_ss(char *host_out, int *port_out, char *ss_id_out)
+int nm_replication_control_channel(int fd, const char *ss_id, int heartbeat_ms)
+{
+    ControlChannel *channel = calloc(1, sizeof(ControlChannel));
+    if (!channel)
+        return ERR_INTERNAL;
+    channel->fd = fd;
+    strncpy(channel->ss_id, ss_id, sizeof(channel->ss_id) - 1);
+
+    pthread_mutex_lock(&g_replication_mutex);
+    channel->id = g_next_channel++;
+    SSNode *node = find_node(ss_id);
+    if (node)
+    {
+        g_channel[node - g_ss_nodes] = channel->id;
+        arrival_reset(&g_arrivals[node - g_ss_nodes], heartbeat_ms);
+    }
+    pthread_mutex_unlock(&g_replication_mutex);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, control_channel_thread, channel) != 0)
+    {
+        free(channel);
+        return ERR_INTERNAL;
+    }
+    pthread_detach(thread);
+    log_message("NM", "SS_CONTROL", "127.0.0.1", 5050, ss_id, "Control channel open");
+    return OK;
+}
+
+void nm_replication_check_failures(void)
 {
     pthread_mutex_lock(&g_replication_mutex);
 
+    time_t now = time(NULL);
+    long long now_mono = now_ms();
     for (int i = 0; i < g_ss_count; i++)
     {
-        if (g_ss_nodes[i].alive)
+        if (!g_ss_nodes[i].alive)
+            continue;
+
+        char details[256];
+        double phi = arrival_phi(&g_arrivals[i], now_mono);
+        if (phi >= g_phi_threshold)
         {
-            strncpy(host_out, g_ss_nodes[i].host, 63);
-            *port_out = g_ss_nodes[i].client_port;
-            if (ss_id_out)
-            {
-                strncpy(ss_id_out, g_ss_nodes[i].ss_id, 63);
-            }
-            pthread_mutex_unlock(&g_replication_mutex);
-            return OK;
+            snprintf(details, sizeof(details), "FAILURE DETECTED: phi %.1f after %lld ms without a heartbeat",
+                     phi, now_mono - g_arrivals[i].last_ms);
+            mark_failed(&g_ss_nodes[i], details);
+        }
+        else if (phi < 0 && now - g_ss_nodes[i].last_heartbeat > HEARTBEAT_TIMEOUT)
+        {
+            snprintf(details, sizeof(details), "FAILURE DETECTED: SS is unresponsive (last heartbeat: %ld seconds ago)",
+                     (long)(now - g_ss_nodes[i].last_heartbeat));
+            mark_failed(&g_ss_nodes[i], details);
         }
     }
 
     pthread_mutex_unlock(&g_replication_mutex);
-    return ERR_NOT_FOUND;
 }
 
-// Async replication helper thread
-static void *async_replicate_thread(void *arg)
+int nm_replication_map_file(const char *file, const char *primary_ss)
 {
-    char *cmd = (char *)arg;
-    // Parse command and send to replica
-    // Format: "ss_id:operation"
+    pthread_mutex_lock(&g_replication_mutex);
+
+    // Find replica SS for this primary
+    char replica_ss[64] = "";
+    for (int i = 0; i < g_ss_count; i++)
+    {
+        if (g_ss_nodes[i].alive &&
+            strcmp(g_ss_nodes[i].replica_of, primary_ss) == 0)
+        {
+            strncpy(replica_ss, g_ss_nodes[i].ss_id, sizeof(replica_ss) - 1);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&g_replication_mutex);
 
-    char ss_id[64], host[64];
-    int port = 0;
+    CatalogEntry previous;
+    int existed = nm_catalog_get(file, &previous) == OK;
 
-    char *colon = strchr(cmd, ':');
-    if (!colon)
+    int rc = nm_catalog_put(file, primary_ss, replica_ss);
+    nm_search_invalidate(file);
+    if (rc == OK)
+        nm_catalog_mark(file, wall_ms()); // survives a registration sweep in progress
+    if (rc != OK)
     {
-        free(cmd);
-        return NULL;
+        log_message("NM", "FILE_REPLICATION_MAP", "127.0.0.1", 5050, "system", "Out of memory: could not map file");
+        return ERR_INTERNAL;
     }
+    if (!existed)
+        count_primary(NULL, primary_ss);
+    else if (strcmp(previous.primary_ss, primary_ss) != 0)
+        count_primary(previous.primary_ss, primary_ss);
 
-    *colon = '\0';
-    strncpy(ss_id, cmd, sizeof(ss_id) - 1);
-    const char *operation = colon + 1;
+    char details[512];
+    snprintf(details, sizeof(details), "File %s mapped to primary=%s, replica=%s",
+             file, primary_ss, replica_ss[0] ? replica_ss : "none");
+    log_message("NM", "FILE_REPLICATION_MAP", "127.0.0.1", 5050, "system", details);
+    return OK;
+}
 
-    // Find replica SS
+int nm_replication_register_files(const char *ss_id, char **files, int count, unsigned long mark)
+{
     pthread_mutex_lock(&g_replication_mutex);
+    char replica_ss[64] = "";
     for (int i = 0; i < g_ss_count; i++)
     {
-        if (strcmp(g_ss_nodes[i].replica_of, ss_id) == 0 && g_ss_nodes[i].alive)
+        if (g_ss_nodes[i].alive && strcmp(g_ss_nodes[i].replica_of, ss_id) == 0)
         {
-            strncpy(host, g_ss_nodes[i].host, sizeof(host) - 1);
-            port = g_ss_nodes[i].client_port;
+            snprintf(replica_ss, sizeof replica_ss, "%s", g_ss_nodes[i].ss_id);
             break;
         }
     }
     pthread_mutex_unlock(&g_replication_mutex);
 
-    if (port > 0)
+    int mapped = 0;
+    for (int i = 0; i < count; i++)
     {
-        int fd = tcp_connect(host, port);
-        if (fd >= 0)
+        CatalogEntry previous;
+        int existed = nm_catalog_get(files[i], &previous) == OK;
+        if (nm_catalog_put(files[i], ss_id, replica_ss) != OK)
+            continue;
+        if (mark)
+            nm_catalog_mark(files[i], mark);
+        if (!existed || strcmp(previous.primary_ss, ss_id) != 0)
+        {
+            nm_search_invalidate(files[i]);
+            count_primary(existed ? previous.primary_ss : NULL, ss_id);
+        }
+        else if (strcmp(previous.replica_ss, replica_ss) != 0)
         {
-            send_line(fd, operation);
-            close(fd);
-            log_message("NM", "ASYNC_REPLICATION", host, port, ss_id, "Async replication completed");
+            nm_search_invalidate(files[i]);
         }
+        mapped++;
     }
+    return mapped;
+}
 
-    free(cmd);
-    return NULL;
+int nm_replication_unregister_files(const char *ss_id, char **files, int count)
+{
+    int removed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        CatalogEntry entry;
+        if (nm_catalog_get(files[i], &entry) == OK && strcmp(entry.primary_ss, ss_id) == 0 &&
+            nm_replication_unmap_file(files[i]) == OK)
+            removed++;
+    }
+    return removed;
 }
 
-int nm_replication_async_write(const char *file, const char *operation)
+typedef struct
 {
-    pthread_mutex_lock(&g_replication_mutex);
+    const char *ss_id;
+    unsigned long mark;
+    char **names;
+    int count;
+    int cap;
+    int failed;
+} Unlisted;
 
-    // Find primary SS for this file
-    char primary_ss[64] = "";
-    for (int i = 0; i < g_file_replica_count; i++)
+static int collect_unlisted(const CatalogEntry *entry, void *arg)
+{
+    Unlisted *u = arg;
+    if (strcmp(entry->primary_ss, u->ss_id) != 0 || entry->mark >= u->mark)
+        return 0;
+    if (u->count == u->cap)
     {
-        if (strcmp(g_file_replicas[i].file, file) == 0)
+        int cap = u->cap ? u->cap * 2 : 64;
+        char **names = realloc(u->names, cap * sizeof *names);
+        if (!names)
         {
-            strncpy(primary_ss, g_file_replicas[i].primary_ss, sizeof(primary_ss) - 1);
-            break;
+            u->failed = 1;
+            return 1;
         }
+        u->names = names;
+        u->cap = cap;
     }
-
-    pthread_mutex_unlock(&g_replication_mutex);
-
-    if (primary_ss[0] == '\0')
+    u->names[u->count] = strdup(entry->file);
+    if (!u->names[u->count])
     {
-        return ERR_NOT_FOUND;
+        u->failed = 1;
+        return 1;
     }
+    u->count++;
+    return 0;
+}
+
+int nm_replication_sweep_files(const char *ss_id, unsigned long mark)
+{
+    // Files the SS listed carry mark; ones mapped since it started listing
+    // carry a later one. Collect first: unmapping takes the catalog lock
+    // foreach holds.
+    Unlisted u = {ss_id, mark, NULL, 0, 0, 0};
+    nm_catalog_foreach(collect_unlisted, &u);
+    int removed = u.failed ? 0 : nm_replication_unregister_files(ss_id, u.names, u.count);
+    for (int i = 0; i < u.count; i++)
+        free(u.names[i]);
+    free(u.names);
+    return removed;
+}
+
+int nm_replication_is_registered(const char *ss_id)
+{
+    pthread_mutex_lock(&g_replication_mutex);
+    SSNode *node = find_node(ss_id);
+    int registered = node && !node->needs_register;
+    pthread_mutex_unlock(&g_replication_mutex);
+    return registered;
+}
+
+unsigned long nm_replication_registration(const char *ss_id, unsigned long *next)
+{
+    pthread_mutex_lock(&g_replication_mutex);
+    SSNode *node = find_node(ss_id);
+    unsigned long version = node ? node->reg_version : 0;
+    pthread_mutex_unlock(&g_replication_mutex);
+    *next = wall_ms();
+    if (*next <= version)
+        *next = version + 1;
+    return version;
+}
+
+void nm_replication_registration_done(const char *ss_id, unsigned long version)
+{
+    pthread_mutex_lock(&g_replication_mutex);
+    SSNode *node = find_node(ss_id);
+    if (node)
+    {
+        if (version)
+        {
+            node->reg_version = version;
+            journal_node(node);
+        }
+        else
+        {
+            node->needs_register = 1;
+        }
+    }
+    pthread_mutex_unlock(&g_replication_mutex);
+}
+
+int nm_replication_rename_file(const char *old_file, const char *new_file)
+{
+    int rc = nm_catalog_rename(old_file, new_file);
+    if (rc == OK)
+        nm_catalog_mark(new_file, wall_ms());
+    nm_search_invalidate(old_file);
+    nm_search_invalidate(new_file);
+    return rc;
+}
 
-    // Create async thread for replication
-    char *cmd = malloc(1024);
-    snprintf(cmd, 1024, "%s:%s", primary_ss, operation);
+int nm_replication_unmap_file(const char *file)
+{
+    CatalogEntry previous;
+    int existed = nm_catalog_get(file, &previous) == OK;
+
+    int rc = nm_catalog_remove(file);
+    nm_search_invalidate(file);
+    if (existed && rc == OK)
+        count_primary(previous.primary_ss, NULL);
+    return rc;
+}
+
+void nm_replication_set_placement(PlacementStrategy strategy)
+{
+    pthread_mutex_lock(&g_replication_mutex);
+    g_placement = strategy;
+    pthread_mutex_unlock(&g_replication_mutex);
+}
+
+int nm_replication_place_file(const char *file, char *host_out, int *port_out, char *ss_id_out)
+{
+    pthread_mutex_lock(&g_replication_mutex);
+
+    PlacementNode nodes[MAX_SS];
+    int node_index[MAX_SS];
+    int count = 0;
+    for (int i = 0; i < g_ss_count; i++)
+    {
+        if (!g_ss_nodes[i].alive)
+            continue;
+        // Both ids are 64-byte NUL-terminated arrays
+        memcpy(nodes[count].ss_id, g_ss_nodes[i].ss_id, sizeof(nodes[count].ss_id));
+        nodes[count].files = g_ss_nodes[i].files;
+        nodes[count].bytes = g_ss_nodes[i].bytes;
+        nodes[count].load = g_ss_nodes[i].load;
+        node_index[count++] = i;
+    }
+
+    int chosen = nm_placement_choose(g_placement, file, nodes, count);
+    if (chosen < 0)
+    {
+        pthread_mutex_unlock(&g_replication_mutex);
+        return ERR_NOT_FOUND;
+    }
+
+    SSNode *node = &g_ss_nodes[node_index[chosen]];
+    strncpy(host_out, node->host, 63);
+    host_out[63] = '\0';
+    *port_out = node->client_port;
+    strncpy(ss_id_out, node->ss_id, 63);
+    ss_id_out[63] = '\0';
+
+    pthread_mutex_unlock(&g_replication_mutex);
+    return OK;
+}
+
+// Cost of sending one more read to node: open connections weighted by the
+// latency it last reported. Caller holds g_replication_mutex.
+static double read_cost(const SSNode *node)
+{
+    const LoadHistory *history = &g_history[node - g_ss_nodes];
+    long p99 = 0;
+    if (history->count)
+        p99 = history->samples[(history->head + LOAD_HISTORY - 1) % LOAD_HISTORY].p99_us;
+    return (node->active + 1.0) * (p99 + READ_LATENCY_FLOOR_US);
+}
+
+int nm_replication_route_read(const char *file, unsigned long min_version,
+                              char *host_out, int *port_out, int *is_replica, int *balanced)
+{
+    *is_replica = 0;
+    *balanced = 0;
+
+    CatalogEntry entry;
+    if (nm_catalog_get(file, &entry) != OK)
+        return ERR_NOT_FOUND;
+
+    pthread_mutex_lock(&g_replication_mutex);
+
+    SSNode *primary = find_node(entry.primary_ss);
+    SSNode *replica = entry.replica_ss[0] ? find_node(entry.replica_ss) : NULL;
+    if (primary && !primary->alive)
+        primary = NULL;
+    if (replica && !replica->alive)
+        replica = NULL;
+
+    int caught_up = replica && entry.replica_version > 0 &&
+                    entry.replica_version >= entry.primary_version &&
+                    entry.replica_version >= min_version;
+
+    SSNode *chosen = NULL;
+    int rc = OK;
+    if (primary && caught_up)
+    {
+        *balanced = 1;
+        double primary_cost = read_cost(primary), replica_cost = read_cost(replica);
+        if (primary_cost == replica_cost)
+            chosen = (g_read_turn++ & 1) ? replica : primary;
+        else
+            chosen = replica_cost < primary_cost ? replica : primary;
+    }
+    else if (primary)
+    {
+        chosen = primary;
+    }
+    else if (replica && entry.replica_version >= min_version)
+    {
+        chosen = replica;
+    }
+    else
+    {
+        rc = replica ? ERR_BUSY : ERR_NOT_FOUND;
+    }
+
+    if (chosen)
+    {
+        strncpy(host_out, chosen->host, 63);
+        host_out[63] = '\0';
+        *port_out = chosen->client_port;
+        *is_replica = chosen == replica;
+    }
+    pthread_mutex_unlock(&g_replication_mutex);
+
+    if (chosen && !primary)
+    {
+        char details[512];
+        snprintf(details, sizeof(details), "FAILOVER: Using replica SS for file %s (primary %s is down)", file, entry.primary_ss);
+        log_message("NM", "FAILOVER", host_out, *port_out, entry.replica_ss, details);
+    }
+    return rc;
+}
+
+// The alive holder of file, primary first; its id goes to ss_id_out
+// unless that is NULL
+static int get_holder(const char *file, char *host_out, int *port_out, int *is_replica, char *ss_id_out)
+{
+    *is_replica = 0;
+
+    // Find file mapping
+    CatalogEntry entry;
+    if (nm_catalog_get(file, &entry) != OK)
+    {
+        return ERR_NOT_FOUND;
+    }
+
+    pthread_mutex_lock(&g_replication_mutex);
+
+    const char *primary_ss = entry.primary_ss;
+    const char *replica_ss = entry.replica_ss;
+
+    // Try primary first
+    for (int j = 0; j < g_ss_count; j++)
+    {
+        if (strcmp(g_ss_nodes[j].ss_id, primary_ss) == 0 && g_ss_nodes[j].alive)
+        {
+            strncpy(host_out, g_ss_nodes[j].host, 63);
+            *port_out = g_ss_nodes[j].client_port;
+            if (ss_id_out)
+                snprintf(ss_id_out, 64, "%s", primary_ss);
+            pthread_mutex_unlock(&g_replication_mutex);
+            return OK;
+        }
+    }
+
+    // Primary failed, try replica
+    if (replica_ss[0] != '\0')
+    {
+        for (int j = 0; j < g_ss_count; j++)
+        {
+            if (strcmp(g_ss_nodes[j].ss_id, replica_ss) == 0 && g_ss_nodes[j].alive)
+            {
+                strncpy(host_out, g_ss_nodes[j].host, 63);
+                *port_out = g_ss_nodes[j].client_port;
+                *is_replica = 1;
+                if (ss_id_out)
+                    snprintf(ss_id_out, 64, "%s", replica_ss);
+                pthread_mutex_unlock(&g_replication_mutex);
+                char details[512];
+                snprintf(details, sizeof(details), "FAILOVER: Using replica SS for file %s (primary %s is down)", file, primary_ss);
+                log_message("NM", "FAILOVER", g_ss_nodes[j].host, g_ss_nodes[j].client_port, replica_ss, details);
+                return OK;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&g_replication_mutex);
+    return ERR_NOT_FOUND; // Both primary and replica are down
+}
+
+int nm_replication_get_ss(const char *file, char *host_out, int *port_out, int *is_replica)
+{
+    return get_holder(file, host_out, port_out, is_replica, NULL);
+}
+
+int nm_replication_get_ss_id(const char *file, char *host_out, int *port_out, char *ss_id_out)
+{
+    int is_replica;
+    return get_holder(file, host_out, port_out, &is_replica, ss_id_out);
+}
+
+int nm_replication_get_any_ss(char *host_out, int *port_out, char *ss_id_out)
+{
+    pthread_mutex_lock(&g_replication_mutex);
+
+    for (int i = 0; i < g_ss_count; i++)
+    {
+        if (g_ss_nodes[i].alive)
+        {
+            strncpy(host_out, g_ss_nodes[i].host, 63);
+            *port_out = g_ss_nodes[i].client_port;
+            if (ss_id_out)
+            {
+                strncpy(ss_id_out, g_ss_nodes[i].ss_id, 63);
+            }
+            pthread_mutex_unlock(&g_replication_mutex);
+            return OK;
+        }
+    }
+
+    pthread_mutex_unlock(&g_replication_mutex);
+    return ERR_NOT_FOUND;
+}
+
+int nm_replication_list_alive(SSNode *out, int max)
+{
+    pthread_mutex_lock(&g_replication_mutex);
+
+    int n = 0;
+    for (int i = 0; i < g_ss_count && n < max; i++)
+    {
+        if (g_ss_nodes[i].alive)
+        {
+            out[n++] = g_ss_nodes[i];
+        }
+    }
+
+    pthread_mutex_unlock(&g_replication_mutex);
+    return n;
+}
+
+void nm_replication_set_alive(const char *ss_ids)
+{
+    pthread_mutex_lock(&g_replication_mutex);
+    int changed = 0;
+    size_t id_len;
+    for (int i = 0; i < g_ss_count; i++)
+    {
+        int alive = 0;
+        for (const char *p = ss_ids; *p && !alive; p += id_len + (p[id_len] == ','))
+        {
+            id_len = strcspn(p, ",");
+            alive = id_len == strlen(g_ss_nodes[i].ss_id) && !strncmp(p, g_ss_nodes[i].ss_id, id_len);
+        }
+        if (alive != g_ss_nodes[i].alive)
+            changed = 1;
+        g_ss_nodes[i].alive = alive;
+        if (alive)
+        {
+            g_ss_nodes[i].last_heartbeat = time(NULL);
+            arrival_reset(&g_arrivals[i], 0);
+        }
+    }
+    pthread_mutex_unlock(&g_replication_mutex);
+    if (changed)
+        nm_catalog_bump_epoch();
+}
+
+int nm_replication_list_all(SSNode *out, int max)
+{
+    pthread_mutex_lock(&g_replication_mutex);
+    int n = g_ss_count < max ? g_ss_count : max;
+    memcpy(out, g_ss_nodes, n * sizeof(SSNode));
+    pthread_mutex_unlock(&g_replication_mutex);
+    return n;
+}
+
+// ==================== ANTI-ENTROPY ====================
+//
+// A primary and its replica each keep a Merkle tree over the primary's
+// files (storageserver/ss_merkle.h). Recovery walks both trees from the
+// root one level per round trip, descending only into nodes that differ,
+// then compares the files behind the differing leaves and has the primary
+// queue just those on its replication stream. The work is proportional to
+// the differences times the tree depth, not to the number of files.
+
+#define RECOVERY_CONNECT_ATTEMPTS 20 // the SS may not be listening yet
+#define RECOVERY_RETRY_MS 250
+#define MERKLE_BATCH 256             // nodes or leaves per request
+#define MERKLE_REPLY_MAX (1 << 17)
+
+static int connect_with_retry(const char *host, int port)
+{
+    for (int attempt = 0; attempt < RECOVERY_CONNECT_ATTEMPTS; attempt++)
+    {
+        int fd = tcp_connect(host, port);
+        if (fd >= 0)
+            return fd;
+        struct timespec delay = {0, RECOVERY_RETRY_MS * 1000000L};
+        nanosleep(&delay, NULL);
+    }
+    return -1;
+}
 
+// Like send_all, but an SS that goes away must not raise SIGPIPE in the NM
+static int send_quietly(int fd, const char *buf, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+        sent += (size_t)n;
+    }
+    return 0;
+}
+
+// One request/reply on fd; the reply is returned only if its status is 0
+static char *tree_request(int fd, const char *request)
+{
+    char *reply = NULL;
+    int status = -1;
+    char line[RESYNC_LINE_MAX + 2048];
+    int len = snprintf(line, sizeof line, "%s\n", request);
+    if (len < 0 || (size_t)len >= sizeof line || send_quietly(fd, line, (size_t)len) != 0 ||
+        recv_line(fd, &reply, MERKLE_REPLY_MAX) <= 0 ||
+        json_get_int(reply, "status", &status) != 0 || status != 0)
+    {
+        free(reply);
+        return NULL;
+    }
+    return reply;
+}
+
+// "n,n,..." for items[start..start+count)
+static void join_numbers(const int *items, int count, char *out, size_t size)
+{
+    size_t used = 0;
+    out[0] = '\0';
+    for (int i = 0; i < count && used < size; i++)
+        used += snprintf(out + used, size - used, "%s%d", i ? "," : "", items[i]);
+}
+
+// Hashes of the given nodes of SS ss_id's tree for origin
+static int fetch_hashes(int fd, const char *ss_id, const char *origin, const int *nodes, int count,
+                        unsigned long long *out)
+{
+    char list[MERKLE_BATCH * 6];
+    char fields[MERKLE_BATCH * 6 + 32];
+    char request[MERKLE_BATCH * 6 + TOKEN_MAX + 256];
+    for (int start = 0; start < count; start += MERKLE_BATCH)
+    {
+        int n = count - start < MERKLE_BATCH ? count - start : MERKLE_BATCH;
+        join_numbers(nodes + start, n, list, sizeof list);
+        snprintf(fields, sizeof fields, ",\"nodes\":\"%s\"", list);
+        if (nm_token_request(request, sizeof request, "NM_MERKLE", "MERKLE", origin, "", ss_id, fields) != 0)
+            return -1;
+        char *reply = tree_request(fd, request);
+        char *hashes = reply ? malloc(MERKLE_BATCH * 17 + 1) : NULL;
+        if (!hashes || json_get_str(reply, "hashes", hashes, MERKLE_BATCH * 17 + 1) != 0)
+        {
+            free(hashes);
+            free(reply);
+            return -1;
+        }
+        char *p = hashes;
+        for (int i = 0; i < n; i++)
+        {
+            out[start + i] = strtoull(p, &p, 16);
+            if (*p == ',')
+                p++;
+        }
+        free(hashes);
+        free(reply);
+    }
+    return 0;
+}
+
+// ";;file|version|digest;;..." for the files behind the given leaves of
+// SS ss_id's tree for origin
+static char *fetch_entries(int fd, const char *ss_id, const char *origin, const int *leaves, int count)
+{
+    size_t size = MERKLE_REPLY_MAX, used = 2;
+    char *all = malloc(size);
+    char *entries = malloc(MERKLE_REPLY_MAX);
+    char list[MERKLE_BATCH * 6];
+    char fields[MERKLE_BATCH * 6 + 32];
+    char request[MERKLE_BATCH * 6 + TOKEN_MAX + 256];
+    if (!all || !entries)
+    {
+        free(all);
+        free(entries);
+        return NULL;
+    }
+    strcpy(all, ";;");
+
+    for (int start = 0; start < count; start += MERKLE_BATCH)
+    {
+        int n = count - start < MERKLE_BATCH ? count - start : MERKLE_BATCH;
+        join_numbers(leaves + start, n, list, sizeof list);
+        snprintf(fields, sizeof fields, ",\"leaves\":\"%s\"", list);
+        char *reply = nm_token_request(request, sizeof request, "NM_MERKLE_LEAVES", "MERKLE_LEAVES", origin, "",
+                                       ss_id, fields) == 0
+                          ? tree_request(fd, request)
+                          : NULL;
+        if (!reply || json_get_str(reply, "entries", entries, MERKLE_REPLY_MAX) != 0)
+        {
+            free(reply);
+            free(entries);
+            free(all);
+            return NULL;
+        }
+        free(reply);
+        size_t len = strlen(entries);
+        if (used + len + 1 > size)
+        {
+            char *bigger = realloc(all, size * 2 + len);
+            if (!bigger)
+            {
+                free(entries);
+                free(all);
+                return NULL;
+            }
+            all = bigger;
+            size = size * 2 + len;
+        }
+        memcpy(all + used, entries, len + 1);
+        used += len;
+    }
+    free(entries);
+    return all;
+}
+
+// Append to files (";"-separated) each entry of from that has no exact
+// match in other; with by_name, only entries whose file other lacks
+static void collect_differences(const char *from, const char *other, int by_name, char *files, size_t size, int *count)
+{
+    char needle[512];
+    for (const char *p = from + 2; *p;)
+    {
+        const char *end = strstr(p, ";;");
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        const char *bar = memchr(p, '|', len);
+        size_t name_len = bar ? (size_t)(bar - p) : len;
+        size_t key_len = by_name ? name_len + 1 : len + 2;
+        if (len > 0 && key_len + 2 < sizeof needle)
+        {
+            // ";;name|" or ";;name|version|digest;;"
+            snprintf(needle, sizeof needle, ";;%.*s%s", (int)(by_name ? name_len : len), p, by_name ? "|" : ";;");
+            char name[300];
+            snprintf(name, sizeof name, "%.*s;", (int)name_len, p);
+            if (!strstr(other, needle) && !strstr(files, name) && strlen(files) + strlen(name) < size)
+            {
+                strcat(files, name);
+                (*count)++;
+            }
+        }
+        if (!end)
+            break;
+        p = end + 2;
+    }
+}
+
+// Queue files (";"-separated) on the replication stream of primary ss_id
+static int send_resync(int fd, const char *ss_id, const char *files)
+{
+    char fields[RESYNC_LINE_MAX + 32];
+    char request[RESYNC_LINE_MAX + TOKEN_MAX + 128];
+    const char *p = files;
+    while (*p)
+    {
+        // Cut at a separator so no name is split
+        size_t len = strlen(p);
+        if (len > RESYNC_LINE_MAX)
+        {
+            len = RESYNC_LINE_MAX;
+            while (len > 0 && p[len - 1] != ';')
+                len--;
+            if (len == 0)
+                return -1;
+        }
+        snprintf(fields, sizeof fields, ",\"files\":\"%.*s\"", (int)len, p);
+        if (nm_token_request(request, sizeof request, "NM_RESYNC", "RESYNC", "", "", ss_id, fields) != 0)
+            return -1;
+        char *reply = tree_request(fd, request);
+        if (!reply)
+            return -1;
+        free(reply);
+        p += len;
+    }
+    return 0;
+}
+
+// Bring replica's copies of primary's files in line; returns how many
+// files were queued, or -1 if either SS could not be reached
+static int anti_entropy(const SSNode *primary, const SSNode *replica)
+{
+    int pfd = connect_with_retry(primary->host, primary->client_port);
+    int rfd = pfd >= 0 ? connect_with_retry(replica->host, replica->client_port) : -1;
+    int *frontier = malloc(2 * MERKLE_LEAVES * sizeof(int));
+    int *differing = malloc(MERKLE_LEAVES * sizeof(int));
+    unsigned long long *ph = malloc(MERKLE_LEAVES * sizeof *ph);
+    unsigned long long *rh = malloc(MERKLE_LEAVES * sizeof *rh);
+    char *files = malloc(MERKLE_REPLY_MAX);
+    int queued = -1;
+    if (pfd < 0 || rfd < 0 || !frontier || !differing || !ph || !rh || !files)
+        goto done;
+
+    // Level by level: each differing node puts its two children on the next
+    int n = 1, m = 0;
+    frontier[0] = 1;
+    for (;;)
+    {
+        if (fetch_hashes(pfd, primary->ss_id, "", frontier, n, ph) != 0 ||
+            fetch_hashes(rfd, replica->ss_id, primary->ss_id, frontier, n, rh) != 0)
+            goto done;
+        m = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (ph[i] != rh[i])
+                differing[m++] = frontier[i];
+        }
+        if (m == 0 || frontier[0] >= MERKLE_LEAVES)
+            break;
+        n = 0;
+        for (int i = 0; i < m; i++)
+        {
+            frontier[n++] = 2 * differing[i];
+            frontier[n++] = 2 * differing[i] + 1;
+        }
+    }
+
+    queued = 0;
+    files[0] = '\0';
+    if (m > 0)
+    {
+        char *pe = fetch_entries(pfd, primary->ss_id, "", differing, m);
+        char *re = pe ? fetch_entries(rfd, replica->ss_id, primary->ss_id, differing, m) : NULL;
+        if (!re)
+        {
+            free(pe);
+            queued = -1;
+            goto done;
+        }
+        // Changed or missing on the replica, then extra on the replica
+        collect_differences(pe, re, 0, files, MERKLE_REPLY_MAX, &queued);
+        collect_differences(re, pe, 1, files, MERKLE_REPLY_MAX, &queued);
+        free(pe);
+        free(re);
+        if (queued > 0 && send_resync(pfd, primary->ss_id, files) != 0)
+            queued = -1;
+    }
+
+    char details[256];
+    // Ids are at most 63 characters, which keeps the line within details
+    snprintf(details, sizeof details, "%.63s -> %.63s: %d differing leaves, %d files queued",
+             primary->ss_id, replica->ss_id, m, queued);
+    log_message("NM", "ANTI_ENTROPY", replica->host, replica->client_port, primary->ss_id, details);
+
+done:
+    if (pfd >= 0)
+        close(pfd);
+    if (rfd >= 0)
+        close(rfd);
+    free(frontier);
+    free(differing);
+    free(ph);
+    free(rh);
+    free(files);
+    return queued;
+}
+
+static void *recovery_thread(void *arg)
+{
+    char *ss_id = arg;
+
+    // ss_id as a replica of its primary, and as the primary of its replica
+    SSNode pairs[2][2];
+    int count = 0;
+    pthread_mutex_lock(&g_replication_mutex);
+    SSNode *node = find_node(ss_id);
+    SSNode *primary = node && node->replica_of[0] ? find_node(node->replica_of) : NULL;
+    if (node && primary && primary->alive)
+    {
+        pairs[count][0] = *primary;
+        pairs[count++][1] = *node;
+    }
+    for (int i = 0; node && i < g_ss_count && count < 2; i++)
+    {
+        if (g_ss_nodes[i].alive && strcmp(g_ss_nodes[i].replica_of, ss_id) == 0)
+        {
+            pairs[count][0] = *node;
+            pairs[count++][1] = g_ss_nodes[i];
+        }
+    }
+    pthread_mutex_unlock(&g_replication_mutex);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (anti_entropy(&pairs[i][0], &pairs[i][1]) < 0)
+            log_message("NM", "ANTI_ENTROPY", pairs[i][1].host, pairs[i][1].client_port, pairs[i][0].ss_id,
+                        "Tree comparison failed; will retry when the SS next recovers");
+    }
+    free(ss_id);
+    return NULL;
+}
+
+int nm_replication_recover_ss(const char *ss_id)
+{
+    char *arg = strdup(ss_id);
+    if (!arg)
+        return ERR_INTERNAL;
     pthread_t thread;
-    pthread_create(&thread, NULL, async_replicate_thread, cmd);
+    if (pthread_create(&thread, NULL, recovery_thread, arg) != 0)
+    {
+        free(arg);
+        return ERR_INTERNAL;
+    }
     pthread_detach(thread);
+    return OK;
+}
+
+// ==================== REPLICATION QUEUE ====================
+//
+// Operations outside the SS replication stream (checkpoints) wait in a
+// bounded queue per primary, indexed like g_ss_nodes. One sender thread
+// drains the queues, shipping up to REPL_QUEUE_BATCH operations per round
+// trip over a persistent connection to each primary's replica. A full
+// queue drops further operations and has the primary resync the files
+// they named instead.
+
+// Mark file for a resync; returns 1 if it was not marked already. Caller
+// holds g_queue_mutex.
+static int queue_overflow(ReplQueue *q, const char *file)
+{
+    char name[300];
+    snprintf(name, sizeof name, "%s;", file);
+    if (q->resync_all || strstr(q->resync, name))
+        return 0;
+    if (strlen(q->resync) + strlen(name) < sizeof q->resync)
+        strcat(q->resync, name);
+    else
+        q->resync_all = 1;
+    return 1;
+}
 
+int nm_replication_async_write(const char *file, const char *operation)
+{
+    CatalogEntry entry;
+    if (nm_catalog_get(file, &entry) != OK || entry.primary_ss[0] == '\0')
+        return ERR_NOT_FOUND;
+    if (strlen(operation) >= REPL_OP_MAX)
+        return ERR_BAD_REQUEST;
+
+    // Nothing to queue for a primary that has no replica at all
+    pthread_mutex_lock(&g_replication_mutex);
+    SSNode *primary = find_node(entry.primary_ss);
+    int slot = primary ? (int)(primary - g_ss_nodes) : -1;
+    int replicated = 0;
+    for (int i = 0; slot >= 0 && i < g_ss_count && !replicated; i++)
+        replicated = strcmp(g_ss_nodes[i].replica_of, entry.primary_ss) == 0;
+    pthread_mutex_unlock(&g_replication_mutex);
+    if (!replicated)
+        return ERR_NOT_FOUND;
+
+    pthread_mutex_lock(&g_queue_mutex);
+    ReplQueue *q = &g_queues[slot];
+    int overflowed = 0;
+    if (q->count == REPL_QUEUE_MAX)
+    {
+        overflowed = queue_overflow(q, file);
+    }
+    else
+    {
+        snprintf(q->ops[(q->head + q->count) % REPL_QUEUE_MAX], REPL_OP_MAX, "%s", operation);
+        q->count++;
+    }
+    pthread_cond_signal(&g_queue_cond);
+    pthread_mutex_unlock(&g_queue_mutex);
+
+    if (overflowed)
+        log_message("NM", "ASYNC_REPLICATION", "127.0.0.1", 5050, entry.primary_ss,
+                    "Replication queue full; file will be resynced instead");
     return OK;
 }
 
+// Next queue with work that is not backing off, round robin; caller holds
+// g_queue_mutex
+static int next_ready_queue(long long now)
+{
+    for (int k = 0; k < MAX_SS; k++)
+    {
+        int i = (g_queue_turn + k) % MAX_SS;
+        ReplQueue *q = &g_queues[i];
+        if ((q->count || q->resync[0] || q->resync_all) && now >= q->retry_at_ms)
+        {
+            g_queue_turn = i + 1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void queue_close(ReplQueue *q)
+{
+    if (q->fd >= 0)
+        close(q->fd);
+    q->fd = -1;
+}
+
+// The NM_ request that has ss_id carry out a queued operation (always a
+// CHECKPOINT), signed as it is sent, so a wait in the queue cannot
+// outlast its token
+static int sign_op(const char *operation, const char *ss_id, char *out, size_t size)
+{
+    char op[32] = "", file[256] = "", user[64] = "", tag[128] = "", ss_op[40], fields[160];
+    json_get_str(operation, "op", op, sizeof op);
+    json_get_str(operation, "file", file, sizeof file);
+    json_get_str(operation, "user", user, sizeof user);
+    json_get_str(operation, "tag", tag, sizeof tag);
+    snprintf(ss_op, sizeof ss_op, "NM_%s", op);
+    snprintf(fields, sizeof fields, ",\"tag\":\"%s\"", tag);
+    return nm_token_request(out, size, ss_op, op, file, user, ss_id, fields);
+}
+
+// Send ops to the replica in one write and read a reply to each; returns
+// 0 once all were answered
+static int queue_deliver(ReplQueue *q, const SSNode *replica, char (*ops)[REPL_OP_MAX], int n)
+{
+    const char *host = replica->host;
+    int port = replica->client_port;
+    if (q->fd >= 0 && (q->port != port || strcmp(q->host, host) != 0))
+        queue_close(q);
+    if (q->fd < 0)
+    {
+        q->fd = tcp_connect(host, port);
+        if (q->fd < 0)
+            return -1;
+        struct timeval timeout = {REPL_QUEUE_TIMEOUT_S, 0};
+        setsockopt(q->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        snprintf(q->host, sizeof q->host, "%s", host);
+        q->port = port;
+    }
+
+    static char batch[REPL_QUEUE_BATCH * (REPL_OP_MAX + TOKEN_MAX + 16)];
+    char request[REPL_OP_MAX + TOKEN_MAX + 16];
+    size_t len = 0;
+    for (int i = 0; i < n; i++)
+    {
+        // One that cannot be signed still gets its (refusing) reply
+        if (sign_op(ops[i], replica->ss_id, request, sizeof request) != 0)
+            snprintf(request, sizeof request, "%.*s", REPL_OP_MAX - 1, ops[i]);
+        len += (size_t)snprintf(batch + len, sizeof batch - len, "%s\n", request);
+    }
+    if (send_quietly(q->fd, batch, len) != 0)
+    {
+        queue_close(q);
+        return -1;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        // A refused operation (say, a file the replica lacks) is answered
+        // and done; anti-entropy brings the file over
+        char *reply = NULL;
+        ssize_t got = recv_line(q->fd, &reply, CONTROL_LINE_MAX);
+        free(reply);
+        if (got <= 0)
+        {
+            queue_close(q);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Have the primary stream the files again; "" asks for a tree comparison
+static int queue_resync(const SSNode *primary, const char *files)
+{
+    if (!files[0])
+        return nm_replication_recover_ss(primary->ss_id);
+    int fd = tcp_connect(primary->host, primary->client_port);
+    if (fd < 0)
+        return -1;
+    int rc = send_resync(fd, primary->ss_id, files);
+    close(fd);
+    return rc;
+}
+
+// Background sender for the replication queues
+void *nm_replication_queue_sender(void *arg)
+{
+    (void)arg;
+    static char ops[REPL_QUEUE_BATCH][REPL_OP_MAX];
+    char resync[RESYNC_LINE_MAX];
+
+    for (;;)
+    {
+        pthread_mutex_lock(&g_queue_mutex);
+        int slot;
+        while ((slot = next_ready_queue(now_ms())) < 0)
+        {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += REPL_QUEUE_RETRY_MS * 1000000L;
+            until.tv_sec += until.tv_nsec / 1000000000L;
+            until.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&g_queue_cond, &g_queue_mutex, &until);
+        }
+        ReplQueue *q = &g_queues[slot];
+        int n = q->count < REPL_QUEUE_BATCH ? q->count : REPL_QUEUE_BATCH;
+        for (int i = 0; i < n; i++)
+            memcpy(ops[i], q->ops[(q->head + i) % REPL_QUEUE_MAX], REPL_OP_MAX);
+        int resync_all = q->resync_all;
+        snprintf(resync, sizeof resync, "%s", resync_all ? "" : q->resync);
+        int want_resync = resync_all || resync[0];
+        q->resync[0] = '\0';
+        q->resync_all = 0;
+        pthread_mutex_unlock(&g_queue_mutex);
+
+        pthread_mutex_lock(&g_replication_mutex);
+        SSNode primary = g_ss_nodes[slot];
+        SSNode replica = {0};
+        int replicated = 0;
+        for (int i = 0; i < g_ss_count && !replicated; i++)
+        {
+            if (strcmp(g_ss_nodes[i].replica_of, primary.ss_id) == 0)
+            {
+                replica = g_ss_nodes[i];
+                replicated = 1;
+            }
+        }
+        pthread_mutex_unlock(&g_replication_mutex);
+
+        // A replica that is down keeps its operations queued; with no
+        // replica at all there is nobody to deliver them to
+        int delivered = 0, failed = 0;
+        if (n && !replicated)
+            delivered = n;
+        else if (n && replica.alive)
+        {
+            if (queue_deliver(q, &replica, ops, n) == 0)
+                delivered = n;
+            else
+                failed = 1;
+        }
+        else if (n)
+            failed = 1;
+
+        if (want_resync && primary.alive && queue_resync(&primary, resync) != 0)
+        {
+            failed = 1;
+        }
+        else if (want_resync && !primary.alive)
+        {
+            failed = 1;
+        }
+        else if (want_resync)
+        {
+            log_message("NM", "ASYNC_REPLICATION", primary.host, primary.client_port, primary.ss_id,
+                        resync_all ? "Queue overflow: reconciling replica by tree comparison"
+                                   : "Queue overflow: resync of dropped files requested");
+            want_resync = 0;
+        }
+
+        pthread_mutex_lock(&g_queue_mutex);
+        q->head = (q->head + delivered) % REPL_QUEUE_MAX;
+        q->count -= delivered;
+        if (want_resync)
+        {
+            // Put the resync back, merged with anything dropped meanwhile
+            if (resync_all)
+            {
+                q->resync_all = 1;
+            }
+            else
+            {
+                char *save = NULL;
+                for (char *tok = strtok_r(resync, ";", &save); tok; tok = strtok_r(NULL, ";", &save))
+                    queue_overflow(q, tok);
+            }
+        }
+        if (failed)
+            q->retry_at_ms = now_ms() + REPL_QUEUE_RETRY_MS;
+        pthread_mutex_unlock(&g_queue_mutex);
+
+        if (delivered && replicated)
+        {
+            char details[128];
+            snprintf(details, sizeof details, "Delivered %d queued operations", delivered);
+            log_message("NM", "ASYNC_REPLICATION", replica.host, replica.client_port, primary.ss_id, details);
+        }
+    }
+    return NULL;
+}
+
 int nm_replication_get_replica_for_ss(const char *primary_ss, char *host_out, int *port_out)
 {
     pthread_mutex_lock(&g_replication_mutex);
@@ -387,8 +1849,11 @@ void *nm_replication_heartbeat_checker(void *arg)
 
     while (1)
     {
-        sleep(HEARTBEAT_CHECK_INTERVAL);
-        nm_replication_check_failures();
+        struct timespec delay = {0, HEARTBEAT_CHECK_INTERVAL_MS * 1000000L};
+        nanosleep(&delay, NULL);
+        // Followers take liveness from the leader
+        if (nm_raft_is_leader())
+            nm_replication_check_failures();
     }
 
     return NULL;
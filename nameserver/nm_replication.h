@@ -2,6 +2,7 @@
 #define NM_REPLICATION_H
 
 #include <time.h>
+#include "nm_placement.h"
 
 // Storage Server tracking with replication
 typedef struct
@@ -13,15 +14,28 @@ typedef struct
     int alive;   // 1 if alive, 0 if dead
     time_t last_heartbeat;
     char replica_of[64]; // If this is a replica, which SS is it replicating?
+    long files;          // Files this SS is primary for
+    long long bytes;     // Bytes stored, reported by the SS
+    double load;         // Requests per second, reported by the SS
+    int active;          // Open client connections, from the latest heartbeat
+    long repl_pending;   // Changes not yet acknowledged by this SS's replica
+    long repl_lag_ms;    // Age of the oldest of them
+    int needs_register;  // Not fully registered since the NM started; heartbeats are refused
+    unsigned long reg_version; // File list version of the SS's last complete registration, 0 if none
 } SSNode;
 
-// File replication mapping
+// One load report from an SS heartbeat
+#define LOAD_HISTORY 60 // samples kept per SS (5 minutes at one per 5 s)
 typedef struct
 {
-    char file[256];
-    char primary_ss[64];
-    char replica_ss[64];
-} FileReplica;
+    time_t at;
+    int active;          // open client connections
+    double qps;          // requests per second over the report window
+    long p99_us;         // 99th percentile request latency
+    long long bytes;     // committed document bytes
+    int files;           // documents in the SS file cache
+    long long free_disk; // bytes free under the SS data directory, -1 if unknown
+} LoadSample;
 
 // Initialize replication system
 void nm_replication_init(void);
@@ -29,26 +43,109 @@ void nm_replication_init(void);
 // Register a storage server
 int nm_replication_register_ss(const char *ss_id, const char *host, int client_port, int nm_port);
 
-// Update heartbeat for SS
+// Update heartbeat for SS. ERR_NOT_FOUND for an SS that has not
+// registered since the NM started, which makes it register again.
 int nm_replication_heartbeat(const char *ss_id);
 
-// Check for failed storage servers
+// Whether ss_id has registered since the NM started (heartbeats and its
+// control channel are refused until it does)
+int nm_replication_is_registered(const char *ss_id);
+
+// Recreate an SS and its pairing from the journal, down until it registers
+int nm_replication_restore_ss(const char *ss_id, const char *host, int client_port, int nm_port,
+                              const char *replica_of, unsigned long reg_version);
+
+// Recompute each SS's primary file count from the catalog
+void nm_replication_recount(void);
+
+// Heartbeat carrying a load report: refreshes the SS's bytes and load and
+// appends the sample to its history
+int nm_replication_report(const char *ss_id, const LoadSample *sample);
+
+// Serve an SS control channel on fd from a background thread; the thread
+// owns and closes fd. heartbeat_ms is the interval the SS announced (0 if
+// unknown) and seeds the failure detector. The SS is failed as soon as its
+// channel closes. Each heartbeat reply names the SS's replica ("replica":
+// "host:port", empty if none), which the SS streams its changes to. The
+// SS also reports on the channel the catalog changes it made for clients
+// that came with a token (SS_NOTIFY), which the NM applies as it would its
+// own.
+int nm_replication_control_channel(int fd, const char *ss_id, int heartbeat_ms);
+
+// Copy up to max of the newest samples for ss_id into out, oldest first.
+// Returns how many were copied.
+int nm_replication_load_history(const char *ss_id, LoadSample *out, int max);
+
+// Check for failed storage servers. An SS with a heartbeat history is
+// failed when its phi-accrual suspicion reaches the threshold; one without
+// falls back to a fixed 15 s timeout.
+#define PHI_DEFAULT_THRESHOLD 8.0
+void nm_replication_set_phi_threshold(double threshold);
 void nm_replication_check_failures(void);
 
-// Map file to primary and replica SS
+// Map file to primary and replica SS in the NM catalog
 int nm_replication_map_file(const char *file, const char *primary_ss);
 int nm_replication_rename_file(const char *old_file, const char *new_file);
+int nm_replication_unmap_file(const char *file);
+
+// Paged SS registration. registration returns the version of the SS's
+// last complete registration, which a delta must start from, and sets
+// *next to the version this one will get. register_files maps a page of
+// files to ss_id as primary (one replica lookup for the page) and marks
+// their catalog entries with that version; unregister_files unmaps those
+// still on ss_id. After a full file list, sweep_files unmaps every file of
+// ss_id marked before the version (files mapped any other way are marked
+// with the time they were mapped). registration_done records the new
+// version, or with 0 makes the SS register again.
+unsigned long nm_replication_registration(const char *ss_id, unsigned long *next);
+int nm_replication_register_files(const char *ss_id, char **files, int count, unsigned long mark);
+int nm_replication_unregister_files(const char *ss_id, char **files, int count);
+int nm_replication_sweep_files(const char *ss_id, unsigned long mark);
+void nm_replication_registration_done(const char *ss_id, unsigned long version);
 
 // Get SS for file (with failover to replica)
 int nm_replication_get_ss(const char *file, char *host_out, int *port_out, int *is_replica);
 
+// Same, naming the SS in ss_id_out (64 bytes)
+int nm_replication_get_ss_id(const char *file, char *host_out, int *port_out, char *ss_id_out);
+
+// Route a read (READ, STREAM) to the primary or to a replica that has
+// caught up with the primary and with min_version (the client's last write
+// to the file, 0 if none), whichever is less busy; *balanced is set when
+// both were candidates. With the primary down a replica is used unless it
+// is known to lack min_version (ERR_BUSY).
+int nm_replication_route_read(const char *file, unsigned long min_version,
+                              char *host_out, int *port_out, int *is_replica, int *balanced);
+
+// Choose an alive SS for a new file with the configured placement strategy
+void nm_replication_set_placement(PlacementStrategy strategy);
+int nm_replication_place_file(const char *file, char *host_out, int *port_out, char *ss_id_out);
+
 // Get any available SS
 int nm_replication_get_any_ss(char *host_out, int *port_out, char *ss_id_out);
 
-// Async write replication
+// Snapshot of alive storage servers; returns how many were copied
+int nm_replication_list_alive(SSNode *out, int max);
+
+// On a follower NM: take which SSes are alive from the leader, given as
+// comma-separated ids. Those listed count as just heard from, so a
+// follower that becomes leader gives them time to reconnect.
+void nm_replication_set_alive(const char *ss_ids);
+
+// Snapshot of every registered storage server, alive or not
+int nm_replication_list_all(SSNode *out, int max);
+
+// Queue operation for the replica of file's primary. File content and ACLs
+// reach replicas through the SS replication stream; this is for state
+// outside it (checkpoints). A full queue has the file resynced instead.
 int nm_replication_async_write(const char *file, const char *operation);
 
-// SS recovery - sync data back
+// Background sender for queued operations, started once by the NM
+void *nm_replication_queue_sender(void *arg);
+
+// Reconcile ss_id with its primary and with its replica in the background
+// by comparing Merkle trees; the primary streams just the files that
+// differ. Run whenever an SS registers or comes back online.
 int nm_replication_recover_ss(const char *ss_id);
 
 // Get replica SS for a primary SS
@@ -1,141 +1,226 @@
 #include "nm_search.h"
+#include "nm_catalog.h"
+#include "../common/proto.h"
 #include <string.h>
 #include <stdlib.h>
-#include <stdio.h>
+#include <pthread.h>
 
-#define HASH_TABLE_SIZE 1024
-#define LRU_CACHE_SIZE 256
-
-// Hash table entry
-typedef struct HashEntry
+// Cache entry; lives on a bucket chain and on the LRU list (or free list)
+typedef struct RouteEntry
 {
   char filename[256];
   char ss_id[64];
-  struct HashEntry *next;
-  unsigned long last_access; // For LRU
-} HashEntry;
-
-// Hash table with chaining
-static HashEntry *hash_table[HASH_TABLE_SIZE];
-static unsigned long access_counter = 0;
+  int negative; // file was not in the catalog
+  unsigned long hash;
+  struct RouteEntry *chain;
+  struct RouteEntry *prev; // towards most recently used
+  struct RouteEntry *next; // towards least recently used
+} RouteEntry;
+
+static RouteEntry *g_pool = NULL;
+static RouteEntry **g_buckets = NULL;
+static size_t g_bucket_mask = 0;
+static RouteEntry *g_head = NULL; // most recently used
+static RouteEntry *g_tail = NULL; // eviction candidate
+static RouteEntry *g_free = NULL;
+static int g_capacity = 0;
+static int g_entries = 0;
+// Bumped by every invalidation, so a lookup that raced with a catalog
+// change does not cache what it read before the change
+static unsigned long g_generation = 0;
+static SearchStats g_stats;
+static pthread_mutex_t g_search_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // Simple hash function (djb2)
 static unsigned long hash_string(const char *str)
 {
   unsigned long hash = 5381;
   int c;
-  while ((c = *str++))
+  while ((c = (unsigned char)*str++))
   {
     hash = ((hash << 5) + hash) + c; // hash * 33 + c
   }
-  return hash % HASH_TABLE_SIZE;
+  return hash;
 }
 
-// Initialize search system
-int nm_search_init(void)
+static void list_unlink(RouteEntry *e)
 {
-  for (int i = 0; i < HASH_TABLE_SIZE; i++)
-  {
-    hash_table[i] = NULL;
-  }
-  access_counter = 0;
-  return 0;
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    g_head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    g_tail = e->prev;
+  e->prev = e->next = NULL;
 }
 
-// Add entry to hash table - O(1) average
-int nm_search_add_entry(const char *filename, const char *ss_id)
+static void list_push_front(RouteEntry *e)
 {
-  if (!filename || !ss_id)
-    return -1;
-
-  unsigned long index = hash_string(filename);
+  e->prev = NULL;
+  e->next = g_head;
+  if (g_head)
+    g_head->prev = e;
+  g_head = e;
+  if (!g_tail)
+    g_tail = e;
+}
 
-  // Check if entry already exists
-  HashEntry *current = hash_table[index];
-  while (current)
+static RouteEntry *find_entry(const char *filename, unsigned long hash)
+{
+  for (RouteEntry *e = g_buckets[hash & g_bucket_mask]; e; e = e->chain)
   {
-    if (strcmp(current->filename, filename) == 0)
-    {
-      // Update existing entry
-      strncpy(current->ss_id, ss_id, sizeof(current->ss_id) - 1);
-      current->ss_id[sizeof(current->ss_id) - 1] = '\0';
-      current->last_access = ++access_counter;
-      return 0;
-    }
-    current = current->next;
+    if (e->hash == hash && !strcmp(e->filename, filename))
+      return e;
   }
+  return NULL;
+}
 
-  // Create new entry
-  HashEntry *new_entry = (HashEntry *)malloc(sizeof(HashEntry));
-  if (!new_entry)
-    return -1;
+static void drop_entry(RouteEntry *e)
+{
+  RouteEntry **link = &g_buckets[e->hash & g_bucket_mask];
+  while (*link != e)
+    link = &(*link)->chain;
+  *link = e->chain;
+  list_unlink(e);
+  e->next = g_free;
+  g_free = e;
+  g_entries--;
+}
 
-  strncpy(new_entry->filename, filename, sizeof(new_entry->filename) - 1);
-  new_entry->filename[sizeof(new_entry->filename) - 1] = '\0';
-  strncpy(new_entry->ss_id, ss_id, sizeof(new_entry->ss_id) - 1);
-  new_entry->ss_id[sizeof(new_entry->ss_id) - 1] = '\0';
-  new_entry->last_access = ++access_counter;
+// Initialize search system
+int nm_search_init(int capacity)
+{
+  if (capacity <= 0)
+    capacity = NM_SEARCH_DEFAULT_CACHE;
+
+  size_t buckets = 1;
+  while (buckets < (size_t)capacity * 2)
+    buckets <<= 1;
 
-  // Insert at head of chain
-  new_entry->next = hash_table[index];
-  hash_table[index] = new_entry;
+  RouteEntry *pool = calloc(capacity, sizeof(RouteEntry));
+  RouteEntry **table = calloc(buckets, sizeof(RouteEntry *));
+  if (!pool || !table)
+  {
+    free(pool);
+    free(table);
+    return -1;
+  }
 
+  pthread_mutex_lock(&g_search_mutex);
+  free(g_pool);
+  free(g_buckets);
+  g_pool = pool;
+  g_buckets = table;
+  g_bucket_mask = buckets - 1;
+  g_capacity = capacity;
+  g_entries = 0;
+  g_head = g_tail = NULL;
+  g_free = NULL;
+  for (int i = capacity - 1; i >= 0; i--)
+  {
+    pool[i].next = g_free;
+    g_free = &pool[i];
+  }
+  memset(&g_stats, 0, sizeof g_stats);
+  pthread_mutex_unlock(&g_search_mutex);
   return 0;
 }
 
-// Lookup entry in hash table - O(1) average
+// Resolve a file to its primary SS - O(1), cached routes first
 int nm_search_lookup(const char *filename, char *ss_id_out, int buflen)
 {
-  if (!filename || !ss_id_out)
+  if (!filename || !ss_id_out || buflen <= 0)
     return -1;
 
-  unsigned long index = hash_string(filename);
+  unsigned long hash = hash_string(filename);
 
-  HashEntry *current = hash_table[index];
-  while (current)
+  pthread_mutex_lock(&g_search_mutex);
+  if (!g_pool)
+  {
+    pthread_mutex_unlock(&g_search_mutex);
+    return -1;
+  }
+  RouteEntry *e = find_entry(filename, hash);
+  if (e)
   {
-    if (strcmp(current->filename, filename) == 0)
+    list_unlink(e);
+    list_push_front(e);
+    int negative = e->negative;
+    if (negative)
     {
-      // Found! Update LRU counter
-      current->last_access = ++access_counter;
-      strncpy(ss_id_out, current->ss_id, buflen - 1);
+      g_stats.negative_hits++;
+    }
+    else
+    {
+      g_stats.hits++;
+      strncpy(ss_id_out, e->ss_id, buflen - 1);
       ss_id_out[buflen - 1] = '\0';
-      return 0;
     }
-    current = current->next;
+    pthread_mutex_unlock(&g_search_mutex);
+    return negative ? -1 : 0;
   }
+  g_stats.misses++;
+  unsigned long generation = g_generation;
+  pthread_mutex_unlock(&g_search_mutex);
+
+  CatalogEntry entry;
+  int found = nm_catalog_get(filename, &entry) == OK;
 
-  return -1; // Not found
+  pthread_mutex_lock(&g_search_mutex);
+  if (generation == g_generation && !find_entry(filename, hash))
+  {
+    if (!g_free)
+    {
+      drop_entry(g_tail);
+      g_stats.evictions++;
+    }
+    e = g_free;
+    g_free = e->next;
+    strncpy(e->filename, filename, sizeof(e->filename) - 1);
+    e->filename[sizeof(e->filename) - 1] = '\0';
+    strncpy(e->ss_id, found ? entry.primary_ss : "", sizeof(e->ss_id) - 1);
+    e->ss_id[sizeof(e->ss_id) - 1] = '\0';
+    e->negative = !found;
+    e->hash = hash;
+    e->chain = g_buckets[hash & g_bucket_mask];
+    g_buckets[hash & g_bucket_mask] = e;
+    list_push_front(e);
+    g_entries++;
+  }
+  pthread_mutex_unlock(&g_search_mutex);
+
+  if (!found)
+    return -1; // Not found
+
+  strncpy(ss_id_out, entry.primary_ss, buflen - 1);
+  ss_id_out[buflen - 1] = '\0';
+  return 0;
 }
 
-// Remove entry from hash table
-int nm_search_remove_entry(const char *filename)
+void nm_search_invalidate(const char *filename)
 {
   if (!filename)
-    return -1;
+    return;
 
-  unsigned long index = hash_string(filename);
-  HashEntry *current = hash_table[index];
-  HashEntry *prev = NULL;
-
-  while (current)
+  unsigned long hash = hash_string(filename);
+  pthread_mutex_lock(&g_search_mutex);
+  g_generation++;
+  if (g_pool)
   {
-    if (strcmp(current->filename, filename) == 0)
-    {
-      if (prev)
-      {
-        prev->next = current->next;
-      }
-      else
-      {
-        hash_table[index] = current->next;
-      }
-      free(current);
-      return 0;
-    }
-    prev = current;
-    current = current->next;
+    RouteEntry *e = find_entry(filename, hash);
+    if (e)
+      drop_entry(e);
   }
+  pthread_mutex_unlock(&g_search_mutex);
+}
 
-  return -1;
+void nm_search_stats(SearchStats *out)
+{
+  pthread_mutex_lock(&g_search_mutex);
+  *out = g_stats;
+  out->entries = g_entries;
+  out->capacity = g_capacity;
+  pthread_mutex_unlock(&g_search_mutex);
 }
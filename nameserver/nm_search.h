@@ -1,13 +1,30 @@
 #ifndef NM_SEARCH_H
 #define NM_SEARCH_H
 
-// Placeholder for search functionality (HashMap + LRU)
-// To be implemented by Saharsh
+// File route lookup. Placements live in the NM catalog (nm_catalog.h);
+// this resolves a file name to the id of its primary storage server
+// through a bounded LRU cache (HashMap + LRU). Lookups of files that do
+// not exist are cached too, so repeated misses stay off the catalog.
 
-int nm_search_init(void);
-int nm_search_add_entry(const char *filename, const char *ss_id);
+#define NM_SEARCH_DEFAULT_CACHE 4096
+
+typedef struct
+{
+  unsigned long hits;          // served from a cached route
+  unsigned long negative_hits; // served from a cached "not found"
+  unsigned long misses;        // resolved through the catalog
+  unsigned long evictions;
+  int entries;
+  int capacity;
+} SearchStats;
+
+// capacity <= 0 uses NM_SEARCH_DEFAULT_CACHE
+int nm_search_init(int capacity);
 int nm_search_lookup(const char *filename, char *ss_id_out, int buflen);
-int nm_search_remove_entry(const char *filename);
 
-#endif
+// Drop the cached route for filename; must follow every catalog change
+void nm_search_invalidate(const char *filename);
 
+void nm_search_stats(SearchStats *out);
+
+#endif
@@ -0,0 +1,41 @@
+#include "nm_token.h"
+#include "nm_catalog.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static unsigned char g_key[SHA256_BYTES];
+static long g_ttl = NM_TOKEN_TTL_DEFAULT;
+
+int nm_token_init(void)
+{
+  if (token_key_derive(getenv("NM_TOKEN_KEY"), g_key) != 0)
+    return -1;
+  const char *ttl = getenv("NM_TOKEN_TTL");
+  if (ttl && atol(ttl) > 0)
+    g_ttl = atol(ttl);
+  return 0;
+}
+
+const unsigned char *nm_token_key(void)
+{
+  return g_key;
+}
+
+int nm_token_sign(const char *file, const char *user, const char *ss_id, const char *ops, unsigned long epoch,
+                  char *out, size_t size, time_t *expires)
+{
+  *expires = time(NULL) + g_ttl;
+  return token_sign(g_key, file, user, ss_id, ops, epoch, *expires, out, size);
+}
+
+int nm_token_request(char *out, size_t size, const char *ss_op, const char *op, const char *file, const char *user,
+                     const char *ss_id, const char *fields)
+{
+  char ops[2] = {token_op(op), '\0'}, token[TOKEN_MAX];
+  time_t expires;
+  if (nm_token_sign(file, user, ss_id, ops, nm_catalog_epoch(), token, sizeof token, &expires) != 0)
+    return -1;
+  int n = snprintf(out, size, "{\"op\":\"%s\",\"file\":\"%s\",\"user\":\"%s\",\"token\":\"%s\"%s}",
+                   ss_op, file, user, token, fields);
+  return n < 0 || (size_t)n >= size ? -1 : 0;
+}
@@ -0,0 +1,33 @@
+#ifndef NM_TOKEN_H
+#define NM_TOKEN_H
+#include <stddef.h>
+#include <time.h>
+#include "../common/token.h"
+
+// The NM's side of the capability tokens in common/token.h: the key it
+// shares with the storage servers, and the tokens it signs with it. Those
+// go to clients with a control route, and on every request the NM itself
+// sends an SS to change or reveal a file (NM_CREATE, NM_MOVE, ...), which
+// the SS takes from no one else.
+
+#define NM_TOKEN_TTL_DEFAULT 30 // seconds
+
+// Derive the key from the NM_TOKEN_KEY secret and take the lifetime from
+// NM_TOKEN_TTL. Returns 0, or -1 if the secret is unset.
+int nm_token_init(void);
+
+const unsigned char *nm_token_key(void);
+
+// Sign a token for user to run ops on file at ss_id, issued at epoch and
+// valid for the configured lifetime, which ends at *expires. Returns 0, or
+// -1 if out is too small.
+int nm_token_sign(const char *file, const char *user, const char *ss_id, const char *ops, unsigned long epoch,
+                  char *out, size_t size, time_t *expires);
+
+// The request line {"op":ss_op,"file":..,"user":..,"token":..<fields>}
+// that has ss_id carry out user's op on file, signed with the current
+// routing epoch; fields are the request's other fields, each with a
+// leading comma. Returns 0, or -1 if out is too small.
+int nm_token_request(char *out, size_t size, const char *ss_op, const char *op, const char *file, const char *user,
+                     const char *ss_id, const char *fields);
+#endif
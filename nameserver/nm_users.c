@@ -0,0 +1,223 @@
+#include "nm_users.h"
+#include "nm_journal.h"
+#include "../common/proto.h"
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define INITIAL_USERS 256 // power of two
+#define MAX_LOAD_PERCENT 50
+
+// Users live in g_users in the order they first connected and are never
+// removed, so a page cursor is just an index into it. g_slots is an open
+// addressing index over it; a slot holds the user's index + 1, 0 if empty.
+typedef struct
+{
+  unsigned long hash;
+  size_t user;
+} Slot;
+
+static UserInfo *g_users = NULL;
+static size_t g_count = 0;
+static size_t g_user_capacity = 0;
+static Slot *g_slots = NULL;
+static size_t g_capacity = 0; // slots
+static size_t g_connected = 0;
+static pthread_mutex_t g_users_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// djb2, same as the rest of the NM
+static unsigned long hash_name(const char *name)
+{
+  unsigned long hash = 5381;
+  int c;
+  while ((c = (unsigned char)*name++))
+    hash = ((hash << 5) + hash) + c;
+  return hash;
+}
+
+// Index of the slot holding user, or of the empty slot where it would go
+static size_t probe(const char *user, unsigned long hash, int *found)
+{
+  size_t mask = g_capacity - 1;
+  size_t i = hash & mask;
+  while (g_slots[i].user)
+  {
+    if (g_slots[i].hash == hash && !strcmp(g_users[g_slots[i].user - 1].name, user))
+    {
+      *found = 1;
+      return i;
+    }
+    i = (i + 1) & mask;
+  }
+  *found = 0;
+  return i;
+}
+
+static int grow_slots(void)
+{
+  size_t new_capacity = g_capacity ? g_capacity * 2 : INITIAL_USERS * 2;
+  Slot *slots = calloc(new_capacity, sizeof(Slot));
+  if (!slots)
+    return -1;
+
+  size_t mask = new_capacity - 1;
+  for (size_t i = 0; i < g_capacity; i++)
+  {
+    if (!g_slots[i].user)
+      continue;
+    size_t j = g_slots[i].hash & mask;
+    while (slots[j].user)
+      j = (j + 1) & mask;
+    slots[j] = g_slots[i];
+  }
+
+  free(g_slots);
+  g_slots = slots;
+  g_capacity = new_capacity;
+  return 0;
+}
+
+// The user's entry, added if add is set; NULL if unknown or out of
+// memory. Caller holds g_users_mutex.
+static UserInfo *find_user(const char *user, int add)
+{
+  if (!user || !user[0] || !g_capacity)
+    return NULL;
+  unsigned long hash = hash_name(user);
+  int found;
+  size_t i = probe(user, hash, &found);
+  if (found)
+    return &g_users[g_slots[i].user - 1];
+  if (!add)
+    return NULL;
+
+  if ((g_count + 1) * 100 > g_capacity * MAX_LOAD_PERCENT)
+  {
+    if (grow_slots() != 0)
+      return NULL;
+    i = probe(user, hash, &found);
+  }
+  if (g_count == g_user_capacity)
+  {
+    size_t capacity = g_user_capacity ? g_user_capacity * 2 : INITIAL_USERS;
+    UserInfo *users = realloc(g_users, capacity * sizeof *users);
+    if (!users)
+      return NULL;
+    g_users = users;
+    g_user_capacity = capacity;
+  }
+
+  UserInfo *info = &g_users[g_count];
+  memset(info, 0, sizeof *info);
+  strncpy(info->name, user, sizeof info->name - 1);
+  info->first_seen = time(NULL);
+  g_slots[i].hash = hash;
+  g_slots[i].user = ++g_count;
+  return info;
+}
+
+int nm_users_init(void)
+{
+  pthread_mutex_lock(&g_users_mutex);
+  free(g_users);
+  free(g_slots);
+  g_users = NULL;
+  g_slots = NULL;
+  g_count = g_user_capacity = g_capacity = g_connected = 0;
+  int rc = grow_slots();
+  pthread_mutex_unlock(&g_users_mutex);
+  return rc == 0 ? OK : ERR_INTERNAL;
+}
+
+int nm_users_connect(const char *user, const char *host, int port)
+{
+  pthread_mutex_lock(&g_users_mutex);
+  UserInfo *info = find_user(user, 1);
+  if (!info)
+  {
+    pthread_mutex_unlock(&g_users_mutex);
+    return ERR_INTERNAL;
+  }
+  if (info->sessions++ == 0)
+  {
+    g_connected++;
+    nm_journal_record("{\"t\":\"user\",\"user\":\"%s\",\"on\":1}", info->name);
+  }
+  info->last_seen = time(NULL);
+  strncpy(info->host, host ? host : "", sizeof info->host - 1);
+  info->port = port;
+  pthread_mutex_unlock(&g_users_mutex);
+  return OK;
+}
+
+int nm_users_disconnect(const char *user)
+{
+  pthread_mutex_lock(&g_users_mutex);
+  UserInfo *info = find_user(user, 0);
+  int rc = ERR_NOT_FOUND;
+  if (info && info->sessions > 0)
+  {
+    info->last_seen = time(NULL);
+    if (--info->sessions == 0)
+    {
+      g_connected--;
+      nm_journal_record("{\"t\":\"user\",\"user\":\"%s\",\"on\":0}", info->name);
+    }
+    rc = OK;
+  }
+  pthread_mutex_unlock(&g_users_mutex);
+  return rc;
+}
+
+void nm_users_touch(const char *user)
+{
+  pthread_mutex_lock(&g_users_mutex);
+  UserInfo *info = find_user(user, 0);
+  if (info)
+    info->last_seen = time(NULL);
+  pthread_mutex_unlock(&g_users_mutex);
+}
+
+void nm_users_restore(const char *user, int connected)
+{
+  pthread_mutex_lock(&g_users_mutex);
+  UserInfo *info = find_user(user, connected);
+  if (info)
+  {
+    if (connected && info->sessions == 0)
+    {
+      info->sessions = 1;
+      info->last_seen = time(NULL);
+      g_connected++;
+    }
+    else if (!connected && info->sessions > 0)
+    {
+      info->sessions = 0;
+      g_connected--;
+    }
+  }
+  pthread_mutex_unlock(&g_users_mutex);
+}
+
+int nm_users_page(size_t *cursor, int connected_only, UserInfo *out, int max)
+{
+  pthread_mutex_lock(&g_users_mutex);
+  int n = 0;
+  size_t i = *cursor;
+  for (; i < g_count && n < max; i++)
+  {
+    if (!connected_only || g_users[i].sessions > 0)
+      out[n++] = g_users[i];
+  }
+  *cursor = i;
+  pthread_mutex_unlock(&g_users_mutex);
+  return n;
+}
+
+size_t nm_users_connected(void)
+{
+  pthread_mutex_lock(&g_users_mutex);
+  size_t n = g_connected;
+  pthread_mutex_unlock(&g_users_mutex);
+  return n;
+}
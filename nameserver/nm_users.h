@@ -0,0 +1,47 @@
+#ifndef NM_USERS_H
+#define NM_USERS_H
+
+#include <stddef.h>
+#include <time.h>
+
+// Every user that has connected to the NM, kept in a hash set. A user is
+// connected while it has open CLI sessions; one that has left keeps its
+// entry, so its last-seen time stays known.
+typedef struct
+{
+  char name[64];
+  int sessions;       // open CLI sessions, 0 once the user has left
+  time_t first_seen;  // first session since the NM started
+  time_t last_seen;   // latest request
+  char host[64];      // where the latest session connected from
+  int port;
+} UserInfo;
+
+int nm_users_init(void);
+
+// A CLI session for user opened from host:port. Returns OK, or
+// ERR_INTERNAL when the registry could not grow.
+int nm_users_connect(const char *user, const char *host, int port);
+
+// One of user's sessions closed. Returns OK, or ERR_NOT_FOUND when user
+// has none open.
+int nm_users_disconnect(const char *user);
+
+// Note a request from a known user
+void nm_users_touch(const char *user);
+
+// Set user's presence from the journal: connected with one session, or
+// left
+void nm_users_restore(const char *user, int connected);
+
+// Copy up to max users into out, in the order they first connected,
+// starting at *cursor (0 for the first page) and advancing it. With
+// connected_only, users that have left are skipped. Returns how many were
+// copied; 0 once the cursor has passed the last user. Users arriving
+// between pages are picked up by later ones.
+int nm_users_page(size_t *cursor, int connected_only, UserInfo *out, int max);
+
+// Users with open sessions
+size_t nm_users_connected(void);
+
+#endif
@@ -5,6 +5,8 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
 #include <pthread.h>
 #include <dirent.h>
 #include <netinet/in.h>
@@ -13,36 +15,97 @@
 #include "../common/jsonl.h"
 #include "../common/proto.h"
 #include "../common/log.h"
+#include "../common/token.h"
 #include "ss_files.h"
+#include "ss_chunks.h"
+#include "ss_stream.h"
+#include "ss_stats.h"
+#include "ss_replicate.h"
+#include "ss_merkle.h"
+#include "ss_notify.h"
 
 #define SS_LOGFILE "storageserver/ss.log"
+#define REG_MANIFEST "storageserver/data/registered" // file list of the last registration
+#define GREP_MAX_HITS 500
 
 static const char *NM_HOST = "192.168.1.102";
 static int NM_PORT = 5050;
+static NMTarget g_nm; // NM_HOST:NM_PORT, or the leader of the NM_PEERS cluster
+#define NM_REDIRECTS 10 // leaders followed per registration, covering an election
 static const char *SS_ID = "ss-1";
 static int SS_CLIENT_PORT = 6001;
 static int SS_NM_PORT = 6000;
+static int g_heartbeat_ms = 200;         // NM failure detection scales with this
+#define LOAD_REPORT_MS 5000              // load reports ride on every Nth heartbeat
+#define NM_LINE_MAX 8192                 // longest line the NM reads
+#define CONTROL_LINE_MAX 4096            // longest control channel line
+#define MERKLE_REQUEST_MAX 256           // tree nodes or leaves per anti-entropy request
+#define MERKLE_ENTRIES_MAX 65536         // reply buffer for MERKLE_LEAVES
 
-static void append_file_to_list(char *file_list, size_t file_list_size, const char *entry, int *first)
+// Key for the tokens the NM signs, derived from NM_TOKEN_KEY, and their
+// epoch floor, taken from the control channel ack
+static unsigned char g_token_key[SHA256_BYTES];
+static unsigned long g_token_epoch = 0;
+static pthread_mutex_t g_token_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Like send_line, but a dead NM must not raise SIGPIPE in the SS
+static int control_send(int fd, const char *msg)
 {
-  if (!file_list || !entry || file_list_size == 0 || !first)
-    return;
+  char buf[NM_LINE_MAX];
+  int len = snprintf(buf, sizeof buf, "%s\n", msg);
+  if (len < 0 || len >= (int)sizeof buf)
+    return -1;
+  int sent = 0;
+  while (sent < len)
+  {
+    ssize_t n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+    if (n <= 0)
+      return -1;
+    sent += (int)n;
+  }
+  return 0;
+}
+
+// File names for registration, from disk or from the manifest
+typedef struct
+{
+  char **names;
+  int count;
+  int cap;
+} NameList;
 
-  if (!*first)
+static int name_list_add(NameList *list, const char *name)
+{
+  if (list->count == list->cap)
   {
-    size_t remaining = file_list_size - strlen(file_list) - 1;
-    if (remaining > 0)
-      strncat(file_list, ",", remaining);
+    int cap = list->cap ? list->cap * 2 : 256;
+    char **names = realloc(list->names, cap * sizeof *names);
+    if (!names)
+      return -1;
+    list->names = names;
+    list->cap = cap;
   }
+  list->names[list->count] = strdup(name);
+  if (!list->names[list->count])
+    return -1;
+  list->count++;
+  return 0;
+}
 
-  size_t remaining = file_list_size - strlen(file_list) - 1;
-  if (remaining > 0)
-    strncat(file_list, entry, remaining);
+static void name_list_free(NameList *list)
+{
+  for (int i = 0; i < list->count; i++)
+    free(list->names[i]);
+  free(list->names);
+  memset(list, 0, sizeof *list);
+}
 
-  *first = 0;
+static int compare_names(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
 }
 
-static void scan_dir(const char *base_path, const char *rel_path, char *file_list, size_t file_list_size, int *first)
+static void scan_dir(const char *base_path, const char *rel_path, NameList *files)
 {
   char full_path[512];
   snprintf(full_path, sizeof(full_path), "%s%s%s", base_path,
@@ -72,7 +135,7 @@ static void scan_dir(const char *base_path, const char *rel_path, char *file_lis
                rel_path && rel_path[0] ? rel_path : "",
                (rel_path && rel_path[0]) ? "/" : "",
                entry->d_name);
-      scan_dir(base_path, new_rel_path, file_list, file_list_size, first);
+      scan_dir(base_path, new_rel_path, files);
     }
     else if (S_ISREG(st.st_mode))
     {
@@ -81,92 +144,587 @@ static void scan_dir(const char *base_path, const char *rel_path, char *file_lis
         snprintf(entry_name, sizeof(entry_name), "%s/%s", rel_path, entry->d_name);
       else
         snprintf(entry_name, sizeof(entry_name), "%s", entry->d_name);
-      append_file_to_list(file_list, file_list_size, entry_name, first);
+      // Copies replicated from another SS are that SS's to register; names
+      // a registration page cannot carry are skipped
+      if (!ss_files_is_replica_copy(entry_name) && !strpbrk(entry_name, ",\"\\"))
+        name_list_add(files, entry_name);
     }
   }
 
   closedir(dir);
 }
 
-static void register_with_nm(void)
+// Load the file list of the last registration the NM completed (sorted,
+// one name per line after its version). Returns the version, 0 if none.
+static unsigned long load_manifest(NameList *files)
 {
-  int fd = -1;
-  int retries = 10;
-
-  // Retry connection to NM with backoff
-  while (retries-- > 0)
+  FILE *f = fopen(REG_MANIFEST, "r");
+  if (!f)
+    return 0;
+  unsigned long version = 0;
+  char line[600];
+  if (fgets(line, sizeof line, f) && sscanf(line, "%lu", &version) == 1)
   {
-    fd = tcp_connect(NM_HOST, NM_PORT);
-    if (fd >= 0)
-      break;
-    printf("[SS] Waiting for Name Server... (retries left: %d)\n", retries);
-    sleep(1);
+    while (fgets(line, sizeof line, f))
+    {
+      line[strcspn(line, "\n")] = '\0';
+      if (line[0] && name_list_add(files, line) != 0)
+      {
+        version = 0;
+        break;
+      }
+    }
   }
+  fclose(f);
+  return version;
+}
 
-  if (fd < 0)
+static void save_manifest(unsigned long version, const NameList *files)
+{
+  const char *tmp = REG_MANIFEST ".tmp";
+  FILE *f = fopen(tmp, "w");
+  if (!f)
+    return;
+  int failed = fprintf(f, "%lu\n", version) < 0;
+  for (int i = 0; i < files->count && !failed; i++)
+    failed = fprintf(f, "%s\n", files->names[i]) < 0;
+  failed = fflush(f) != 0 || fsync(fileno(f)) != 0 || failed;
+  if (fclose(f) != 0 || failed || rename(tmp, REG_MANIFEST) != 0)
+    unlink(tmp);
+}
+
+// Send names in REG_FILES or REG_REMOVE pages, waiting for each to be
+// acked with the advanced cursor
+static int send_pages(int fd, const char *op, char **names, int count, long long *cursor)
+{
+  char files[REG_PAGE_BYTES + 1];
+  char msg[NM_LINE_MAX];
+  int i = 0;
+  while (i < count)
   {
-    fprintf(stderr, "[SS] Failed to connect to Name Server after retries\n");
-    exit(1);
+    size_t used = 0;
+    int n = 0;
+    while (i < count && n < REG_PAGE_NAMES)
+    {
+      size_t len = strlen(names[i]);
+      if (used + len + 1 > REG_PAGE_BYTES)
+        break;
+      if (n)
+        files[used++] = ',';
+      memcpy(files + used, names[i], len);
+      used += len;
+      n++;
+      i++;
+    }
+    files[used] = '\0';
+    snprintf(msg, sizeof msg, "{\"op\":\"%s\",\"cursor\":%lld,\"files\":\"%s\"}", op, *cursor, files);
+
+    char *resp = NULL;
+    int status = -1;
+    long long acked = -1;
+    if (control_send(fd, msg) == 0 && recv_line(fd, &resp, 1024) > 0)
+    {
+      json_get_int(resp, "status", &status);
+      json_get_long(resp, "cursor", &acked);
+    }
+    free(resp);
+    if (status != OK || acked != *cursor + n)
+      return -1;
+    *cursor = acked;
   }
+  return 0;
+}
 
-  printf("[SS] Connected to Name Server\n");
+// Open a session with the NM (SS_REGISTER, SS_CONTROL) with msg, answering
+// its challenge with proof that this SS holds the token key. Returns the
+// NM's reply to the session (ack, redirect or refusal), or NULL.
+static char *nm_handshake(int fd, const char *msg)
+{
+  char *resp = NULL;
+  if (control_send(fd, msg) != 0 || recv_line(fd, &resp, 1024) <= 0)
+  {
+    free(resp);
+    return NULL;
+  }
+  char op[32] = "", challenge[TOKEN_KEY_HEX] = "";
+  json_get_str(resp, "op", op, sizeof op);
+  if (strcmp(op, "NM_CHALLENGE") != 0)
+    return resp;
+  json_get_str(resp, "challenge", challenge, sizeof challenge);
+  free(resp);
+  resp = NULL;
 
-  // Determine local IP address used for this connection
-  char local_ip[INET_ADDRSTRLEN] = "127.0.0.1";
-  struct sockaddr_in local_addr;
-  socklen_t local_len = sizeof(local_addr);
-  if (getsockname(fd, (struct sockaddr *)&local_addr, &local_len) == 0)
+  char proof[TOKEN_KEY_HEX], reply[128];
+  token_prove(g_token_key, TOKEN_PROOF_NM, SS_ID, challenge, proof);
+  snprintf(reply, sizeof reply, "{\"op\":\"SS_AUTH\",\"proof\":\"%s\"}", proof);
+  if (control_send(fd, reply) != 0 || recv_line(fd, &resp, 1024) <= 0)
   {
-    inet_ntop(AF_INET, &local_addr.sin_addr, local_ip, sizeof local_ip);
+    free(resp);
+    return NULL;
   }
+  int status = 0;
+  json_get_int(resp, "status", &status);
+  if (status == ERR_UNAUTHORIZED)
+    fprintf(stderr, "[SS] Name Server refused this SS; is NM_TOKEN_KEY the one it was started with?\n");
+  return resp;
+}
 
+// Register this SS and the files it is primary for. The NM gets the list
+// in pages; when it still has the list this SS last registered (the
+// manifest's version), only the files added and removed since.
+static void register_with_nm(void)
+{
   // Build list of actual files from disk (recursively scan directories)
-  char file_list[4096] = "";
-  int first = 1;
-  scan_dir("storageserver/data/files", "", file_list, sizeof(file_list), &first);
-
-  // Register with NM (send simple comma-separated list, not JSON array)
-  char *msg = jsonl_build("{\"op\":\"SS_REGISTER\",\"ss_id\":\"%s\",\"ss_client_port\":%d,\"ss_nm_port\":%d,\"ss_host\":\"%s\",\"files\":\"%s\"}",
-                          SS_ID, SS_CLIENT_PORT, SS_NM_PORT, local_ip, file_list);
-  send_line(fd, msg);
+  NameList files = {0}, registered = {0};
+  scan_dir("storageserver/data/files", "", &files);
+  qsort(files.names, files.count, sizeof *files.names, compare_names);
+  unsigned long since = load_manifest(&registered);
+
+  int fd = -1;
+  char msg[NM_LINE_MAX];
   char *line = NULL;
-  recv_line(fd, &line, 8192);
-  if (line)
+  char mode[16] = "";
+  for (int redirects = 0;; redirects++)
+  {
+    // Retry connection to NM with backoff
+    int retries = 10;
+    while (retries-- > 0)
+    {
+      fd = nm_target_connect(&g_nm);
+      if (fd >= 0)
+        break;
+      printf("[SS] Waiting for Name Server... (retries left: %d)\n", retries);
+      sleep(1);
+    }
+
+    if (fd < 0)
+    {
+      fprintf(stderr, "[SS] Failed to connect to Name Server after retries\n");
+      exit(1);
+    }
+
+    printf("[SS] Connected to Name Server\n");
+
+    // Determine local IP address used for this connection
+    char local_ip[INET_ADDRSTRLEN] = "127.0.0.1";
+    struct sockaddr_in local_addr;
+    socklen_t local_len = sizeof(local_addr);
+    if (getsockname(fd, (struct sockaddr *)&local_addr, &local_len) == 0)
+    {
+      inet_ntop(AF_INET, &local_addr.sin_addr, local_ip, sizeof local_ip);
+    }
+
+    snprintf(msg, sizeof msg,
+             "{\"op\":\"SS_REGISTER\",\"ss_id\":\"%s\",\"ss_client_port\":%d,\"ss_nm_port\":%d,\"ss_host\":\"%s\",\"since\":%lu}",
+             SS_ID, SS_CLIENT_PORT, SS_NM_PORT, local_ip, since);
+    line = nm_handshake(fd, msg);
+    if (line)
+      json_get_str(line, "mode", mode, sizeof mode);
+    // A follower NM names the leader to register with
+    int redirected = redirects < NM_REDIRECTS && nm_target_redirect(&g_nm, line);
+    free(line);
+    line = NULL;
+    if (!redirected)
+      break;
+    close(fd);
+  }
+  int delta = !strcmp(mode, "delta");
+
+  // Both lists are sorted; a merge yields what changed since the manifest
+  char **added = files.names, **removed = NULL;
+  int add_count = files.count, remove_count = 0;
+  if (delta)
+  {
+    added = malloc((files.count + 1) * sizeof *added);
+    removed = malloc((registered.count + 1) * sizeof *removed);
+    add_count = 0;
+    int i = 0, j = 0;
+    while (added && removed && (i < files.count || j < registered.count))
+    {
+      int cmp = i == files.count ? 1 : j == registered.count ? -1 : strcmp(files.names[i], registered.names[j]);
+      if (cmp < 0)
+        added[add_count++] = files.names[i++];
+      else if (cmp > 0)
+        removed[remove_count++] = registered.names[j++];
+      else
+        i++, j++;
+    }
+  }
+
+  long long cursor = 0;
+  unsigned long version = 0;
+  if (mode[0] && (!delta || (added && removed)) &&
+      send_pages(fd, "REG_FILES", added, add_count, &cursor) == 0 &&
+      send_pages(fd, "REG_REMOVE", removed, remove_count, &cursor) == 0)
   {
-    printf("[SS] NM reply: %s\n", line);
+    snprintf(msg, sizeof msg, "{\"op\":\"REG_END\",\"cursor\":%lld}", cursor);
+    long long v = 0;
+    if (control_send(fd, msg) == 0 && recv_line(fd, &line, 1024) > 0 && json_get_long(line, "version", &v) == 0)
+      version = (unsigned long)v;
     free(line);
   }
   close(fd);
+
+  if (version)
+  {
+    save_manifest(version, &files);
+    printf("[SS] Registered %d files with the Name Server (%s: %d sent, %d removed)\n",
+           files.count, delta ? "delta" : "full", add_count, remove_count);
+  }
+  else
+  {
+    fprintf(stderr, "[SS] Registration with the Name Server failed; retrying on the next heartbeat\n");
+  }
+  if (delta)
+  {
+    free(added);
+    free(removed);
+  }
+  name_list_free(&files);
+  name_list_free(&registered);
+}
+
+// Open the control channel: one long-lived connection to the NM that
+// carries every heartbeat and its load report
+static int open_control_channel(void)
+{
+  int fd = nm_target_connect(&g_nm);
+  if (fd < 0)
+    return -1;
+
+  // An NM that stops answering is treated like one that closed the channel
+  struct timeval timeout = {10, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+  char msg[256];
+  snprintf(msg, sizeof msg, "{\"op\":\"SS_CONTROL\",\"ss_id\":\"%s\",\"heartbeat_ms\":%d}", SS_ID, g_heartbeat_ms);
+  char *resp = nm_handshake(fd, msg);
+  int status = -1;
+  if (resp && !nm_target_redirect(&g_nm, resp))
+  {
+    status = 0;
+    json_get_int(resp, "status", &status);
+  }
+  if (status != 0)
+  {
+    // After a redirect the next beat opens the channel to the leader; an
+    // NM that does not know this SS (it restarted) takes a registration
+    free(resp);
+    close(fd);
+    if (status == ERR_NOT_FOUND)
+      register_with_nm();
+    return -1;
+  }
+
+  long long epoch = 0;
+  json_get_long(resp, "epoch", &epoch);
+  free(resp);
+  pthread_mutex_lock(&g_token_mutex);
+  g_token_epoch = (unsigned long)epoch;
+  pthread_mutex_unlock(&g_token_mutex);
+
+  printf("[SS] Control channel to Name Server open\n");
+  return fd;
+}
+
+static void notify_nm(const char *event, const char *file, const char *extra);
+
+// Pass queued catalog changes on to the NM, oldest first. Returns -1 if
+// the channel failed or the NM is no longer the leader.
+static int send_notices(int fd)
+{
+  char notice[SS_NOTIFY_LINE_MAX];
+  while (ss_notify_peek(notice, sizeof notice) == 0)
+  {
+    char *resp = NULL;
+    if (control_send(fd, notice) != 0 || recv_line(fd, &resp, 1024) <= 0)
+    {
+      free(resp);
+      return -1;
+    }
+    int redirected = nm_target_redirect(&g_nm, resp);
+    free(resp);
+    if (redirected)
+      return -1;
+    ss_notify_pop();
+  }
+  return 0;
+}
+
+// Point replication at the "host:port" the NM named in a heartbeat reply
+static void apply_replica_target(const char *resp)
+{
+  char replica[128] = "";
+  json_get_str(resp, "replica", replica, sizeof replica);
+  char *colon = strrchr(replica, ':');
+  if (colon)
+  {
+    *colon = '\0';
+    ss_replicate_set_target(replica, atoi(colon + 1));
+  }
+  else
+  {
+    ss_replicate_set_target("", 0);
+  }
 }
 
-// Heartbeat thread - sends periodic heartbeats to NM
+// Heartbeat thread - sends periodic heartbeats to NM. Every beat carries
+// the open connection count, the replication lag and the versions of files
+// that changed since the last beat (all files after a reconnect), which the
+// NM uses to balance reads and to tell whether a replica is up to date. The
+// reply names this SS's replica.
 static void *heartbeat_thread(void *arg)
 {
   (void)arg;
+  int fd = -1;
+  unsigned long reported = 0; // change sequence the NM has seen
+  long long last_report = ss_stats_now_us();
+  long long last_beat = 0;
   
   while (1)
   {
-    sleep(5); // Send heartbeat every 5 seconds
-    
-    int fd = tcp_connect(NM_HOST, NM_PORT);
-    if (fd >= 0)
-    {
-      char *msg = jsonl_build("{\"op\":\"SS_HEARTBEAT\",\"ss_id\":\"%s\"}", SS_ID);
-      send_line(fd, msg);
-      
-      // Read response (optional, just to clear the buffer)
-      char *resp = NULL;
-      recv_line(fd, &resp, 1024);
-      if (resp)
-        free(resp);
-      
+    // Sleep out the beat; with the channel open, wake early to pass on
+    // catalog changes
+    long left_ms = g_heartbeat_ms - (long)((ss_stats_now_us() - last_beat) / 1000);
+    if (fd >= 0 && left_ms > 0)
+    {
+      ss_notify_wait(left_ms);
+    }
+    else if (left_ms > 0)
+    {
+      struct timespec delay = {left_ms / 1000, (left_ms % 1000) * 1000000L};
+      nanosleep(&delay, NULL);
+    }
+
+    if (fd < 0)
+    {
+      fd = open_control_channel();
+      reported = 0;
+    }
+    // Dropped replication records leave the replica to a tree comparison
+    if (ss_replicate_take_reconcile())
+      notify_nm("reconcile", "", "");
+    if (fd >= 0 && send_notices(fd) != 0)
+    {
+      close(fd);
+      fd = -1;
+    }
+    if (fd >= 0 && ss_notify_overflowed())
+    {
+      register_with_nm();
+      reported = 0;
+    }
+    if (ss_stats_now_us() - last_beat < g_heartbeat_ms * 1000LL)
+      continue;
+    last_beat = ss_stats_now_us();
+
+    char msg[CONTROL_LINE_MAX];
+    int len;
+    if (ss_stats_now_us() - last_report >= LOAD_REPORT_MS * 1000LL)
+    {
+      SSLoadReport report;
+      ss_stats_report(&report);
+      last_report = ss_stats_now_us();
+      len = snprintf(msg, sizeof msg,
+                     "{\"op\":\"SS_HEARTBEAT\",\"ss_id\":\"%s\",\"active\":%d,\"requests\":%ld,\"window_ms\":%ld,"
+                     "\"p99_us\":%ld,\"bytes\":%lld,\"files\":%d,\"free_disk\":%lld",
+                     SS_ID, report.active, report.requests, report.window_ms, report.p99_us,
+                     report.bytes, report.files, report.free_disk);
+    }
+    else
+    {
+      len = snprintf(msg, sizeof msg, "{\"op\":\"SS_HEARTBEAT\",\"ss_id\":\"%s\",\"active\":%d",
+                     SS_ID, ss_stats_active());
+    }
+    if (fd < 0)
+      continue;
+
+    ReplLag lag;
+    ss_replicate_lag(&lag);
+    len += snprintf(msg + len, sizeof msg - len, ",\"repl_pending\":%ld,\"repl_lag_ms\":%ld,\"repl_acked\":%lu",
+                    lag.pending, lag.lag_ms, lag.acked);
+
+    char versions[CONTROL_LINE_MAX - 512];
+    unsigned long next = ss_files_changes(reported, versions, sizeof versions);
+    if (versions[0])
+      snprintf(msg + len, sizeof msg - len, ",\"versions\":\"%s\"}", versions);
+    else
+      snprintf(msg + len, sizeof msg - len, "}");
+
+    // Reconnect on the next beat if the NM went away
+    char *resp = NULL;
+    if (control_send(fd, msg) != 0 || recv_line(fd, &resp, 1024) <= 0)
+    {
       close(fd);
+      fd = -1;
+    }
+    else
+    {
+      reported = next;
+      int status = 0;
+      json_get_int(resp, "status", &status);
+      if (status == ERR_NOT_FOUND)
+      {
+        // The NM restarted and no longer knows this SS
+        register_with_nm();
+        reported = 0;
+      }
+      else if (nm_target_redirect(&g_nm, resp))
+      {
+        // The NM lost the leadership; find the new leader
+        close(fd);
+        fd = -1;
+      }
+      else
+      {
+        apply_replica_target(resp);
+      }
     }
+    free(resp);
   }
   
   return NULL;
 }
 
+static void *cold_storage_thread(void *arg)
+{
+  (void)arg;
+
+  while (1)
+  {
+    sleep(60 * 60); // Look for cold documents hourly
+    int n = ss_files_compress_cold();
+    if (n > 0)
+      printf("[SS] Compressed %d cold document(s)\n", n);
+  }
+
+  return NULL;
+}
+
+// Parse a "n,n,..." list of tree node numbers; returns how many
+static int parse_nodes(const char *list, int *nodes, int max)
+{
+  int count = 0;
+  for (const char *p = list; *p && count < max;)
+  {
+    char *end;
+    long n = strtol(p, &end, 10);
+    if (end == p)
+      break;
+    nodes[count++] = (int)n;
+    p = *end == ',' ? end + 1 : end;
+  }
+  return count;
+}
+
+// Anti-entropy requests from the NM (see ss_merkle.h), signed for the tree
+// of origin: MERKLE returns the hashes of tree nodes, MERKLE_LEAVES the
+// files behind leaves, and RESYNC queues files for the replication stream
+static void handle_anti_entropy(int cfd, const char *line, const char *op, const char *origin)
+{
+  char list[4096] = "";
+  int nodes[MERKLE_REQUEST_MAX];
+
+  if (!strcmp(op, "MERKLE"))
+  {
+    json_get_str(line, "nodes", list, sizeof list);
+    int count = parse_nodes(list, nodes, MERKLE_REQUEST_MAX);
+    unsigned long long hashes[MERKLE_REQUEST_MAX];
+    ss_merkle_nodes(origin, nodes, count, hashes);
+
+    char reply[MERKLE_REQUEST_MAX * 17 + 64];
+    int used = snprintf(reply, sizeof reply, "{\"status\":0,\"hashes\":\"");
+    for (int i = 0; i < count; i++)
+      used += snprintf(reply + used, sizeof reply - used, "%s%016llx", i ? "," : "", hashes[i]);
+    snprintf(reply + used, sizeof reply - used, "\"}");
+    send_line(cfd, reply);
+  }
+  else if (!strcmp(op, "MERKLE_LEAVES"))
+  {
+    json_get_str(line, "leaves", list, sizeof list);
+    int count = parse_nodes(list, nodes, MERKLE_REQUEST_MAX);
+    char *entries = malloc(MERKLE_ENTRIES_MAX);
+    char *reply = malloc(MERKLE_ENTRIES_MAX + 64);
+    if (!entries || !reply)
+    {
+      send_line(cfd, "{\"status\":6,\"code\":\"ERR_INTERNAL\"}");
+    }
+    else
+    {
+      ss_files_merkle_entries(origin, nodes, count, entries, MERKLE_ENTRIES_MAX);
+      snprintf(reply, MERKLE_ENTRIES_MAX + 64, "{\"status\":0,\"entries\":\"%s\"}", entries);
+      send_line(cfd, reply);
+    }
+    free(entries);
+    free(reply);
+  }
+  else
+  {
+    char *files = malloc(MERKLE_ENTRIES_MAX);
+    int queued = 0;
+    if (files && json_get_str(line, "files", files, MERKLE_ENTRIES_MAX) == 0)
+    {
+      char *save = NULL;
+      for (char *tok = strtok_r(files, ";", &save); tok; tok = strtok_r(NULL, ";", &save))
+      {
+        ss_replicate_note(tok);
+        queued++;
+      }
+    }
+    free(files);
+    char reply[64];
+    snprintf(reply, sizeof reply, "{\"status\":0,\"queued\":%d}", queued);
+    send_line(cfd, reply);
+  }
+}
+
+// The op a request must bring a token for, NULL if none. Every op that
+// changes a file's place, ACL or checkpoints, or reveals its metadata or
+// checkpoints, does: clients send CREATE, DELETE, INFO, ADD/REMACCESS,
+// MOVE, CHECKPOINT and REVERT with a token from their control route, and
+// the NM sends each of these (and the checkpoint reads) as NM_<op> with a
+// token of its own. NM_ACCESS carries ADDACCESS and REMACCESS alike. The
+// anti-entropy requests come only from the NM, as NM_MERKLE,
+// NM_MERKLE_LEAVES and NM_RESYNC, signed for the tree's origin as file.
+static const char *token_required_op(const char *op)
+{
+  static const char *const ops[] = {"CREATE", "DELETE", "INFO", "ADDACCESS", "REMACCESS", "MOVE",
+                                    "CHECKPOINT", "VIEWCHECKPOINT", "REVERT", "LISTCHECKPOINTS",
+                                    "MERKLE", "MERKLE_LEAVES", "RESYNC"};
+  if (!strcmp(op, "NM_ACCESS"))
+    return "ADDACCESS";
+  const char *name = strncmp(op, "NM_", 3) ? op : op + 3;
+  for (size_t i = 0; i < sizeof ops / sizeof ops[0]; i++)
+    if (!strcmp(name, ops[i]))
+      return ops[i];
+  return NULL;
+}
+
+// Check a client's token for op on file. Returns 0, or -1 with why in
+// *reason.
+static int check_token(const char *token, const char *op, const char *file, const char *user, const char **reason)
+{
+  if (!token[0])
+  {
+    *reason = "token required";
+    return -1;
+  }
+  pthread_mutex_lock(&g_token_mutex);
+  int rc = token_verify(g_token_key, token, file, user, SS_ID, op, g_token_epoch, time(NULL), reason);
+  pthread_mutex_unlock(&g_token_mutex);
+  return rc;
+}
+
+// Queue a catalog change made for a client with a token for the NM; extra
+// is more fields, each with a leading comma
+static void notify_nm(const char *event, const char *file, const char *extra)
+{
+  char notice[SS_NOTIFY_LINE_MAX];
+  snprintf(notice, sizeof notice, "{\"op\":\"SS_NOTIFY\",\"ss_id\":\"%s\",\"event\":\"%s\",\"file\":\"%s\"%s}",
+           SS_ID, event, file, extra);
+  ss_notify_push(notice);
+}
+
 static void *handle_client_thread(void *arg)
 {
   int cfd = *(int *)arg;
@@ -184,6 +742,10 @@ static void *handle_client_thread(void *arg)
     client_port = ntohs(addr.sin_port);
   }
 
+  // The primary this connection proved to be with REPL_HELLO, "" if none
+  char repl_from[64] = "";
+
+  ss_stats_connection_opened();
   for (;;)
   {
     char *line = NULL;
@@ -193,6 +755,7 @@ static void *handle_client_thread(void *arg)
       free(line);
       break;
     }
+    long long started = ss_stats_now_us();
 
     char op[64], user[64] = "", file[256] = "";
     if (json_get_str(line, "op", op, sizeof op) != 0)
@@ -207,7 +770,19 @@ static void *handle_client_thread(void *arg)
     log_message("SS", op, client_ip, client_port, user, file[0] ? file : "N/A");
     log_to_file(SS_LOGFILE, jsonl_build("REQ: %s", line));
 
-    if (!strcmp(op, "READ"))
+    // A client that skips the NM proves with its token that the NM let it,
+    // and so does the NM for the ops it carries out for a client
+    char token[TOKEN_MAX] = "";
+    const char *granted = token_required_op(op);
+    int direct = granted && strncmp(op, "NM_", 3) != 0;
+    const char *reason = NULL;
+    json_get_str(line, "token", token, sizeof token);
+
+    if (granted && check_token(token, granted, file, user, &reason) != 0)
+    {
+      send_line(cfd, jsonl_build("{\"status\":%d,\"code\":\"ERR_TOKEN\",\"msg\":\"%s\"}", ERR_UNAUTHORIZED, reason));
+    }
+    else if (!strcmp(op, "READ"))
     {
       char content[8192];
       int rc = ss_files_read(file, user, content, sizeof content);
@@ -267,7 +842,10 @@ static void *handle_client_thread(void *arg)
       int rc = ss_files_write_commit(file, user);
       if (rc == OK)
       {
-        send_line(cfd, "{\"status\":0,\"msg\":\"committed\"}");
+        // The version lets the client insist on reading its own write
+        unsigned long version = 0;
+        ss_files_version(file, &version);
+        send_line(cfd, jsonl_build("{\"status\":0,\"msg\":\"committed\",\"version\":%lu}", version));
       }
       else
       {
@@ -279,12 +857,22 @@ static void *handle_client_thread(void *arg)
       int rc = ss_files_undo(file, user);
       if (rc == OK)
       {
-        send_line(cfd, "{\"status\":0,\"msg\":\"undo successful\"}");
+        unsigned long version = 0;
+        ss_files_version(file, &version);
+        send_line(cfd, jsonl_build("{\"status\":0,\"msg\":\"undo successful\",\"version\":%lu}", version));
       }
       else if (rc == ERR_NOT_FOUND)
       {
         send_line(cfd, jsonl_build("{\"status\":%d,\"code\":\"ERR_NOT_FOUND\",\"msg\":\"no undo history\"}", ERR_NOT_FOUND));
       }
+      else if (rc == ERR_LOCKED)
+      {
+        send_line(cfd, jsonl_build("{\"status\":%d,\"code\":\"ERR_LOCKED\",\"msg\":\"file has an active write session\"}", ERR_LOCKED));
+      }
+      else if (rc == ERR_CONFLICT)
+      {
+        send_line(cfd, jsonl_build("{\"status\":%d,\"code\":\"ERR_CONFLICT\",\"msg\":\"sentence changed by a later edit\"}", ERR_CONFLICT));
+      }
       else
       {
         send_line(cfd, jsonl_build("{\"status\":%d,\"code\":\"ERR_INTERNAL\",\"msg\":\"undo failed\"}", ERR_INTERNAL));
@@ -292,33 +880,58 @@ static void *handle_client_thread(void *arg)
     }
     else if (!strcmp(op, "STREAM"))
     {
-      char content[8192];
-      int rc = ss_files_read(file, user, content, sizeof content);
-      if (rc == OK)
+      int interval_ms = SS_STREAM_DEFAULT_INTERVAL_MS;
+      json_get_int(line, "interval_ms", &interval_ms);
+
+      if (ss_stream_start(cfd, file, user, interval_ms) == OK)
       {
-        char *word = strtok(content, " .");
-        while (word)
-        {
-          char buf[256];
-          snprintf(buf, sizeof buf, "{\"op\":\"TOK\",\"w\":\"%s\"}", word);
-          send_line(cfd, buf);
-          usleep(100000);
-          word = strtok(NULL, " .");
-        }
-        send_line(cfd, "{\"op\":\"STOP\"}");
+        // The scheduler owns the connection from here on
+        ss_stats_request_done(started);
+        ss_stats_connection_closed();
+        free(line);
+        return NULL;
       }
-      else
+      send_line(cfd, jsonl_build("{\"status\":%d,\"code\":\"ERR_NOT_FOUND\",\"msg\":\"file not found\"}", ERR_NOT_FOUND));
+    }
+    else if (!strcmp(op, "NM_MERKLE") || !strcmp(op, "NM_MERKLE_LEAVES") || !strcmp(op, "NM_RESYNC"))
+    {
+      handle_anti_entropy(cfd, line, op + 3, file);
+    }
+    else if (!strcmp(op, "REPL_HELLO"))
+    {
+      if (ss_replicate_serve_hello(cfd, line, repl_from, sizeof repl_from) != 0)
       {
-        send_line(cfd, jsonl_build("{\"status\":%d,\"code\":\"ERR_NOT_FOUND\",\"msg\":\"file not found\"}", ERR_NOT_FOUND));
+        ss_stats_request_done(started);
+        free(line);
+        break;
       }
     }
-    else if (!strcmp(op, "NM_CREATE"))
+    else if (!strcmp(op, "REPL_BATCH"))
     {
-      char owner[64];
-      json_get_str(line, "owner", owner, sizeof owner);
-      int rc = ss_files_create(file, owner);
+      // Its records follow the header, so a batch from a peer that has not
+      // proven itself ends the connection
+      if (!repl_from[0])
+      {
+        send_line(cfd, jsonl_build("{\"status\":%d,\"code\":\"ERR_UNAUTHORIZED\",\"msg\":\"REPL_HELLO first\"}",
+                                   ERR_UNAUTHORIZED));
+        ss_stats_request_done(started);
+        free(line);
+        break;
+      }
+      if (ss_replicate_serve_batch(cfd, line, repl_from) != 0)
+      {
+        ss_stats_request_done(started);
+        free(line);
+        break;
+      }
+    }
+    else if (!strcmp(op, "NM_CREATE") || !strcmp(op, "CREATE"))
+    {
+      int rc = ss_files_create(file, user);
       if (rc == OK)
       {
+        if (direct)
+          notify_nm("create", file, "");
         send_line(cfd, "{\"status\":0,\"msg\":\"file created\"}");
       }
       else if (rc == ERR_CONFLICT)
@@ -330,12 +943,14 @@ static void *handle_client_thread(void *arg)
         send_line(cfd, jsonl_build("{\"status\":%d,\"code\":\"ERR_INTERNAL\",\"msg\":\"creation failed\"}", ERR_INTERNAL));
       }
     }
-    else if (!strcmp(op, "NM_DELETE"))
+    else if (!strcmp(op, "NM_DELETE") || !strcmp(op, "DELETE"))
     {
       int rc = ss_files_delete(file, user);
+      if (rc == OK && direct)
+        notify_nm("delete", file, "");
       send_line(cfd, rc == OK ? "{\"status\":0,\"msg\":\"deleted\"}" : "{\"status\":6,\"msg\":\"delete failed\"}");
     }
-    else if (!strcmp(op, "INFO"))
+    else if (!strcmp(op, "NM_INFO") || !strcmp(op, "INFO"))
     {
       char info[2048];
       int rc = ss_files_get_info(file, info, sizeof info);
@@ -359,23 +974,58 @@ static void *handle_client_thread(void *arg)
       ss_files_list_all(list, sizeof list, include_all, include_details, user);
       send_line(cfd, jsonl_build("{\"op\":\"LIST\",\"status\":0,\"files\":\"%s\"}", list));
     }
-    else if (!strcmp(op, "NM_ACCESS"))
+    else if (!strcmp(op, "SEARCH"))
     {
-      char cmd[16], mode[8], target_user[64];
+      char query[512] = "";
+      int limit = 20;
+      json_get_str(line, "query", query, sizeof query);
+      json_get_int(line, "limit", &limit);
+
+      char results[7680]; // leaves room for the reply envelope
+      int rc = ss_files_search(user, query, limit, results, sizeof results);
+      if (rc == OK)
+        send_line(cfd, jsonl_build("{\"op\":\"SEARCH\",\"status\":0,\"results\":\"%s\"}", results));
+      else
+        send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"search failed\"}", rc));
+    }
+    else if (!strcmp(op, "GREP"))
+    {
+      char pattern[512] = "", gflags[16] = "";
+      json_get_str(line, "pattern", pattern, sizeof pattern);
+      json_get_str(line, "flags", gflags, sizeof gflags);
+
+      // Hits are streamed one per line and closed by a STOP line
+      GrepHit *hits = calloc(GREP_MAX_HITS, sizeof(GrepHit));
+      int count = 0;
+      int rc = hits ? ss_files_grep(user, pattern, gflags, hits, GREP_MAX_HITS, &count) : ERR_INTERNAL;
+      for (int i = 0; i < count; i++)
+      {
+        send_line(cfd, jsonl_build("{\"op\":\"HIT\",\"file\":\"%s\",\"sentence\":%d,\"word\":%d,\"text\":\"%s\"}",
+                                   hits[i].file, hits[i].sentence, hits[i].word, hits[i].text));
+      }
+      free(hits);
+      if (rc == OK)
+        send_line(cfd, jsonl_build("{\"op\":\"STOP\",\"status\":0,\"hits\":%d}", count));
+      else
+        send_line(cfd, jsonl_build("{\"op\":\"STOP\",\"status\":%d,\"msg\":\"invalid pattern\"}", rc));
+    }
+    else if (!strcmp(op, "NM_ACCESS") || !strcmp(op, "ADDACCESS") || !strcmp(op, "REMACCESS"))
+    {
+      char cmd[16] = "", mode[8] = "", target_user[64] = "";
       json_get_str(line, "cmd", cmd, sizeof cmd);
       json_get_str(line, "mode", mode, sizeof mode);
       json_get_str(line, "target_user", target_user, sizeof target_user);
-      char actor[64] = "";
-      json_get_str(line, "actor", actor, sizeof actor);
+      if (direct)
+        snprintf(cmd, sizeof cmd, "%s", !strcmp(op, "ADDACCESS") ? "ADD" : "REM");
 
       int rc;
       if (!strcmp(cmd, "ADD"))
       {
-        rc = ss_files_add_access(file, actor, target_user, mode);
+        rc = ss_files_add_access(file, user, target_user, mode);
       }
       else
       {
-        rc = ss_files_remove_access(file, actor, target_user);
+        rc = ss_files_remove_access(file, user, target_user);
       }
 
       send_line(cfd, rc == OK ? "{\"status\":0,\"msg\":\"access updated\"}" : "{\"status\":6,\"msg\":\"failed\"}");
@@ -412,13 +1062,22 @@ static void *handle_client_thread(void *arg)
         send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"failed to create folder\"}", ERR_INTERNAL));
       }
     }
-    else if (!strcmp(op, "MOVE"))
+    else if (!strcmp(op, "NM_MOVE") || !strcmp(op, "MOVE"))
     {
       char folder[256];
       json_get_str(line, "folder", folder, sizeof folder);
       int rc = ss_files_move_file(file, folder);
       if (rc == OK)
       {
+        if (direct)
+        {
+          char to[600];
+          if (folder[0])
+            snprintf(to, sizeof to, ",\"to\":\"%s/%s\"", folder, file);
+          else
+            snprintf(to, sizeof to, ",\"to\":\"%s\"", file);
+          notify_nm("move", file, to);
+        }
         send_line(cfd, "{\"status\":0,\"msg\":\"file moved\"}");
       }
       else
@@ -441,13 +1100,20 @@ static void *handle_client_thread(void *arg)
         send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"folder not found\"}", ERR_NOT_FOUND));
       }
     }
-    else if (!strcmp(op, "CHECKPOINT"))
+    else if (!strcmp(op, "NM_CHECKPOINT") || !strcmp(op, "CHECKPOINT"))
     {
       char tag[128];
       json_get_str(line, "tag", tag, sizeof tag);
       int rc = ss_files_create_checkpoint(file, tag);
       if (rc == OK)
       {
+        // The NM has the replica take the checkpoint too
+        if (direct)
+        {
+          char extra[256];
+          snprintf(extra, sizeof extra, ",\"tag\":\"%s\",\"user\":\"%s\"", tag, user);
+          notify_nm("checkpoint", file, extra);
+        }
         send_line(cfd, "{\"status\":0,\"msg\":\"checkpoint created\"}");
       }
       else
@@ -455,7 +1121,7 @@ static void *handle_client_thread(void *arg)
         send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"failed to create checkpoint\"}", rc));
       }
     }
-    else if (!strcmp(op, "VIEWCHECKPOINT"))
+    else if (!strcmp(op, "NM_VIEWCHECKPOINT") || !strcmp(op, "VIEWCHECKPOINT"))
     {
       char tag[128];
       json_get_str(line, "tag", tag, sizeof tag);
@@ -470,7 +1136,7 @@ static void *handle_client_thread(void *arg)
         send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"checkpoint not found\"}", ERR_NOT_FOUND));
       }
     }
-    else if (!strcmp(op, "REVERT"))
+    else if (!strcmp(op, "NM_REVERT") || !strcmp(op, "REVERT"))
     {
       char tag[128];
       json_get_str(line, "tag", tag, sizeof tag);
@@ -484,7 +1150,7 @@ static void *handle_client_thread(void *arg)
         send_line(cfd, jsonl_build("{\"status\":%d,\"msg\":\"failed to revert\"}", rc));
       }
     }
-    else if (!strcmp(op, "LISTCHECKPOINTS"))
+    else if (!strcmp(op, "NM_LISTCHECKPOINTS") || !strcmp(op, "LISTCHECKPOINTS"))
     {
       char checkpoints[4096];
       int rc = ss_files_list_checkpoints(file, checkpoints, sizeof checkpoints);
@@ -501,18 +1167,57 @@ static void *handle_client_thread(void *arg)
     {
       send_line(cfd, jsonl_build("{\"status\":%d,\"code\":\"ERR_BAD_REQUEST\",\"msg\":\"unsupported op: %s\"}", ERR_BAD_REQUEST, op));
     }
+    ss_stats_request_done(started);
     free(line);
   }
+  ss_stats_connection_closed();
   close(cfd);
   return NULL;
 }
 
 int main(int argc, char **argv)
 {
-  // parse flags (omitted: set SS_ID / ports from args)
   (void)argc;
   (void)argv;
 
+  // Identity and ports, so several storage servers can share a host
+  const char *ss_id = getenv("SS_ID");
+  if (ss_id && ss_id[0])
+    SS_ID = ss_id;
+  const char *client_port = getenv("SS_CLIENT_PORT");
+  if (client_port && atoi(client_port) > 0)
+    SS_CLIENT_PORT = atoi(client_port);
+  const char *nm_port = getenv("SS_NM_PORT");
+  if (nm_port && atoi(nm_port) > 0)
+    SS_NM_PORT = atoi(nm_port);
+
+  // The secret NM and SSes share; requests and tokens from the NM are
+  // checked with it
+  if (token_key_derive(getenv("NM_TOKEN_KEY"), g_token_key) != 0)
+  {
+    fprintf(stderr, "[SS] Set NM_TOKEN_KEY to the secret the Name Server was started with\n");
+    return 1;
+  }
+
+  // Heartbeat interval on the NM control channel
+  const char *heartbeat_ms = getenv("SS_HEARTBEAT_MS");
+  if (heartbeat_ms && atoi(heartbeat_ms) > 0)
+    g_heartbeat_ms = atoi(heartbeat_ms);
+
+  const char *undo_depth = getenv("SS_UNDO_DEPTH");
+  if (undo_depth)
+    ss_files_set_undo_depth(atoi(undo_depth));
+
+  // SS_COMPRESS=0 stores checkpoint chunks uncompressed
+  const char *compress = getenv("SS_COMPRESS");
+  if (compress)
+    ss_chunks_set_compression(atoi(compress) != 0);
+
+  // Compress documents not accessed for this many days (0 = never)
+  const char *cold_days = getenv("SS_COLD_DAYS");
+  if (cold_days)
+    ss_files_set_cold_days(atoi(cold_days));
+
   // Initialize file subsystem
   printf("[SS] Initializing file system...\n");
   if (ss_files_init() != OK)
@@ -521,7 +1226,30 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  if (ss_stream_init() != OK)
+  {
+    fprintf(stderr, "[SS] Failed to start stream scheduler\n");
+    return 1;
+  }
+
+  // Listen before registering: the NM routes clients here as soon as it
+  // knows this SS, and they wait in the backlog until the accept loop runs
+  int lfd = tcp_listen(NULL, SS_CLIENT_PORT, 128);
+  if (lfd < 0)
+  {
+    perror("ss listen");
+    return 1;
+  }
+  printf("[SS] Listening on :%d\n", SS_CLIENT_PORT);
+
+  nm_target_init(&g_nm, NM_HOST, NM_PORT);
   register_with_nm();
+
+  if (ss_replicate_init(SS_ID, g_token_key) != OK)
+  {
+    fprintf(stderr, "[SS] Failed to start replication\n");
+    return 1;
+  }
   
   // Start heartbeat thread
   pthread_t hb_thread;
@@ -532,15 +1260,14 @@ int main(int argc, char **argv)
   }
   pthread_detach(hb_thread);
   printf("[SS] Heartbeat thread started\n");
-  
-  int lfd = tcp_listen(NULL, SS_CLIENT_PORT, 128);
-  if (lfd < 0)
+
+  if (cold_days && atoi(cold_days) > 0)
   {
-    perror("ss listen");
-    return 1;
+    pthread_t cold_thread;
+    if (pthread_create(&cold_thread, NULL, cold_storage_thread, NULL) == 0)
+      pthread_detach(cold_thread);
   }
-  printf("[SS] Listening on :%d\n", SS_CLIENT_PORT);
-
+  
   for (;;)
   {
     int cfd = accept(lfd, NULL, NULL);
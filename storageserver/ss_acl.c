@@ -1,5 +1,7 @@
 #include "ss_acl.h"
 #include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 // Placeholder implementation
 // To be implemented by Saharsh
@@ -37,3 +39,151 @@ int ss_acl_remove_permission(const char *file, const char *user) {
   return 0;
 }
 
+
+// ==================== USER -> FILES INDEX ====================
+
+#define ACL_INDEX_INITIAL_BUCKETS 64
+
+typedef struct UserFiles {
+  char user[64];
+  FileState **files;
+  int count;
+  int capacity;
+  struct UserFiles *next;
+} UserFiles;
+
+static UserFiles **g_index = NULL;
+static int g_index_buckets = 0;
+static int g_index_users = 0;
+static pthread_mutex_t g_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long user_hash(const char *user) {
+  unsigned long h = 5381;
+  while (*user)
+    h = ((h << 5) + h) + (unsigned char)*user++;
+  return h;
+}
+
+// Double the bucket array once chains average more than two users
+static void index_grow(void) {
+  int new_buckets = g_index_buckets ? g_index_buckets * 2 : ACL_INDEX_INITIAL_BUCKETS;
+  UserFiles **table = calloc(new_buckets, sizeof(UserFiles *));
+  if (!table)
+    return;
+  for (int i = 0; i < g_index_buckets; i++) {
+    UserFiles *uf = g_index[i];
+    while (uf) {
+      UserFiles *next = uf->next;
+      unsigned long b = user_hash(uf->user) % new_buckets;
+      uf->next = table[b];
+      table[b] = uf;
+      uf = next;
+    }
+  }
+  free(g_index);
+  g_index = table;
+  g_index_buckets = new_buckets;
+}
+
+static UserFiles *find_user(const char *user, int create) {
+  if (g_index_buckets > 0) {
+    for (UserFiles *uf = g_index[user_hash(user) % g_index_buckets]; uf; uf = uf->next) {
+      if (!strcmp(uf->user, user))
+        return uf;
+    }
+  }
+  if (!create)
+    return NULL;
+
+  if (g_index_users >= g_index_buckets * 2)
+    index_grow();
+  if (g_index_buckets == 0)
+    return NULL;
+
+  UserFiles *uf = calloc(1, sizeof(UserFiles));
+  if (!uf)
+    return NULL;
+  strncpy(uf->user, user, sizeof uf->user - 1);
+  unsigned long b = user_hash(user) % g_index_buckets;
+  uf->next = g_index[b];
+  g_index[b] = uf;
+  g_index_users++;
+  return uf;
+}
+
+static void grant_locked(const char *user, FileState *state) {
+  if (!user || !user[0])
+    return;
+  UserFiles *uf = find_user(user, 1);
+  if (!uf)
+    return;
+  for (int i = 0; i < uf->count; i++) {
+    if (uf->files[i] == state)
+      return;
+  }
+  if (uf->count >= uf->capacity) {
+    int new_cap = uf->capacity ? uf->capacity * 2 : 8;
+    FileState **files = realloc(uf->files, new_cap * sizeof(FileState *));
+    if (!files)
+      return;
+    uf->files = files;
+    uf->capacity = new_cap;
+  }
+  uf->files[uf->count++] = state;
+}
+
+static void revoke_locked(const char *user, FileState *state) {
+  if (!user || !user[0])
+    return;
+  UserFiles *uf = find_user(user, 0);
+  if (!uf)
+    return;
+  for (int i = 0; i < uf->count; i++) {
+    if (uf->files[i] == state) {
+      // Keep insertion order so VIEW output stays stable
+      memmove(&uf->files[i], &uf->files[i + 1], (uf->count - i - 1) * sizeof(FileState *));
+      uf->count--;
+      return;
+    }
+  }
+}
+
+void ss_acl_index_grant(const char *user, FileState *state) {
+  pthread_mutex_lock(&g_index_mutex);
+  grant_locked(user, state);
+  pthread_mutex_unlock(&g_index_mutex);
+}
+
+void ss_acl_index_revoke(const char *user, FileState *state) {
+  pthread_mutex_lock(&g_index_mutex);
+  revoke_locked(user, state);
+  pthread_mutex_unlock(&g_index_mutex);
+}
+
+void ss_acl_index_add_file(FileState *state) {
+  pthread_mutex_lock(&g_index_mutex);
+  grant_locked(state->metadata.owner, state);
+  for (int i = 0; i < state->metadata.access_count; i++)
+    grant_locked(state->metadata.access_list[i].username, state);
+  pthread_mutex_unlock(&g_index_mutex);
+}
+
+void ss_acl_index_remove_file(FileState *state) {
+  pthread_mutex_lock(&g_index_mutex);
+  revoke_locked(state->metadata.owner, state);
+  for (int i = 0; i < state->metadata.access_count; i++)
+    revoke_locked(state->metadata.access_list[i].username, state);
+  pthread_mutex_unlock(&g_index_mutex);
+}
+
+void ss_acl_index_foreach(const char *user, int (*fn)(FileState *state, void *arg), void *arg) {
+  pthread_mutex_lock(&g_index_mutex);
+  UserFiles *uf = user ? find_user(user, 0) : NULL;
+  if (uf) {
+    for (int i = 0; i < uf->count; i++) {
+      if (fn(uf->files[i], arg))
+        break;
+    }
+  }
+  pthread_mutex_unlock(&g_index_mutex);
+}
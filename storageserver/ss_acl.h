@@ -1,5 +1,6 @@
 #ifndef SS_ACL_H
 #define SS_ACL_H
+#include "ss_files.h"
 
 // Access Control List management
 // To be implemented by Saharsh
@@ -10,5 +11,16 @@ int ss_acl_check_write(const char *file, const char *user);
 int ss_acl_add_permission(const char *file, const char *user, const char *mode);
 int ss_acl_remove_permission(const char *file, const char *user);
 
+// Inverted index: user -> cached files the user owns or appears in the ACL of.
+// Entries point at FileState, so renames need no update; callers must remove
+// a file before freeing it.
+void ss_acl_index_grant(const char *user, FileState *state);
+void ss_acl_index_revoke(const char *user, FileState *state);
+void ss_acl_index_add_file(FileState *state);
+void ss_acl_index_remove_file(FileState *state);
+
+// Call fn for each file indexed under user until it returns nonzero
+void ss_acl_index_foreach(const char *user, int (*fn)(FileState *state, void *arg), void *arg);
+
 #endif
 
@@ -0,0 +1,167 @@
+// Storage benchmark: on-disk footprint and cold-read latency of plain vs
+// block-compressed documents. Built with `make bench`, not part of `all`.
+//
+// Usage: ./ss_bench [file...]    (no files: uses a generated 1 MB prose corpus)
+#define _POSIX_C_SOURCE 200809L
+#include "ss_compress.h"
+#include "../common/proto.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define ITERATIONS 50
+#define VIEW_BYTES 4096
+#define CORPUS_BYTES (1 << 20)
+
+static double now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static char *generate_corpus(size_t *len_out)
+{
+  static const char *words[] = {
+      "the", "document", "server", "client", "writes", "a", "sentence", "and",
+      "reads", "every", "file", "from", "storage", "while", "users", "edit",
+      "shared", "text", "with", "locks", "on", "each", "word", "checkpoint",
+      "history", "is", "kept", "for", "undo", "in", "order", "to", "recover"};
+  int nwords = sizeof words / sizeof words[0];
+
+  char *buf = malloc(CORPUS_BYTES + 64);
+  if (!buf)
+    return NULL;
+  size_t pos = 0;
+  unsigned int seed = 42;
+  int in_sentence = 0;
+  while (pos < CORPUS_BYTES)
+  {
+    seed = seed * 1103515245 + 12345;
+    const char *w = words[(seed >> 16) % nwords];
+    pos += sprintf(buf + pos, "%s%s", in_sentence ? " " : (pos ? " " : ""), w);
+    in_sentence++;
+    if (in_sentence > 6 && (seed >> 8) % 5 == 0)
+    {
+      buf[pos++] = ".?!"[(seed >> 4) % 3];
+      in_sentence = 0;
+    }
+  }
+  buf[pos] = '\0';
+  *len_out = pos;
+  return buf;
+}
+
+static int write_plain(const char *path, const char *data, size_t len)
+{
+  FILE *fp = fopen(path, "wb");
+  if (!fp)
+    return ERR_INTERNAL;
+  size_t n = fwrite(data, 1, len, fp);
+  fclose(fp);
+  return n == len ? OK : ERR_INTERNAL;
+}
+
+static long file_size(const char *path)
+{
+  struct stat st;
+  return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+// Average microseconds to load the whole file, or to read its first VIEW_BYTES
+static double time_load(const char *path, int view_only)
+{
+  char *view = malloc(VIEW_BYTES);
+  double start = now_us();
+  for (int i = 0; i < ITERATIONS; i++)
+  {
+    if (view_only)
+    {
+      ss_compress_read_file(path, view, VIEW_BYTES);
+    }
+    else
+    {
+      char *data = NULL;
+      size_t len = 0;
+      if (ss_compress_load_file(path, &data, &len) == OK)
+        free(data);
+    }
+  }
+  double elapsed = (now_us() - start) / ITERATIONS;
+  free(view);
+  return elapsed;
+}
+
+static void bench_one(const char *name, const char *data, size_t len)
+{
+  char plain_path[64], packed_path[64];
+  snprintf(plain_path, sizeof plain_path, "/tmp/ss_bench_%d.txt", (int)getpid());
+  snprintf(packed_path, sizeof packed_path, "/tmp/ss_bench_%d.dpz", (int)getpid());
+
+  double start = now_us();
+  if (write_plain(plain_path, data, len) != OK ||
+      ss_compress_write_file(packed_path, data, len) != OK)
+  {
+    fprintf(stderr, "%s: failed to write temp files\n", name);
+    return;
+  }
+  double encode_us = now_us() - start;
+
+  // Round-trip check before reporting numbers
+  char *check = NULL;
+  size_t check_len = 0;
+  if (ss_compress_load_file(packed_path, &check, &check_len) != OK ||
+      check_len != len || memcmp(check, data, len) != 0)
+  {
+    fprintf(stderr, "%s: round trip mismatch\n", name);
+    free(check);
+    return;
+  }
+  free(check);
+
+  long plain = file_size(plain_path);
+  long packed = file_size(packed_path);
+  printf("%-24s %10ld %10ld %6.2fx %9.1f %9.1f %9.1f %9.1f %8.1f\n",
+         name, plain, packed, packed > 0 ? (double)plain / packed : 0.0,
+         time_load(plain_path, 0), time_load(packed_path, 0),
+         time_load(plain_path, 1), time_load(packed_path, 1),
+         encode_us > 0 ? len / encode_us : 0.0);
+
+  unlink(plain_path);
+  unlink(packed_path);
+}
+
+int main(int argc, char **argv)
+{
+  printf("%-24s %10s %10s %7s %9s %9s %9s %9s %8s\n",
+         "input", "plain_B", "packed_B", "ratio",
+         "load_us", "cload_us", "view_us", "cview_us", "enc_MB/s");
+
+  if (argc < 2)
+  {
+    size_t len = 0;
+    char *corpus = generate_corpus(&len);
+    if (!corpus)
+      return 1;
+    bench_one("generated-prose", corpus, len);
+    free(corpus);
+    return 0;
+  }
+
+  for (int i = 1; i < argc; i++)
+  {
+    char *data = NULL;
+    size_t len = 0;
+    if (ss_compress_load_file(argv[i], &data, &len) != OK)
+    {
+      fprintf(stderr, "%s: cannot read\n", argv[i]);
+      continue;
+    }
+    bench_one(argv[i], data, len);
+    free(data);
+  }
+  return 0;
+}
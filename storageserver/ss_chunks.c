@@ -0,0 +1,509 @@
+#define _POSIX_C_SOURCE 200809L
+#include "ss_chunks.h"
+#include "ss_compress.h"
+#include "../common/proto.h"
+#include "../common/sha256.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#define CHUNK_DIR "storageserver/data/chunks/"
+#define CHECKPOINT_DIR "storageserver/data/checkpoints/"
+#define MANIFEST_MAGIC "CDC1"
+#define HASH_HEX_LEN (SHA256_BYTES * 2)
+#define REF_BUCKETS 4096
+
+// Content-defined chunking bounds: cut where the rolling gear hash has its
+// top 12 bits clear (they depend on the last 64 bytes), giving ~4 KB average
+// chunks whose boundaries survive inserts/deletes elsewhere in the file
+#define MIN_CHUNK 1024
+#define MAX_CHUNK 16384
+#define CUT_MASK (((1ULL << 12) - 1) << 52)
+
+typedef struct RefEntry
+{
+  char hash[HASH_HEX_LEN + 1];
+  int refs;
+  struct RefEntry *next;
+} RefEntry;
+
+typedef struct
+{
+  char hash[HASH_HEX_LEN + 1];
+  size_t len;
+} ChunkRef;
+
+static RefEntry *g_refs[REF_BUCKETS];
+static uint64_t g_gear[256];
+static pthread_mutex_t g_chunks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int g_compress = 1;
+
+static uint64_t splitmix64(uint64_t *state)
+{
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// Chunks are addressed by SHA-256 so two different chunks never share a
+// name by accident or design; dedup trusts an equal hash to mean equal bytes
+static void chunk_hash(const unsigned char *p, size_t n, char out[HASH_HEX_LEN + 1])
+{
+  unsigned char digest[SHA256_BYTES];
+  sha256(p, n, digest);
+  for (int i = 0; i < SHA256_BYTES; i++)
+    snprintf(out + 2 * i, 3, "%02x", digest[i]);
+}
+
+// A chunk name is exactly the SHA-256 in lowercase hex
+static int is_chunk_name(const char *name)
+{
+  if (strlen(name) != HASH_HEX_LEN)
+    return 0;
+  for (const char *c = name; *c; c++)
+  {
+    if ((*c < '0' || *c > '9') && (*c < 'a' || *c > 'f'))
+      return 0;
+  }
+  return 1;
+}
+
+static size_t next_cut(const unsigned char *p, size_t n)
+{
+  if (n <= MIN_CHUNK)
+    return n;
+  size_t limit = n < MAX_CHUNK ? n : MAX_CHUNK;
+  uint64_t h = 0;
+  for (size_t i = MIN_CHUNK; i < limit; i++)
+  {
+    h = (h << 1) + g_gear[p[i]];
+    if ((h & CUT_MASK) == 0)
+      return i + 1;
+  }
+  return limit;
+}
+
+static unsigned long ref_bucket(const char *hash)
+{
+  unsigned long h = 5381;
+  while (*hash)
+    h = ((h << 5) + h) + (unsigned char)*hash++;
+  return h % REF_BUCKETS;
+}
+
+static RefEntry *ref_find(const char *hash, int create)
+{
+  unsigned long b = ref_bucket(hash);
+  for (RefEntry *e = g_refs[b]; e; e = e->next)
+  {
+    if (!strcmp(e->hash, hash))
+      return e;
+  }
+  if (!create)
+    return NULL;
+  RefEntry *e = calloc(1, sizeof(RefEntry));
+  if (!e)
+    return NULL;
+  snprintf(e->hash, sizeof e->hash, "%s", hash);
+  e->next = g_refs[b];
+  g_refs[b] = e;
+  return e;
+}
+
+static void ref_drop(const char *hash)
+{
+  unsigned long b = ref_bucket(hash);
+  RefEntry *prev = NULL;
+  for (RefEntry *e = g_refs[b]; e; prev = e, e = e->next)
+  {
+    if (!strcmp(e->hash, hash))
+    {
+      if (prev)
+        prev->next = e->next;
+      else
+        g_refs[b] = e->next;
+      free(e);
+      return;
+    }
+  }
+}
+
+static void chunk_path(const char *hash, char *out, size_t outlen)
+{
+  snprintf(out, outlen, "%s%.2s/%s", CHUNK_DIR, hash, hash);
+}
+
+static void incref(const char *hash)
+{
+  RefEntry *e = ref_find(hash, 1);
+  if (e)
+    e->refs++;
+}
+
+// Release one reference; the chunk file goes away with its last reference
+static void decref(const char *hash)
+{
+  RefEntry *e = ref_find(hash, 0);
+  if (!e)
+    return;
+  if (--e->refs > 0)
+    return;
+  char path[512];
+  chunk_path(hash, path, sizeof path);
+  unlink(path);
+  ref_drop(hash);
+}
+
+static int store_chunk(const char *hash, const char *data, size_t len)
+{
+  char path[512];
+  chunk_path(hash, path, sizeof path);
+
+  // Chunk files only appear via rename, so an existing one is complete
+  struct stat st;
+  if (stat(path, &st) == 0)
+    return OK;
+
+  char dir[512];
+  snprintf(dir, sizeof dir, "%s%.2s", CHUNK_DIR, hash);
+  mkdir(dir, 0755);
+
+  if (g_compress)
+    return ss_compress_write_file(path, data, len);
+
+  char tmp[520];
+  snprintf(tmp, sizeof tmp, "%s.tmp", path);
+  FILE *fp = fopen(tmp, "wb");
+  if (!fp)
+    return ERR_INTERNAL;
+  size_t written = fwrite(data, 1, len, fp);
+  fclose(fp);
+  if (written != len || rename(tmp, path) != 0)
+  {
+    unlink(tmp);
+    return ERR_INTERNAL;
+  }
+  return OK;
+}
+
+int ss_chunks_is_manifest(const char *path)
+{
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return 0;
+  char magic[8] = "";
+  size_t n = fread(magic, 1, strlen(MANIFEST_MAGIC) + 1, fp);
+  fclose(fp);
+  return n == strlen(MANIFEST_MAGIC) + 1 && !strncmp(magic, MANIFEST_MAGIC " ", n);
+}
+
+// Parse a manifest into a malloc'd chunk list
+static int read_manifest(const char *path, ChunkRef **chunks_out, int *count_out, size_t *total_out)
+{
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return ERR_NOT_FOUND;
+
+  unsigned long long total = 0;
+  int count = 0;
+  if (fscanf(fp, MANIFEST_MAGIC " %llu %d\n", &total, &count) != 2 || count < 0)
+  {
+    fclose(fp);
+    return ERR_INTERNAL;
+  }
+
+  ChunkRef *chunks = calloc(count ? count : 1, sizeof(ChunkRef));
+  if (!chunks)
+  {
+    fclose(fp);
+    return ERR_INTERNAL;
+  }
+  for (int i = 0; i < count; i++)
+  {
+    unsigned long long len = 0;
+    if (fscanf(fp, "%64s %llu\n", chunks[i].hash, &len) != 2 || !is_chunk_name(chunks[i].hash))
+    {
+      free(chunks);
+      fclose(fp);
+      return ERR_INTERNAL;
+    }
+    chunks[i].len = (size_t)len;
+  }
+  fclose(fp);
+
+  *chunks_out = chunks;
+  *count_out = count;
+  if (total_out)
+    *total_out = (size_t)total;
+  return OK;
+}
+
+// Count references from every manifest under dir
+static void scan_manifests(const char *dir)
+{
+  DIR *d = opendir(dir);
+  if (!d)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL)
+  {
+    if (entry->d_name[0] == '.')
+      continue;
+    char path[512];
+    snprintf(path, sizeof path, "%s/%s", dir, entry->d_name);
+    struct stat st;
+    if (stat(path, &st) != 0)
+      continue;
+    if (S_ISDIR(st.st_mode))
+    {
+      scan_manifests(path);
+    }
+    else if (S_ISREG(st.st_mode) && ss_chunks_is_manifest(path))
+    {
+      ChunkRef *chunks = NULL;
+      int count = 0;
+      if (read_manifest(path, &chunks, &count, NULL) == OK)
+      {
+        for (int i = 0; i < count; i++)
+          incref(chunks[i].hash);
+        free(chunks);
+      }
+    }
+  }
+  closedir(d);
+}
+
+// Remove chunk files (and interrupted writes) that no manifest references
+static void collect_garbage(void)
+{
+  DIR *top = opendir(CHUNK_DIR);
+  if (!top)
+    return;
+  struct dirent *sub;
+  while ((sub = readdir(top)) != NULL)
+  {
+    if (sub->d_name[0] == '.')
+      continue;
+    char subdir[512];
+    snprintf(subdir, sizeof subdir, "%s%s", CHUNK_DIR, sub->d_name);
+    DIR *d = opendir(subdir);
+    if (!d)
+      continue;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+      if (entry->d_name[0] == '.')
+        continue;
+      if (!is_chunk_name(entry->d_name) || !ref_find(entry->d_name, 0))
+      {
+        char path[1024];
+        snprintf(path, sizeof path, "%s/%s", subdir, entry->d_name);
+        unlink(path);
+      }
+    }
+    closedir(d);
+  }
+  closedir(top);
+}
+
+void ss_chunks_set_compression(int enabled)
+{
+  g_compress = enabled;
+}
+
+int ss_chunks_init(void)
+{
+  pthread_mutex_lock(&g_chunks_mutex);
+  uint64_t seed = 0x646f63732b2bULL;
+  for (int i = 0; i < 256; i++)
+    g_gear[i] = splitmix64(&seed);
+
+  mkdir(CHUNK_DIR, 0755);
+  scan_manifests(CHECKPOINT_DIR);
+  collect_garbage();
+  pthread_mutex_unlock(&g_chunks_mutex);
+  return OK;
+}
+
+int ss_chunks_write_manifest(const char *manifest_path, const char *data, size_t len)
+{
+  pthread_mutex_lock(&g_chunks_mutex);
+
+  int cap = 16, count = 0;
+  ChunkRef *chunks = malloc(cap * sizeof(ChunkRef));
+  if (!chunks)
+  {
+    pthread_mutex_unlock(&g_chunks_mutex);
+    return ERR_INTERNAL;
+  }
+
+  size_t off = 0;
+  while (off < len)
+  {
+    size_t n = next_cut((const unsigned char *)data + off, len - off);
+    if (count == cap)
+    {
+      cap *= 2;
+      ChunkRef *grown = realloc(chunks, cap * sizeof(ChunkRef));
+      if (!grown)
+      {
+        free(chunks);
+        pthread_mutex_unlock(&g_chunks_mutex);
+        return ERR_INTERNAL;
+      }
+      chunks = grown;
+    }
+    ChunkRef *c = &chunks[count++];
+    chunk_hash((const unsigned char *)data + off, n, c->hash);
+    c->len = n;
+
+    // Only chunks nobody references yet need to hit the disk
+    if (!ref_find(c->hash, 0) && store_chunk(c->hash, data + off, n) != OK)
+    {
+      free(chunks);
+      pthread_mutex_unlock(&g_chunks_mutex);
+      return ERR_INTERNAL;
+    }
+    off += n;
+  }
+
+  // Remember what a replaced manifest referenced so it can be released
+  ChunkRef *old = NULL;
+  int old_count = 0;
+  if (ss_chunks_is_manifest(manifest_path))
+    read_manifest(manifest_path, &old, &old_count, NULL);
+
+  char tmp[520];
+  snprintf(tmp, sizeof tmp, "%s.tmp", manifest_path);
+  FILE *fp = fopen(tmp, "w");
+  if (!fp)
+  {
+    free(chunks);
+    free(old);
+    pthread_mutex_unlock(&g_chunks_mutex);
+    return ERR_INTERNAL;
+  }
+  fprintf(fp, MANIFEST_MAGIC " %llu %d\n", (unsigned long long)len, count);
+  for (int i = 0; i < count; i++)
+    fprintf(fp, "%s %llu\n", chunks[i].hash, (unsigned long long)chunks[i].len);
+  fclose(fp);
+  if (rename(tmp, manifest_path) != 0)
+  {
+    unlink(tmp);
+    free(chunks);
+    free(old);
+    pthread_mutex_unlock(&g_chunks_mutex);
+    return ERR_INTERNAL;
+  }
+
+  for (int i = 0; i < count; i++)
+    incref(chunks[i].hash);
+  for (int i = 0; i < old_count; i++)
+    decref(old[i].hash);
+
+  free(chunks);
+  free(old);
+  pthread_mutex_unlock(&g_chunks_mutex);
+  return OK;
+}
+
+// Copy up to maxlen bytes of the manifest's content into buf; returns bytes copied or -1
+static long assemble(const char *manifest_path, char *buf, size_t maxlen)
+{
+  if (!ss_chunks_is_manifest(manifest_path))
+  {
+    // Legacy checkpoint stored as a full copy
+    return ss_compress_read_file(manifest_path, buf, maxlen);
+  }
+
+  ChunkRef *chunks = NULL;
+  int count = 0;
+  if (read_manifest(manifest_path, &chunks, &count, NULL) != OK)
+    return -1;
+
+  size_t pos = 0;
+  for (int i = 0; i < count && pos < maxlen; i++)
+  {
+    char path[512];
+    chunk_path(chunks[i].hash, path, sizeof path);
+    // Only the blocks covering the requested prefix get decoded
+    size_t want = chunks[i].len < maxlen - pos ? chunks[i].len : maxlen - pos;
+    long n = ss_compress_read_file(path, buf + pos, want);
+    if (n != (long)want)
+    {
+      free(chunks);
+      return -1;
+    }
+    pos += n;
+  }
+  free(chunks);
+  return (long)pos;
+}
+
+int ss_chunks_load(const char *manifest_path, char **data_out, size_t *len_out)
+{
+  size_t total = 0;
+  if (ss_chunks_is_manifest(manifest_path))
+  {
+    ChunkRef *chunks = NULL;
+    int count = 0;
+    if (read_manifest(manifest_path, &chunks, &count, &total) != OK)
+      return ERR_INTERNAL;
+    free(chunks);
+  }
+  else
+  {
+    struct stat st;
+    if (stat(manifest_path, &st) != 0)
+      return ERR_NOT_FOUND;
+    total = (size_t)st.st_size;
+  }
+
+  char *data = malloc(total + 1);
+  if (!data)
+    return ERR_INTERNAL;
+  long n = assemble(manifest_path, data, total);
+  if (n < 0)
+  {
+    free(data);
+    return ERR_INTERNAL;
+  }
+  data[n] = '\0';
+  *data_out = data;
+  *len_out = (size_t)n;
+  return OK;
+}
+
+int ss_chunks_read(const char *manifest_path, char *buf, size_t maxlen)
+{
+  if (maxlen == 0)
+    return ERR_BAD_REQUEST;
+  long n = assemble(manifest_path, buf, maxlen - 1);
+  if (n < 0)
+    return ERR_NOT_FOUND;
+  buf[n] = '\0';
+  return OK;
+}
+
+int ss_chunks_remove_manifest(const char *manifest_path)
+{
+  pthread_mutex_lock(&g_chunks_mutex);
+  ChunkRef *chunks = NULL;
+  int count = 0;
+  if (ss_chunks_is_manifest(manifest_path) &&
+      read_manifest(manifest_path, &chunks, &count, NULL) == OK)
+  {
+    for (int i = 0; i < count; i++)
+      decref(chunks[i].hash);
+    free(chunks);
+  }
+  int rc = unlink(manifest_path) == 0 ? OK : ERR_NOT_FOUND;
+  pthread_mutex_unlock(&g_chunks_mutex);
+  return rc;
+}
@@ -0,0 +1,30 @@
+#ifndef SS_CHUNKS_H
+#define SS_CHUNKS_H
+#include <stddef.h>
+
+// Content-addressed chunk store shared by all checkpoints.
+// Data is split with content-defined chunking, each chunk is stored once under
+// its hash and a checkpoint is just a manifest listing chunk hashes.
+
+int ss_chunks_init(void);
+
+// Store new chunks block-compressed (default) or plain; both remain readable
+void ss_chunks_set_compression(int enabled);
+
+// Chunk data and write a manifest at manifest_path, storing only chunks not
+// already present. Replacing an existing manifest releases its old chunks.
+int ss_chunks_write_manifest(const char *manifest_path, const char *data, size_t len);
+
+// Reassemble a manifest into a malloc'd buffer (caller frees)
+int ss_chunks_load(const char *manifest_path, char **data_out, size_t *len_out);
+
+// Reassemble at most maxlen-1 bytes into buf (NUL-terminated)
+int ss_chunks_read(const char *manifest_path, char *buf, size_t maxlen);
+
+// Drop the manifest and release its chunks
+int ss_chunks_remove_manifest(const char *manifest_path);
+
+// 1 if path holds a chunk manifest, 0 for a legacy full-copy checkpoint
+int ss_chunks_is_manifest(const char *path);
+
+#endif
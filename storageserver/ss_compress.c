@@ -0,0 +1,687 @@
+#define _POSIX_C_SOURCE 200809L
+#include "ss_compress.h"
+#include "../common/proto.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Container layout (little-endian):
+//   "DPZ1" | raw_len u32 | block_size u32 | block_count u32
+//   block_count x index entry u32 (stored length | stage flags)
+//   blocks...
+// A block is LZ-compressed unless NO_LZ_FLAG is set, and the result is
+// Huffman-coded when HUFF_FLAG is set.
+#define CONTAINER_MAGIC "DPZ1"
+#define HEADER_SIZE 16
+#define NO_LZ_FLAG 0x80000000u
+#define HUFF_FLAG 0x40000000u
+#define STORED_LEN_MASK 0x3fffffffu
+
+// LZ parameters: 4-byte minimum match, 64 KB window, 4096-entry match finder
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+static void put32(unsigned char *p, uint32_t v)
+{
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// ==================== BLOCK CODEC ====================
+//
+// Each sequence is a token (literal count << 4 | match length - 4), optional
+// length extension bytes, the literals, then a 2-byte match offset. The final
+// sequence carries literals only.
+
+static int put_length(unsigned char *dst, size_t *op, size_t cap, size_t len)
+{
+  while (len >= 255)
+  {
+    if (*op >= cap)
+      return -1;
+    dst[(*op)++] = 255;
+    len -= 255;
+  }
+  if (*op >= cap)
+    return -1;
+  dst[(*op)++] = (unsigned char)len;
+  return 0;
+}
+
+static int emit_sequence(unsigned char *dst, size_t *op, size_t cap,
+                         const unsigned char *lit, size_t lit_len,
+                         size_t offset, size_t match_len)
+{
+  size_t ml = match_len ? match_len - MIN_MATCH : 0;
+  if (*op >= cap)
+    return -1;
+  dst[(*op)++] = (unsigned char)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+  if (lit_len >= 15 && put_length(dst, op, cap, lit_len - 15) != 0)
+    return -1;
+  if (*op + lit_len > cap)
+    return -1;
+  memcpy(dst + *op, lit, lit_len);
+  *op += lit_len;
+  if (!match_len)
+    return 0;
+  if (*op + 2 > cap)
+    return -1;
+  dst[(*op)++] = offset & 0xff;
+  dst[(*op)++] = (offset >> 8) & 0xff;
+  if (ml >= 15 && put_length(dst, op, cap, ml - 15) != 0)
+    return -1;
+  return 0;
+}
+
+// Returns the compressed size, or 0 if the block does not fit in cap
+static size_t block_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap)
+{
+  int32_t table[1 << HASH_BITS];
+  for (int i = 0; i < (1 << HASH_BITS); i++)
+    table[i] = -1;
+
+  size_t ip = 0, anchor = 0, op = 0;
+  while (ip + MIN_MATCH <= n)
+  {
+    uint32_t seq;
+    memcpy(&seq, src + ip, 4);
+    uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+    int32_t ref = table[h];
+    table[h] = (int32_t)ip;
+
+    if (ref >= 0 && ip - ref <= MAX_OFFSET && !memcmp(src + ref, src + ip, MIN_MATCH))
+    {
+      size_t len = MIN_MATCH;
+      while (ip + len < n && src[ref + len] == src[ip + len])
+        len++;
+      if (emit_sequence(dst, &op, cap, src + anchor, ip - anchor, ip - ref, len) != 0)
+        return 0;
+      ip += len;
+      anchor = ip;
+    }
+    else
+    {
+      ip++;
+    }
+  }
+
+  if (emit_sequence(dst, &op, cap, src + anchor, n - anchor, 0, 0) != 0)
+    return 0;
+  return op;
+}
+
+static int get_length(const unsigned char *src, size_t *ip, size_t n, size_t *len)
+{
+  unsigned char b;
+  do
+  {
+    if (*ip >= n)
+      return -1;
+    b = src[(*ip)++];
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+static int block_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t raw_len)
+{
+  size_t ip = 0, op = 0;
+  while (ip < n)
+  {
+    unsigned char token = src[ip++];
+    size_t lit = token >> 4;
+    if (lit == 15 && get_length(src, &ip, n, &lit) != 0)
+      return ERR_INTERNAL;
+    if (ip + lit > n || op + lit > raw_len)
+      return ERR_INTERNAL;
+    memcpy(dst + op, src + ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == n)
+      break;
+
+    if (ip + 2 > n)
+      return ERR_INTERNAL;
+    size_t offset = src[ip] | (src[ip + 1] << 8);
+    ip += 2;
+    size_t len = token & 15;
+    if (len == 15 && get_length(src, &ip, n, &len) != 0)
+      return ERR_INTERNAL;
+    len += MIN_MATCH;
+    if (offset == 0 || offset > op || op + len > raw_len)
+      return ERR_INTERNAL;
+    if (offset >= len)
+    {
+      memcpy(dst + op, dst + op - offset, len);
+      op += len;
+    }
+    else
+    {
+      // Overlapping match repeats its own output, so copy forward bytewise
+      for (size_t i = 0; i < len; i++, op++)
+        dst[op] = dst[op - offset];
+    }
+  }
+  return op == raw_len ? OK : ERR_INTERNAL;
+}
+
+// ==================== HUFFMAN STAGE ====================
+//
+// Canonical Huffman over the LZ output of one block. Code lengths are capped
+// at HUFF_LIMIT bits so decoding is a single table lookup per byte. Layout:
+// 128 bytes of 4-bit code lengths, the decoded length (u32), the bitstream.
+
+#define HUFF_LIMIT 11
+#define HUFF_HEADER (128 + 4)
+
+static void huff_lengths(const uint32_t freq_in[256], unsigned char lens[256])
+{
+  uint32_t freq[256];
+  memcpy(freq, freq_in, sizeof freq);
+
+  while (1)
+  {
+    uint64_t weight[512];
+    int parent[512];
+    int alive[512];
+    int leaf_node[256];
+    int nodes = 0;
+
+    memset(lens, 0, 256);
+    for (int sym = 0; sym < 256; sym++)
+    {
+      leaf_node[sym] = -1;
+      if (freq[sym])
+      {
+        leaf_node[sym] = nodes;
+        weight[nodes] = freq[sym];
+        alive[nodes] = 1;
+        parent[nodes] = -1;
+        nodes++;
+      }
+    }
+    if (nodes == 0)
+      return;
+    if (nodes == 1)
+    {
+      for (int sym = 0; sym < 256; sym++)
+        if (leaf_node[sym] >= 0)
+          lens[sym] = 1;
+      return;
+    }
+
+    // Repeatedly merge the two lightest live nodes
+    for (int live = nodes; live > 1; live--)
+    {
+      int a = -1, b = -1;
+      for (int i = 0; i < nodes; i++)
+      {
+        if (!alive[i])
+          continue;
+        if (a < 0 || weight[i] < weight[a])
+        {
+          b = a;
+          a = i;
+        }
+        else if (b < 0 || weight[i] < weight[b])
+        {
+          b = i;
+        }
+      }
+      weight[nodes] = weight[a] + weight[b];
+      alive[nodes] = 1;
+      parent[nodes] = -1;
+      alive[a] = alive[b] = 0;
+      parent[a] = parent[b] = nodes;
+      nodes++;
+    }
+
+    int max_len = 0;
+    for (int sym = 0; sym < 256; sym++)
+    {
+      if (leaf_node[sym] < 0)
+        continue;
+      int depth = 0;
+      for (int n = leaf_node[sym]; parent[n] >= 0; n = parent[n])
+        depth++;
+      lens[sym] = (unsigned char)(depth < 15 ? depth : 15);
+      if (depth > max_len)
+        max_len = depth;
+    }
+    if (max_len <= HUFF_LIMIT)
+      return;
+
+    // Flatten the distribution and rebuild until the tree is shallow enough
+    for (int sym = 0; sym < 256; sym++)
+      if (freq[sym])
+        freq[sym] = (freq[sym] >> 1) | 1;
+  }
+}
+
+// Canonical codes, bit-reversed for an LSB-first bitstream
+static void huff_codes(const unsigned char lens[256], uint32_t codes[256])
+{
+  int count[HUFF_LIMIT + 2] = {0};
+  for (int sym = 0; sym < 256; sym++)
+    count[lens[sym]]++;
+  count[0] = 0;
+
+  uint32_t next[HUFF_LIMIT + 2] = {0};
+  uint32_t code = 0;
+  for (int len = 1; len <= HUFF_LIMIT; len++)
+  {
+    code = (code + count[len - 1]) << 1;
+    next[len] = code;
+  }
+
+  for (int sym = 0; sym < 256; sym++)
+  {
+    int len = lens[sym];
+    if (!len)
+      continue;
+    uint32_t c = next[len]++;
+    uint32_t rev = 0;
+    for (int i = 0; i < len; i++)
+      rev |= ((c >> i) & 1) << (len - 1 - i);
+    codes[sym] = rev;
+  }
+}
+
+// Returns the coded size, or 0 if it does not fit in cap
+static size_t huff_encode(const unsigned char *src, size_t n, unsigned char *dst, size_t cap)
+{
+  if (cap < HUFF_HEADER)
+    return 0;
+
+  uint32_t freq[256] = {0};
+  for (size_t i = 0; i < n; i++)
+    freq[src[i]]++;
+
+  unsigned char lens[256];
+  uint32_t codes[256] = {0};
+  huff_lengths(freq, lens);
+  huff_codes(lens, codes);
+
+  for (int i = 0; i < 128; i++)
+    dst[i] = (unsigned char)(lens[2 * i] | (lens[2 * i + 1] << 4));
+  put32(dst + 128, (uint32_t)n);
+
+  size_t op = HUFF_HEADER;
+  uint64_t acc = 0;
+  int bits = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    acc |= (uint64_t)codes[src[i]] << bits;
+    bits += lens[src[i]];
+    while (bits >= 8)
+    {
+      if (op >= cap)
+        return 0;
+      dst[op++] = acc & 0xff;
+      acc >>= 8;
+      bits -= 8;
+    }
+  }
+  if (bits > 0)
+  {
+    if (op >= cap)
+      return 0;
+    dst[op++] = acc & 0xff;
+  }
+  return op;
+}
+
+static int huff_decode(const unsigned char *src, size_t n, unsigned char *dst, size_t cap, size_t *out_len)
+{
+  if (n < HUFF_HEADER)
+    return ERR_INTERNAL;
+
+  unsigned char lens[256];
+  for (int i = 0; i < 128; i++)
+  {
+    lens[2 * i] = src[i] & 0x0f;
+    lens[2 * i + 1] = src[i] >> 4;
+  }
+  for (int sym = 0; sym < 256; sym++)
+    if (lens[sym] > HUFF_LIMIT)
+      return ERR_INTERNAL;
+  size_t count = get32(src + 128);
+  if (count > cap)
+    return ERR_INTERNAL;
+
+  uint32_t codes[256] = {0};
+  huff_codes(lens, codes);
+  uint16_t table[1 << HUFF_LIMIT];
+  memset(table, 0, sizeof table);
+  for (int sym = 0; sym < 256; sym++)
+  {
+    int len = lens[sym];
+    if (!len)
+      continue;
+    for (uint32_t fill = codes[sym]; fill < (1u << HUFF_LIMIT); fill += 1u << len)
+      table[fill] = (uint16_t)((sym << 4) | len);
+  }
+
+  size_t ip = HUFF_HEADER;
+  uint64_t acc = 0;
+  int bits = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    while (bits <= 56 && ip < n)
+    {
+      acc |= (uint64_t)src[ip++] << bits;
+      bits += 8;
+    }
+    uint16_t entry = table[acc & ((1u << HUFF_LIMIT) - 1)];
+    int len = entry & 0x0f;
+    if (len == 0 || len > bits)
+      return ERR_INTERNAL;
+    dst[i] = (unsigned char)(entry >> 4);
+    acc >>= len;
+    bits -= len;
+  }
+  *out_len = count;
+  return OK;
+}
+
+// ==================== CONTAINER ====================
+
+int ss_compress_is_container(const char *buf, size_t len)
+{
+  return len >= HEADER_SIZE && !memcmp(buf, CONTAINER_MAGIC, 4);
+}
+
+int ss_compress_encode(const char *data, size_t len, char **out, size_t *outlen)
+{
+  size_t blocks = (len + SS_COMPRESS_BLOCK - 1) / SS_COMPRESS_BLOCK;
+  size_t index_size = HEADER_SIZE + blocks * 4;
+  unsigned char *buf = malloc(index_size + len);
+  unsigned char *stage = malloc(SS_COMPRESS_BLOCK);
+  if (!buf || !stage)
+  {
+    free(buf);
+    free(stage);
+    return ERR_INTERNAL;
+  }
+
+  memcpy(buf, CONTAINER_MAGIC, 4);
+  put32(buf + 4, (uint32_t)len);
+  put32(buf + 8, SS_COMPRESS_BLOCK);
+  put32(buf + 12, (uint32_t)blocks);
+
+  size_t op = index_size;
+  for (size_t b = 0; b < blocks; b++)
+  {
+    const unsigned char *src = (const unsigned char *)data + b * SS_COMPRESS_BLOCK;
+    size_t n = len - b * SS_COMPRESS_BLOCK;
+    if (n > SS_COMPRESS_BLOCK)
+      n = SS_COMPRESS_BLOCK;
+
+    // LZ first, keeping the block as-is if that does not shrink it
+    uint32_t flags = 0;
+    size_t stage_len = block_compress(src, n, stage, n - 1);
+    const unsigned char *stage_out = stage;
+    if (!stage_len)
+    {
+      flags |= NO_LZ_FLAG;
+      stage_out = src;
+      stage_len = n;
+    }
+
+    // Then entropy-code whatever came out, if that helps
+    size_t coded = huff_encode(stage_out, stage_len, buf + op, stage_len - 1);
+    if (coded)
+    {
+      flags |= HUFF_FLAG;
+      stage_len = coded;
+    }
+    else
+    {
+      memcpy(buf + op, stage_out, stage_len);
+    }
+    put32(buf + HEADER_SIZE + b * 4, (uint32_t)stage_len | flags);
+    op += stage_len;
+  }
+  free(stage);
+
+  *out = (char *)buf;
+  *outlen = op;
+  return OK;
+}
+
+// Decode one block described by its index entry; returns its raw length or -1
+static long decode_block(const unsigned char *src, uint32_t entry, size_t raw_len, unsigned char *dst)
+{
+  size_t stored = entry & STORED_LEN_MASK;
+  unsigned char *stage = NULL;
+  if (entry & HUFF_FLAG)
+  {
+    stage = malloc(raw_len ? raw_len : 1);
+    if (!stage || huff_decode(src, stored, stage, raw_len, &stored) != OK)
+    {
+      free(stage);
+      return -1;
+    }
+    src = stage;
+  }
+
+  long result = -1;
+  if (entry & NO_LZ_FLAG)
+  {
+    if (stored == raw_len)
+    {
+      memcpy(dst, src, stored);
+      result = (long)stored;
+    }
+  }
+  else if (block_decompress(src, stored, dst, raw_len) == OK)
+  {
+    result = (long)raw_len;
+  }
+  free(stage);
+  return result;
+}
+
+int ss_compress_decode(const char *buf, size_t len, char **out, size_t *outlen)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+  if (!ss_compress_is_container(buf, len))
+    return ERR_BAD_REQUEST;
+
+  size_t raw_len = get32(p + 4);
+  size_t block_size = get32(p + 8);
+  size_t blocks = get32(p + 12);
+  if (block_size == 0 || HEADER_SIZE + blocks * 4 > len ||
+      blocks != (raw_len + block_size - 1) / block_size)
+    return ERR_INTERNAL;
+
+  char *data = malloc(raw_len + 1);
+  if (!data)
+    return ERR_INTERNAL;
+
+  size_t ip = HEADER_SIZE + blocks * 4;
+  for (size_t b = 0; b < blocks; b++)
+  {
+    uint32_t entry = get32(p + HEADER_SIZE + b * 4);
+    size_t stored = entry & STORED_LEN_MASK;
+    size_t n = raw_len - b * block_size < block_size ? raw_len - b * block_size : block_size;
+    if (ip + stored > len ||
+        decode_block(p + ip, entry, n, (unsigned char *)data + b * block_size) < 0)
+    {
+      free(data);
+      return ERR_INTERNAL;
+    }
+    ip += stored;
+  }
+
+  data[raw_len] = '\0';
+  *out = data;
+  *outlen = raw_len;
+  return OK;
+}
+
+// ==================== FILES ====================
+
+int ss_compress_is_file(const char *path)
+{
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return 0;
+  char header[HEADER_SIZE];
+  size_t n = fread(header, 1, sizeof header, fp);
+  fclose(fp);
+  return ss_compress_is_container(header, n);
+}
+
+long ss_compress_file_size(const char *path)
+{
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return -1;
+  unsigned char header[HEADER_SIZE];
+  size_t n = fread(header, 1, sizeof header, fp);
+  struct stat st;
+  int have_stat = fstat(fileno(fp), &st) == 0;
+  fclose(fp);
+  if (ss_compress_is_container((const char *)header, n))
+    return (long)get32(header + 4);
+  return have_stat ? (long)st.st_size : -1;
+}
+
+int ss_compress_write_file(const char *path, const char *data, size_t len)
+{
+  char *buf = NULL;
+  size_t buflen = 0;
+  if (ss_compress_encode(data, len, &buf, &buflen) != OK)
+    return ERR_INTERNAL;
+
+  // Incompressible content is cheaper to keep plain
+  const char *out = buflen < len ? buf : data;
+  size_t outlen = buflen < len ? buflen : len;
+
+  char tmp[520];
+  snprintf(tmp, sizeof tmp, "%s.tmp", path);
+  FILE *fp = fopen(tmp, "wb");
+  if (!fp)
+  {
+    free(buf);
+    return ERR_INTERNAL;
+  }
+  size_t written = fwrite(out, 1, outlen, fp);
+  fclose(fp);
+  free(buf);
+  if (written != outlen || rename(tmp, path) != 0)
+  {
+    unlink(tmp);
+    return ERR_INTERNAL;
+  }
+  return OK;
+}
+
+int ss_compress_load_file(const char *path, char **out, size_t *outlen)
+{
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return ERR_NOT_FOUND;
+
+  struct stat st;
+  if (fstat(fileno(fp), &st) != 0)
+  {
+    fclose(fp);
+    return ERR_INTERNAL;
+  }
+  char *buf = malloc(st.st_size + 1);
+  if (!buf)
+  {
+    fclose(fp);
+    return ERR_INTERNAL;
+  }
+  size_t n = fread(buf, 1, st.st_size, fp);
+  fclose(fp);
+  buf[n] = '\0';
+
+  if (!ss_compress_is_container(buf, n))
+  {
+    *out = buf;
+    *outlen = n;
+    return OK;
+  }
+
+  int rc = ss_compress_decode(buf, n, out, outlen);
+  free(buf);
+  return rc;
+}
+
+long ss_compress_read_file(const char *path, char *buf, size_t maxlen)
+{
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return -1;
+
+  unsigned char header[HEADER_SIZE];
+  size_t n = fread(header, 1, sizeof header, fp);
+  if (!ss_compress_is_container((const char *)header, n))
+  {
+    // Plain file: copy the prefix directly
+    size_t copied = n < maxlen ? n : maxlen;
+    memcpy(buf, header, copied);
+    if (copied == n)
+      copied += fread(buf + copied, 1, maxlen - copied, fp);
+    fclose(fp);
+    return (long)copied;
+  }
+
+  size_t raw_len = get32(header + 4);
+  size_t block_size = get32(header + 8);
+  size_t blocks = get32(header + 12);
+  if (block_size == 0 || blocks != (raw_len + block_size - 1) / block_size)
+  {
+    fclose(fp);
+    return -1;
+  }
+
+  size_t want = raw_len < maxlen ? raw_len : maxlen;
+  size_t needed = (want + block_size - 1) / block_size;
+  unsigned char *index = malloc(needed * 4 + 1);
+  unsigned char *stored = malloc(block_size);
+  unsigned char *raw = malloc(block_size);
+  long result = -1;
+  // Blocks follow the full index, in order
+  if (index && stored && raw && fread(index, 4, needed, fp) == needed &&
+      fseek(fp, HEADER_SIZE + (long)blocks * 4, SEEK_SET) == 0)
+  {
+    size_t pos = 0;
+    size_t b = 0;
+    for (; b < needed; b++)
+    {
+      uint32_t entry = get32(index + b * 4);
+      size_t len = entry & STORED_LEN_MASK;
+      size_t block_raw = raw_len - b * block_size < block_size ? raw_len - b * block_size : block_size;
+      if (len > block_size || fread(stored, 1, len, fp) != len ||
+          decode_block(stored, entry, block_raw, raw) < 0)
+        break;
+      size_t take = want - pos < block_raw ? want - pos : block_raw;
+      memcpy(buf + pos, raw, take);
+      pos += take;
+    }
+    if (b == needed)
+      result = (long)pos;
+  }
+
+  free(index);
+  free(stored);
+  free(raw);
+  fclose(fp);
+  return result;
+}
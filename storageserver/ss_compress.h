@@ -0,0 +1,38 @@
+#ifndef SS_COMPRESS_H
+#define SS_COMPRESS_H
+#include <stddef.h>
+
+// Block-compressed at-rest format. Data is split into fixed-size blocks that
+// are LZ-compressed independently and preceded by a block index, so a prefix
+// of the content can be decoded without touching the remaining blocks.
+// Readers accept both this container and plain files.
+
+#define SS_COMPRESS_BLOCK 16384
+
+// Encode data into a malloc'd container (caller frees)
+int ss_compress_encode(const char *data, size_t len, char **out, size_t *outlen);
+
+// Decode a whole container held in memory into a malloc'd, NUL-terminated buffer
+int ss_compress_decode(const char *buf, size_t len, char **out, size_t *outlen);
+
+// 1 if buf starts with the container header
+int ss_compress_is_container(const char *buf, size_t len);
+
+// 1 if the file at path is a container, 0 for plain content
+int ss_compress_is_file(const char *path);
+
+// Uncompressed size of a plain or compressed file, or -1
+long ss_compress_file_size(const char *path);
+
+// Write data to path as a container, or plain if compression would not
+// shrink it (tmp + rename)
+int ss_compress_write_file(const char *path, const char *data, size_t len);
+
+// Load a plain or compressed file into a malloc'd, NUL-terminated buffer
+int ss_compress_load_file(const char *path, char **out, size_t *outlen);
+
+// Copy at most maxlen bytes of a plain or compressed file into buf, decoding
+// only the blocks that cover them. Returns bytes copied or -1.
+long ss_compress_read_file(const char *path, char *buf, size_t maxlen);
+
+#endif
@@ -1,5 +1,12 @@
 #define _POSIX_C_SOURCE 200809L
 #include "ss_files.h"
+#include "ss_acl.h"
+#include "ss_search.h"
+#include "ss_trigram.h"
+#include "ss_chunks.h"
+#include "ss_compress.h"
+#include "ss_replicate.h"
+#include "ss_merkle.h"
 #include "../common/proto.h"
 #include "../common/jsonl.h"
 #include <string.h>
@@ -10,17 +17,28 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <pthread.h>
+#include <regex.h>
+#include <sched.h>
 
 #define MAX_FILES 128
 #define DATA_DIR "storageserver/data/files/"
 #define UNDO_DIR "storageserver/data/undo/"
 #define META_DIR "storageserver/data/meta/"
 #define CHECKPOINT_DIR "storageserver/data/checkpoints/"
+#define DEFAULT_UNDO_DEPTH 16
 
 // Global file state cache
 static FileState *g_file_cache[MAX_FILES];
 static int g_file_count = 0;
 static pthread_mutex_t g_file_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int g_undo_depth = DEFAULT_UNDO_DEPTH;
+static int g_cold_days = 0;
+static atomic_int g_trigram_live; // set once the background trigram build has started
+static atomic_ulong g_change_seq; // stamped on a file each time it is loaded or changed
+
+static void copy_sentence(Sentence *dst, const Sentence *src);
+static void free_sentence(Sentence *sent);
+static void remove_file(const char *file);
 
 static int ensure_lock_capacity(FileState *state)
 {
@@ -57,14 +75,28 @@ static int sentence_locked_by_other(FileState *state, int sentence_idx, const ch
   return 0;
 }
 
-static int add_lock(FileState *state, const char *user, int sentence_idx)
+static int add_lock(FileState *state, const char *user, int sentence_idx, int appended)
 {
   if (ensure_lock_capacity(state) != 0)
     return -1;
   SentenceLock *lock = &state->locks[state->lock_count++];
+  memset(lock, 0, sizeof *lock);
   lock->sentence_idx = sentence_idx;
   strncpy(lock->user, user, sizeof(lock->user) - 1);
   lock->user[sizeof(lock->user) - 1] = '\0';
+  lock->work = calloc(1, sizeof(Sentence));
+  if (!lock->work)
+  {
+    state->lock_count--;
+    return -1;
+  }
+  lock->span = 1;
+  lock->old_span = appended ? 0 : 1;
+  if (!appended)
+  {
+    copy_sentence(&lock->before, &state->sentences[sentence_idx]);
+    copy_sentence(&lock->work[0], &state->sentences[sentence_idx]);
+  }
   return 0;
 }
 
@@ -74,6 +106,10 @@ static int remove_lock(FileState *state, const char *user)
   {
     if (!strcmp(state->locks[i].user, user))
     {
+      free_sentence(&state->locks[i].before);
+      for (int j = 0; j < state->locks[i].span; j++)
+        free_sentence(&state->locks[i].work[j]);
+      free(state->locks[i].work);
       for (int j = i; j < state->lock_count - 1; j++)
       {
         state->locks[j] = state->locks[j + 1];
@@ -90,6 +126,521 @@ static int any_active_locks(FileState *state)
   return state->lock_count > 0;
 }
 
+// ==================== SNAPSHOTS ====================
+//
+// Readers never look at the sentence arrays or take the cache lock. Each
+// commit renders the committed document into an immutable, reference-counted
+// snapshot and publishes it in a table of atomic pointers, one slot per
+// cached file. A reader finds the slot by file name and pins the snapshot
+// inside a read-side section; a writer that swaps a snapshot out waits for
+// the sections that may have loaded it before dropping its reference.
+
+struct Snapshot
+{
+  atomic_int refs;
+  const FileState *state; // owner, only ever compared
+  char filename[256];
+  unsigned long version;
+  size_t len;
+  char text[];
+};
+
+static _Atomic(Snapshot *) g_published[MAX_FILES];
+
+// Read-side sections are counted per epoch parity; retiring a snapshot
+// advances the epoch and waits for the old parity to drain
+static atomic_uint g_read_epoch;
+static atomic_long g_readers[2];
+static pthread_mutex_t g_retire_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned read_enter(void)
+{
+  for (;;)
+  {
+    unsigned e = atomic_load(&g_read_epoch) & 1;
+    atomic_fetch_add(&g_readers[e], 1);
+    if ((atomic_load(&g_read_epoch) & 1) == e)
+      return e;
+    // A writer moved the epoch on before we were counted
+    atomic_fetch_sub(&g_readers[e], 1);
+  }
+}
+
+static void read_exit(unsigned e)
+{
+  atomic_fetch_sub(&g_readers[e], 1);
+}
+
+// Return once no read-side section can still hold a pointer unpublished
+// before the call. Sections only load a pointer and take a reference, so
+// the wait is a few instructions long.
+static void wait_for_readers(void)
+{
+  pthread_mutex_lock(&g_retire_mutex);
+  unsigned old = atomic_fetch_add(&g_read_epoch, 1) & 1;
+  while (atomic_load(&g_readers[old]) > 0)
+    sched_yield();
+  pthread_mutex_unlock(&g_retire_mutex);
+}
+
+static void snapshot_release(Snapshot *snap)
+{
+  if (snap && atomic_fetch_sub(&snap->refs, 1) == 1)
+    free(snap);
+}
+
+// Pin the snapshot published for state or, with state NULL, for file;
+// *slot (if given) is where it was found
+static Snapshot *snapshot_pin(const FileState *state, const char *file, int *slot)
+{
+  Snapshot *found = NULL;
+  unsigned e = read_enter();
+  for (int i = 0; i < MAX_FILES && !found; i++)
+  {
+    Snapshot *snap = atomic_load(&g_published[i]);
+    if (snap && (state ? snap->state == state : !strcmp(snap->filename, file)))
+    {
+      atomic_fetch_add(&snap->refs, 1);
+      found = snap;
+      if (slot)
+        *slot = i;
+    }
+  }
+  read_exit(e);
+  return found;
+}
+
+static Snapshot *snapshot_acquire(FileState *state)
+{
+  return snapshot_pin(state, NULL, NULL);
+}
+
+static int snapshot_slot(const FileState *state)
+{
+  int slot = -1;
+  snapshot_release(snapshot_pin(state, NULL, &slot));
+  return slot;
+}
+
+// Render the committed sentences as the text readers will see at version
+static Snapshot *render_snapshot(FileState *state, unsigned long version)
+{
+  size_t len = 0;
+  for (int i = 0; i < state->sentence_count; i++)
+  {
+    Sentence *sent = &state->sentences[i];
+    for (int j = 0; j < sent->word_count; j++)
+      len += strlen(sent->words[j]) + 1;
+    if (sent->delimiter)
+      len++;
+  }
+
+  Snapshot *snap = malloc(sizeof(Snapshot) + len + 1);
+  if (!snap)
+    return NULL;
+  atomic_init(&snap->refs, 1);
+  snap->state = state;
+  snprintf(snap->filename, sizeof snap->filename, "%s", state->filename);
+  snap->version = version;
+  rebuild_file(state, snap->text, (int)len + 1);
+  snap->len = strlen(snap->text);
+  return snap;
+}
+
+// Swap what slot holds for snap (NULL to unpublish) and retire the old one
+static void swap_snapshot(int slot, Snapshot *snap)
+{
+  Snapshot *old = atomic_exchange(&g_published[slot], snap);
+  if (old)
+  {
+    wait_for_readers();
+    snapshot_release(old);
+  }
+}
+
+// Make snap the version readers see; takes over the caller's reference.
+// Publishing is done under the cache lock, so slots change hands one at a
+// time.
+static void install_snapshot(FileState *state, Snapshot *snap)
+{
+  int slot = snapshot_slot(state);
+  for (int i = 0; i < MAX_FILES && slot < 0; i++)
+  {
+    Snapshot *empty = NULL;
+    if (atomic_compare_exchange_strong(&g_published[i], &empty, snap))
+      return;
+  }
+  if (slot < 0)
+    snapshot_release(snap); // more files than slots; never published
+  else
+    swap_snapshot(slot, snap);
+}
+
+static void publish_snapshot(FileState *state)
+{
+  Snapshot *snap = render_snapshot(state, state->version);
+  if (snap)
+    install_snapshot(state, snap);
+}
+
+// ==================== ACCESS TIMES ====================
+//
+// A read records when and by whom the file was last read in memory only,
+// against its published slot. The note is folded into the metadata under
+// the cache lock when the metadata is shown or next written, and the index
+// thread writes out files with a read pending every few seconds.
+
+#define ACCESS_FLUSH_SECONDS 5
+
+typedef struct
+{
+  char file[256];
+  char user[64];
+  time_t when; // 0 if nothing is pending
+} AccessNote;
+
+static AccessNote g_access_notes[MAX_FILES];
+static pthread_mutex_t g_access_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void note_access(int slot, const Snapshot *snap, const char *user)
+{
+  pthread_mutex_lock(&g_access_mutex);
+  AccessNote *note = &g_access_notes[slot];
+  if (strcmp(note->file, snap->filename) != 0)
+  {
+    snprintf(note->file, sizeof note->file, "%s", snap->filename);
+    note->user[0] = '\0';
+  }
+  note->when = time(NULL);
+  if (user && user[0])
+    snprintf(note->user, sizeof note->user, "%s", user);
+  pthread_mutex_unlock(&g_access_mutex);
+}
+
+// Move a pending read of state into its metadata; returns 1 if there was
+// one. Caller holds the cache lock.
+static int fold_access(FileState *state)
+{
+  int slot = snapshot_slot(state);
+  if (slot < 0)
+    return 0;
+
+  int folded = 0;
+  pthread_mutex_lock(&g_access_mutex);
+  AccessNote *note = &g_access_notes[slot];
+  if (note->when && !strcmp(note->file, state->filename))
+  {
+    if (note->when >= state->metadata.accessed_time)
+    {
+      state->metadata.accessed_time = note->when;
+      if (note->user[0])
+        snprintf(state->metadata.last_access_user, sizeof state->metadata.last_access_user, "%s", note->user);
+      folded = 1;
+    }
+    note->when = 0;
+  }
+  pthread_mutex_unlock(&g_access_mutex);
+  return folded;
+}
+
+// ==================== INDEX QUEUE ====================
+//
+// The search indexes, the Merkle tree and the replication log follow
+// committed content, but none of that is done under the cache lock. A
+// change queues what the indexes need, in commit order, and the queue is
+// applied after the lock is dropped: by the committing thread, by a search
+// that wants the indexes current, or by the index thread.
+
+typedef struct IndexJob
+{
+  FileState *state;   // index key; only its Merkle digest is touched here
+  char filename[256];
+  char origin[64];
+  Snapshot *snap;     // committed text, for the Merkle digest
+  char **sentences;   // the new sentences as the matcher sees them
+  int count;          // all of them, or the inserted ones of a splice
+  int idx;            // a commit's splice: sentences [idx, idx + inserted)
+  int removed;        // replaced removed ones; -1 if the whole text is new
+  int inserted;
+  int replicate;      // a change the replica has to hear about
+  struct IndexJob *next;
+} IndexJob;
+
+static IndexJob *g_index_head = NULL;
+static IndexJob **g_index_tail = &g_index_head;
+static pthread_mutex_t g_index_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_index_cond = PTHREAD_COND_INITIALIZER;
+
+// Held while applying jobs, so they apply one at a time and in order, and
+// while a file's index keys (name, origin) change or it is dropped. Taken
+// after the cache lock, never before it.
+static pthread_mutex_t g_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Words joined by single spaces, followed by the delimiter
+static char *sentence_text(const Sentence *sent)
+{
+  size_t need = 2;
+  for (int w = 0; w < sent->word_count; w++)
+    need += strlen(sent->words[w]) + 1;
+  char *text = malloc(need);
+  if (!text)
+    return NULL;
+  size_t len = 0;
+  for (int w = 0; w < sent->word_count; w++)
+  {
+    if (w)
+      text[len++] = ' ';
+    size_t wl = strlen(sent->words[w]);
+    memcpy(text + len, sent->words[w], wl);
+    len += wl;
+  }
+  if (sent->delimiter)
+    text[len++] = sent->delimiter;
+  text[len] = '\0';
+  return text;
+}
+
+static char **render_sentences(const FileState *state, int from, int count)
+{
+  char **texts = calloc(count ? count : 1, sizeof(char *));
+  if (!texts)
+    return NULL;
+  for (int i = 0; i < count; i++)
+  {
+    texts[i] = sentence_text(&state->sentences[from + i]);
+    if (!texts[i])
+      texts[i] = strdup("");
+  }
+  return texts;
+}
+
+static void free_sentences(char **texts, int count)
+{
+  for (int i = 0; texts && i < count; i++)
+    free(texts[i]);
+  free(texts);
+}
+
+// Queue the indexes' view of state as committed in snap (the caller's
+// reference is not taken), changed by splicing inserted sentences at idx in
+// place of removed ones, or by a whole new text if removed is -1. Caller
+// holds the cache lock.
+static void queue_index(FileState *state, Snapshot *snap, int idx, int removed, int inserted, int replicate)
+{
+  IndexJob *job = calloc(1, sizeof(IndexJob));
+  if (!job)
+    return;
+  job->state = state;
+  snprintf(job->filename, sizeof job->filename, "%s", state->filename);
+  snprintf(job->origin, sizeof job->origin, "%s", state->origin);
+  job->snap = snap;
+  atomic_fetch_add(&snap->refs, 1);
+  // A splice renders only the sentences it inserted
+  int from = removed < 0 ? 0 : idx;
+  int count = removed < 0 ? state->sentence_count : inserted;
+  job->sentences = render_sentences(state, from, count);
+  job->count = job->sentences ? count : 0;
+  job->idx = idx;
+  job->removed = removed;
+  job->inserted = inserted;
+  job->replicate = replicate;
+
+  pthread_mutex_lock(&g_index_queue_mutex);
+  *g_index_tail = job;
+  g_index_tail = &job->next;
+  pthread_cond_signal(&g_index_cond);
+  pthread_mutex_unlock(&g_index_queue_mutex);
+}
+
+// Put the file's current version and content in its origin's Merkle tree.
+// Caller holds g_index_mutex.
+static void merkle_update(FileState *state, const char *origin, const char *filename, const Snapshot *snap)
+{
+  unsigned long long digest = ss_merkle_digest(filename, snap ? snap->version : state->version,
+                                               snap ? snap->text : "", snap ? snap->len : 0);
+  ss_merkle_update(origin, filename, state->digest, digest);
+  state->digest = digest;
+}
+
+static void merkle_refresh(FileState *state)
+{
+  Snapshot *snap = snapshot_acquire(state);
+  merkle_update(state, state->origin, state->filename, snap);
+  snapshot_release(snap);
+}
+
+static void merkle_forget(FileState *state)
+{
+  ss_merkle_update(state->origin, state->filename, state->digest, 0);
+  state->digest = 0;
+}
+
+// Files loaded before the trigram build starts are picked up by the build
+// thread
+static void apply_index_job(IndexJob *job)
+{
+  merkle_update(job->state, job->origin, job->filename, job->snap);
+  if (job->sentences)
+  {
+    int live = atomic_load(&g_trigram_live);
+    if (job->removed < 0)
+    {
+      ss_search_index_file(job->state, job->sentences, job->count);
+      if (live)
+        ss_trigram_index_file(job->state, job->sentences, job->count);
+    }
+    else
+    {
+      ss_search_splice_file(job->state, job->idx, job->removed, job->sentences, job->count);
+      if (live)
+        ss_trigram_splice_file(job->state, job->idx, job->removed, job->sentences, job->count);
+    }
+  }
+  if (job->replicate)
+    ss_replicate_note(job->filename);
+}
+
+// Apply every queued job. Caller holds g_index_mutex.
+static void index_drain_locked(void)
+{
+  for (;;)
+  {
+    pthread_mutex_lock(&g_index_queue_mutex);
+    IndexJob *job = g_index_head;
+    if (job)
+    {
+      g_index_head = job->next;
+      if (!g_index_head)
+        g_index_tail = &g_index_head;
+    }
+    pthread_mutex_unlock(&g_index_queue_mutex);
+    if (!job)
+      break;
+
+    apply_index_job(job);
+    snapshot_release(job->snap);
+    free_sentences(job->sentences, job->count);
+    free(job);
+  }
+}
+
+static void index_drain(void)
+{
+  pthread_mutex_lock(&g_index_mutex);
+  index_drain_locked();
+  pthread_mutex_unlock(&g_index_mutex);
+}
+
+static void save_metadata(const FileState *state);
+
+// Write out the metadata of files read since the last flush
+static void flush_access(void)
+{
+  pthread_mutex_lock(&g_file_cache_mutex);
+  for (int i = 0; i < g_file_count; i++)
+  {
+    if (g_file_cache[i] && fold_access(g_file_cache[i]))
+      save_metadata(g_file_cache[i]);
+  }
+  pthread_mutex_unlock(&g_file_cache_mutex);
+}
+
+// Applies jobs nobody else drained (loads, mostly) and flushes access times
+static void *index_thread(void *arg)
+{
+  (void)arg;
+  time_t next_flush = time(NULL) + ACCESS_FLUSH_SECONDS;
+  for (;;)
+  {
+    pthread_mutex_lock(&g_index_queue_mutex);
+    struct timespec until = {next_flush, 0};
+    while (!g_index_head && time(NULL) < next_flush)
+      pthread_cond_timedwait(&g_index_cond, &g_index_queue_mutex, &until);
+    pthread_mutex_unlock(&g_index_queue_mutex);
+
+    index_drain();
+    if (time(NULL) >= next_flush)
+    {
+      flush_access();
+      next_flush = time(NULL) + ACCESS_FLUSH_SECONDS;
+    }
+  }
+  return NULL;
+}
+
+static void on_file_loaded(FileState *state)
+{
+  state->change_seq = atomic_fetch_add(&g_change_seq, 1) + 1;
+  Snapshot *snap = render_snapshot(state, state->version);
+  if (!snap)
+    return;
+  queue_index(state, snap, 0, -1, 0, 0);
+  install_snapshot(state, snap);
+}
+
+// A committed change: new version (persisted with the metadata), the same
+// work as a load, and a record for the replica
+static void on_file_changed(FileState *state)
+{
+  state->version++;
+  state->change_seq = atomic_fetch_add(&g_change_seq, 1) + 1;
+  Snapshot *snap = render_snapshot(state, state->version);
+  if (!snap)
+  {
+    ss_replicate_note(state->filename);
+    return;
+  }
+  queue_index(state, snap, 0, -1, 0, 1);
+  install_snapshot(state, snap);
+}
+
+static int write_snapshot(const FileState *state, const Snapshot *snap);
+
+// Like on_file_changed for the inserted sentences spliced in memory at idx
+// in place of removed ones, but the new text reaches the data file before
+// readers, the indexes or the replica see it, and the indexes only redo
+// the spliced sentences. On ERR_INTERNAL nothing was published and the
+// caller undoes the splice.
+static int commit_file_change(FileState *state, int idx, int removed, int inserted)
+{
+  Snapshot *snap = render_snapshot(state, state->version + 1);
+  if (!snap)
+    return ERR_INTERNAL;
+  if (write_snapshot(state, snap) != OK)
+  {
+    snapshot_release(snap);
+    return ERR_INTERNAL;
+  }
+  state->version++;
+  state->change_seq = atomic_fetch_add(&g_change_seq, 1) + 1;
+  queue_index(state, snap, idx, removed, inserted, 1);
+  install_snapshot(state, snap);
+  return OK;
+}
+
+// Drop a file from the derived indexes and unpublish it before it is
+// freed. Caller holds the cache lock, so no job for it can be queued after
+// the drain.
+static void on_file_removed(FileState *state)
+{
+  pthread_mutex_lock(&g_index_mutex);
+  index_drain_locked();
+  merkle_forget(state);
+  ss_search_remove_file(state);
+  ss_trigram_remove_file(state);
+  pthread_mutex_unlock(&g_index_mutex);
+  ss_acl_index_remove_file(state);
+
+  int slot = snapshot_slot(state);
+  if (slot >= 0)
+  {
+    pthread_mutex_lock(&g_access_mutex);
+    g_access_notes[slot].when = 0;
+    pthread_mutex_unlock(&g_access_mutex);
+    swap_snapshot(slot, NULL);
+  }
+}
+
 // Helper: ensure directory path exists (mkdir -p)
 static void ensure_dirs(const char *path)
 {
@@ -156,6 +707,22 @@ static void insert_word_at(Sentence *sent, int idx, const char *word)
   sent->word_count++;
 }
 
+static void copy_sentence(Sentence *dst, const Sentence *src)
+{
+  memset(dst, 0, sizeof *dst);
+  dst->delimiter = src->delimiter;
+  for (int i = 0; i < src->word_count; i++)
+    add_word_to_sentence(dst, src->words[i]);
+}
+
+static void free_sentence(Sentence *sent)
+{
+  for (int i = 0; i < sent->word_count; i++)
+    free(sent->words[i]);
+  free(sent->words);
+  memset(sent, 0, sizeof *sent);
+}
+
 // Helper: Add sentence to file state
 static void add_sentence_to_file(FileState *fs, Sentence sent)
 {
@@ -170,24 +737,12 @@ static void add_sentence_to_file(FileState *fs, Sentence sent)
 // Tokenize file into sentences and words
 int tokenize_file(const char *filepath, FileState *state)
 {
-  FILE *fp = fopen(filepath, "r");
-  if (!fp)
-    return ERR_NOT_FOUND;
-
-  fseek(fp, 0, SEEK_END);
-  long fsize = ftell(fp);
-  fseek(fp, 0, SEEK_SET);
-
-  char *content = malloc(fsize + 1);
-  if (!content)
-  {
-    fclose(fp);
-    return ERR_INTERNAL;
-  }
-
-  size_t bytes_read = fread(content, 1, fsize, fp);
-  content[bytes_read] = 0;
-  fclose(fp);
+  // Cold documents may be stored block-compressed
+  char *content = NULL;
+  size_t bytes_read = 0;
+  int rc = ss_compress_load_file(filepath, &content, &bytes_read);
+  if (rc != OK)
+    return rc;
 
   state->sentence_count = 0;
   state->sentence_capacity = 0;
@@ -294,9 +849,21 @@ void free_file_state(FileState *state)
   }
   if (state->locks)
   {
+    for (int i = 0; i < state->lock_count; i++)
+    {
+      free_sentence(&state->locks[i].before);
+      for (int j = 0; j < state->locks[i].span; j++)
+        free_sentence(&state->locks[i].work[j]);
+      free(state->locks[i].work);
+    }
     free(state->locks);
   }
 
+  for (int i = 0; i < state->undo.count; i++)
+    free_sentence(&state->undo.entries[(state->undo.head + i) % state->undo.capacity].old);
+  free(state->undo.entries);
+  memset(&state->undo, 0, sizeof state->undo);
+
   state->locks = NULL;
   state->lock_count = 0;
   state->lock_capacity = 0;
@@ -348,12 +915,16 @@ static void save_metadata(const FileState *state)
   if (!fp)
     return;
 
-  fprintf(fp, "{\"owner\":\"%s\",\"created\":%ld,\"modified\":%ld,\"accessed\":%ld,\"last_access_user\":\"%s\",\"access_list\":[",
+  fprintf(fp, "{\"owner\":\"%s\",\"created\":%ld,\"modified\":%ld,\"accessed\":%ld,\"last_access_user\":\"%s\",\"version\":%lu,",
           state->metadata.owner,
           (long)state->metadata.created_time,
           (long)state->metadata.modified_time,
           (long)state->metadata.accessed_time,
-          state->metadata.last_access_user[0] ? state->metadata.last_access_user : state->metadata.owner);
+          state->metadata.last_access_user[0] ? state->metadata.last_access_user : state->metadata.owner,
+          state->version);
+  if (state->origin[0])
+    fprintf(fp, "\"origin\":\"%s\",", state->origin);
+  fprintf(fp, "\"access_list\":[");
 
   // Save access control list
   for (int i = 0; i < state->metadata.access_count; i++)
@@ -412,6 +983,12 @@ static int load_metadata(FileState *state)
     else
       state->metadata.accessed_time = state->metadata.modified_time;
 
+    long long version = 0;
+    if (json_get_long(line, "version", &version) == 0 && version > 0)
+      state->version = (unsigned long)version;
+
+    json_get_str(line, "origin", state->origin, sizeof state->origin);
+
     char last_access_user[64];
     if (json_get_str(line, "last_access_user", last_access_user, sizeof last_access_user) == 0)
     {
@@ -524,78 +1101,332 @@ int check_access(const char *file, const char *user, int need_write)
   return ERR_UNAUTHORIZED;
 }
 
-// Load or get file from cache
-static FileState *load_file(const char *filename)
-{
-  FileState *cached = find_file_in_cache(filename);
-  if (cached)
-    return cached;
+// ==================== UNDO HISTORY ====================
+//
+// Each commit records a reverse delta: the sentence the session locked and
+// how many sentences it turned into. Entries live in a bounded ring per file
+// and are mirrored to an append-only log in UNDO_DIR, so commit and undo cost
+// is proportional to the edited sentences rather than the whole document.
 
-  char filepath[512];
-  snprintf(filepath, sizeof filepath, "%s%s", DATA_DIR, filename);
+#define UNDO_AT(ring, i) (&(ring)->entries[((ring)->head + (i)) % (ring)->capacity])
 
-  FileState *state = calloc(1, sizeof(FileState));
-  if (!state)
-    return NULL;
+void ss_files_set_undo_depth(int depth)
+{
+  g_undo_depth = depth < 0 ? 0 : depth;
+}
 
-  strncpy(state->filename, filename, sizeof state->filename - 1);
+// Returns 0, or -1 if the path does not fit in out
+static int undo_log_path(const char *file, char *out, size_t outlen)
+{
+  int n = snprintf(out, outlen, "%s%s.undo", UNDO_DIR, file);
+  return n < 0 || (size_t)n >= outlen ? -1 : 0;
+}
 
-  if (tokenize_file(filepath, state) != OK)
+// Helper: mkdir -p for the directory containing path
+static void ensure_parent_dir(const char *path)
+{
+  char dir[512];
+  snprintf(dir, sizeof dir, "%s", path);
+  char *slash = strrchr(dir, '/');
+  if (!slash)
+    return;
+  *slash = '\0';
+  ensure_dirs(dir);
+}
+
+// Takes ownership of entry->old; evicts the oldest entry when the ring is full
+static void undo_push(UndoRing *ring, UndoEntry *entry)
+{
+  if (g_undo_depth == 0)
   {
-    free(state);
-    return NULL;
+    free_sentence(&entry->old);
+    return;
   }
 
-  // Try to load metadata first
-  if (load_metadata(state) != 0)
+  if (!ring->entries)
   {
-    // No metadata found, initialize from file stats
-    struct stat st;
-    if (stat(filepath, &st) == 0)
+    ring->entries = calloc(g_undo_depth, sizeof(UndoEntry));
+    if (!ring->entries)
     {
-      state->metadata.created_time = st.st_ctime;
-      state->metadata.modified_time = st.st_mtime;
-      state->metadata.accessed_time = st.st_atime;
+      free_sentence(&entry->old);
+      return;
     }
-    // Owner unknown for legacy files
-    state->metadata.owner[0] = 0;
-    state->owner[0] = 0;
+    ring->capacity = g_undo_depth;
   }
 
-  update_metadata_counts(state);
-
-  if (g_file_count < MAX_FILES)
+  if (ring->count == ring->capacity)
   {
-    g_file_cache[g_file_count++] = state;
+    free_sentence(&ring->entries[ring->head].old);
+    ring->head = (ring->head + 1) % ring->capacity;
+    ring->count--;
   }
 
-  return state;
+  *UNDO_AT(ring, ring->count) = *entry;
+  ring->count++;
 }
 
-// Helper function to recursively scan directories
-static void scan_directory_recursive(const char *base_dir, const char *relative_path)
+static void undo_remove_at(UndoRing *ring, int pos)
 {
-  char scan_path[512];
-  if (relative_path && relative_path[0])
-  {
-    snprintf(scan_path, sizeof(scan_path), "%s%s", base_dir, relative_path);
-  }
-  else
-  {
-    snprintf(scan_path, sizeof(scan_path), "%s", base_dir);
-  }
+  free_sentence(&UNDO_AT(ring, pos)->old);
+  for (int i = pos; i < ring->count - 1; i++)
+    *UNDO_AT(ring, i) = *UNDO_AT(ring, i + 1);
+  ring->count--;
+}
 
-  DIR *dir = opendir(scan_path);
-  if (!dir)
-    return;
+// Drop all history for a file, e.g. once its content is replaced wholesale
+static void undo_reset(FileState *state)
+{
+  UndoRing *ring = &state->undo;
+  for (int i = 0; i < ring->count; i++)
+    free_sentence(&UNDO_AT(ring, i)->old);
+  ring->head = 0;
+  ring->count = 0;
+  ring->log_records = 0;
+
+  char path[512];
+  undo_log_path(state->filename, path, sizeof path);
+  unlink(path);
+}
 
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != NULL)
+// Words are escaped so a quote, backslash or newline in one survives the
+// round trip; "words" is always the last field so undo_read_words can find
+// its end without a full JSON parser
+static void undo_write_entry(FILE *fp, const UndoEntry *entry)
+{
+  fprintf(fp, "{\"user\":\"%s\",\"idx\":%d,\"new\":%d,\"old\":%d,\"delim\":%d,\"words\":\"",
+          entry->user, entry->sentence_idx, entry->new_span, entry->old_span, (int)entry->old.delimiter);
+  for (int i = 0; i < entry->old.word_count; i++)
   {
-    // Skip hidden files and .gitkeep
-    if (entry->d_name[0] == '.' || strcmp(entry->d_name, ".gitkeep") == 0)
+    if (i)
+      fputc(' ', fp);
+    for (const char *c = entry->old.words[i]; *c; c++)
     {
-      continue;
+      if (*c == '"' || *c == '\\')
+        fprintf(fp, "\\%c", *c);
+      else if (*c == '\n')
+        fputs("\\n", fp);
+      else
+        fputc(*c, fp);
+    }
+  }
+  fprintf(fp, "\"}\n");
+}
+
+// Unescape the "words" value of a log line into out (at least as long as
+// line). Returns 0, or -1 if the field is missing or unterminated.
+static int undo_read_words(const char *line, char *out)
+{
+  const char *p = strstr(line, "\"words\":\"");
+  if (!p)
+    return -1;
+  p += strlen("\"words\":\"");
+  while (*p && *p != '"')
+  {
+    if (*p == '\\' && p[1])
+    {
+      p++;
+      *out++ = *p == 'n' ? '\n' : *p;
+      p++;
+    }
+    else
+      *out++ = *p++;
+  }
+  *out = '\0';
+  return *p == '"' ? 0 : -1;
+}
+
+static void undo_rewrite_log(FileState *state)
+{
+  char logpath[512];
+  undo_log_path(state->filename, logpath, sizeof logpath);
+
+  if (state->undo.count == 0)
+  {
+    unlink(logpath);
+    state->undo.log_records = 0;
+    return;
+  }
+
+  ensure_parent_dir(logpath);
+  FILE *fp = fopen(logpath, "w");
+  if (!fp)
+    return;
+  for (int i = 0; i < state->undo.count; i++)
+    undo_write_entry(fp, UNDO_AT(&state->undo, i));
+  fclose(fp);
+  state->undo.log_records = state->undo.count;
+}
+
+static void undo_append_log(FileState *state, const UndoEntry *entry)
+{
+  if (state->undo.log_records >= 2 * g_undo_depth)
+  {
+    undo_rewrite_log(state);
+    return;
+  }
+
+  char logpath[512];
+  undo_log_path(state->filename, logpath, sizeof logpath);
+  ensure_parent_dir(logpath);
+  FILE *fp = fopen(logpath, "a");
+  if (!fp)
+    return;
+  undo_write_entry(fp, entry);
+  fclose(fp);
+  state->undo.log_records++;
+}
+
+// Replay the on-disk log into the ring; only the newest g_undo_depth entries survive
+static void undo_load(FileState *state)
+{
+  char logpath[512];
+  undo_log_path(state->filename, logpath, sizeof logpath);
+  FILE *fp = fopen(logpath, "r");
+  if (!fp)
+    return;
+
+  char *line = NULL;
+  size_t cap = 0;
+  while (getline(&line, &cap, fp) > 0)
+  {
+    UndoEntry entry;
+    memset(&entry, 0, sizeof entry);
+    int delim = 0;
+    if (json_get_str(line, "user", entry.user, sizeof entry.user) != 0 ||
+        json_get_int(line, "idx", &entry.sentence_idx) != 0 ||
+        json_get_int(line, "new", &entry.new_span) != 0 ||
+        json_get_int(line, "old", &entry.old_span) != 0)
+      continue;
+    json_get_int(line, "delim", &delim);
+    entry.old.delimiter = (char)delim;
+
+    char *words = malloc(strlen(line) + 1);
+    if (!words)
+      break;
+    if (undo_read_words(line, words) == 0)
+    {
+      for (char *w = strtok(words, " "); w; w = strtok(NULL, " "))
+        add_word_to_sentence(&entry.old, w);
+    }
+    free(words);
+
+    undo_push(&state->undo, &entry);
+    state->undo.log_records++;
+  }
+  free(line);
+  fclose(fp);
+}
+
+// Remove `remove` sentences at idx and insert copies of `insert` in their place
+static void replace_sentences(FileState *state, int idx, int remove, const Sentence *insert, int insert_count)
+{
+  for (int i = idx; i < idx + remove; i++)
+    free_sentence(&state->sentences[i]);
+
+  int tail = state->sentence_count - (idx + remove);
+  int new_count = state->sentence_count - remove + insert_count;
+  if (new_count > state->sentence_capacity)
+  {
+    state->sentence_capacity = new_count;
+    state->sentences = realloc(state->sentences, state->sentence_capacity * sizeof(Sentence));
+  }
+  memmove(&state->sentences[idx + insert_count], &state->sentences[idx + remove], tail * sizeof(Sentence));
+  for (int i = 0; i < insert_count; i++)
+    copy_sentence(&state->sentences[idx + i], &insert[i]);
+  state->sentence_count = new_count;
+}
+
+// Write a rendered snapshot to the data file
+static int write_snapshot(const FileState *state, const Snapshot *snap)
+{
+  char path[512];
+  snprintf(path, sizeof path, "%s%s", DATA_DIR, state->filename);
+  FILE *fp = fopen(path, "w");
+  if (!fp)
+    return ERR_INTERNAL;
+  size_t written = snap->len ? fwrite(snap->text, 1, snap->len, fp) : 0;
+  int closed = fclose(fp) == 0;
+  return written == snap->len && closed ? OK : ERR_INTERNAL;
+}
+
+// Load or get file from cache
+static FileState *load_file(const char *filename)
+{
+  FileState *cached = find_file_in_cache(filename);
+  if (cached)
+    return cached;
+
+  char filepath[512];
+  snprintf(filepath, sizeof filepath, "%s%s", DATA_DIR, filename);
+
+  FileState *state = calloc(1, sizeof(FileState));
+  if (!state)
+    return NULL;
+
+  strncpy(state->filename, filename, sizeof state->filename - 1);
+
+  // Stat before reading so the access time is not our own
+  struct stat st;
+  int have_stat = stat(filepath, &st) == 0;
+
+  if (tokenize_file(filepath, state) != OK)
+  {
+    free(state);
+    return NULL;
+  }
+
+  // Try to load metadata first
+  if (load_metadata(state) != 0)
+  {
+    // No metadata found, initialize from file stats
+    if (have_stat)
+    {
+      state->metadata.created_time = st.st_ctime;
+      state->metadata.modified_time = st.st_mtime;
+      state->metadata.accessed_time = st.st_atime;
+    }
+    // Owner unknown for legacy files
+    state->metadata.owner[0] = 0;
+    state->owner[0] = 0;
+  }
+
+  update_metadata_counts(state);
+  undo_load(state);
+
+  if (g_file_count < MAX_FILES)
+  {
+    g_file_cache[g_file_count++] = state;
+    ss_acl_index_add_file(state);
+    on_file_loaded(state);
+  }
+
+  return state;
+}
+
+// Helper function to recursively scan directories
+static void scan_directory_recursive(const char *base_dir, const char *relative_path)
+{
+  char scan_path[512];
+  if (relative_path && relative_path[0])
+  {
+    snprintf(scan_path, sizeof(scan_path), "%s%s", base_dir, relative_path);
+  }
+  else
+  {
+    snprintf(scan_path, sizeof(scan_path), "%s", base_dir);
+  }
+
+  DIR *dir = opendir(scan_path);
+  if (!dir)
+    return;
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    // Skip hidden files and .gitkeep
+    if (entry->d_name[0] == '.' || strcmp(entry->d_name, ".gitkeep") == 0)
+    {
+      continue;
     }
 
     char filepath[512];
@@ -634,6 +1465,59 @@ static void scan_directory_recursive(const char *base_dir, const char *relative_
   closedir(dir);
 }
 
+// Index a file the build has not reached yet. Caller holds the cache lock
+// and g_index_mutex with the queue drained, so commits queued later apply
+// on top of what is indexed here.
+static void trigram_build_file(FileState *state)
+{
+  if (ss_trigram_has_file(state))
+    return;
+  char **texts = render_sentences(state, 0, state->sentence_count);
+  if (!texts)
+    return;
+  ss_trigram_index_file(state, texts, state->sentence_count);
+  free_sentences(texts, state->sentence_count);
+}
+
+// Index every cached file one at a time so requests are never held up for
+// the whole build. Commits made meanwhile index themselves; a final pass
+// under the cache lock catches files that moved in the cache while we were
+// walking it.
+static void *trigram_build_thread(void *arg)
+{
+  (void)arg;
+  for (int i = 0;; i++)
+  {
+    pthread_mutex_lock(&g_file_cache_mutex);
+    pthread_mutex_lock(&g_index_mutex);
+    index_drain_locked();
+    if (i >= g_file_count)
+    {
+      for (int j = 0; j < g_file_count; j++)
+        trigram_build_file(g_file_cache[j]);
+      ss_trigram_set_ready();
+      pthread_mutex_unlock(&g_index_mutex);
+      pthread_mutex_unlock(&g_file_cache_mutex);
+      break;
+    }
+    trigram_build_file(g_file_cache[i]);
+    pthread_mutex_unlock(&g_index_mutex);
+    pthread_mutex_unlock(&g_file_cache_mutex);
+  }
+  return NULL;
+}
+
+static void start_trigram_build(void)
+{
+  atomic_store(&g_trigram_live, 1);
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, trigram_build_thread, NULL) == 0)
+    pthread_detach(tid);
+  else
+    trigram_build_thread(NULL);
+}
+
 // Initialize file subsystem
 int ss_files_init(void)
 {
@@ -645,40 +1529,464 @@ int ss_files_init(void)
   mkdir("storageserver/data/meta", 0755);
   mkdir("storageserver/data/undo", 0755);
   mkdir("storageserver/data/checkpoints", 0755);
+  ss_chunks_init();
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, index_thread, NULL) == 0)
+    pthread_detach(tid);
 
   // Load existing files from disk recursively
   scan_directory_recursive(DATA_DIR, "");
+  ss_files_compress_cold();
+  start_trigram_build();
+
+  return OK;
+}
+
+// ==================== COLD STORAGE ====================
+//
+// Documents nobody has accessed for g_cold_days are rewritten on disk in the
+// block-compressed format. The in-memory copy is unaffected, and the next
+// commit writes the file back as plain text.
+
+#define COLD_MIN_BYTES 1024
+
+void ss_files_set_cold_days(int days)
+{
+  g_cold_days = days < 0 ? 0 : days;
+}
+
+// Returns the number of documents compressed
+int ss_files_compress_cold(void)
+{
+  if (g_cold_days == 0)
+    return 0;
+
+  time_t cutoff = time(NULL) - (time_t)g_cold_days * 24 * 60 * 60;
+  int compressed = 0;
+
+  pthread_mutex_lock(&g_file_cache_mutex);
+  for (int i = 0; i < g_file_count; i++)
+  {
+    FileState *state = g_file_cache[i];
+    if (state && fold_access(state))
+      save_metadata(state);
+    if (!state || any_active_locks(state) || state->metadata.accessed_time > cutoff)
+      continue;
+
+    char filepath[512];
+    snprintf(filepath, sizeof filepath, "%s%s", DATA_DIR, state->filename);
+    struct stat st;
+    if (stat(filepath, &st) != 0 || st.st_size < COLD_MIN_BYTES || ss_compress_is_file(filepath))
+      continue;
+
+    char *data = NULL;
+    size_t len = 0;
+    if (ss_compress_load_file(filepath, &data, &len) != OK)
+      continue;
+    if (ss_compress_write_file(filepath, data, len) == OK && ss_compress_is_file(filepath))
+      compressed++;
+    free(data);
+  }
+  pthread_mutex_unlock(&g_file_cache_mutex);
+
+  return compressed;
+}
+
+// Documents held in the cache and the bytes of their committed text
+void ss_files_usage(int *files, long long *bytes)
+{
+  long long total = 0;
+  pthread_mutex_lock(&g_file_cache_mutex);
+  for (int i = 0; i < g_file_count; i++)
+  {
+    Snapshot *snap = g_file_cache[i] ? snapshot_acquire(g_file_cache[i]) : NULL;
+    if (!snap)
+      continue;
+    total += (long long)snap->len;
+    snapshot_release(snap);
+  }
+  *files = g_file_count;
+  pthread_mutex_unlock(&g_file_cache_mutex);
+  *bytes = total;
+}
+
+int ss_files_version(const char *file, unsigned long *version)
+{
+  pthread_mutex_lock(&g_file_cache_mutex);
+  FileState *state = find_file_in_cache(file);
+  if (state)
+    *version = state->version;
+  pthread_mutex_unlock(&g_file_cache_mutex);
+  return state ? OK : ERR_NOT_FOUND;
+}
+
+unsigned long ss_files_changes(unsigned long since, char *out, size_t size)
+{
+  unsigned long cursor = atomic_load(&g_change_seq);
+  unsigned long first_left_out = 0;
+  size_t used = 0;
+  out[0] = '\0';
+
+  pthread_mutex_lock(&g_file_cache_mutex);
+  for (int i = 0; i < g_file_count; i++)
+  {
+    FileState *state = g_file_cache[i];
+    if (!state || state->change_seq <= since)
+      continue;
+    int n = snprintf(out + used, size - used, "%s%s:%lu", used ? "," : "", state->filename, state->version);
+    if (n < 0 || (size_t)n >= size - used)
+    {
+      out[used] = '\0';
+      if (!first_left_out || state->change_seq < first_left_out)
+        first_left_out = state->change_seq;
+      continue;
+    }
+    used += (size_t)n;
+  }
+  pthread_mutex_unlock(&g_file_cache_mutex);
+
+  // Whatever did not fit is picked up by the next call
+  return first_left_out ? first_left_out - 1 : cursor;
+}
+
+// ==================== REPLICATION ====================
+//
+// The primary ships whole file states (see ss_replicate.c); the replica
+// installs them without bumping versions or recording replication records
+// of its own.
+
+int ss_files_export(const char *file, ReplicaFile *out, char **content, size_t *len)
+{
+  pthread_mutex_lock(&g_file_cache_mutex);
+  FileState *state = find_file_in_cache(file);
+  Snapshot *snap = state ? snapshot_acquire(state) : NULL;
+  if (!snap)
+  {
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return ERR_NOT_FOUND;
+  }
+
+  memset(out, 0, sizeof *out);
+  out->version = state->version;
+  snprintf(out->owner, sizeof out->owner, "%s", state->metadata.owner);
+  size_t used = 0;
+  for (int i = 0; i < state->metadata.access_count; i++)
+  {
+    const AccessEntry *ae = &state->metadata.access_list[i];
+    int n = snprintf(out->acl + used, sizeof out->acl - used, "%s%s:%s", used ? "," : "",
+                     ae->username, ae->can_write ? "W" : "R");
+    if (n < 0 || (size_t)n >= sizeof out->acl - used)
+    {
+      out->acl[used] = '\0';
+      break;
+    }
+    used += (size_t)n;
+  }
+  pthread_mutex_unlock(&g_file_cache_mutex);
+
+  *content = malloc(snap->len + 1);
+  if (*content)
+  {
+    memcpy(*content, snap->text, snap->len + 1);
+    *len = snap->len;
+  }
+  snapshot_release(snap);
+  return *content ? OK : ERR_INTERNAL;
+}
+
+// Replace the access list with "user:W,user:R,..."
+static void set_access_list(FileState *state, const char *acl)
+{
+  state->metadata.access_count = 0;
+  char copy[REPLICA_ACL_MAX];
+  snprintf(copy, sizeof copy, "%s", acl);
+  char *save = NULL;
+  for (char *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+  {
+    char *colon = strrchr(tok, ':');
+    if (!colon)
+      continue;
+    *colon = '\0';
+    if (state->metadata.access_count >= state->metadata.access_capacity)
+    {
+      int capacity = state->metadata.access_capacity ? state->metadata.access_capacity * 2 : 4;
+      AccessEntry *list = realloc(state->metadata.access_list, capacity * sizeof(AccessEntry));
+      if (!list)
+        return;
+      state->metadata.access_list = list;
+      state->metadata.access_capacity = capacity;
+    }
+    AccessEntry *ae = &state->metadata.access_list[state->metadata.access_count++];
+    memset(ae, 0, sizeof *ae);
+    strncpy(ae->username, tok, sizeof ae->username - 1);
+    ae->can_read = 1;
+    ae->can_write = colon[1] == 'W';
+  }
+}
+
+int ss_files_import(const char *file, const ReplicaFile *in, const char *content, size_t len)
+{
+  char filepath[512], metapath[512];
+  snprintf(filepath, sizeof filepath, "%s%s", DATA_DIR, file);
+  snprintf(metapath, sizeof metapath, "%s%s.json", META_DIR, file);
+
+  pthread_mutex_lock(&g_file_cache_mutex);
+
+  FileState *state = find_file_in_cache(file);
+  if (state && any_active_locks(state))
+  {
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return ERR_LOCKED;
+  }
+  if (!state && g_file_count >= MAX_FILES)
+  {
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return ERR_INTERNAL;
+  }
+
+  ensure_parent_dir(filepath);
+  ensure_parent_dir(metapath);
+  FILE *fp = fopen(filepath, "w");
+  if (!fp)
+  {
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return ERR_INTERNAL;
+  }
+  size_t written = len ? fwrite(content, 1, len, fp) : 0;
+  fclose(fp);
+  if (written != len)
+  {
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return ERR_INTERNAL;
+  }
 
+  int is_new = state == NULL;
+  if (is_new)
+  {
+    state = calloc(1, sizeof(FileState));
+    if (!state)
+    {
+      pthread_mutex_unlock(&g_file_cache_mutex);
+      return ERR_INTERNAL;
+    }
+    strncpy(state->filename, file, sizeof state->filename - 1);
+    strncpy(state->metadata.filename, file, sizeof state->metadata.filename - 1);
+    state->metadata.created_time = time(NULL);
+  }
+  else
+  {
+    // Owner, ACL and origin may change below
+    pthread_mutex_lock(&g_index_mutex);
+    index_drain_locked();
+    merkle_forget(state);
+    pthread_mutex_unlock(&g_index_mutex);
+    ss_acl_index_remove_file(state);
+    for (int i = 0; i < state->sentence_count; i++)
+      free_sentence(&state->sentences[i]);
+    free(state->sentences);
+  }
+
+  if (tokenize_file(filepath, state) != OK)
+  {
+    if (is_new)
+    {
+      free(state);
+    }
+    else
+    {
+      ss_acl_index_add_file(state);
+      pthread_mutex_lock(&g_index_mutex);
+      merkle_refresh(state);
+      pthread_mutex_unlock(&g_index_mutex);
+    }
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return ERR_INTERNAL;
+  }
+
+  snprintf(state->owner, sizeof state->owner, "%s", in->owner);
+  snprintf(state->metadata.owner, sizeof state->metadata.owner, "%s", in->owner);
+  set_access_list(state, in->acl);
+  snprintf(state->origin, sizeof state->origin, "%s", in->origin);
+  state->version = in->version;
+  state->metadata.modified_time = time(NULL);
+  update_metadata_counts(state);
+  undo_reset(state);
+
+  if (is_new)
+    g_file_cache[g_file_count++] = state;
+  ss_acl_index_add_file(state);
+  on_file_loaded(state);
+  save_metadata(state);
+
+  pthread_mutex_unlock(&g_file_cache_mutex);
+  index_drain();
   return OK;
 }
 
+int ss_files_is_replica_copy(const char *file)
+{
+  pthread_mutex_lock(&g_file_cache_mutex);
+  FileState *state = find_file_in_cache(file);
+  int copy = state && state->origin[0];
+  pthread_mutex_unlock(&g_file_cache_mutex);
+  return copy;
+}
+
+int ss_files_merkle_entries(const char *origin, const int *leaves, int count, char *out, size_t size)
+{
+  size_t used = 0;
+  int listed = 0;
+  out[0] = '\0';
+
+  pthread_mutex_lock(&g_file_cache_mutex);
+  pthread_mutex_lock(&g_index_mutex);
+  index_drain_locked();
+  for (int i = 0; i < g_file_count; i++)
+  {
+    FileState *state = g_file_cache[i];
+    if (!state || !state->digest || strcmp(state->origin, origin) != 0)
+      continue;
+    int leaf = ss_merkle_leaf(state->filename), wanted = 0;
+    for (int j = 0; j < count && !wanted; j++)
+      wanted = leaves[j] == leaf;
+    if (!wanted)
+      continue;
+    int n = snprintf(out + used, size - used, "%s|%lu|%016llx;;", state->filename, state->version, state->digest);
+    if (n < 0 || (size_t)n >= size - used)
+    {
+      out[used] = '\0';
+      break;
+    }
+    used += (size_t)n;
+    listed++;
+  }
+  pthread_mutex_unlock(&g_index_mutex);
+  pthread_mutex_unlock(&g_file_cache_mutex);
+  return listed;
+}
+
+int ss_files_import_delete(const char *file)
+{
+  pthread_mutex_lock(&g_file_cache_mutex);
+  FileState *state = find_file_in_cache(file);
+  if (state && any_active_locks(state))
+  {
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return ERR_LOCKED;
+  }
+  remove_file(file);
+  pthread_mutex_unlock(&g_file_cache_mutex);
+  return OK;
+}
+
+// Pin file's published snapshot, loading the file into the cache first if
+// it is not there yet. NULL if there is no such file; files beyond the
+// cache limit are never published and read as missing, as before.
+static Snapshot *pin_file(const char *file, int *slot)
+{
+  Snapshot *snap = snapshot_pin(NULL, file, slot);
+  if (snap)
+    return snap;
+
+  pthread_mutex_lock(&g_file_cache_mutex);
+  FileState *state = load_file(file);
+  snap = state ? snapshot_pin(state, NULL, slot) : NULL;
+  pthread_mutex_unlock(&g_file_cache_mutex);
+  return snap;
+}
+
 // Read file content
 int ss_files_read(const char *file, const char *user, char *content, int maxlen)
 {
+  // A cached file is read from its published snapshot without the cache
+  // lock, so a reader neither waits for nor sees an open write session or a
+  // commit in progress. Reads do not need an ACL entry (can be changed).
+  int slot;
+  Snapshot *snap = pin_file(file, &slot);
+  if (!snap)
+    return ERR_NOT_FOUND;
+  note_access(slot, snap, user);
+
+  size_t n = snap->len < (size_t)maxlen - 1 ? snap->len : (size_t)maxlen - 1;
+  memcpy(content, snap->text, n);
+  content[n] = '\0';
+  snapshot_release(snap);
+  return OK;
+}
+
+// Check STREAM access and record the read; returns the committed version
+// so the stream layer can reuse frames already built for it
+int ss_files_stream_version(const char *file, const char *user, unsigned long *version)
+{
+  // Same access rule as ss_files_read
+  int slot;
+  Snapshot *snap = pin_file(file, &slot);
+  if (!snap)
+    return ERR_NOT_FOUND;
+  note_access(slot, snap, user);
+  *version = snap->version;
+  snapshot_release(snap);
+  return OK;
+}
+
+// Copy out the tokens STREAM sends: every word in reading order, with a
+// '?' or '!' delimiter kept on the last word of its sentence
+int ss_files_stream_words(const char *file, char ***words, int *count, unsigned long *version)
+{
+  *words = NULL;
+  *count = 0;
+
+  pthread_mutex_lock(&g_file_cache_mutex);
   FileState *state = load_file(file);
   if (!state)
+  {
+    pthread_mutex_unlock(&g_file_cache_mutex);
     return ERR_NOT_FOUND;
+  }
 
-  // Check read access
-  int access_check = check_access(file, user, 0);
-  if (access_check != OK && access_check != ERR_UNAUTHORIZED)
+  int total = 0;
+  for (int s = 0; s < state->sentence_count; s++)
+    total += state->sentences[s].word_count;
+
+  char **list = calloc(total ? total : 1, sizeof(char *));
+  if (!list)
   {
-    return access_check;
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return ERR_INTERNAL;
   }
-  // For now, allow reads even without explicit access (can be changed)
 
-  int rc = rebuild_file(state, content, maxlen);
-  if (rc == OK)
+  int n = 0;
+  for (int s = 0; s < state->sentence_count; s++)
   {
-    state->metadata.accessed_time = time(NULL);
-    if (user && user[0])
+    Sentence *sent = &state->sentences[s];
+    for (int w = 0; w < sent->word_count; w++)
     {
-      strncpy(state->metadata.last_access_user, user, sizeof state->metadata.last_access_user - 1);
-      state->metadata.last_access_user[sizeof state->metadata.last_access_user - 1] = '\0';
+      size_t len = strlen(sent->words[w]);
+      int keep_delim = w == sent->word_count - 1 && (sent->delimiter == '?' || sent->delimiter == '!');
+      list[n] = malloc(len + 2);
+      if (!list[n])
+        continue;
+      memcpy(list[n], sent->words[w], len);
+      if (keep_delim)
+        list[n][len++] = sent->delimiter;
+      list[n][len] = '\0';
+      n++;
     }
-    save_metadata(state);
   }
-  return rc;
+  *version = state->version;
+  pthread_mutex_unlock(&g_file_cache_mutex);
+
+  *words = list;
+  *count = n;
+  return OK;
+}
+
+void ss_files_free_words(char **words, int count)
+{
+  for (int i = 0; i < count; i++)
+    free(words[i]);
+  free(words);
 }
 
 // Begin write session
@@ -701,41 +2009,21 @@ int ss_files_write_begin(const char *file, const char *user, int sentence_idx)
     return access_check;
   }
 
-  // Special case: empty file and writing to sentence 0
-  if (state->sentence_count == 0 && sentence_idx == 0)
-  {
-    // Create first empty sentence (no delimiter until user adds one)
-    Sentence empty_sent = {0};
-    empty_sent.delimiter = 0; // No delimiter initially
-    add_sentence_to_file(state, empty_sent);
-  }
-
-  // Allow writing to one past the last sentence ONLY if previous sentence has delimiter
+  // Writing one past the last sentence appends a new one, allowed only for
+  // the first sentence or after a delimiter. The new sentence lives in the
+  // session's private copy until commit.
+  int appended = 0;
   if (sentence_idx == state->sentence_count)
   {
-    if (sentence_idx == 0)
+    if (sentence_idx > 0 && state->sentences[sentence_idx - 1].delimiter == 0)
     {
-      // Allow creating first sentence even without delimiter from previous
-      Sentence empty_sent = {0};
-      empty_sent.delimiter = 0;
-      add_sentence_to_file(state, empty_sent);
-    }
-    else if (sentence_idx > 0 && state->sentences[sentence_idx - 1].delimiter != 0)
-    {
-      // Previous sentence has delimiter, allow creating new sentence
-      Sentence empty_sent = {0};
-      empty_sent.delimiter = 0;
-      add_sentence_to_file(state, empty_sent);
-    }
-    else
-    {
-      // Previous sentence has no delimiter, can't create new sentence
       pthread_mutex_unlock(&g_file_cache_mutex);
       return ERR_BAD_REQUEST;
     }
+    appended = 1;
   }
 
-  if (sentence_idx < 0 || sentence_idx >= state->sentence_count)
+  if (sentence_idx < 0 || sentence_idx > state->sentence_count)
   {
     pthread_mutex_unlock(&g_file_cache_mutex);
     return ERR_BAD_REQUEST;
@@ -759,7 +2047,7 @@ int ss_files_write_begin(const char *file, const char *user, int sentence_idx)
     return ERR_LOCKED;
   }
 
-  if (add_lock(state, user, sentence_idx) != 0)
+  if (add_lock(state, user, sentence_idx, appended) != 0)
   {
     pthread_mutex_unlock(&g_file_cache_mutex);
     return ERR_INTERNAL;
@@ -769,18 +2057,11 @@ int ss_files_write_begin(const char *file, const char *user, int sentence_idx)
   return OK;
 }
 
-// Edit word in sentence
-int ss_files_write_edit(const char *file, const char *user, int word_index, const char *content)
+// Apply an edit to the session's private copy; the committed document and
+// its readers are untouched until ETIRW
+static int apply_edit(SentenceLock *lock, int word_index, const char *content)
 {
-  FileState *state = find_file_in_cache(file);
-  if (!state)
-    return ERR_NOT_FOUND;
-
-  SentenceLock *lock = find_lock(state, user);
-  if (!lock)
-    return ERR_BAD_REQUEST;
-
-  Sentence *sent = &state->sentences[lock->sentence_idx];
+  Sentence *sent = &lock->work[0];
 
   if (word_index < 0 || word_index > sent->word_count)
   {
@@ -868,25 +2149,17 @@ int ss_files_write_edit(const char *file, const char *user, int word_index, cons
           add_word_to_sentence(&new_sent, word_start);
         }
 
-        if (state->sentence_count >= state->sentence_capacity)
-        {
-          state->sentence_capacity = state->sentence_capacity == 0 ? 8 : state->sentence_capacity * 2;
-          state->sentences = realloc(state->sentences, state->sentence_capacity * sizeof(Sentence));
-        }
-
-        for (int i = state->sentence_count; i > lock->sentence_idx + 1; i--)
+        Sentence *work = realloc(lock->work, (lock->span + 1) * sizeof(Sentence));
+        if (!work)
         {
-          state->sentences[i] = state->sentences[i - 1];
-        }
-        state->sentences[lock->sentence_idx + 1] = new_sent;
-        state->sentence_count++;
-        for (int i = 0; i < state->lock_count; i++)
-        {
-          if (state->locks[i].sentence_idx > lock->sentence_idx)
-          {
-            state->locks[i].sentence_idx++;
-          }
+          free_sentence(&new_sent);
+          free(content_copy);
+          return ERR_INTERNAL;
         }
+        lock->work = work;
+        memmove(&lock->work[2], &lock->work[1], (lock->span - 1) * sizeof(Sentence));
+        lock->work[1] = new_sent;
+        lock->span++;
       }
 
       free(content_copy);
@@ -912,53 +2185,81 @@ int ss_files_write_edit(const char *file, const char *user, int word_index, cons
   return OK;
 }
 
-// Commit write session
-int ss_files_write_commit(const char *file, const char *user)
+// Edit word in sentence
+int ss_files_write_edit(const char *file, const char *user, int word_index, const char *content)
 {
+  pthread_mutex_lock(&g_file_cache_mutex);
+
   FileState *state = find_file_in_cache(file);
   if (!state)
+  {
+    pthread_mutex_unlock(&g_file_cache_mutex);
     return ERR_NOT_FOUND;
+  }
 
   SentenceLock *lock = find_lock(state, user);
   if (!lock)
   {
+    pthread_mutex_unlock(&g_file_cache_mutex);
     return ERR_BAD_REQUEST;
   }
 
-  char src_path[512], undo_path[512];
-  snprintf(src_path, sizeof src_path, "%s%s", DATA_DIR, file);
-  snprintf(undo_path, sizeof undo_path, "%s%s.bak", UNDO_DIR, file);
+  int rc = apply_edit(lock, word_index, content);
+  pthread_mutex_unlock(&g_file_cache_mutex);
+  return rc;
+}
+
+// Commit write session
+int ss_files_write_commit(const char *file, const char *user)
+{
+  pthread_mutex_lock(&g_file_cache_mutex);
 
-  FILE *src = fopen(src_path, "r");
-  FILE *dst = fopen(undo_path, "w");
-  if (src && dst)
+  FileState *state = find_file_in_cache(file);
+  if (!state)
   {
-    char buf[4096];
-    size_t n;
-    while ((n = fread(buf, 1, sizeof buf, src)) > 0)
-    {
-      fwrite(buf, 1, n, dst);
-    }
-    fclose(src);
-    fclose(dst);
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return ERR_NOT_FOUND;
   }
-  else
+
+  SentenceLock *lock = find_lock(state, user);
+  if (!lock)
   {
-    if (src)
-      fclose(src);
-    if (dst)
-      fclose(dst);
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return ERR_BAD_REQUEST;
   }
 
-  char content[8192];
-  rebuild_file(state, content, sizeof content);
-
-  FILE *fp = fopen(src_path, "w");
-  if (!fp)
+  // Splice the private copy into the committed document; sessions further
+  // down move by the number of sentences it added
+  int idx = lock->sentence_idx;
+  replace_sentences(state, idx, lock->old_span, lock->work, lock->span);
+  if (commit_file_change(state, idx, lock->old_span, lock->span) != OK)
+  {
+    // The data file still holds the old text, so memory goes back to it
+    replace_sentences(state, idx, lock->span, &lock->before, lock->old_span);
+    remove_lock(state, user);
+    pthread_mutex_unlock(&g_file_cache_mutex);
     return ERR_INTERNAL;
-  fprintf(fp, "%s", content);
-  fclose(fp);
+  }
+  for (int i = 0; i < state->lock_count; i++)
+  {
+    if (&state->locks[i] != lock && state->locks[i].sentence_idx > idx)
+      state->locks[i].sentence_idx += lock->span - lock->old_span;
+  }
 
+  // Record the reverse delta; the entry takes over the lock's pre-image
+  UndoEntry entry;
+  memset(&entry, 0, sizeof entry);
+  strncpy(entry.user, user, sizeof entry.user - 1);
+  entry.sentence_idx = idx;
+  entry.new_span = lock->span;
+  entry.old_span = lock->old_span;
+  entry.old = lock->before;
+  memset(&lock->before, 0, sizeof lock->before);
+  if (g_undo_depth > 0)
+    undo_append_log(state, &entry);
+  undo_push(&state->undo, &entry);
+
+  fold_access(state);
   state->metadata.modified_time = time(NULL);
   state->metadata.accessed_time = time(NULL);
   if (user && user[0])
@@ -973,58 +2274,114 @@ int ss_files_write_commit(const char *file, const char *user)
   // Save metadata to disk
   save_metadata(state);
 
+  pthread_mutex_unlock(&g_file_cache_mutex);
+  index_drain();
   return OK;
 }
 
-// Undo last commit
+// Undo the user's most recent commit that is still applied
 int ss_files_undo(const char *file, const char *user)
 {
+  pthread_mutex_lock(&g_file_cache_mutex);
+
   FileState *state = load_file(file);
   if (!state)
+  {
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return ERR_NOT_FOUND;
+  }
+
+  int access_check = check_access(file, user, 1);
+  if (access_check != OK)
+  {
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return access_check;
+  }
+
+  // Sentence positions are only stable while no session is in progress
+  if (any_active_locks(state))
+  {
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return ERR_LOCKED;
+  }
+
+  // The user's undo cursor is their newest entry still in the ring
+  UndoRing *ring = &state->undo;
+  int pos = -1;
+  for (int i = ring->count - 1; i >= 0; i--)
+  {
+    if (!strcmp(UNDO_AT(ring, i)->user, user))
+    {
+      pos = i;
+      break;
+    }
+  }
+  if (pos < 0)
+  {
+    pthread_mutex_unlock(&g_file_cache_mutex);
     return ERR_NOT_FOUND;
+  }
 
-  int access_check = check_access(file, user, 1);
-  if (access_check != OK)
+  // Carry the entry's position forward through later commits; refuse if
+  // someone has since edited the same sentences
+  UndoEntry *target = UNDO_AT(ring, pos);
+  int cur = target->sentence_idx;
+  for (int i = pos + 1; i < ring->count; i++)
   {
-    return access_check;
+    UndoEntry *later = UNDO_AT(ring, i);
+    if (later->sentence_idx + later->old_span <= cur)
+      cur += later->new_span - later->old_span;
+    else if (later->sentence_idx < cur + target->new_span)
+    {
+      pthread_mutex_unlock(&g_file_cache_mutex);
+      return ERR_CONFLICT;
+    }
+  }
+  if (cur < 0 || cur + target->new_span > state->sentence_count)
+  {
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return ERR_CONFLICT;
   }
 
-  char src_path[512], undo_path[512];
-  snprintf(src_path, sizeof src_path, "%s%s", DATA_DIR, file);
-  snprintf(undo_path, sizeof undo_path, "%s%s.bak", UNDO_DIR, file);
-
-  FILE *undo = fopen(undo_path, "r");
-  if (!undo)
-    return ERR_NOT_FOUND;
-
-  fseek(undo, 0, SEEK_END);
-  long size = ftell(undo);
-  fseek(undo, 0, SEEK_SET);
-
-  char *content = malloc(size + 1);
-  if (!content)
+  // Keep what the undo replaces until the undone text is on disk
+  Sentence *undone = calloc(target->new_span ? target->new_span : 1, sizeof(Sentence));
+  if (!undone)
   {
-    fclose(undo);
+    pthread_mutex_unlock(&g_file_cache_mutex);
     return ERR_INTERNAL;
   }
+  for (int i = 0; i < target->new_span; i++)
+    copy_sentence(&undone[i], &state->sentences[cur + i]);
 
-  fread(content, 1, size, undo);
-  content[size] = 0;
-  fclose(undo);
+  replace_sentences(state, cur, target->new_span, &target->old, target->old_span);
+  int rc = commit_file_change(state, cur, target->new_span, target->old_span);
+  if (rc != OK)
+    replace_sentences(state, cur, target->old_span, undone, target->new_span);
+  for (int i = 0; i < target->new_span; i++)
+    free_sentence(&undone[i]);
+  free(undone);
+  if (rc != OK)
+  {
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return rc;
+  }
 
-  FILE *fp = fopen(src_path, "w");
-  if (!fp)
+  // Later entries positioned after the undone range move with it
+  int shift = target->old_span - target->new_span;
+  int at = target->sentence_idx;
+  for (int i = pos + 1; i < ring->count; i++)
   {
-    free(content);
-    return ERR_INTERNAL;
+    UndoEntry *later = UNDO_AT(ring, i);
+    if (later->sentence_idx + later->old_span <= at)
+      at += later->new_span - later->old_span;
+    else
+      later->sentence_idx += shift;
   }
-  fprintf(fp, "%s", content);
-  fclose(fp);
-  free(content);
+  undo_remove_at(ring, pos);
+  undo_rewrite_log(state);
 
-  free_file_state(state);
-  tokenize_file(src_path, state);
   update_metadata_counts(state);
+  fold_access(state);
   state->metadata.modified_time = time(NULL);
   state->metadata.accessed_time = time(NULL);
   if (user && user[0])
@@ -1034,11 +2391,13 @@ int ss_files_undo(const char *file, const char *user)
   }
   save_metadata(state);
 
+  pthread_mutex_unlock(&g_file_cache_mutex);
+  index_drain();
   return OK;
 }
 
-// Create new file
-int ss_files_create(const char *file, const char *owner)
+// Caller holds the cache lock, which publishing the new file needs
+static int create_file(const char *file, const char *owner)
 {
   // Check if file is already in cache
   if (find_file_in_cache(file))
@@ -1087,6 +2446,8 @@ int ss_files_create(const char *file, const char *owner)
   if (g_file_count < MAX_FILES)
   {
     g_file_cache[g_file_count++] = state;
+    ss_acl_index_add_file(state);
+    on_file_changed(state);
   }
 
   // Save metadata to disk
@@ -1095,28 +2456,29 @@ int ss_files_create(const char *file, const char *owner)
   return OK;
 }
 
-// Delete file
-int ss_files_delete(const char *file, const char *actor)
+// Create new file
+int ss_files_create(const char *file, const char *owner)
 {
-  FileState *state = load_file(file);
-  if (!state)
-    return ERR_NOT_FOUND;
-
-  if (strcmp(state->metadata.owner, actor) != 0)
-    return ERR_UNAUTHORIZED;
-
-  if (any_active_locks(state))
-    return ERR_LOCKED;
+  pthread_mutex_lock(&g_file_cache_mutex);
+  int rc = create_file(file, owner);
+  pthread_mutex_unlock(&g_file_cache_mutex);
+  index_drain();
+  return rc;
+}
 
+// Drop a file from the cache and remove it with its metadata and undo log
+static void remove_file(const char *file)
+{
   char filepath[512], undopath[512], metapath[512];
   snprintf(filepath, sizeof filepath, "%s%s", DATA_DIR, file);
-  snprintf(undopath, sizeof undopath, "%s%s.bak", UNDO_DIR, file);
+  undo_log_path(file, undopath, sizeof undopath);
   snprintf(metapath, sizeof metapath, "%s%s.json", META_DIR, file);
 
   for (int i = 0; i < g_file_count; i++)
   {
     if (g_file_cache[i] && strcmp(g_file_cache[i]->filename, file) == 0)
     {
+      on_file_removed(g_file_cache[i]);
       free_file_state(g_file_cache[i]);
       free(g_file_cache[i]);
       for (int j = i; j < g_file_count - 1; j++)
@@ -1131,17 +2493,32 @@ int ss_files_delete(const char *file, const char *actor)
   unlink(filepath);
   unlink(undopath);
   unlink(metapath);
-
-  return OK;
 }
 
-// Get file info
-int ss_files_get_info(const char *file, char *info, int maxlen)
+// Delete file
+int ss_files_delete(const char *file, const char *actor)
 {
+  pthread_mutex_lock(&g_file_cache_mutex);
   FileState *state = load_file(file);
+  int rc = OK;
   if (!state)
-    return ERR_NOT_FOUND;
+    rc = ERR_NOT_FOUND;
+  else if (strcmp(state->metadata.owner, actor) != 0)
+    rc = ERR_UNAUTHORIZED;
+  else if (any_active_locks(state))
+    rc = ERR_LOCKED;
+  else
+    remove_file(file);
+  pthread_mutex_unlock(&g_file_cache_mutex);
 
+  if (rc == OK)
+    ss_replicate_note(file);
+  return rc;
+}
+
+// INFO line for a cached file. Caller holds the cache lock.
+static int format_info(FileState *state, const char *file, char *info, int maxlen)
+{
   struct stat st;
   char filepath[512];
   snprintf(filepath, sizeof filepath, "%s%s", DATA_DIR, file);
@@ -1183,7 +2560,7 @@ int ss_files_get_info(const char *file, char *info, int maxlen)
            state->metadata.owner,
            created,
            modified,
-           (long long)st.st_size,
+           (long long)ss_compress_file_size(filepath),
            access_buf,
            accessed,
            last_user);
@@ -1191,63 +2568,75 @@ int ss_files_get_info(const char *file, char *info, int maxlen)
   return OK;
 }
 
-// List all files
-int ss_files_list_all(char *list, int maxlen, int include_all, int include_details, const char *user)
+// Get file info
+int ss_files_get_info(const char *file, char *info, int maxlen)
 {
-  list[0] = 0;
-  int pos = 0;
-
-  for (int i = 0; i < g_file_count; i++)
+  pthread_mutex_lock(&g_file_cache_mutex);
+  FileState *state = load_file(file);
+  int rc = ERR_NOT_FOUND;
+  if (state)
   {
-    FileState *state = g_file_cache[i];
-    if (!state)
-      continue;
+    // Show reads not yet written out
+    if (fold_access(state))
+      save_metadata(state);
+    rc = format_info(state, file, info, maxlen);
+  }
+  pthread_mutex_unlock(&g_file_cache_mutex);
+  return rc;
+}
 
-    // Verify file still exists on disk
-    char filepath[512];
-    snprintf(filepath, sizeof filepath, "%s%s", DATA_DIR, state->filename);
-    struct stat st;
-    if (stat(filepath, &st) != 0)
-    {
-      // File was deleted externally, skip it
-      continue;
-    }
+typedef struct
+{
+  char *list;
+  int maxlen;
+  int pos;
+  int include_details;
+} ListBuilder;
+
+// Append one VIEW line; returns nonzero once the buffer is full
+static int append_listing(FileState *state, void *arg)
+{
+  ListBuilder *b = arg;
+  int room = b->maxlen - b->pos;
+  int n;
 
-    // Check access
-    int has_access = (strcmp(state->metadata.owner, user) == 0);
-    if (!has_access)
-    {
-      for (int j = 0; j < state->metadata.access_count; j++)
-      {
-        if (strcmp(state->metadata.access_list[j].username, user) == 0)
-        {
-          has_access = 1;
-          break;
-        }
-      }
-    }
+  if (b->include_details)
+  {
+    char timestr[64];
+    strftime(timestr, sizeof timestr, "%Y-%m-%d %H:%M:%S", localtime(&state->metadata.modified_time));
 
-    // Skip files without access if -a flag not set
-    if (!include_all && !has_access)
-      continue;
+    n = snprintf(b->list + b->pos, room,
+                 "%s | Owner: %s | Words: %d | Chars: %d | Modified: %s;;",
+                 state->filename, state->metadata.owner,
+                 state->metadata.word_count, state->metadata.char_count, timestr);
+  }
+  else
+  {
+    n = snprintf(b->list + b->pos, room, "%s;;", state->filename);
+  }
 
-    if (include_details)
-    {
-      char timestr[64];
-      strftime(timestr, sizeof timestr, "%Y-%m-%d %H:%M:%S", localtime(&state->metadata.modified_time));
+  b->pos += n < room ? n : room - 1;
+  return b->pos >= b->maxlen - 1;
+}
 
-      pos += snprintf(list + pos, maxlen - pos,
-                      "%s | Owner: %s | Words: %d | Chars: %d | Modified: %s;;",
-                      state->filename, state->metadata.owner,
-                      state->metadata.word_count, state->metadata.char_count, timestr);
-    }
-    else
+// List files visible to user (all files with -a)
+int ss_files_list_all(char *list, int maxlen, int include_all, int include_details, const char *user)
+{
+  list[0] = 0;
+  ListBuilder builder = {list, maxlen, 0, include_details};
+
+  // -a lists every file; otherwise the index yields just the user's files
+  if (include_all)
+  {
+    for (int i = 0; i < g_file_count; i++)
     {
-      pos += snprintf(list + pos, maxlen - pos, "%s;;", state->filename);
+      if (g_file_cache[i] && append_listing(g_file_cache[i], &builder))
+        break;
     }
-
-    if (pos >= maxlen - 1)
-      break;
+  }
+  else
+  {
+    ss_acl_index_foreach(user, append_listing, &builder);
   }
 
   return OK;
@@ -1281,6 +2670,7 @@ int ss_files_add_access(const char *file, const char *actor, const char *target_
         state->metadata.access_list[i].can_read = 1;
       }
       save_metadata(state);
+      ss_replicate_note(file);
       return OK;
     }
   }
@@ -1297,8 +2687,10 @@ int ss_files_add_access(const char *file, const char *actor, const char *target_
   strncpy(entry->username, target_user, sizeof entry->username - 1);
   entry->can_read = 1;
   entry->can_write = (strcmp(mode, "W") == 0) ? 1 : 0;
+  ss_acl_index_grant(target_user, state);
 
   save_metadata(state);
+  ss_replicate_note(file);
   return OK;
 }
 
@@ -1322,7 +2714,10 @@ int ss_files_remove_access(const char *file, const char *actor, const char *targ
         state->metadata.access_list[j] = state->metadata.access_list[j + 1];
       }
       state->metadata.access_count--;
+      if (strcmp(target_user, state->metadata.owner) != 0)
+        ss_acl_index_revoke(target_user, state);
       save_metadata(state);
+      ss_replicate_note(file);
       return OK;
     }
   }
@@ -1399,23 +2794,36 @@ int ss_files_move_file(const char *filename, const char *foldername)
   rename(src_meta, dest_meta); // Ignore errors
 
   char src_undo[512], dest_undo[512];
-  snprintf(src_undo, sizeof(src_undo), "%s%s.bak", UNDO_DIR, filename);
-  snprintf(dest_undo, sizeof(dest_undo), "%s%s/%s.bak", UNDO_DIR, foldername, filename);
-  rename(src_undo, dest_undo); // Ignore errors
+  if (undo_log_path(filename, src_undo, sizeof(src_undo)) == 0 &&
+      undo_log_path(new_filename, dest_undo, sizeof(dest_undo)) == 0)
+    rename(src_undo, dest_undo); // Ignore errors
 
-  // Update filename in cache
+  // Update filename in cache; the name decides the Merkle leaf and is what
+  // readers look the published snapshot up by
+  pthread_mutex_lock(&g_file_cache_mutex);
   FileState *state = find_file_in_cache(filename);
   if (state)
   {
+    fold_access(state);
+    pthread_mutex_lock(&g_index_mutex);
+    index_drain_locked();
+    merkle_forget(state);
     strncpy(state->filename, new_filename, sizeof(state->filename) - 1);
     state->filename[sizeof(state->filename) - 1] = '\0';
     strncpy(state->metadata.filename, new_filename, sizeof(state->metadata.filename) - 1);
     state->metadata.filename[sizeof(state->metadata.filename) - 1] = '\0';
+    publish_snapshot(state);
 
     // Save updated metadata
     save_metadata(state);
+    merkle_refresh(state);
+    pthread_mutex_unlock(&g_index_mutex);
   }
+  pthread_mutex_unlock(&g_file_cache_mutex);
 
+  // The replica drops the old name and takes the file under the new one
+  ss_replicate_note(filename);
+  ss_replicate_note(new_filename);
   return OK;
 }
 
@@ -1456,9 +2864,216 @@ int ss_files_view_folder(const char *foldername, char *files, int maxlen)
   return OK;
 }
 
+// ==================== SEARCH ====================
+
+static int search_visible(FileState *state, void *arg)
+{
+  return check_access(state->filename, (const char *)arg, 0) == OK;
+}
+
+// Ranked full-text search over files the user may read. Results are
+// "file|score|sentence|snippet" entries separated by ";;".
+int ss_files_search(const char *user, const char *query, int limit, char *results, int maxlen)
+{
+  results[0] = '\0';
+  if (!query || !query[0])
+    return ERR_BAD_REQUEST;
+  if (limit <= 0 || limit > 100)
+    limit = 100;
+
+  SearchHit *hits = calloc(limit, sizeof(SearchHit));
+  if (!hits)
+    return ERR_INTERNAL;
+
+  // Bring the index up to every change committed so far
+  index_drain();
+  pthread_mutex_lock(&g_file_cache_mutex);
+  int n = ss_search_query(query, search_visible, (void *)user, hits, limit);
+
+  int pos = 0;
+  for (int i = 0; i < n && pos < maxlen - 1; i++)
+  {
+    FileState *state = hits[i].state;
+
+    // Snippet: the start of the best matching sentence
+    char snippet[128] = "";
+    int sp = 0;
+    if (hits[i].sentence < state->sentence_count)
+    {
+      Sentence *sent = &state->sentences[hits[i].sentence];
+      for (int w = 0; w < sent->word_count && sp < (int)sizeof snippet - 1; w++)
+        sp += snprintf(snippet + sp, sizeof snippet - sp, "%s%s", w ? " " : "", sent->words[w]);
+      if (sent->delimiter && sp < (int)sizeof snippet - 1)
+        snippet[sp++] = sent->delimiter;
+      snippet[sp < (int)sizeof snippet ? sp : (int)sizeof snippet - 1] = '\0';
+    }
+
+    int room = maxlen - pos;
+    int w = snprintf(results + pos, room, "%s|%.4f|%d|%s;;",
+                     state->filename, hits[i].score, hits[i].sentence, snippet);
+    if (w >= room)
+    {
+      // Drop a truncated entry rather than send half of it
+      results[pos] = '\0';
+      break;
+    }
+    pos += w;
+  }
+  pthread_mutex_unlock(&g_file_cache_mutex);
+
+  free(hits);
+  return OK;
+}
+
+// ==================== GREP ====================
+
+// Append one hit per match of the pattern in text (a whole sentence);
+// returns the updated hit count
+static int grep_sentence(const char *filename, int sentence, const char *text, const char *haystack,
+                         const char *needle, regex_t *re, GrepHit *hits, int count, int max_hits)
+{
+  size_t offset = 0;
+  size_t len = strlen(text);
+  while (count < max_hits && offset <= len)
+  {
+    size_t start, end;
+    if (re)
+    {
+      regmatch_t m;
+      if (regexec(re, text + offset, 1, &m, offset ? REG_NOTBOL : 0) != 0)
+        break;
+      start = offset + m.rm_so;
+      end = offset + m.rm_eo;
+    }
+    else
+    {
+      const char *hit = strstr(haystack + offset, needle);
+      if (!hit)
+        break;
+      start = hit - haystack;
+      end = start + strlen(needle);
+    }
+
+    int word = 0;
+    for (size_t i = 0; i < start; i++)
+    {
+      if (text[i] == ' ')
+        word++;
+    }
+
+    GrepHit *h = &hits[count++];
+    snprintf(h->file, sizeof h->file, "%s", filename);
+    h->sentence = sentence;
+    h->word = word;
+    snprintf(h->text, sizeof h->text, "%s", text);
+
+    offset = end > start ? end : start + 1;
+  }
+  return count;
+}
+
+static int compare_states(const void *a, const void *b)
+{
+  return strcmp((*(FileState *const *)a)->filename, (*(FileState *const *)b)->filename);
+}
+
+// Find substring (flags contain 'F') or POSIX extended regex matches in
+// files the user may read; 'i' ignores case. The trigram index narrows the
+// files to scan, each candidate sentence is then checked for real.
+int ss_files_grep(const char *user, const char *pattern, const char *flags,
+                  GrepHit *hits, int max_hits, int *count)
+{
+  *count = 0;
+  if (!pattern || !pattern[0])
+    return ERR_BAD_REQUEST;
+  int fixed = flags && strchr(flags, 'F') != NULL;
+  int icase = flags && strchr(flags, 'i') != NULL;
+
+  regex_t re;
+  if (!fixed && regcomp(&re, pattern, REG_EXTENDED | (icase ? REG_ICASE : 0)) != 0)
+    return ERR_BAD_REQUEST;
+
+  char needle[512];
+  snprintf(needle, sizeof needle, "%s", pattern);
+  if (fixed && icase)
+  {
+    for (char *c = needle; *c; c++)
+      *c = (char)tolower((unsigned char)*c);
+  }
+
+  index_drain();
+  pthread_mutex_lock(&g_file_cache_mutex);
+
+  FileState *candidates[MAX_FILES];
+  int ncand = ss_trigram_candidates(pattern, fixed, candidates, MAX_FILES);
+  if (ncand < 0)
+  {
+    for (ncand = 0; ncand < g_file_count; ncand++)
+      candidates[ncand] = g_file_cache[ncand];
+  }
+  // Files in name order, however the index happens to hold them
+  qsort(candidates, ncand, sizeof *candidates, compare_states);
+
+  int n = 0;
+  char *text = NULL, *folded = NULL;
+  size_t text_cap = 0;
+  for (int c = 0; c < ncand && n < max_hits; c++)
+  {
+    FileState *state = candidates[c];
+    if (check_access(state->filename, user, 0) != OK)
+      continue;
+
+    for (int s = 0; s < state->sentence_count && n < max_hits; s++)
+    {
+      Sentence *sent = &state->sentences[s];
+      size_t need = 2;
+      for (int w = 0; w < sent->word_count; w++)
+        need += strlen(sent->words[w]) + 1;
+      if (need > text_cap)
+      {
+        char *grown = realloc(text, need);
+        char *grown_folded = grown ? realloc(folded, need) : NULL;
+        if (grown)
+          text = grown;
+        if (!grown || !grown_folded)
+          break;
+        folded = grown_folded;
+        text_cap = need;
+      }
+
+      size_t len = 0;
+      for (int w = 0; w < sent->word_count; w++)
+        len += snprintf(text + len, text_cap - len, "%s%s", w ? " " : "", sent->words[w]);
+      if (sent->delimiter)
+        text[len++] = sent->delimiter;
+      text[len] = '\0';
+
+      const char *haystack = text;
+      if (fixed && icase)
+      {
+        for (size_t i = 0; i <= len; i++)
+          folded[i] = (char)tolower((unsigned char)text[i]);
+        haystack = folded;
+      }
+      n = grep_sentence(state->filename, s, text, haystack, needle, fixed ? NULL : &re,
+                        hits, n, max_hits);
+    }
+  }
+
+  pthread_mutex_unlock(&g_file_cache_mutex);
+
+  free(text);
+  free(folded);
+  if (!fixed)
+    regfree(&re);
+  *count = n;
+  return OK;
+}
+
 // ==================== CHECKPOINT OPERATIONS ====================
 
-// Create a checkpoint for a file
+// Create a checkpoint for a file. Checkpoints are chunk manifests, so
+// content shared with earlier checkpoints of any file is stored only once.
 int ss_files_create_checkpoint(const char *file, const char *tag)
 {
   char filepath[512];
@@ -1476,32 +3091,20 @@ int ss_files_create_checkpoint(const char *file, const char *tag)
   snprintf(checkpoint_dir, sizeof(checkpoint_dir), "%s%s", CHECKPOINT_DIR, file);
   ensure_dirs(checkpoint_dir);
 
-  // Copy file to checkpoint
   char checkpoint_path[512];
   snprintf(checkpoint_path, sizeof(checkpoint_path), "%s/%s", checkpoint_dir, tag);
 
-  FILE *src = fopen(filepath, "r");
-  if (!src)
-    return ERR_INTERNAL;
-
-  FILE *dest = fopen(checkpoint_path, "w");
-  if (!dest)
-  {
-    fclose(src);
+  pthread_mutex_lock(&g_file_cache_mutex);
+  char *data = NULL;
+  size_t len = 0;
+  int load_rc = ss_compress_load_file(filepath, &data, &len);
+  pthread_mutex_unlock(&g_file_cache_mutex);
+  if (load_rc != OK)
     return ERR_INTERNAL;
-  }
 
-  char buffer[8192];
-  size_t bytes;
-  while ((bytes = fread(buffer, 1, sizeof(buffer), src)) > 0)
-  {
-    fwrite(buffer, 1, bytes, dest);
-  }
-
-  fclose(src);
-  fclose(dest);
-
-  return OK;
+  int rc = ss_chunks_write_manifest(checkpoint_path, data, len);
+  free(data);
+  return rc;
 }
 
 // View checkpoint content
@@ -1510,17 +3113,7 @@ int ss_files_view_checkpoint(const char *file, const char *tag, char *content, i
   char checkpoint_path[512];
   snprintf(checkpoint_path, sizeof(checkpoint_path), "%s%s/%s", CHECKPOINT_DIR, file, tag);
 
-  FILE *fp = fopen(checkpoint_path, "r");
-  if (!fp)
-  {
-    return ERR_NOT_FOUND;
-  }
-
-  size_t bytes = fread(content, 1, maxlen - 1, fp);
-  content[bytes] = '\0';
-  fclose(fp);
-
-  return OK;
+  return ss_chunks_read(checkpoint_path, content, maxlen);
 }
 
 // Revert file to a checkpoint
@@ -1539,50 +3132,57 @@ int ss_files_revert_checkpoint(const char *file, const char *tag)
     return ERR_NOT_FOUND;
   }
 
-  // Copy checkpoint back to file
-  FILE *src = fopen(checkpoint_path, "r");
-  if (!src)
-    return ERR_INTERNAL;
+  pthread_mutex_lock(&g_file_cache_mutex);
 
-  FILE *dest = fopen(filepath, "w");
-  if (!dest)
+  FileState *state = load_file(file);
+  if (!state)
   {
-    fclose(src);
-    return ERR_INTERNAL;
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return ERR_NOT_FOUND;
   }
 
-  char buffer[8192];
-  size_t bytes;
-  while ((bytes = fread(buffer, 1, sizeof(buffer), src)) > 0)
+  // Sessions hold indices into the current content
+  if (any_active_locks(state))
   {
-    fwrite(buffer, 1, bytes, dest);
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return ERR_LOCKED;
   }
 
-  fclose(src);
-  fclose(dest);
+  char *data = NULL;
+  size_t len = 0;
+  if (ss_chunks_load(checkpoint_path, &data, &len) != OK)
+  {
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return ERR_INTERNAL;
+  }
 
-  // Invalidate cache
-  for (int i = 0; i < g_file_count; i++)
+  FILE *dest = fopen(filepath, "w");
+  if (!dest)
   {
-    if (g_file_cache[i] && strcmp(g_file_cache[i]->filename, file) == 0)
-    {
-      // Free and reload
-      for (int j = 0; j < g_file_cache[i]->sentence_count; j++)
-      {
-        for (int k = 0; k < g_file_cache[i]->sentences[j].word_count; k++)
-        {
-          free(g_file_cache[i]->sentences[j].words[k]);
-        }
-        free(g_file_cache[i]->sentences[j].words);
-      }
-      free(g_file_cache[i]->sentences);
-      free(g_file_cache[i]->metadata.access_list);
-      free(g_file_cache[i]);
-      g_file_cache[i] = NULL;
-      break;
-    }
+    free(data);
+    pthread_mutex_unlock(&g_file_cache_mutex);
+    return ERR_INTERNAL;
   }
+  fwrite(data, 1, len, dest);
+  fclose(dest);
+  free(data);
+
+  // Re-tokenize in place so the cache slot stays valid
+  for (int i = 0; i < state->sentence_count; i++)
+    free_sentence(&state->sentences[i]);
+  free(state->sentences);
+  tokenize_file(filepath, state);
+
+  // Undo deltas refer to the replaced content
+  undo_reset(state);
+
+  state->metadata.modified_time = time(NULL);
+  update_metadata_counts(state);
+  on_file_changed(state);
+  save_metadata(state);
 
+  pthread_mutex_unlock(&g_file_cache_mutex);
+  index_drain();
   return OK;
 }
 
@@ -1,6 +1,8 @@
 #ifndef SS_FILES_H
 #define SS_FILES_H
 #include <time.h>
+#include <stdatomic.h>
+#include <stddef.h>
 
 // Data structures for sentence/word tokenization
 typedef struct
@@ -37,14 +39,41 @@ typedef struct
 
 typedef struct
 {
-  int sentence_idx;
+  int sentence_idx; // position in the committed document
   char user[64];
+  Sentence *work;   // private copy the session edits, spliced in at commit
+  int span;         // sentences in work (grows on split)
+  int old_span;     // 0 if the session appended a new sentence, else 1
+  Sentence before;  // pre-image of the locked sentence, kept for undo
 } SentenceLock;
 
+// Reverse delta for one committed write session
+typedef struct
+{
+  char user[64];
+  int sentence_idx; // position in the committed document
+  int new_span;     // sentences produced by the commit
+  int old_span;     // sentences replaced by the commit (0 or 1)
+  Sentence old;     // content to restore on undo
+} UndoEntry;
+
+// Bounded ring of reverse deltas, oldest entry at head
+typedef struct
+{
+  UndoEntry *entries;
+  int head;
+  int count;
+  int capacity;
+  int log_records; // lines in the on-disk log, compacted when it grows past 2x depth
+} UndoRing;
+
+// Immutable committed text of a file (defined in ss_files.c)
+typedef struct Snapshot Snapshot;
+
 typedef struct
 {
   char filename[256];
-  Sentence *sentences;
+  Sentence *sentences; // committed document only
   int sentence_count;
   int sentence_capacity;
   char owner[64];
@@ -52,11 +81,63 @@ typedef struct
   int lock_count;
   int lock_capacity;
   FileMetadata metadata;
+  UndoRing undo;
+  unsigned long version;    // bumped on every committed change, persisted
+  unsigned long change_seq; // when this file last changed, for ss_files_changes
+  char origin[64];          // primary SS this file is a replica copy of, "" if our own
+  unsigned long long digest; // entry in origin's Merkle tree, 0 if none
 } FileState;
 
+// One GREP match: sentence and word index of where it starts
+typedef struct
+{
+  char file[256];
+  int sentence;
+  int word;
+  char text[160]; // start of the matching sentence
+} GrepHit;
+
+// Everything about a file the primary ships to its replica besides the text
+#define REPLICA_ACL_MAX 2048
+typedef struct
+{
+  unsigned long version;
+  char owner[64];
+  char acl[REPLICA_ACL_MAX]; // "user:W,user:R,..."
+  char origin[64];           // sending SS, set by the replica
+} ReplicaFile;
+
 // Public API
 int ss_files_init(void);
+void ss_files_set_undo_depth(int depth);
+void ss_files_set_cold_days(int days);
+int ss_files_compress_cold(void);
+void ss_files_usage(int *files, long long *bytes);
+int ss_files_version(const char *file, unsigned long *version);
+
+// "file:version,..." for files loaded or changed after change sequence
+// since. Returns the sequence to pass next time; files that did not fit in
+// out are listed again then.
+unsigned long ss_files_changes(unsigned long since, char *out, size_t size);
+
+// Replication (ss_replicate.c). Export copies a file's committed state
+// (content is malloc'd, ERR_NOT_FOUND once the file is gone); import and
+// import_delete install it on the replica, keeping the primary's version.
+// Replica copies are left out of NM registration.
+int ss_files_export(const char *file, ReplicaFile *out, char **content, size_t *len);
+int ss_files_import(const char *file, const ReplicaFile *in, const char *content, size_t len);
+int ss_files_import_delete(const char *file);
+int ss_files_is_replica_copy(const char *file);
+
+// "file|version|digest;;..." (digest in hex) for the files of origin's
+// Merkle tree that fall in the given leaves. Returns how many were listed;
+// entries that do not fit in out are left out.
+int ss_files_merkle_entries(const char *origin, const int *leaves, int count, char *out, size_t size);
+
 int ss_files_read(const char *file, const char *user, char *content, int maxlen);
+int ss_files_stream_version(const char *file, const char *user, unsigned long *version);
+int ss_files_stream_words(const char *file, char ***words, int *count, unsigned long *version);
+void ss_files_free_words(char **words, int count);
 int ss_files_write_begin(const char *file, const char *user, int sentence_idx);
 int ss_files_write_edit(const char *file, const char *user, int word_index, const char *content);
 int ss_files_write_commit(const char *file, const char *user);
@@ -67,6 +148,9 @@ int ss_files_get_info(const char *file, char *info, int maxlen);
 int ss_files_list_all(char *list, int maxlen, int include_all, int include_details, const char *user);
 int ss_files_add_access(const char *file, const char *actor, const char *target_user, const char *mode);
 int ss_files_remove_access(const char *file, const char *actor, const char *target_user);
+int ss_files_search(const char *user, const char *query, int limit, char *results, int maxlen);
+int ss_files_grep(const char *user, const char *pattern, const char *flags,
+                  GrepHit *hits, int max_hits, int *count);
 
 // Folder operations
 int ss_files_create_folder(const char *foldername);
@@ -0,0 +1,105 @@
+#include "ss_merkle.h"
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+
+typedef struct
+{
+  char origin[64];
+  int files; // files with a digest in this tree; the slot is free at 0
+  unsigned long long nodes[2 * MERKLE_LEAVES];
+} MerkleTree;
+
+static MerkleTree g_trees[MERKLE_MAX_TREES];
+static pthread_mutex_t g_merkle_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long long mix(unsigned long long x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// FNV-1a
+static unsigned long long hash_bytes(const char *data, size_t len)
+{
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++)
+  {
+    h ^= (unsigned char)data[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+unsigned long long ss_merkle_digest(const char *file, unsigned long version, const char *content, size_t len)
+{
+  unsigned long long d = mix(hash_bytes(file, strlen(file)) ^ mix(version) ^ mix(hash_bytes(content, len) + 1));
+  return d ? d : 1;
+}
+
+int ss_merkle_leaf(const char *file)
+{
+  return MERKLE_LEAVES + (int)(mix(hash_bytes(file, strlen(file))) & (MERKLE_LEAVES - 1));
+}
+
+// Caller holds g_merkle_mutex
+static MerkleTree *find_tree(const char *origin, int create)
+{
+  MerkleTree *free_slot = NULL;
+  for (int i = 0; i < MERKLE_MAX_TREES; i++)
+  {
+    if (g_trees[i].files > 0 && !strcmp(g_trees[i].origin, origin))
+      return &g_trees[i];
+    if (!free_slot && g_trees[i].files == 0)
+      free_slot = &g_trees[i];
+  }
+  if (!create || !free_slot)
+    return NULL;
+  memset(free_slot, 0, sizeof *free_slot);
+  snprintf(free_slot->origin, sizeof free_slot->origin, "%s", origin);
+  return free_slot;
+}
+
+void ss_merkle_update(const char *origin, const char *file, unsigned long long old_digest,
+                      unsigned long long new_digest)
+{
+  if (old_digest == new_digest)
+    return;
+
+  pthread_mutex_lock(&g_merkle_mutex);
+  MerkleTree *tree = find_tree(origin ? origin : "", new_digest != 0);
+  if (!tree)
+  {
+    pthread_mutex_unlock(&g_merkle_mutex);
+    if (new_digest)
+      fprintf(stderr, "[SS] Merkle tree limit reached; %s is not tracked\n", file);
+    return;
+  }
+
+  int node = ss_merkle_leaf(file);
+  tree->nodes[node] ^= old_digest ^ new_digest;
+  for (node /= 2; node >= 1; node /= 2)
+  {
+    unsigned long long left = tree->nodes[2 * node], right = tree->nodes[2 * node + 1];
+    tree->nodes[node] = left || right ? mix(left ^ mix(right)) : 0;
+  }
+  if (!old_digest)
+    tree->files++;
+  if (!new_digest)
+    tree->files--;
+  pthread_mutex_unlock(&g_merkle_mutex);
+}
+
+void ss_merkle_nodes(const char *origin, const int *nodes, int count, unsigned long long *out)
+{
+  pthread_mutex_lock(&g_merkle_mutex);
+  MerkleTree *tree = find_tree(origin ? origin : "", 0);
+  for (int i = 0; i < count; i++)
+  {
+    int valid = tree && nodes[i] >= 1 && nodes[i] < 2 * MERKLE_LEAVES;
+    out[i] = valid ? tree->nodes[nodes[i]] : 0;
+  }
+  pthread_mutex_unlock(&g_merkle_mutex);
+}
@@ -0,0 +1,35 @@
+#ifndef SS_MERKLE_H
+#define SS_MERKLE_H
+#include <stddef.h>
+#include "../common/proto.h"
+
+// Merkle trees over the files this SS holds, for anti-entropy between a
+// primary and its replica. There is one tree per origin: "" for the files
+// this SS is primary for, and the primary's ss_id for the replica copies
+// of its files, so a primary's "" tree and its replica's copy tree hold the
+// same files when the two are in sync.
+//
+// Files hash into MERKLE_LEAVES buckets by name. A leaf is the XOR of the
+// digests of its files (file name, version, content hash), so a change
+// updates one leaf and the log2(MERKLE_LEAVES) nodes above it. Nodes are
+// heap-numbered: 1 is the root, node i has children 2i and 2i+1, and the
+// leaves are MERKLE_LEAVES .. 2*MERKLE_LEAVES-1 (MERKLE_LEAVES is in
+// proto.h, shared with the NM).
+
+#define MERKLE_MAX_TREES 8
+
+// Digest of one file's state; never 0, which stands for "absent"
+unsigned long long ss_merkle_digest(const char *file, unsigned long version, const char *content, size_t len);
+
+// Leaf node number of the bucket file falls in
+int ss_merkle_leaf(const char *file);
+
+// Replace a file's digest in origin's tree (0 for none on either side)
+void ss_merkle_update(const char *origin, const char *file, unsigned long long old_digest,
+                      unsigned long long new_digest);
+
+// Hashes of the given nodes of origin's tree (0 where the tree is empty
+// or a node number is out of range)
+void ss_merkle_nodes(const char *origin, const int *nodes, int count, unsigned long long *out);
+
+#endif
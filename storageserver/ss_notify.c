@@ -0,0 +1,90 @@
+#define _POSIX_C_SOURCE 200809L
+#include "ss_notify.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// Ring of pending notices, oldest at g_head
+static char g_queue[SS_NOTIFY_MAX][SS_NOTIFY_LINE_MAX];
+static int g_head = 0;
+static int g_count = 0;
+static int g_overflowed = 0;
+
+static pthread_mutex_t g_notify_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_notify_wake = PTHREAD_COND_INITIALIZER;
+
+void ss_notify_push(const char *notice)
+{
+  pthread_mutex_lock(&g_notify_mutex);
+  if (g_count == SS_NOTIFY_MAX)
+  {
+    // Registering again reports every change at once
+    g_head = 0;
+    g_count = 0;
+    g_overflowed = 1;
+  }
+  else
+  {
+    snprintf(g_queue[(g_head + g_count) % SS_NOTIFY_MAX], SS_NOTIFY_LINE_MAX, "%s", notice);
+    g_count++;
+  }
+  pthread_cond_signal(&g_notify_wake);
+  pthread_mutex_unlock(&g_notify_mutex);
+}
+
+int ss_notify_wait(long ms)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += ms / 1000;
+  deadline.tv_nsec += (ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&g_notify_mutex);
+  while (g_count == 0 && !g_overflowed)
+  {
+    if (pthread_cond_timedwait(&g_notify_wake, &g_notify_mutex, &deadline) != 0)
+      break;
+  }
+  int pending = g_count > 0 || g_overflowed;
+  pthread_mutex_unlock(&g_notify_mutex);
+  return pending;
+}
+
+int ss_notify_peek(char *out, size_t size)
+{
+  pthread_mutex_lock(&g_notify_mutex);
+  int rc = -1;
+  if (g_count > 0)
+  {
+    snprintf(out, size, "%s", g_queue[g_head]);
+    rc = 0;
+  }
+  pthread_mutex_unlock(&g_notify_mutex);
+  return rc;
+}
+
+void ss_notify_pop(void)
+{
+  pthread_mutex_lock(&g_notify_mutex);
+  if (g_count > 0)
+  {
+    g_head = (g_head + 1) % SS_NOTIFY_MAX;
+    g_count--;
+  }
+  pthread_mutex_unlock(&g_notify_mutex);
+}
+
+int ss_notify_overflowed(void)
+{
+  pthread_mutex_lock(&g_notify_mutex);
+  int overflowed = g_overflowed;
+  g_overflowed = 0;
+  pthread_mutex_unlock(&g_notify_mutex);
+  return overflowed;
+}
@@ -0,0 +1,31 @@
+#ifndef SS_NOTIFY_H
+#define SS_NOTIFY_H
+#include <stddef.h>
+
+// Catalog changes this SS made for clients that came with a token from the
+// NM instead of through it (create, delete, move, checkpoint), and requests
+// to reconcile its replica after replication records were dropped. The
+// heartbeat thread passes the notices on over the control channel, oldest
+// first, waking as soon as one is queued, and drops each once the NM
+// acknowledges it. When the queue overflows the notices are dropped and
+// the SS registers again instead, which tells the NM all of it.
+
+#define SS_NOTIFY_MAX 1024      // queued notices before falling back to registering
+#define SS_NOTIFY_LINE_MAX 1024 // one SS_NOTIFY line
+
+// Queue a complete SS_NOTIFY line
+void ss_notify_push(const char *notice);
+
+// Wait up to ms for a notice to be queued. Returns 1 if one is.
+int ss_notify_wait(long ms);
+
+// Copy the oldest notice to out. Returns 0, or -1 if there is none.
+int ss_notify_peek(char *out, size_t size);
+
+// Drop the oldest notice once the NM has it
+void ss_notify_pop(void);
+
+// Whether notices were lost to an overflow since the last call
+int ss_notify_overflowed(void);
+
+#endif
@@ -0,0 +1,483 @@
+#define _POSIX_C_SOURCE 200809L
+#include "ss_replicate.h"
+#include "ss_files.h"
+#include "../common/net.h"
+#include "../common/jsonl.h"
+#include "../common/proto.h"
+#include "../common/token.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define REPL_RETRY_MS 500     // pause after a failed connect or a partial ack
+#define REPL_ACK_TIMEOUT_S 10 // a replica that stops answering is reconnected
+#define REPL_LINE_MAX 4096    // record header lines
+#define REPL_REFUSED_MAX 5    // batches a record the replica refuses may hold up
+#define REPL_AUTH_TIMEOUT_S 5 // a primary that never proves itself must not hold the thread
+
+typedef struct
+{
+  unsigned long seq;
+  char file[256];
+  long long at_ms; // when the record was logged
+} ReplRecord;
+
+// Pending records, oldest at g_head. The first g_inflight of them are in
+// the batch being sent and are not coalesced with new changes.
+static ReplRecord g_log[REPL_LOG_MAX];
+static int g_head = 0;
+static int g_count = 0;
+static int g_inflight = 0;
+static unsigned long g_next_seq = 1;
+static unsigned long g_acked = 0;
+static int g_reconcile = 0; // records were dropped; the NM should compare trees
+
+static char g_ss_id[64];
+static unsigned char g_key[SHA256_BYTES];
+static char g_target_host[64];
+static int g_target_port = 0;
+static unsigned long g_target_gen = 0;
+
+static pthread_mutex_t g_repl_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_repl_wake = PTHREAD_COND_INITIALIZER;
+
+#define RECORD(i) (&g_log[(g_head + (i)) % REPL_LOG_MAX])
+
+static long long now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void pause_ms(int ms)
+{
+  struct timespec delay = {ms / 1000, (ms % 1000) * 1000000L};
+  nanosleep(&delay, NULL);
+}
+
+// Caller holds g_repl_mutex. Pending records are dropped, deletes among
+// them, so re-sending the files that exist would leave deleted ones on the
+// replica; the NM's Merkle tree comparison finds both kinds of difference
+// (see ss_merkle.h). Without a target the NM reconciles the replica it
+// assigns later anyway. Records already in flight stay.
+static void drop_pending_locked(void)
+{
+  g_count = g_inflight;
+  g_reconcile = g_target_port > 0;
+}
+
+void ss_replicate_note(const char *file)
+{
+  pthread_mutex_lock(&g_repl_mutex);
+
+  // Without a target records are still kept, for the replica the NM
+  // assigns next
+  for (int i = g_inflight; i < g_count; i++)
+  {
+    if (!strcmp(RECORD(i)->file, file))
+    {
+      pthread_mutex_unlock(&g_repl_mutex);
+      return;
+    }
+  }
+
+  if (g_count == REPL_LOG_MAX)
+  {
+    drop_pending_locked();
+    pthread_mutex_unlock(&g_repl_mutex);
+    return;
+  }
+
+  ReplRecord *rec = RECORD(g_count);
+  rec->seq = g_next_seq++;
+  snprintf(rec->file, sizeof rec->file, "%s", file);
+  rec->at_ms = now_ms();
+  g_count++;
+  pthread_cond_signal(&g_repl_wake);
+
+  pthread_mutex_unlock(&g_repl_mutex);
+}
+
+void ss_replicate_set_target(const char *host, int port)
+{
+  if (!host || !host[0])
+    port = 0;
+
+  pthread_mutex_lock(&g_repl_mutex);
+  if (port == g_target_port && (!port || !strcmp(host, g_target_host)))
+  {
+    pthread_mutex_unlock(&g_repl_mutex);
+    return;
+  }
+  snprintf(g_target_host, sizeof g_target_host, "%s", port ? host : "");
+  g_target_port = port;
+  g_target_gen++;
+  pthread_cond_signal(&g_repl_wake);
+  pthread_mutex_unlock(&g_repl_mutex);
+
+  if (port)
+    printf("[SS] Replicating to %s:%d\n", host, port);
+  else
+    printf("[SS] No replica assigned\n");
+}
+
+int ss_replicate_take_reconcile(void)
+{
+  pthread_mutex_lock(&g_repl_mutex);
+  int wanted = g_reconcile;
+  g_reconcile = 0;
+  pthread_mutex_unlock(&g_repl_mutex);
+  return wanted;
+}
+
+void ss_replicate_lag(ReplLag *out)
+{
+  pthread_mutex_lock(&g_repl_mutex);
+  // Records kept while no replica is assigned are not lag
+  int pending = g_target_port ? g_count : 0;
+  out->acked = g_acked;
+  out->pending = pending;
+  out->lag_ms = pending ? (long)(now_ms() - RECORD(0)->at_ms) : 0;
+  pthread_mutex_unlock(&g_repl_mutex);
+}
+
+// The replica may vanish mid-batch; that must not raise SIGPIPE here
+static int send_bytes(int fd, const char *buf, size_t len)
+{
+  size_t sent = 0;
+  while (sent < len)
+  {
+    ssize_t n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+    if (n <= 0)
+      return -1;
+    sent += (size_t)n;
+  }
+  return 0;
+}
+
+static int recv_bytes(int fd, char *buf, size_t len)
+{
+  size_t got = 0;
+  while (got < len)
+  {
+    ssize_t n = recv(fd, buf + got, len - got, 0);
+    if (n <= 0)
+      return -1;
+    got += (size_t)n;
+  }
+  return 0;
+}
+
+// ==================== PRIMARY SIDE ====================
+
+// Wire format: a header line, then per record either
+//   {"op":"REPL_PUT","seq":..,"file":..,"version":..,"owner":..,"acl":..,"bytes":N}
+// followed by N bytes of content, or {"op":"REPL_DEL","seq":..,"file":..}.
+// The replica answers the whole batch with {"status":0,"acked":seq}.
+static int send_batch(int fd, const ReplRecord *batch, int n, unsigned long *acked)
+{
+  char line[REPL_LINE_MAX];
+  int len = snprintf(line, sizeof line, "{\"op\":\"REPL_BATCH\",\"from\":\"%s\",\"count\":%d}\n", g_ss_id, n);
+  if (send_bytes(fd, line, (size_t)len) != 0)
+    return -1;
+
+  for (int i = 0; i < n; i++)
+  {
+    ReplicaFile meta;
+    char *content = NULL;
+    size_t content_len = 0;
+    int rc = ss_files_export(batch[i].file, &meta, &content, &content_len);
+    if (rc == OK)
+    {
+      len = snprintf(line, sizeof line,
+                     "{\"op\":\"REPL_PUT\",\"seq\":%lu,\"file\":\"%s\",\"version\":%lu,\"owner\":\"%s\",\"acl\":\"%s\",\"bytes\":%zu}\n",
+                     batch[i].seq, batch[i].file, meta.version, meta.owner, meta.acl, content_len);
+      rc = len > 0 && len < (int)sizeof line && send_bytes(fd, line, (size_t)len) == 0 &&
+                   send_bytes(fd, content, content_len) == 0
+               ? OK
+               : ERR_INTERNAL;
+      free(content);
+    }
+    else if (rc == ERR_NOT_FOUND)
+    {
+      len = snprintf(line, sizeof line, "{\"op\":\"REPL_DEL\",\"seq\":%lu,\"file\":\"%s\"}\n",
+                     batch[i].seq, batch[i].file);
+      rc = send_bytes(fd, line, (size_t)len) == 0 ? OK : ERR_INTERNAL;
+    }
+    if (rc != OK)
+      return -1;
+  }
+
+  char *resp = NULL;
+  if (recv_line(fd, &resp, 1024) <= 0)
+  {
+    free(resp);
+    return -1;
+  }
+  long long seq = 0;
+  json_get_long(resp, "acked", &seq);
+  free(resp);
+  *acked = (unsigned long)seq;
+  return 0;
+}
+
+// Open the stream to the replica and prove to it that this SS holds the
+// token key: {"op":"REPL_HELLO","from":..} is answered with a challenge,
+// {"op":"REPL_AUTH","proof":..} with status 0 once the replica takes it
+static int connect_replica(const char *host, int port)
+{
+  static int warned = 0;
+  int fd = tcp_connect(host, port);
+  if (fd < 0)
+    return -1;
+  struct timeval timeout = {REPL_ACK_TIMEOUT_S, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+  char line[REPL_LINE_MAX], challenge[TOKEN_KEY_HEX] = "", proof[TOKEN_KEY_HEX];
+  char *resp = NULL;
+  int len = snprintf(line, sizeof line, "{\"op\":\"REPL_HELLO\",\"from\":\"%s\"}\n", g_ss_id);
+  if (send_bytes(fd, line, (size_t)len) != 0 || recv_line(fd, &resp, 1024) <= 0 ||
+      json_get_str(resp, "challenge", challenge, sizeof challenge) != 0)
+  {
+    free(resp);
+    close(fd);
+    return -1;
+  }
+  free(resp);
+  resp = NULL;
+
+  token_prove(g_key, TOKEN_PROOF_REPL, g_ss_id, challenge, proof);
+  len = snprintf(line, sizeof line, "{\"op\":\"REPL_AUTH\",\"proof\":\"%s\"}\n", proof);
+  int status = -1;
+  if (send_bytes(fd, line, (size_t)len) != 0 || recv_line(fd, &resp, 1024) <= 0 ||
+      json_get_int(resp, "status", &status) != 0 || status != 0)
+  {
+    if (status == ERR_UNAUTHORIZED && !warned)
+      fprintf(stderr, "[SS] Replica at %s:%d refused this SS; is NM_TOKEN_KEY the same on both?\n", host, port);
+    warned = warned || status == ERR_UNAUTHORIZED;
+    free(resp);
+    close(fd);
+    return -1;
+  }
+  free(resp);
+  warned = 0;
+  return fd;
+}
+
+static void *sender_thread(void *arg)
+{
+  (void)arg;
+  int fd = -1;
+  unsigned long gen = 0;
+  unsigned long refused_seq = 0; // record the replica last refused
+  int refused = 0;               // batches in a row it refused it in
+
+  for (;;)
+  {
+    pthread_mutex_lock(&g_repl_mutex);
+    while (!g_target_port || g_count == 0)
+      pthread_cond_wait(&g_repl_wake, &g_repl_mutex);
+    if (gen != g_target_gen)
+    {
+      if (fd >= 0)
+        close(fd);
+      fd = -1;
+      gen = g_target_gen;
+    }
+    char host[64];
+    snprintf(host, sizeof host, "%s", g_target_host);
+    int port = g_target_port;
+    pthread_mutex_unlock(&g_repl_mutex);
+
+    if (fd < 0 && (fd = connect_replica(host, port)) < 0)
+    {
+      pause_ms(REPL_RETRY_MS);
+      continue;
+    }
+
+    // The oldest records form the next batch
+    ReplRecord batch[REPL_BATCH_MAX];
+    pthread_mutex_lock(&g_repl_mutex);
+    int n = g_count < REPL_BATCH_MAX ? g_count : REPL_BATCH_MAX;
+    for (int i = 0; i < n; i++)
+      batch[i] = *RECORD(i);
+    g_inflight = n;
+    pthread_mutex_unlock(&g_repl_mutex);
+    if (n == 0)
+      continue;
+
+    unsigned long acked = 0;
+    int rc = send_batch(fd, batch, n, &acked);
+
+    pthread_mutex_lock(&g_repl_mutex);
+    g_inflight = 0;
+    while (g_count > 0 && RECORD(0)->seq <= acked)
+    {
+      g_head = (g_head + 1) % REPL_LOG_MAX;
+      g_count--;
+    }
+    if (acked > g_acked)
+      g_acked = acked;
+
+    // An acknowledged batch that stops short means the replica refused the
+    // next record (its MAX_FILES is full, say). Retrying it forever would
+    // hold up every change behind it, so after a few batches it is dropped;
+    // the next tree comparison with the replica tries the file again.
+    char skipped[256] = "";
+    if (rc == 0 && g_count > 0 && RECORD(0)->seq <= batch[n - 1].seq)
+    {
+      refused = RECORD(0)->seq == refused_seq ? refused + 1 : 1;
+      refused_seq = RECORD(0)->seq;
+      if (refused >= REPL_REFUSED_MAX)
+      {
+        snprintf(skipped, sizeof skipped, "%s", RECORD(0)->file);
+        g_head = (g_head + 1) % REPL_LOG_MAX;
+        g_count--;
+        refused = 0;
+      }
+    }
+    pthread_mutex_unlock(&g_repl_mutex);
+    if (skipped[0])
+      fprintf(stderr, "[SS] Replica refused %s %d times; skipping it\n", skipped, REPL_REFUSED_MAX);
+
+    if (rc != 0)
+    {
+      close(fd);
+      fd = -1;
+    }
+    if (rc != 0 || acked < batch[n - 1].seq)
+      pause_ms(REPL_RETRY_MS);
+  }
+
+  return NULL;
+}
+
+int ss_replicate_init(const char *ss_id, const unsigned char key[SHA256_BYTES])
+{
+  snprintf(g_ss_id, sizeof g_ss_id, "%s", ss_id);
+  memcpy(g_key, key, SHA256_BYTES);
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, sender_thread, NULL) != 0)
+    return ERR_INTERNAL;
+  pthread_detach(tid);
+  return OK;
+}
+
+// ==================== REPLICA SIDE ====================
+
+int ss_replicate_serve_hello(int fd, const char *line, char *from, size_t size)
+{
+  char claimed[64] = "", challenge[TOKEN_KEY_HEX], reply[128];
+  json_get_str(line, "from", claimed, sizeof claimed);
+  if (!claimed[0] || token_challenge(challenge) != 0)
+  {
+    snprintf(reply, sizeof reply, "{\"status\":%d,\"code\":\"ERR_BAD_REQUEST\"}\n", ERR_BAD_REQUEST);
+    send_bytes(fd, reply, strlen(reply));
+    return -1;
+  }
+  snprintf(reply, sizeof reply, "{\"status\":0,\"challenge\":\"%s\"}\n", challenge);
+  if (send_bytes(fd, reply, strlen(reply)) != 0)
+    return -1;
+
+  struct timeval timeout = {REPL_AUTH_TIMEOUT_S, 0}, none = {0, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  char *resp = NULL, op[16] = "", proof[TOKEN_KEY_HEX] = "";
+  if (recv_line(fd, &resp, 1024) > 0)
+  {
+    json_get_str(resp, "op", op, sizeof op);
+    json_get_str(resp, "proof", proof, sizeof proof);
+  }
+  free(resp);
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof none);
+
+  if (strcmp(op, "REPL_AUTH") != 0 || token_proof_ok(g_key, TOKEN_PROOF_REPL, claimed, challenge, proof) != 0)
+  {
+    fprintf(stderr, "[SS] Replication peer claiming to be %s could not prove it holds NM_TOKEN_KEY\n", claimed);
+    snprintf(reply, sizeof reply, "{\"status\":%d,\"code\":\"ERR_UNAUTHORIZED\",\"msg\":\"bad proof\"}\n",
+             ERR_UNAUTHORIZED);
+    send_bytes(fd, reply, strlen(reply));
+    return -1;
+  }
+  snprintf(from, size, "%s", claimed);
+  const char *ok = "{\"status\":0}\n";
+  return send_bytes(fd, ok, strlen(ok));
+}
+
+int ss_replicate_serve_batch(int fd, const char *line, const char *from)
+{
+  int count = 0;
+  json_get_int(line, "count", &count);
+
+  // Records after one that cannot be applied yet are read but not applied,
+  // so the primary resends them in order
+  unsigned long acked = 0;
+  int stalled = 0;
+  for (int i = 0; i < count; i++)
+  {
+    char *rec = NULL;
+    if (recv_line(fd, &rec, REPL_LINE_MAX) <= 0)
+    {
+      free(rec);
+      return -1;
+    }
+
+    char op[16] = "", file[256] = "";
+    long long seq = 0;
+    json_get_str(rec, "op", op, sizeof op);
+    json_get_str(rec, "file", file, sizeof file);
+    json_get_long(rec, "seq", &seq);
+
+    int rc;
+    if (!strcmp(op, "REPL_PUT"))
+    {
+      ReplicaFile meta;
+      memset(&meta, 0, sizeof meta);
+      long long version = 0, bytes = -1;
+      json_get_long(rec, "version", &version);
+      json_get_long(rec, "bytes", &bytes);
+      json_get_str(rec, "owner", meta.owner, sizeof meta.owner);
+      json_get_str(rec, "acl", meta.acl, sizeof meta.acl);
+      snprintf(meta.origin, sizeof meta.origin, "%s", from);
+      meta.version = (unsigned long)version;
+
+      char *content = bytes >= 0 && bytes <= REPL_CONTENT_MAX ? malloc((size_t)bytes + 1) : NULL;
+      if (!content || recv_bytes(fd, content, (size_t)bytes) != 0)
+      {
+        free(content);
+        free(rec);
+        return -1;
+      }
+      content[bytes] = '\0';
+      rc = stalled || !file[0] ? ERR_BAD_REQUEST : ss_files_import(file, &meta, content, (size_t)bytes);
+      free(content);
+    }
+    else if (!strcmp(op, "REPL_DEL"))
+    {
+      rc = stalled || !file[0] ? ERR_BAD_REQUEST : ss_files_import_delete(file);
+    }
+    else
+    {
+      free(rec);
+      return -1;
+    }
+    free(rec);
+
+    if (rc == OK && !stalled)
+      acked = (unsigned long)seq;
+    else if (!stalled)
+    {
+      stalled = 1;
+      fprintf(stderr, "[SS] Replication of %s stalled (error %d)\n", file, rc);
+    }
+  }
+
+  char reply[128];
+  int len = snprintf(reply, sizeof reply, "{\"status\":0,\"acked\":%lu}\n", acked);
+  return send_bytes(fd, reply, (size_t)len);
+}
@@ -0,0 +1,59 @@
+#ifndef SS_REPLICATE_H
+#define SS_REPLICATE_H
+#include <stddef.h>
+#include "../common/sha256.h"
+
+// Write replication from this SS to the replica the NM assigned it. Every
+// committed change (write, undo, revert, create, delete, ACL change, move)
+// appends a sequence-numbered record naming the file to an in-memory log.
+// One sender thread ships the log in order, in batches, over a persistent
+// connection to the replica and drops records once the replica
+// acknowledges them; unacknowledged records are resent after a reconnect.
+//
+// A record carries the file's state when its batch is sent, not the edit
+// that produced it, so replaying is idempotent and a file changed several
+// times while waiting is sent once.
+//
+// The replica takes batches only on a connection whose primary has proven
+// it holds the token key (REPL_HELLO, see common/token.h), and files them
+// under the id the proof was bound to.
+
+#define REPL_BATCH_MAX 64          // records per batch
+#define REPL_LOG_MAX 4096          // pending records before falling back to a tree comparison
+#define REPL_CONTENT_MAX (64 << 20) // largest document a replica accepts
+
+typedef struct
+{
+  unsigned long acked; // newest sequence the replica acknowledged
+  long pending;        // records not yet acknowledged
+  long lag_ms;         // age of the oldest of them, 0 if none
+} ReplLag;
+
+int ss_replicate_init(const char *ss_id, const unsigned char key[SHA256_BYTES]);
+
+// Replica endpoint from the NM (empty host or port 0 for none). Pending
+// records go to the new target; files it lacks are found by the NM's
+// Merkle tree comparison and queued with ss_replicate_note.
+void ss_replicate_set_target(const char *host, int port);
+
+// Record that file changed (or is gone)
+void ss_replicate_note(const char *file);
+
+// Whether pending records were dropped (the log overflowed) since the last
+// call. The caller asks the NM to reconcile the replica, which also removes
+// files deleted in the meantime.
+int ss_replicate_take_reconcile(void);
+
+void ss_replicate_lag(ReplLag *out);
+
+// Replica side: answer the REPL_HELLO in line with a challenge and check
+// the primary's proof. Returns 0 with the primary's id in from, or -1 if
+// it gave none (it has been told why) and the connection should be dropped.
+int ss_replicate_serve_hello(int fd, const char *line, char *from, size_t size);
+
+// Replica side: apply the REPL_BATCH whose header is line from the proven
+// primary from, reading its records from fd, and acknowledge the newest
+// one applied in order. Returns -1 if the connection should be dropped.
+int ss_replicate_serve_batch(int fd, const char *line, const char *from);
+
+#endif
@@ -0,0 +1,592 @@
+#define _POSIX_C_SOURCE 200809L
+#include "ss_search.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+
+#define TERM_MAX 64
+#define INITIAL_BUCKETS 1024
+
+// BM25 parameters
+#define BM25_K1 1.2
+#define BM25_B 0.75
+
+// A sentence's postings point here rather than at a position, so a splice
+// that moves later sentences renumbers them without touching their postings
+typedef struct DocSentence
+{
+  int position;             // index in the document
+  int length;               // indexed words
+  struct TermEntry **terms; // distinct terms, one posting each
+  int term_count;
+} DocSentence;
+
+typedef struct SearchDoc
+{
+  FileState *state;
+  int length;               // indexed words
+  struct TermEntry **terms; // distinct terms, for removal
+  int term_count;
+  int term_capacity;
+  DocSentence **sentences;  // in document order
+  int sentence_count;
+  int sentence_capacity;
+
+  // Per-query scratch, valid while query_id matches
+  int query_id;
+  int matched;
+  double score;
+  double best_idf;
+  int best_sentence;
+
+  struct SearchDoc *next;
+} SearchDoc;
+
+typedef struct
+{
+  SearchDoc *doc;
+  DocSentence *sentence;
+  int tf;
+} Posting;
+
+typedef struct TermEntry
+{
+  char term[TERM_MAX];
+  Posting *postings; // grouped by document
+  int count;
+  int capacity;
+  int df;
+
+  // Indexing scratch, valid while stamp matches
+  int stamp;
+  int slot;
+
+  struct TermEntry *next;
+} TermEntry;
+
+static TermEntry **g_terms = NULL;
+static int g_term_buckets = 0;
+static int g_term_count = 0;
+static SearchDoc *g_docs = NULL;
+static int g_doc_count = 0;
+static long g_total_length = 0;
+static int g_query_id = 0;
+static int g_index_stamp = 0;
+static pthread_mutex_t g_search_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// ==================== TERM TABLE ====================
+
+static unsigned long term_hash(const char *term)
+{
+  unsigned long h = 5381;
+  while (*term)
+    h = ((h << 5) + h) + (unsigned char)*term++;
+  return h;
+}
+
+static void grow_terms(void)
+{
+  int new_buckets = g_term_buckets ? g_term_buckets * 2 : INITIAL_BUCKETS;
+  TermEntry **table = calloc(new_buckets, sizeof(TermEntry *));
+  if (!table)
+    return;
+  for (int i = 0; i < g_term_buckets; i++)
+  {
+    TermEntry *t = g_terms[i];
+    while (t)
+    {
+      TermEntry *next = t->next;
+      unsigned long b = term_hash(t->term) % new_buckets;
+      t->next = table[b];
+      table[b] = t;
+      t = next;
+    }
+  }
+  free(g_terms);
+  g_terms = table;
+  g_term_buckets = new_buckets;
+}
+
+static TermEntry *find_term(const char *term, int create)
+{
+  if (g_term_buckets > 0)
+  {
+    for (TermEntry *t = g_terms[term_hash(term) % g_term_buckets]; t; t = t->next)
+    {
+      if (!strcmp(t->term, term))
+        return t;
+    }
+  }
+  if (!create)
+    return NULL;
+
+  if (g_term_count >= g_term_buckets)
+    grow_terms();
+  if (g_term_buckets == 0)
+    return NULL;
+
+  TermEntry *t = calloc(1, sizeof(TermEntry));
+  if (!t)
+    return NULL;
+  snprintf(t->term, sizeof t->term, "%s", term);
+  unsigned long b = term_hash(term) % g_term_buckets;
+  t->next = g_terms[b];
+  g_terms[b] = t;
+  g_term_count++;
+  return t;
+}
+
+static void drop_term(TermEntry *term)
+{
+  unsigned long b = term_hash(term->term) % g_term_buckets;
+  TermEntry **link = &g_terms[b];
+  while (*link && *link != term)
+    link = &(*link)->next;
+  if (*link)
+    *link = term->next;
+  free(term->postings);
+  free(term);
+  g_term_count--;
+}
+
+static int is_term_char(char c)
+{
+  return isalnum((unsigned char)c) || c == '_' || c == '-' || c == '\'';
+}
+
+// Read the next lowercased term from *p and advance past it; returns 0 once
+// the text runs out. Documents and queries both go through here, so
+// "world," in a sentence and "world" in a query meet as the same term.
+static int next_term(const char **p, char term[TERM_MAX])
+{
+  const char *s = *p;
+  while (*s && !is_term_char(*s))
+    s++;
+  int len = 0;
+  for (; *s && is_term_char(*s); s++)
+  {
+    if (len < TERM_MAX - 1)
+      term[len++] = (char)tolower((unsigned char)*s);
+  }
+  term[len] = '\0';
+  *p = s;
+  return len > 0;
+}
+
+// ==================== DOCUMENTS ====================
+
+static SearchDoc *find_doc(FileState *state)
+{
+  for (SearchDoc *d = g_docs; d; d = d->next)
+  {
+    if (d->state == state)
+      return d;
+  }
+  return NULL;
+}
+
+static void free_doc_sentence(DocSentence *sent)
+{
+  free(sent->terms);
+  free(sent);
+}
+
+static void unindex_doc(SearchDoc *doc)
+{
+  for (int i = 0; i < doc->term_count; i++)
+  {
+    TermEntry *t = doc->terms[i];
+    int kept = 0;
+    for (int j = 0; j < t->count; j++)
+    {
+      if (t->postings[j].doc != doc)
+        t->postings[kept++] = t->postings[j];
+    }
+    t->count = kept;
+    t->df--;
+    if (t->count == 0)
+      drop_term(t);
+  }
+  doc->term_count = 0;
+  for (int i = 0; i < doc->sentence_count; i++)
+    free_doc_sentence(doc->sentences[i]);
+  doc->sentence_count = 0;
+  g_total_length -= doc->length;
+  doc->length = 0;
+}
+
+// Where doc's postings for t start, or -1; *end is set past the last one
+static int doc_run(const TermEntry *t, const SearchDoc *doc, int *end)
+{
+  for (int j = 0; j < t->count; j++)
+  {
+    if (t->postings[j].doc != doc)
+      continue;
+    int k = j;
+    while (k < t->count && t->postings[k].doc == doc)
+      k++;
+    *end = k;
+    return j;
+  }
+  *end = t->count;
+  return -1;
+}
+
+static int add_doc_term(SearchDoc *doc, TermEntry *t)
+{
+  if (doc->term_count >= doc->term_capacity)
+  {
+    int new_cap = doc->term_capacity ? doc->term_capacity * 2 : 16;
+    TermEntry **terms = realloc(doc->terms, new_cap * sizeof(TermEntry *));
+    if (!terms)
+      return -1;
+    doc->terms = terms;
+    doc->term_capacity = new_cap;
+  }
+  doc->terms[doc->term_count++] = t;
+  t->df++;
+  return 0;
+}
+
+// Give sent its posting in t
+static void add_posting(SearchDoc *doc, DocSentence *sent, TermEntry *t, int tf)
+{
+  if (t->count >= t->capacity)
+  {
+    int new_cap = t->capacity ? t->capacity * 2 : 4;
+    Posting *postings = realloc(t->postings, new_cap * sizeof(Posting));
+    if (!postings)
+      return;
+    t->postings = postings;
+    t->capacity = new_cap;
+  }
+
+  // Postings for one document are contiguous; a new one goes at the end of
+  // the document's run, which is the end of the list while a document is
+  // indexed from scratch
+  int end = t->count;
+  if (!(t->count && t->postings[t->count - 1].doc == doc) && doc_run(t, doc, &end) < 0 &&
+      add_doc_term(doc, t) != 0)
+    return;
+  memmove(&t->postings[end + 1], &t->postings[end], (t->count - end) * sizeof(Posting));
+  t->postings[end].doc = doc;
+  t->postings[end].sentence = sent;
+  t->postings[end].tf = tf;
+  t->count++;
+}
+
+// Drop sent's postings; terms left in no other sentence of doc leave it
+static void remove_postings(SearchDoc *doc, DocSentence *sent)
+{
+  for (int i = 0; i < sent->term_count; i++)
+  {
+    TermEntry *t = sent->terms[i];
+    int end, start = doc_run(t, doc, &end);
+    if (start < 0)
+      continue;
+    int kept = start;
+    for (int j = start; j < end; j++)
+    {
+      if (t->postings[j].sentence != sent)
+        t->postings[kept++] = t->postings[j];
+    }
+    memmove(&t->postings[kept], &t->postings[end], (t->count - end) * sizeof(Posting));
+    t->count -= end - kept;
+
+    if (kept == start)
+    {
+      for (int k = 0; k < doc->term_count; k++)
+      {
+        if (doc->terms[k] == t)
+        {
+          doc->terms[k] = doc->terms[--doc->term_count];
+          break;
+        }
+      }
+      t->df--;
+      if (t->count == 0)
+        drop_term(t);
+    }
+  }
+  doc->length -= sent->length;
+  g_total_length -= sent->length;
+}
+
+// A new sentence indexed from its text
+static DocSentence *index_sentence(SearchDoc *doc, const char *text)
+{
+  DocSentence *sent = calloc(1, sizeof(DocSentence));
+  if (!sent)
+    return NULL;
+
+  // Each distinct term gets one posting; its stamp marks it as seen in this
+  // sentence, at slot in sent->terms
+  int stamp = ++g_index_stamp, capacity = 0;
+  int *tfs = NULL;
+  char term[TERM_MAX];
+  const char *p = text;
+  while (next_term(&p, term))
+  {
+    sent->length++;
+    TermEntry *t = find_term(term, 1);
+    if (!t)
+      continue;
+    if (t->stamp == stamp)
+    {
+      tfs[t->slot]++;
+      continue;
+    }
+    if (sent->term_count >= capacity)
+    {
+      int new_cap = capacity ? capacity * 2 : 16;
+      TermEntry **terms = realloc(sent->terms, new_cap * sizeof(TermEntry *));
+      if (terms)
+        sent->terms = terms;
+      int *grown = terms ? realloc(tfs, new_cap * sizeof(int)) : NULL;
+      if (!grown)
+        continue;
+      tfs = grown;
+      capacity = new_cap;
+    }
+    t->stamp = stamp;
+    t->slot = sent->term_count;
+    sent->terms[sent->term_count] = t;
+    tfs[sent->term_count++] = 1;
+  }
+  for (int i = 0; i < sent->term_count; i++)
+    add_posting(doc, sent, sent->terms[i], tfs[i]);
+  free(tfs);
+
+  doc->length += sent->length;
+  g_total_length += sent->length;
+  return sent;
+}
+
+// Replace doc's sentences [idx, idx + removed) with the count texts and
+// renumber the sentences after them
+static void splice_doc(SearchDoc *doc, int idx, int removed, char *const *sentences, int count)
+{
+  for (int i = idx; i < idx + removed; i++)
+  {
+    remove_postings(doc, doc->sentences[i]);
+    free_doc_sentence(doc->sentences[i]);
+  }
+
+  int tail = doc->sentence_count - idx - removed;
+  if (doc->sentence_count - removed + count > doc->sentence_capacity)
+  {
+    int new_cap = doc->sentence_capacity ? doc->sentence_capacity : 16;
+    while (new_cap < doc->sentence_count - removed + count)
+      new_cap *= 2;
+    DocSentence **grown = realloc(doc->sentences, new_cap * sizeof(DocSentence *));
+    if (grown)
+    {
+      doc->sentences = grown;
+      doc->sentence_capacity = new_cap;
+    }
+    else
+    {
+      count = 0; // the new sentences stay out of the index
+    }
+  }
+  memmove(&doc->sentences[idx + count], &doc->sentences[idx + removed], tail * sizeof(DocSentence *));
+
+  int added = 0;
+  for (int i = 0; i < count; i++)
+  {
+    DocSentence *sent = index_sentence(doc, sentences[i]);
+    if (sent)
+      doc->sentences[idx + added++] = sent;
+  }
+  if (added < count)
+    memmove(&doc->sentences[idx + added], &doc->sentences[idx + count], tail * sizeof(DocSentence *));
+  doc->sentence_count = idx + added + tail;
+  for (int i = idx; i < doc->sentence_count; i++)
+    doc->sentences[i]->position = i;
+}
+
+// The document indexed for state, added empty if there is none yet
+static SearchDoc *get_doc(FileState *state)
+{
+  SearchDoc *doc = find_doc(state);
+  if (doc)
+    return doc;
+  doc = calloc(1, sizeof(SearchDoc));
+  if (!doc)
+    return NULL;
+  doc->state = state;
+  doc->next = g_docs;
+  g_docs = doc;
+  g_doc_count++;
+  return doc;
+}
+
+void ss_search_index_file(FileState *state, char *const *sentences, int count)
+{
+  pthread_mutex_lock(&g_search_mutex);
+  SearchDoc *doc = get_doc(state);
+  if (doc)
+  {
+    unindex_doc(doc);
+    splice_doc(doc, 0, 0, sentences, count);
+  }
+  pthread_mutex_unlock(&g_search_mutex);
+}
+
+void ss_search_splice_file(FileState *state, int idx, int removed, char *const *sentences, int count)
+{
+  pthread_mutex_lock(&g_search_mutex);
+  SearchDoc *doc = find_doc(state);
+  if (doc && idx >= 0 && removed >= 0 && idx + removed <= doc->sentence_count)
+    splice_doc(doc, idx, removed, sentences, count);
+  pthread_mutex_unlock(&g_search_mutex);
+}
+
+void ss_search_remove_file(FileState *state)
+{
+  pthread_mutex_lock(&g_search_mutex);
+
+  SearchDoc **link = &g_docs;
+  while (*link && (*link)->state != state)
+    link = &(*link)->next;
+  if (*link)
+  {
+    SearchDoc *doc = *link;
+    unindex_doc(doc);
+    *link = doc->next;
+    free(doc->terms);
+    free(doc->sentences);
+    free(doc);
+    g_doc_count--;
+  }
+
+  pthread_mutex_unlock(&g_search_mutex);
+}
+
+// ==================== QUERIES ====================
+
+static int compare_hits(const void *a, const void *b)
+{
+  const SearchHit *ha = a, *hb = b;
+  if (ha->score < hb->score)
+    return 1;
+  if (ha->score > hb->score)
+    return -1;
+  return 0;
+}
+
+// Split a query into distinct normalized terms
+static int parse_query(const char *query, char terms[][TERM_MAX], int max_terms)
+{
+  int n = 0;
+  const char *p = query;
+  while (n < max_terms && next_term(&p, terms[n]))
+  {
+    int duplicate = 0;
+    for (int i = 0; i < n; i++)
+    {
+      if (!strcmp(terms[i], terms[n]))
+        duplicate = 1;
+    }
+    if (!duplicate)
+      n++;
+  }
+  return n;
+}
+
+int ss_search_query(const char *query, int (*visible)(FileState *state, void *arg), void *arg,
+                    SearchHit *hits, int max_hits)
+{
+  char terms[SEARCH_MAX_TERMS][TERM_MAX];
+  int nterms = parse_query(query, terms, SEARCH_MAX_TERMS);
+  if (nterms == 0 || max_hits <= 0)
+    return 0;
+
+  pthread_mutex_lock(&g_search_mutex);
+
+  int qid = ++g_query_id;
+  double avg_len = g_doc_count ? (double)g_total_length / g_doc_count : 1.0;
+  if (avg_len <= 0)
+    avg_len = 1.0;
+
+  for (int i = 0; i < nterms; i++)
+  {
+    TermEntry *t = find_term(terms[i], 0);
+    if (!t)
+    {
+      // Every term must match, so an unknown term means no results
+      pthread_mutex_unlock(&g_search_mutex);
+      return 0;
+    }
+
+    double idf = log(1.0 + (g_doc_count - t->df + 0.5) / (t->df + 0.5));
+    for (int j = 0; j < t->count;)
+    {
+      SearchDoc *doc = t->postings[j].doc;
+      int tf = 0;
+      int first_sentence = t->postings[j].sentence->position;
+      for (; j < t->count && t->postings[j].doc == doc; j++)
+      {
+        tf += t->postings[j].tf;
+        if (t->postings[j].sentence->position < first_sentence)
+          first_sentence = t->postings[j].sentence->position;
+      }
+
+      if (doc->query_id != qid)
+      {
+        doc->query_id = qid;
+        doc->matched = 0;
+        doc->score = 0;
+        doc->best_idf = -1;
+        doc->best_sentence = 0;
+      }
+      // Only documents that matched every earlier term stay candidates
+      if (doc->matched != i)
+        continue;
+
+      double norm = 1.0 - BM25_B + BM25_B * doc->length / avg_len;
+      doc->score += idf * tf * (BM25_K1 + 1.0) / (tf + BM25_K1 * norm);
+      doc->matched++;
+      if (idf > doc->best_idf)
+      {
+        doc->best_idf = idf;
+        doc->best_sentence = first_sentence;
+      }
+    }
+  }
+
+  int found = 0, capacity = 0;
+  SearchHit *all = NULL;
+  for (SearchDoc *d = g_docs; d; d = d->next)
+  {
+    if (d->query_id != qid || d->matched != nterms)
+      continue;
+    if (visible && !visible(d->state, arg))
+      continue;
+    if (found >= capacity)
+    {
+      capacity = capacity ? capacity * 2 : 16;
+      SearchHit *grown = realloc(all, capacity * sizeof(SearchHit));
+      if (!grown)
+        break;
+      all = grown;
+    }
+    all[found].state = d->state;
+    all[found].score = d->score;
+    all[found].sentence = d->best_sentence;
+    found++;
+  }
+
+  pthread_mutex_unlock(&g_search_mutex);
+
+  if (found > 1)
+    qsort(all, found, sizeof(SearchHit), compare_hits);
+  int n = found < max_hits ? found : max_hits;
+  if (n > 0)
+    memcpy(hits, all, n * sizeof(SearchHit));
+  free(all);
+  return n;
+}
@@ -0,0 +1,34 @@
+#ifndef SS_SEARCH_H
+#define SS_SEARCH_H
+#include "ss_files.h"
+
+// Full-text inverted index over cached documents: term -> (file, sentence)
+// postings. Files are reindexed individually whenever their committed
+// content changes, from the text of their sentences rather than the file
+// state, so indexing can run without the file cache lock.
+
+#define SEARCH_MAX_TERMS 16
+
+typedef struct
+{
+  FileState *state;
+  double score;
+  int sentence; // sentence holding the rarest query term
+} SearchHit;
+
+// Index state's document as the count sentence texts, replacing what was
+// indexed for it before. state is only used as the key.
+void ss_search_index_file(FileState *state, char *const *sentences, int count);
+
+// Replace the postings of sentences [idx, idx + removed) of state's indexed
+// document with those of the count sentence texts, and move the sentences
+// after them along. Only the postings of the terms involved are touched.
+void ss_search_splice_file(FileState *state, int idx, int removed, char *const *sentences, int count);
+void ss_search_remove_file(FileState *state);
+
+// Rank files containing every query term (BM25), skipping those for which
+// visible() returns 0. Fills up to max_hits, best first; returns the count.
+int ss_search_query(const char *query, int (*visible)(FileState *state, void *arg), void *arg,
+                    SearchHit *hits, int max_hits);
+
+#endif
@@ -0,0 +1,88 @@
+#define _POSIX_C_SOURCE 200809L
+#include "ss_stats.h"
+#include "ss_files.h"
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/statvfs.h>
+
+#define DATA_DIR "storageserver/data"
+
+// Latency histogram with power-of-two microsecond buckets: bucket i holds
+// requests that took less than 2^i us (the last one catches the rest)
+#define LATENCY_BUCKETS 32
+
+static atomic_int g_active;
+static atomic_long g_latency[LATENCY_BUCKETS];
+static long long g_window_start_us = 0;
+
+long long ss_stats_now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void ss_stats_connection_opened(void)
+{
+  atomic_fetch_add(&g_active, 1);
+}
+
+void ss_stats_connection_closed(void)
+{
+  atomic_fetch_sub(&g_active, 1);
+}
+
+int ss_stats_active(void)
+{
+  return atomic_load(&g_active);
+}
+
+void ss_stats_request_done(long long start_us)
+{
+  long long elapsed = ss_stats_now_us() - start_us;
+  int bucket = 0;
+  while (bucket < LATENCY_BUCKETS - 1 && elapsed >= (1LL << bucket))
+    bucket++;
+  atomic_fetch_add(&g_latency[bucket], 1);
+}
+
+// Only the heartbeat thread reports, so the window start needs no lock
+void ss_stats_report(SSLoadReport *out)
+{
+  long long now = ss_stats_now_us();
+  if (g_window_start_us == 0)
+    g_window_start_us = now;
+
+  long counts[LATENCY_BUCKETS];
+  long total = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++)
+  {
+    counts[i] = atomic_exchange(&g_latency[i], 0);
+    total += counts[i];
+  }
+
+  // Upper bound of the bucket holding the 99th percentile request
+  long p99 = 0;
+  long seen = 0;
+  long rank = total - total / 100;
+  for (int i = 0; i < LATENCY_BUCKETS && total > 0; i++)
+  {
+    seen += counts[i];
+    if (seen >= rank)
+    {
+      p99 = 1L << i;
+      break;
+    }
+  }
+
+  out->active = atomic_load(&g_active);
+  out->requests = total;
+  out->window_ms = (long)((now - g_window_start_us) / 1000);
+  out->p99_us = p99;
+  ss_files_usage(&out->files, &out->bytes);
+
+  struct statvfs vfs;
+  out->free_disk = statvfs(DATA_DIR, &vfs) == 0 ? (long long)(vfs.f_bavail * vfs.f_frsize) : -1LL;
+
+  g_window_start_us = now;
+}
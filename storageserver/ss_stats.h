@@ -0,0 +1,30 @@
+#ifndef SS_STATS_H
+#define SS_STATS_H
+
+// Load counters reported to the NM with every heartbeat. Connection and
+// request accounting is lock-free so the client threads never contend on it.
+
+typedef struct
+{
+  int active;            // client connections currently open
+  long requests;         // requests completed since the previous report
+  long window_ms;        // length of that window
+  long p99_us;           // 99th percentile request latency in the window
+  long long bytes;       // committed document bytes
+  int files;             // documents in the file cache
+  long long free_disk;   // bytes available to the data directory
+} SSLoadReport;
+
+void ss_stats_connection_opened(void);
+void ss_stats_connection_closed(void);
+int ss_stats_active(void);
+
+// Monotonic clock in microseconds; pass the value taken when a request
+// arrived to ss_stats_request_done once it has been answered
+long long ss_stats_now_us(void);
+void ss_stats_request_done(long long start_us);
+
+// Fill out and start a new measurement window
+void ss_stats_report(SSLoadReport *out);
+
+#endif
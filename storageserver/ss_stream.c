@@ -0,0 +1,635 @@
+#define _POSIX_C_SOURCE 200809L
+#include "ss_stream.h"
+#include "ss_files.h"
+#include "../common/proto.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+// Two-level wheel: 256 slots of one tick, then 64 slots of 256 ticks
+// (about 2.5 s and 160 s of range at 10 ms per tick)
+#define TICK_MS 10
+#define WHEEL0_BITS 8
+#define WHEEL0_SLOTS (1 << WHEEL0_BITS)
+#define WHEEL1_SLOTS 64
+#define MAX_DELAY_TICKS ((unsigned long)(WHEEL1_SLOTS - 1) * WHEEL0_SLOTS)
+
+// A late joiner may attach to a running channel while it has released at
+// most this many frames; they are replayed to it before it follows live.
+// A subscriber that falls this far behind is moved to its own channel.
+#define REPLAY_FRAMES 32
+
+// Encoded TOK frames for one version of a file, shared by every stream of
+// that version
+typedef struct Frames
+{
+  int refs;
+  char file[256];
+  unsigned long version;
+  char *data;   // TOK lines followed by STOP
+  size_t *ends; // end offset of each frame in data
+  int count;
+  struct Frames *next;
+} Frames;
+
+struct Channel;
+
+typedef struct Subscriber
+{
+  int fd;
+  size_t sent;      // bytes of frames already written
+  int done_frames;  // frames completely written
+  int parked;       // waiting for POLLOUT
+  struct Channel *channel;
+  struct Subscriber *next;      // in the channel
+  struct Subscriber *wait_next; // in the parked list
+} Subscriber;
+
+// One producer: releases a frame every interval to all its subscribers
+typedef struct Channel
+{
+  Frames *frames;
+  int interval_ticks; // 0 = unthrottled
+  int position;       // frames released so far
+  int joinable;       // 0 for channels holding a detached laggard
+  int scheduled;      // on the wheel
+  Subscriber *subs;
+  int sub_count;
+  unsigned long expires;
+  struct Channel *next;      // in a wheel slot
+  struct Channel *list_next; // in g_channels
+} Channel;
+
+static Channel *g_wheel0[WHEEL0_SLOTS];
+static Channel *g_wheel1[WHEEL1_SLOTS];
+static int g_timer_count = 0;
+static unsigned long g_tick = 0; // last tick processed
+static struct timespec g_epoch;
+
+static Channel *g_channels = NULL;
+static Subscriber *g_waiting = NULL; // parked on POLLOUT
+static int g_waiting_count = 0;
+
+static Frames *g_frames = NULL;
+static pthread_mutex_t g_frames_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Streams handed over by client threads, picked up by the scheduler
+typedef struct Pending
+{
+  int fd;
+  Frames *frames;
+  int interval_ticks;
+  struct Pending *next;
+} Pending;
+
+static Pending *g_incoming = NULL;
+static pthread_mutex_t g_incoming_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int g_wake[2] = {-1, -1};
+
+static unsigned long elapsed_ms(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long)(now.tv_sec - g_epoch.tv_sec) * 1000 +
+         (now.tv_nsec - g_epoch.tv_nsec) / 1000000;
+}
+
+// ==================== FRAME CACHE ====================
+
+static void frames_release(Frames *f)
+{
+  pthread_mutex_lock(&g_frames_mutex);
+  if (--f->refs > 0)
+  {
+    pthread_mutex_unlock(&g_frames_mutex);
+    return;
+  }
+  Frames **link = &g_frames;
+  while (*link && *link != f)
+    link = &(*link)->next;
+  if (*link)
+    *link = f->next;
+  pthread_mutex_unlock(&g_frames_mutex);
+
+  free(f->data);
+  free(f->ends);
+  free(f);
+}
+
+static Frames *frames_lookup_locked(const char *file, unsigned long version)
+{
+  for (Frames *f = g_frames; f; f = f->next)
+  {
+    if (f->version == version && !strcmp(f->file, file))
+    {
+      f->refs++;
+      return f;
+    }
+  }
+  return NULL;
+}
+
+// Encode every word as a TOK line once, so the scheduler only copies bytes
+static Frames *frames_encode(const char *file, unsigned long version, char **words, int count)
+{
+  static const char stop[] = "{\"op\":\"STOP\"}\n";
+  size_t size = sizeof stop;
+  for (int i = 0; i < count; i++)
+    size += strlen(words[i]) + 24;
+
+  Frames *f = calloc(1, sizeof(Frames));
+  if (!f)
+    return NULL;
+  f->data = malloc(size);
+  f->ends = malloc((count + 1) * sizeof(size_t));
+  if (!f->data || !f->ends)
+  {
+    free(f->data);
+    free(f->ends);
+    free(f);
+    return NULL;
+  }
+
+  size_t pos = 0;
+  for (int i = 0; i < count; i++)
+  {
+    pos += snprintf(f->data + pos, size - pos, "{\"op\":\"TOK\",\"w\":\"%s\"}\n", words[i]);
+    f->ends[i] = pos;
+  }
+  memcpy(f->data + pos, stop, sizeof stop - 1);
+  pos += sizeof stop - 1;
+  f->ends[count] = pos;
+  f->count = count + 1;
+  f->refs = 1;
+  snprintf(f->file, sizeof f->file, "%s", file);
+  f->version = version;
+  return f;
+}
+
+// Frames for the current version of file, tokenizing only on a cache miss
+static int frames_acquire(const char *file, const char *user, Frames **out)
+{
+  unsigned long version = 0;
+  int rc = ss_files_stream_version(file, user, &version);
+  if (rc != OK)
+    return rc;
+
+  pthread_mutex_lock(&g_frames_mutex);
+  Frames *f = frames_lookup_locked(file, version);
+  pthread_mutex_unlock(&g_frames_mutex);
+  if (f)
+  {
+    *out = f;
+    return OK;
+  }
+
+  char **words = NULL;
+  int count = 0;
+  rc = ss_files_stream_words(file, &words, &count, &version);
+  if (rc != OK)
+    return rc;
+  Frames *built = frames_encode(file, version, words, count);
+  ss_files_free_words(words, count);
+  if (!built)
+    return ERR_INTERNAL;
+
+  // Another client may have built the same version meanwhile
+  pthread_mutex_lock(&g_frames_mutex);
+  f = frames_lookup_locked(file, version);
+  if (!f)
+  {
+    built->next = g_frames;
+    g_frames = built;
+  }
+  pthread_mutex_unlock(&g_frames_mutex);
+  if (f)
+    frames_release(built);
+
+  *out = f ? f : built;
+  return OK;
+}
+
+// ==================== TIMER WHEEL ====================
+
+static void wheel_insert(Channel *ch)
+{
+  unsigned long delta = ch->expires > g_tick ? ch->expires - g_tick : 0;
+  if (delta > MAX_DELAY_TICKS)
+  {
+    delta = MAX_DELAY_TICKS;
+    ch->expires = g_tick + delta;
+  }
+
+  Channel **slot;
+  if (delta < WHEEL0_SLOTS)
+    slot = &g_wheel0[ch->expires & (WHEEL0_SLOTS - 1)];
+  else
+    slot = &g_wheel1[(ch->expires >> WHEEL0_BITS) & (WHEEL1_SLOTS - 1)];
+  ch->next = *slot;
+  *slot = ch;
+  g_timer_count++;
+}
+
+static void schedule(Channel *ch, int ticks)
+{
+  ch->expires = g_tick + (ticks > 0 ? ticks : 1);
+  ch->scheduled = 1;
+  wheel_insert(ch);
+}
+
+// ==================== CHANNELS ====================
+
+static Channel *channel_new(Frames *frames, int interval_ticks, int joinable)
+{
+  Channel *ch = calloc(1, sizeof(Channel));
+  if (!ch)
+    return NULL;
+  ch->frames = frames;
+  ch->interval_ticks = interval_ticks;
+  ch->joinable = joinable;
+  ch->list_next = g_channels;
+  g_channels = ch;
+  return ch;
+}
+
+// Free a channel once it has no subscribers and is off the wheel
+static void channel_maybe_free(Channel *ch)
+{
+  if (ch->sub_count > 0 || ch->scheduled)
+    return;
+  Channel **link = &g_channels;
+  while (*link && *link != ch)
+    link = &(*link)->list_next;
+  if (*link)
+    *link = ch->list_next;
+  frames_release(ch->frames);
+  free(ch);
+}
+
+static void channel_attach(Channel *ch, Subscriber *sub)
+{
+  sub->channel = ch;
+  sub->next = ch->subs;
+  ch->subs = sub;
+  ch->sub_count++;
+}
+
+static void channel_detach(Subscriber *sub)
+{
+  Channel *ch = sub->channel;
+  Subscriber **link = &ch->subs;
+  while (*link && *link != sub)
+    link = &(*link)->next;
+  if (*link)
+    *link = sub->next;
+  ch->sub_count--;
+  sub->channel = NULL;
+}
+
+static Channel *find_joinable(Frames *frames, int interval_ticks)
+{
+  for (Channel *ch = g_channels; ch; ch = ch->list_next)
+  {
+    if (ch->joinable && ch->frames == frames && ch->interval_ticks == interval_ticks &&
+        ch->position <= REPLAY_FRAMES && ch->position < frames->count)
+      return ch;
+  }
+  return NULL;
+}
+
+// ==================== WRITING ====================
+
+static void park(Subscriber *sub)
+{
+  sub->parked = 1;
+  sub->wait_next = g_waiting;
+  g_waiting = sub;
+  g_waiting_count++;
+}
+
+// Write everything the channel has released to this subscriber. The
+// subscriber is parked when its socket fills, and closed once it has the
+// whole stream or the client has gone away. Does not free the channel.
+static void subscriber_flush(Subscriber *sub)
+{
+  Channel *ch = sub->channel;
+  Frames *f = ch->frames;
+  size_t limit = ch->position > 0 ? f->ends[ch->position - 1] : 0;
+
+  while (sub->sent < limit)
+  {
+    ssize_t n = send(sub->fd, f->data + sub->sent, limit - sub->sent, MSG_NOSIGNAL);
+    if (n > 0)
+    {
+      sub->sent += n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      park(sub);
+      return;
+    }
+    // Client went away
+    channel_detach(sub);
+    close(sub->fd);
+    free(sub);
+    return;
+  }
+
+  while (sub->done_frames < f->count && f->ends[sub->done_frames] <= sub->sent)
+    sub->done_frames++;
+  if (sub->done_frames >= f->count)
+  {
+    channel_detach(sub);
+    close(sub->fd);
+    free(sub);
+  }
+}
+
+// Give a parked subscriber that fell REPLAY_FRAMES behind its own channel,
+// paced from where it is, so the shared channel does not wait on it
+static void detach_laggard(Subscriber *sub)
+{
+  Channel *old = sub->channel;
+  Channel *solo = channel_new(old->frames, old->interval_ticks, 0);
+  if (!solo)
+    return;
+  pthread_mutex_lock(&g_frames_mutex);
+  old->frames->refs++;
+  pthread_mutex_unlock(&g_frames_mutex);
+
+  channel_detach(sub);
+  channel_attach(solo, sub);
+  solo->position = sub->done_frames + 1;
+  if (solo->position < solo->frames->count)
+    schedule(solo, solo->interval_ticks);
+}
+
+// Release the next frame (every frame when unthrottled) to all subscribers
+static void channel_release(Channel *ch)
+{
+  ch->scheduled = 0;
+
+  // Hold the position while nobody can take a frame, so a stalled reader
+  // is paused rather than left with a backlog
+  int writable = 0;
+  for (Subscriber *sub = ch->subs; sub; sub = sub->next)
+    writable += !sub->parked;
+
+  if (ch->interval_ticks == 0)
+    ch->position = ch->frames->count;
+  else if (ch->position < ch->frames->count && (writable > 0 || ch->position == 0))
+    ch->position++;
+
+  Subscriber *sub = ch->subs;
+  while (sub)
+  {
+    Subscriber *next = sub->next;
+    if (!sub->parked)
+      subscriber_flush(sub);
+    else if (ch->joinable && ch->position - sub->done_frames > REPLAY_FRAMES)
+      detach_laggard(sub);
+    sub = next;
+  }
+
+  if (ch->sub_count > 0 && ch->position < ch->frames->count)
+    schedule(ch, ch->interval_ticks);
+  channel_maybe_free(ch);
+}
+
+static void process_tick(unsigned long tick)
+{
+  g_tick = tick;
+
+  // Entering a new level-0 rotation: move the matching level-1 slot down
+  if ((tick & (WHEEL0_SLOTS - 1)) == 0)
+  {
+    Channel *ch = g_wheel1[(tick >> WHEEL0_BITS) & (WHEEL1_SLOTS - 1)];
+    g_wheel1[(tick >> WHEEL0_BITS) & (WHEEL1_SLOTS - 1)] = NULL;
+    while (ch)
+    {
+      Channel *next = ch->next;
+      g_timer_count--;
+      wheel_insert(ch);
+      ch = next;
+    }
+  }
+
+  Channel *due = g_wheel0[tick & (WHEEL0_SLOTS - 1)];
+  g_wheel0[tick & (WHEEL0_SLOTS - 1)] = NULL;
+  while (due)
+  {
+    Channel *next = due->next;
+    g_timer_count--;
+    channel_release(due);
+    due = next;
+  }
+}
+
+// Attach a new stream to a running channel for the same frames and rate,
+// or start a channel for it
+static void start_pending(Pending *p)
+{
+  Subscriber *sub = calloc(1, sizeof(Subscriber));
+  if (!sub)
+  {
+    close(p->fd);
+    frames_release(p->frames);
+    return;
+  }
+  sub->fd = p->fd;
+
+  Channel *ch = find_joinable(p->frames, p->interval_ticks);
+  if (ch)
+  {
+    // The channel holds its own reference
+    frames_release(p->frames);
+    channel_attach(ch, sub);
+    subscriber_flush(sub); // replay what was already released
+    channel_maybe_free(ch);
+    return;
+  }
+
+  ch = channel_new(p->frames, p->interval_ticks, 1);
+  if (!ch)
+  {
+    close(sub->fd);
+    free(sub);
+    frames_release(p->frames);
+    return;
+  }
+  channel_attach(ch, sub);
+  channel_release(ch);
+}
+
+// ==================== SCHEDULER ====================
+
+static void *scheduler_thread(void *arg)
+{
+  (void)arg;
+  int capacity = 64;
+  struct pollfd *fds = malloc(capacity * sizeof(struct pollfd));
+  Subscriber **polled = malloc(capacity * sizeof(Subscriber *));
+  if (!fds || !polled)
+  {
+    fprintf(stderr, "[SS] Stream scheduler out of memory\n");
+    free(fds);
+    free(polled);
+    return NULL;
+  }
+
+  for (;;)
+  {
+    // Detach the parked subscribers; the ones still blocked are re-parked
+    int nwait = g_waiting_count;
+    if (nwait + 1 > capacity)
+    {
+      int new_cap = (nwait + 1) * 2;
+      struct pollfd *grown_fds = realloc(fds, new_cap * sizeof(struct pollfd));
+      if (grown_fds)
+        fds = grown_fds;
+      Subscriber **grown_polled = grown_fds ? realloc(polled, new_cap * sizeof(Subscriber *)) : NULL;
+      if (grown_polled)
+      {
+        polled = grown_polled;
+        capacity = new_cap;
+      }
+      // Otherwise the extra subscribers wait for a later round
+    }
+
+    int nfds = 1;
+    fds[0].fd = g_wake[0];
+    fds[0].events = POLLIN;
+    Subscriber *sub = g_waiting;
+    g_waiting = NULL;
+    g_waiting_count = 0;
+    while (sub)
+    {
+      Subscriber *next = sub->wait_next;
+      if (nfds < capacity)
+      {
+        fds[nfds].fd = sub->fd;
+        fds[nfds].events = POLLOUT;
+        polled[nfds++] = sub;
+      }
+      else
+      {
+        sub->wait_next = g_waiting;
+        g_waiting = sub;
+        g_waiting_count++;
+      }
+      sub = next;
+    }
+
+    int timeout = -1;
+    if (g_timer_count > 0)
+    {
+      unsigned long now = elapsed_ms();
+      unsigned long next_due = (g_tick + 1) * TICK_MS;
+      timeout = next_due > now ? (int)(next_due - now) : 0;
+    }
+
+    int ready = poll(fds, nfds, timeout);
+    if (ready < 0 && errno != EINTR)
+      ready = 0;
+
+    if (ready > 0 && (fds[0].revents & POLLIN))
+    {
+      char drain[64];
+      while (read(g_wake[0], drain, sizeof drain) > 0)
+        ;
+    }
+
+    for (int i = 1; i < nfds; i++)
+    {
+      if (ready > 0 && fds[i].revents)
+      {
+        Channel *ch = polled[i]->channel;
+        polled[i]->parked = 0;
+        subscriber_flush(polled[i]);
+        channel_maybe_free(ch);
+      }
+      else
+      {
+        polled[i]->wait_next = g_waiting;
+        g_waiting = polled[i];
+        g_waiting_count++;
+      }
+    }
+
+    pthread_mutex_lock(&g_incoming_mutex);
+    Pending *incoming = g_incoming;
+    g_incoming = NULL;
+    pthread_mutex_unlock(&g_incoming_mutex);
+
+    // Catch the wheel up before starting new streams so their first
+    // interval is measured from now
+    unsigned long now_tick = elapsed_ms() / TICK_MS;
+    while (g_tick < now_tick)
+      process_tick(g_tick + 1);
+
+    while (incoming)
+    {
+      Pending *next = incoming->next;
+      start_pending(incoming);
+      free(incoming);
+      incoming = next;
+    }
+  }
+  return NULL;
+}
+
+int ss_stream_init(void)
+{
+  if (pipe(g_wake) != 0)
+    return ERR_INTERNAL;
+  fcntl(g_wake[0], F_SETFL, fcntl(g_wake[0], F_GETFL) | O_NONBLOCK);
+  fcntl(g_wake[1], F_SETFL, fcntl(g_wake[1], F_GETFL) | O_NONBLOCK);
+  clock_gettime(CLOCK_MONOTONIC, &g_epoch);
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, scheduler_thread, NULL) != 0)
+    return ERR_INTERNAL;
+  pthread_detach(tid);
+  return OK;
+}
+
+int ss_stream_start(int fd, const char *file, const char *user, int interval_ms)
+{
+  if (interval_ms < 0)
+    interval_ms = SS_STREAM_DEFAULT_INTERVAL_MS;
+  if (interval_ms > SS_STREAM_MAX_INTERVAL_MS)
+    interval_ms = SS_STREAM_MAX_INTERVAL_MS;
+
+  Pending *p = calloc(1, sizeof(Pending));
+  if (!p)
+    return ERR_INTERNAL;
+  int rc = frames_acquire(file, user, &p->frames);
+  if (rc != OK)
+  {
+    free(p);
+    return rc;
+  }
+  p->fd = fd;
+  p->interval_ticks = (interval_ms + TICK_MS - 1) / TICK_MS;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  pthread_mutex_lock(&g_incoming_mutex);
+  p->next = g_incoming;
+  g_incoming = p;
+  pthread_mutex_unlock(&g_incoming_mutex);
+
+  // A full pipe already means a wakeup is pending
+  ssize_t w = write(g_wake[1], "x", 1);
+  (void)w;
+  return OK;
+}
@@ -0,0 +1,22 @@
+#ifndef SS_STREAM_H
+#define SS_STREAM_H
+
+// STREAM delivery. One scheduler thread drives every active stream from a
+// hierarchical timer wheel over non-blocking sockets, so an open stream
+// costs a timer slot instead of a sleeping thread. A client that stops
+// reading is parked until its socket drains rather than blocking others.
+//
+// Streams of the same file version and rate share a channel: the file is
+// tokenized and encoded once and every subscriber is sent the same frames.
+
+#define SS_STREAM_DEFAULT_INTERVAL_MS 100
+#define SS_STREAM_MAX_INTERVAL_MS 60000
+
+int ss_stream_init(void);
+
+// Check access, then hand fd over to the scheduler, which sends one TOK
+// frame per word every interval_ms (0 sends as fast as the client reads),
+// then STOP and closes it. On failure fd is left to the caller.
+int ss_stream_start(int fd, const char *file, const char *user, int interval_ms);
+
+#endif
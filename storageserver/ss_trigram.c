@@ -0,0 +1,656 @@
+#define _POSIX_C_SOURCE 200809L
+#include "ss_trigram.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#define INITIAL_BUCKETS 4096
+#define MAX_QUERY_GRAMS 256
+
+typedef struct
+{
+  uint32_t *grams; // distinct trigrams, sorted
+  int gram_count;
+} TriSentence;
+
+typedef struct TriDoc
+{
+  FileState *state;
+  TriSentence *sentences; // in document order
+  int sentence_count;
+  int sentence_capacity;
+  uint32_t *grams; // distinct trigrams of the document, sorted
+  int *holders;    // sentences holding each
+  int gram_count;
+
+  // Per-query scratch, valid while query_id matches
+  int query_id;
+  int matched;
+
+  struct TriDoc *next;
+} TriDoc;
+
+typedef struct GramEntry
+{
+  uint32_t gram;
+  TriDoc **docs;
+  int count;
+  int capacity;
+  struct GramEntry *next;
+} GramEntry;
+
+static GramEntry **g_grams = NULL;
+static int g_gram_buckets = 0;
+static int g_gram_count = 0;
+static TriDoc *g_docs = NULL;
+static int g_query_id = 0;
+static int g_ready = 0;
+static pthread_mutex_t g_trigram_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t pack(const unsigned char *p)
+{
+  return ((uint32_t)tolower(p[0]) << 16) | ((uint32_t)tolower(p[1]) << 8) | (uint32_t)tolower(p[2]);
+}
+
+static int compare_grams(const void *a, const void *b)
+{
+  uint32_t ga = *(const uint32_t *)a, gb = *(const uint32_t *)b;
+  return ga < gb ? -1 : ga > gb;
+}
+
+// Sort and drop duplicates in place; returns the new count
+static int unique_grams(uint32_t *grams, int count)
+{
+  if (count <= 1)
+    return count;
+  qsort(grams, count, sizeof(uint32_t), compare_grams);
+  int kept = 1;
+  for (int i = 1; i < count; i++)
+  {
+    if (grams[i] != grams[kept - 1])
+      grams[kept++] = grams[i];
+  }
+  return kept;
+}
+
+// ==================== GRAM TABLE ====================
+
+static unsigned long gram_hash(uint32_t gram)
+{
+  return (unsigned long)(gram * 2654435761u);
+}
+
+static void grow_grams(void)
+{
+  int new_buckets = g_gram_buckets ? g_gram_buckets * 2 : INITIAL_BUCKETS;
+  GramEntry **table = calloc(new_buckets, sizeof(GramEntry *));
+  if (!table)
+    return;
+  for (int i = 0; i < g_gram_buckets; i++)
+  {
+    GramEntry *e = g_grams[i];
+    while (e)
+    {
+      GramEntry *next = e->next;
+      unsigned long b = gram_hash(e->gram) % new_buckets;
+      e->next = table[b];
+      table[b] = e;
+      e = next;
+    }
+  }
+  free(g_grams);
+  g_grams = table;
+  g_gram_buckets = new_buckets;
+}
+
+static GramEntry *find_gram(uint32_t gram, int create)
+{
+  if (g_gram_buckets > 0)
+  {
+    for (GramEntry *e = g_grams[gram_hash(gram) % g_gram_buckets]; e; e = e->next)
+    {
+      if (e->gram == gram)
+        return e;
+    }
+  }
+  if (!create)
+    return NULL;
+
+  if (g_gram_count >= g_gram_buckets)
+    grow_grams();
+  if (g_gram_buckets == 0)
+    return NULL;
+
+  GramEntry *e = calloc(1, sizeof(GramEntry));
+  if (!e)
+    return NULL;
+  e->gram = gram;
+  unsigned long b = gram_hash(gram) % g_gram_buckets;
+  e->next = g_grams[b];
+  g_grams[b] = e;
+  g_gram_count++;
+  return e;
+}
+
+static void drop_gram(GramEntry *entry)
+{
+  unsigned long b = gram_hash(entry->gram) % g_gram_buckets;
+  GramEntry **link = &g_grams[b];
+  while (*link && *link != entry)
+    link = &(*link)->next;
+  if (*link)
+    *link = entry->next;
+  free(entry->docs);
+  free(entry);
+  g_gram_count--;
+}
+
+// ==================== DOCUMENTS ====================
+
+static TriDoc *find_doc(FileState *state)
+{
+  for (TriDoc *d = g_docs; d; d = d->next)
+  {
+    if (d->state == state)
+      return d;
+  }
+  return NULL;
+}
+
+static void link_doc(uint32_t gram, TriDoc *doc)
+{
+  GramEntry *e = find_gram(gram, 1);
+  if (!e)
+    return;
+  if (e->count >= e->capacity)
+  {
+    int new_cap = e->capacity ? e->capacity * 2 : 4;
+    TriDoc **docs = realloc(e->docs, new_cap * sizeof(TriDoc *));
+    if (!docs)
+      return;
+    e->docs = docs;
+    e->capacity = new_cap;
+  }
+  e->docs[e->count++] = doc;
+}
+
+static void unlink_doc(uint32_t gram, TriDoc *doc)
+{
+  GramEntry *e = find_gram(gram, 0);
+  if (!e)
+    return;
+  for (int j = 0; j < e->count; j++)
+  {
+    if (e->docs[j] == doc)
+    {
+      e->docs[j] = e->docs[--e->count];
+      break;
+    }
+  }
+  if (e->count == 0)
+    drop_gram(e);
+}
+
+static void unindex_doc(TriDoc *doc)
+{
+  for (int i = 0; i < doc->gram_count; i++)
+    unlink_doc(doc->grams[i], doc);
+  free(doc->grams);
+  free(doc->holders);
+  doc->grams = NULL;
+  doc->holders = NULL;
+  doc->gram_count = 0;
+  for (int i = 0; i < doc->sentence_count; i++)
+    free(doc->sentences[i].grams);
+  doc->sentence_count = 0;
+}
+
+// Distinct trigrams of one sentence as the matcher sees it: words joined
+// by single spaces, followed by the delimiter
+static int collect_grams(const char *text, uint32_t **out)
+{
+  size_t len = strlen(text);
+  int count = len >= 3 ? (int)(len - 2) : 0;
+  uint32_t *grams = malloc((count ? count : 1) * sizeof(uint32_t));
+  if (!grams)
+    count = 0;
+  for (int i = 0; i < count; i++)
+    grams[i] = pack((const unsigned char *)text + i);
+  *out = grams;
+  return unique_grams(grams, count);
+}
+
+static int find_doc_gram(const TriDoc *doc, uint32_t gram)
+{
+  int lo = 0, hi = doc->gram_count - 1;
+  while (lo <= hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (doc->grams[mid] == gram)
+      return mid;
+    if (doc->grams[mid] < gram)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return -1;
+}
+
+// Trigrams of each sentence text, collected before the index lock is taken
+static TriSentence *collect_sentences(char *const *sentences, int nsent)
+{
+  TriSentence *added = calloc(nsent ? nsent : 1, sizeof(TriSentence));
+  for (int i = 0; added && i < nsent; i++)
+    added[i].gram_count = collect_grams(sentences[i], &added[i].grams);
+  return added;
+}
+
+// Replace doc's sentences [idx, idx + removed) with the nsent added ones,
+// taking them over. Only the trigrams of those sentences are looked at: a
+// trigram leaves the document with the last sentence holding it, and joins
+// it with the first.
+static void splice_doc(TriDoc *doc, int idx, int removed, TriSentence *added, int nsent)
+{
+  for (int i = idx; i < idx + removed; i++)
+  {
+    TriSentence *sent = &doc->sentences[i];
+    for (int g = 0; g < sent->gram_count; g++)
+    {
+      int at = find_doc_gram(doc, sent->grams[g]);
+      if (at >= 0 && --doc->holders[at] == 0)
+        unlink_doc(sent->grams[g], doc);
+    }
+    free(sent->grams);
+  }
+
+  int tail = doc->sentence_count - idx - removed;
+  if (doc->sentence_count - removed + nsent > doc->sentence_capacity)
+  {
+    int new_cap = doc->sentence_capacity ? doc->sentence_capacity : 16;
+    while (new_cap < doc->sentence_count - removed + nsent)
+      new_cap *= 2;
+    TriSentence *grown = realloc(doc->sentences, new_cap * sizeof(TriSentence));
+    if (grown)
+    {
+      doc->sentences = grown;
+      doc->sentence_capacity = new_cap;
+    }
+    else
+    {
+      // The new sentences stay out of the index
+      for (int i = 0; i < nsent; i++)
+        free(added[i].grams);
+      nsent = 0;
+    }
+  }
+  memmove(&doc->sentences[idx + nsent], &doc->sentences[idx + removed], tail * sizeof(TriSentence));
+  doc->sentence_count = idx + nsent + tail;
+
+  // Trigrams the document did not have yet are gathered and merged in once
+  uint32_t *fresh = NULL;
+  int fresh_count = 0, fresh_cap = 0;
+  for (int i = 0; i < nsent; i++)
+  {
+    TriSentence *sent = &doc->sentences[idx + i];
+    *sent = added[i];
+    for (int g = 0; g < sent->gram_count; g++)
+    {
+      int at = find_doc_gram(doc, sent->grams[g]);
+      if (at >= 0)
+      {
+        if (doc->holders[at]++ == 0)
+          link_doc(sent->grams[g], doc);
+        continue;
+      }
+      if (fresh_count >= fresh_cap)
+      {
+        int new_cap = fresh_cap ? fresh_cap * 2 : 256;
+        uint32_t *grown = realloc(fresh, new_cap * sizeof(uint32_t));
+        if (!grown)
+          continue;
+        fresh = grown;
+        fresh_cap = new_cap;
+      }
+      fresh[fresh_count++] = sent->grams[g];
+    }
+  }
+  if (fresh_count > 1)
+    qsort(fresh, fresh_count, sizeof(uint32_t), compare_grams);
+
+  // Merge: drop trigrams no sentence holds any more, add the new ones with
+  // the number of sentences that brought them
+  int total = doc->gram_count + fresh_count;
+  uint32_t *grams = malloc((total ? total : 1) * sizeof(uint32_t));
+  int *holders = malloc((total ? total : 1) * sizeof(int));
+  if (!grams || !holders)
+  {
+    free(grams);
+    free(holders);
+    free(fresh);
+    free(added);
+    return;
+  }
+  int n = 0, i = 0, f = 0;
+  while (i < doc->gram_count || f < fresh_count)
+  {
+    if (f >= fresh_count || (i < doc->gram_count && doc->grams[i] < fresh[f]))
+    {
+      if (doc->holders[i] > 0)
+      {
+        grams[n] = doc->grams[i];
+        holders[n++] = doc->holders[i];
+      }
+      i++;
+      continue;
+    }
+    grams[n] = fresh[f];
+    holders[n] = 0;
+    while (f < fresh_count && fresh[f] == grams[n])
+    {
+      holders[n]++;
+      f++;
+    }
+    link_doc(grams[n++], doc);
+  }
+  free(fresh);
+  free(added);
+  free(doc->grams);
+  free(doc->holders);
+  doc->grams = grams;
+  doc->holders = holders;
+  doc->gram_count = n;
+}
+
+static TriDoc *get_doc(FileState *state)
+{
+  TriDoc *doc = find_doc(state);
+  if (doc)
+    return doc;
+  doc = calloc(1, sizeof(TriDoc));
+  if (!doc)
+    return NULL;
+  doc->state = state;
+  doc->next = g_docs;
+  g_docs = doc;
+  return doc;
+}
+
+static void free_sentences(TriSentence *added, int nsent)
+{
+  for (int i = 0; added && i < nsent; i++)
+    free(added[i].grams);
+  free(added);
+}
+
+void ss_trigram_index_file(FileState *state, char *const *sentences, int nsent)
+{
+  // Trigram extraction runs outside the index lock
+  TriSentence *added = collect_sentences(sentences, nsent);
+  if (!added)
+    return;
+
+  pthread_mutex_lock(&g_trigram_mutex);
+  TriDoc *doc = get_doc(state);
+  if (doc)
+  {
+    unindex_doc(doc);
+    splice_doc(doc, 0, 0, added, nsent);
+  }
+  else
+  {
+    free_sentences(added, nsent);
+  }
+  pthread_mutex_unlock(&g_trigram_mutex);
+}
+
+void ss_trigram_splice_file(FileState *state, int idx, int removed, char *const *sentences, int nsent)
+{
+  TriSentence *added = collect_sentences(sentences, nsent);
+  if (!added)
+    return;
+
+  pthread_mutex_lock(&g_trigram_mutex);
+  TriDoc *doc = find_doc(state);
+  if (doc && idx >= 0 && removed >= 0 && idx + removed <= doc->sentence_count)
+    splice_doc(doc, idx, removed, added, nsent);
+  else
+    free_sentences(added, nsent);
+  pthread_mutex_unlock(&g_trigram_mutex);
+}
+
+void ss_trigram_remove_file(FileState *state)
+{
+  pthread_mutex_lock(&g_trigram_mutex);
+
+  TriDoc **link = &g_docs;
+  while (*link && (*link)->state != state)
+    link = &(*link)->next;
+  if (*link)
+  {
+    TriDoc *doc = *link;
+    unindex_doc(doc);
+    *link = doc->next;
+    free(doc->sentences);
+    free(doc);
+  }
+
+  pthread_mutex_unlock(&g_trigram_mutex);
+}
+
+int ss_trigram_has_file(FileState *state)
+{
+  pthread_mutex_lock(&g_trigram_mutex);
+  int found = find_doc(state) != NULL;
+  pthread_mutex_unlock(&g_trigram_mutex);
+  return found;
+}
+
+void ss_trigram_set_ready(void)
+{
+  pthread_mutex_lock(&g_trigram_mutex);
+  g_ready = 1;
+  pthread_mutex_unlock(&g_trigram_mutex);
+}
+
+// ==================== QUERIES ====================
+
+static int add_run_grams(const char *run, int len, uint32_t *grams, int count, int max)
+{
+  for (int i = 0; i + 3 <= len && count < max; i++)
+    grams[count++] = pack((const unsigned char *)run + i);
+  return count;
+}
+
+// Skip a bracket expression starting at '[', returning the position after ']'
+static const char *skip_bracket(const char *p)
+{
+  p++;
+  if (*p == '^')
+    p++;
+  if (*p == ']')
+    p++;
+  while (*p && *p != ']')
+  {
+    if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '='))
+    {
+      char close = p[1];
+      p += 2;
+      while (*p && !(*p == close && p[1] == ']'))
+        p++;
+      if (*p)
+        p += 2;
+      continue;
+    }
+    p++;
+  }
+  return *p ? p + 1 : p;
+}
+
+// Skip a parenthesised group starting at '(', returning the position after
+// the matching ')'
+static const char *skip_group(const char *p)
+{
+  int depth = 0;
+  while (*p)
+  {
+    if (*p == '\\' && p[1])
+    {
+      p += 2;
+      continue;
+    }
+    if (*p == '[')
+    {
+      p = skip_bracket(p);
+      continue;
+    }
+    if (*p == '(')
+      depth++;
+    else if (*p == ')' && --depth == 0)
+      return p + 1;
+    p++;
+  }
+  return p;
+}
+
+// Trigrams of the literal runs that every match of pattern must contain.
+// Groups, bracket expressions and optional characters end a run; top-level
+// alternation means nothing is required. Returns -1 in that case.
+static int required_grams(const char *pattern, int fixed, uint32_t *grams, int max)
+{
+  if (fixed)
+    return add_run_grams(pattern, (int)strlen(pattern), grams, 0, max);
+
+  char run[512];
+  int len = 0, count = 0;
+  const char *p = pattern;
+  while (*p)
+  {
+    char c = *p;
+    if (c == '|')
+      return -1;
+
+    if (c == '\\' && p[1])
+    {
+      if (isalnum((unsigned char)p[1]))
+      {
+        // Class or anchor escape such as \w or \b
+        count = add_run_grams(run, len, grams, count, max);
+        len = 0;
+      }
+      else if (len < (int)sizeof run)
+      {
+        run[len++] = p[1];
+      }
+      p += 2;
+      continue;
+    }
+
+    switch (c)
+    {
+    case '*':
+    case '?':
+    case '{':
+      // The preceding character may be absent
+      if (len > 0)
+        len--;
+      count = add_run_grams(run, len, grams, count, max);
+      len = 0;
+      if (c == '{')
+      {
+        while (*p && *p != '}')
+          p++;
+      }
+      if (*p)
+        p++;
+      break;
+    case '+':
+    case '.':
+    case '^':
+    case '$':
+      count = add_run_grams(run, len, grams, count, max);
+      len = 0;
+      p++;
+      break;
+    case '[':
+      count = add_run_grams(run, len, grams, count, max);
+      len = 0;
+      p = skip_bracket(p);
+      break;
+    case '(':
+      count = add_run_grams(run, len, grams, count, max);
+      len = 0;
+      p = skip_group(p);
+      break;
+    default:
+      if (len < (int)sizeof run)
+        run[len++] = c;
+      p++;
+      break;
+    }
+  }
+  return add_run_grams(run, len, grams, count, max);
+}
+
+int ss_trigram_candidates(const char *pattern, int fixed, FileState **out, int max)
+{
+  uint32_t grams[MAX_QUERY_GRAMS];
+  int n = required_grams(pattern, fixed, grams, MAX_QUERY_GRAMS);
+  if (n <= 0)
+    return -1;
+  n = unique_grams(grams, n);
+
+  pthread_mutex_lock(&g_trigram_mutex);
+  if (!g_ready)
+  {
+    pthread_mutex_unlock(&g_trigram_mutex);
+    return -1;
+  }
+
+  // Start from the rarest trigram so the first pass touches the fewest docs
+  GramEntry *entries[MAX_QUERY_GRAMS];
+  int rarest = 0;
+  for (int i = 0; i < n; i++)
+  {
+    entries[i] = find_gram(grams[i], 0);
+    if (!entries[i])
+    {
+      // A required trigram nobody has: no file can match
+      pthread_mutex_unlock(&g_trigram_mutex);
+      return 0;
+    }
+    if (entries[i]->count < entries[rarest]->count)
+      rarest = i;
+  }
+  GramEntry *tmp = entries[0];
+  entries[0] = entries[rarest];
+  entries[rarest] = tmp;
+
+  int qid = ++g_query_id;
+  for (int j = 0; j < entries[0]->count; j++)
+  {
+    entries[0]->docs[j]->query_id = qid;
+    entries[0]->docs[j]->matched = 1;
+  }
+  for (int i = 1; i < n; i++)
+  {
+    for (int j = 0; j < entries[i]->count; j++)
+    {
+      TriDoc *doc = entries[i]->docs[j];
+      if (doc->query_id == qid && doc->matched == i)
+        doc->matched++;
+    }
+  }
+
+  int found = 0;
+  for (int j = 0; j < entries[0]->count && found < max; j++)
+  {
+    TriDoc *doc = entries[0]->docs[j];
+    if (doc->matched == n)
+      out[found++] = doc->state;
+  }
+
+  pthread_mutex_unlock(&g_trigram_mutex);
+  return found;
+}
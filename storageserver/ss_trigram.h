@@ -0,0 +1,31 @@
+#ifndef SS_TRIGRAM_H
+#define SS_TRIGRAM_H
+#include "ss_files.h"
+
+// Trigram index over cached documents: every distinct 3-byte sequence of a
+// sentence (lowercased) maps to the files containing it. GREP uses it to
+// narrow the set of files before running the real matcher.
+
+// Index state's document as the nsent sentence texts (words joined by
+// single spaces, then the delimiter); state is only used as the key
+void ss_trigram_index_file(FileState *state, char *const *sentences, int nsent);
+
+// Replace the trigrams of sentences [idx, idx + removed) of state's indexed
+// document with those of the nsent sentence texts
+void ss_trigram_splice_file(FileState *state, int idx, int removed, char *const *sentences, int nsent);
+
+void ss_trigram_remove_file(FileState *state);
+int ss_trigram_has_file(FileState *state);
+
+// Called once the background build has covered every cached file; until
+// then candidate lookups report that all files must be scanned
+void ss_trigram_set_ready(void);
+
+// Collect into out the files that contain every trigram a match of pattern
+// must contain (pattern is a POSIX extended regex, or a literal string when
+// fixed is set). Returns the number of candidates, or -1 when the pattern
+// yields no usable trigram (or the index is not ready) and every file has to
+// be scanned.
+int ss_trigram_candidates(const char *pattern, int fixed, FileState **out, int max);
+
+#endif
@@ -0,0 +1,167 @@
+#!/bin/bash
+# Kill test for storage server failure detection. Starts a Name Server and
+# two storage servers on this host (ss-2 replicates ss-1), then:
+#   1. keeps both busy with parallel READs and checks nothing is failed
+#   2. SIGSTOPs ss-1 and checks the NM fails it within the bound and every
+#      file is still readable, ss-1's from its replica; then resumes it and
+#      checks it comes back
+#   3. SIGKILLs ss-1 and checks the same
+#
+# Usage: tests/failover.sh [bound_ms]   (run `make` first; `make test-failover`
+# does both). Ports come from NM_PORT and SS_BASE_PORT (5050 and 6100).
+
+set -u
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BOUND_MS=${1:-1000}
+LOAD_SECONDS=${LOAD_SECONDS:-5}
+FILES=${FILES:-8}
+NM_PORT=${NM_PORT:-5050}
+SS_BASE_PORT=${SS_BASE_PORT:-6100}
+export NM_TOKEN_KEY=${NM_TOKEN_KEY:-test-$$}
+
+WORK=$(mktemp -d)
+NM_OUT=$WORK/nm.out
+FAILED=0
+declare -A PID
+
+cleanup()
+{
+  for p in "${PID[@]}"; do
+    kill -CONT "$p" 2>/dev/null
+    kill -KILL "$p" 2>/dev/null
+  done
+  wait 2>/dev/null
+  if [ "$FAILED" -eq 0 ]; then rm -rf "$WORK"; else echo "logs kept in $WORK"; fi
+}
+trap cleanup EXIT
+
+pass() { echo "PASS: $*"; }
+fail() { echo "FAIL: $*"; FAILED=1; }
+now_ms() { echo $(($(date +%s%N) / 1000000)); }
+
+# Wait up to $3 ms for pattern $1 to appear in file $2
+wait_for()
+{
+  local deadline=$(($(now_ms) + $3))
+  while [ "$(now_ms)" -lt "$deadline" ]; do
+    grep -q -E "$1" "$2" 2>/dev/null && return 0
+    sleep 0.01
+  done
+  return 1
+}
+
+start_nm()
+{
+  mkdir -p "$WORK/nm/nameserver"
+  (cd "$WORK/nm" && NM_PORT=$NM_PORT exec "$ROOT/nm" > "$NM_OUT" 2>&1) &
+  PID[nm]=$!
+}
+
+# start_ss <id> <n>: client port SS_BASE_PORT+2n-1, NM port SS_BASE_PORT+2n-2
+start_ss()
+{
+  mkdir -p "$WORK/$1"
+  (cd "$WORK/$1" && SS_ID=$1 SS_CLIENT_PORT=$((SS_BASE_PORT + 2 * $2 - 1)) SS_NM_PORT=$((SS_BASE_PORT + 2 * $2 - 2)) \
+     NM_PEERS="1=127.0.0.1:$NM_PORT" exec "$ROOT/ss" > "$WORK/$1.out" 2>&1) &
+  PID[$1]=$!
+}
+
+# cli <user> <commands...>: one session, one command per argument
+cli()
+{
+  local user=$1
+  shift
+  { echo "$user"; printf '%s\n' "$@"; echo EXIT; } |
+    (cd "$WORK" && NM_PEERS="1=127.0.0.1:$NM_PORT" timeout 20 "$ROOT/cli" 2>&1)
+}
+
+# Read every file once; prints how many came back with their content
+read_all()
+{
+  local cmds=()
+  for i in $(seq "$FILES"); do cmds+=("READ f$i.txt"); done
+  cli alice "${cmds[@]}" | grep -c -E "^(docs\+\+> )?content of file [0-9]+\.$"
+}
+
+# Stop or kill ss with signal $2 and check the NM fails it within BOUND_MS
+# and every file stays readable
+expect_failover()
+{
+  local ss=$1 sig=$2
+  local before
+  before=$(grep -c "SS_FAILURE" "$NM_OUT")
+  local t0
+  t0=$(now_ms)
+  kill "-$sig" "${PID[$ss]}"
+  [ "$sig" = KILL ] && wait "${PID[$ss]}" 2>/dev/null
+  if ! wait_for "SS_FAILURE .*User:$ss " "$NM_OUT" $((BOUND_MS * 5)); then
+    fail "$ss not failed within $((BOUND_MS * 5)) ms of SIG$sig"
+    return
+  fi
+  local elapsed=$(($(now_ms) - t0))
+  [ "$(grep -c "SS_FAILURE" "$NM_OUT")" -eq $((before + 1)) ] || fail "SIG$sig to $ss failed more than $ss"
+  if [ "$elapsed" -le "$BOUND_MS" ]; then
+    pass "SIG$sig to $ss detected in $elapsed ms (bound $BOUND_MS ms)"
+  else
+    fail "SIG$sig to $ss detected in $elapsed ms (bound $BOUND_MS ms)"
+  fi
+
+  local ok
+  ok=$(read_all)
+  if [ "$ok" -eq "$FILES" ]; then
+    pass "all $FILES files readable with $ss down"
+  else
+    fail "$ok of $FILES files readable with $ss down"
+  fi
+}
+
+[ -x "$ROOT/nm" ] && [ -x "$ROOT/ss" ] && [ -x "$ROOT/cli" ] || { echo "build nm, ss and cli first (make)"; exit 1; }
+
+start_nm
+wait_for "Listening on" "$NM_OUT" 3000
+start_ss ss-1 1
+start_ss ss-2 2
+wait_for "SS_REGISTER .*User:ss-1 " "$NM_OUT" 5000 && wait_for "SS_REGISTER .*User:ss-2 " "$NM_OUT" 5000 ||
+  { fail "storage servers did not register"; exit 1; }
+
+for i in $(seq "$FILES"); do
+  cli alice "CREATE f$i.txt" "WRITE f$i.txt 0" "0 content of file $i." "ETIRW" > /dev/null
+done
+
+# ss-2 holds every file once ss-1's replication stream drains
+deadline=$(($(now_ms) + 10000))
+while [ "$(now_ms)" -lt "$deadline" ]; do
+  n=$(ls "$WORK/ss-2/storageserver/data/files" 2>/dev/null | wc -l)
+  [ "$n" -ge "$FILES" ] && break
+  sleep 0.1
+done
+[ "$n" -ge "$FILES" ] || fail "ss-1's files not replicated to ss-2 ($n of $FILES there)"
+
+# 1. No false positives while both servers are busy
+load_end=$(($(now_ms) + LOAD_SECONDS * 1000))
+load=()
+for w in 1 2 3 4; do
+  (while [ "$(now_ms)" -lt "$load_end" ]; do read_all > /dev/null; done) &
+  load+=($!)
+done
+wait "${load[@]}"
+if grep -q "SS_FAILURE" "$NM_OUT"; then
+  fail "false failure under ${LOAD_SECONDS} s of READ load: $(grep SS_FAILURE "$NM_OUT" | head -1)"
+else
+  pass "no failures under ${LOAD_SECONDS} s of READ load"
+fi
+
+# 2. A hung server: heartbeats stop but the connection stays open
+expect_failover ss-1 STOP
+kill -CONT "${PID[ss-1]}"
+if wait_for "(SS_BACK_ONLINE|SS_RECOVERY) .*User:ss-1 " "$NM_OUT" 5000; then
+  pass "ss-1 recovered after SIGCONT"
+else
+  fail "ss-1 did not recover after SIGCONT"
+fi
+
+# 3. A crashed server: the control connection closes
+expect_failover ss-1 KILL
+
+[ "$FAILED" -eq 0 ] && echo "failover test passed" || echo "failover test FAILED"
+exit "$FAILED"
@@ -0,0 +1,210 @@
+#!/bin/bash
+# Name Server cluster test. Starts three NMs and a storage server on this
+# host, then checks that:
+#   1. writes through the leader reach every NM
+#   2. SIGKILLing the leader elects another within the bound, with every
+#      acknowledged write kept, and the old leader catches up on restart
+#   3. a leader cut off from both followers (SIGSTOP) acknowledges no write
+#   4. after SIGKILLing the whole cluster and starting it again, the new
+#      leader still has every acknowledged write
+#
+# Usage: tests/raft.sh [bound_ms]   (run `make` first; `make test-raft`
+# does both). NMs listen on NM_BASE_PORT..+2 (5050) and their Raft ports
+# 100 above; the SS on SS_BASE_PORT (6100).
+
+set -u
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BOUND_MS=${1:-3000}
+FILES=${FILES:-5}
+NM_BASE_PORT=${NM_BASE_PORT:-5050}
+SS_BASE_PORT=${SS_BASE_PORT:-6100}
+export NM_TOKEN_KEY=${NM_TOKEN_KEY:-test-$$}
+
+WORK=$(mktemp -d)
+FAILED=0
+CREATED=0 # files the cluster acknowledged
+declare -A PID
+PEERS="1=127.0.0.1:$NM_BASE_PORT,2=127.0.0.1:$((NM_BASE_PORT + 1)),3=127.0.0.1:$((NM_BASE_PORT + 2))"
+
+cleanup()
+{
+  for p in "${PID[@]}"; do
+    kill -CONT "$p" 2>/dev/null
+    kill -KILL "$p" 2>/dev/null
+  done
+  wait 2>/dev/null
+  if [ "$FAILED" -eq 0 ]; then rm -rf "$WORK"; else echo "logs kept in $WORK"; fi
+}
+trap cleanup EXIT
+
+pass() { echo "PASS: $*"; }
+fail() { echo "FAIL: $*"; FAILED=1; }
+now_ms() { echo $(($(date +%s%N) / 1000000)); }
+nm_port() { echo $((NM_BASE_PORT + $1 - 1)); }
+alive() { [ -n "${PID[nm$1]:-}" ] && kill -0 "${PID[nm$1]}" 2>/dev/null; }
+
+start_nm()
+{
+  mkdir -p "$WORK/nm$1/nameserver"
+  (cd "$WORK/nm$1" && NM_ID=$1 NM_PEERS=$PEERS exec "$ROOT/nm" >> "$WORK/nm$1.out" 2>&1) &
+  PID[nm$1]=$!
+}
+
+start_ss()
+{
+  mkdir -p "$WORK/ss-1"
+  (cd "$WORK/ss-1" && SS_ID=ss-1 SS_CLIENT_PORT=$((SS_BASE_PORT + 1)) SS_NM_PORT=$SS_BASE_PORT \
+     NM_PEERS=$PEERS exec "$ROOT/ss" > "$WORK/ss-1.out" 2>&1) &
+  PID[ss-1]=$!
+}
+
+# Wait up to $3 ms for pattern $1 to appear in file $2
+wait_for()
+{
+  local deadline=$(($(now_ms) + $3))
+  while [ "$(now_ms)" -lt "$deadline" ]; do
+    grep -q -E "$1" "$2" 2>/dev/null && return 0
+    sleep 0.01
+  done
+  return 1
+}
+
+# One request line to NM $1, printing its reply
+nm_send()
+{
+  local port
+  port=$(nm_port "$1")
+  timeout 10 bash -c "exec 3<>/dev/tcp/127.0.0.1/$port && echo '$2' >&3 && head -1 <&3" 2>/dev/null
+}
+
+# Id of the NM whose latest role line says it leads, with the highest term
+leader()
+{
+  local best=0 best_term=-1
+  for i in 1 2 3; do
+    alive "$i" || continue
+    local last
+    last=$(grep -E "RAFT_(LEADER|FOLLOWER|START)" "$WORK/nm$i.out" | tail -1)
+    case "$last" in
+      *"Leader for term "*)
+        local term=${last##*Leader for term }
+        term=${term%% *}
+        [ "$term" -gt "$best_term" ] && best=$i best_term=$term ;;
+    esac
+  done
+  echo "$best"
+}
+
+# Wait up to $1 ms for a leader; prints its id, or 0
+wait_leader()
+{
+  local deadline=$(($(now_ms) + $1)) id=0
+  while [ "$(now_ms)" -lt "$deadline" ]; do
+    id=$(leader)
+    [ "$id" -gt 0 ] && nm_send "$id" '{"op":"SERVERS","user":"raft-test"}' | grep -q '"status":0' && break
+    id=0
+    sleep 0.05
+  done
+  echo "$id"
+}
+
+# Create files f<from>..f<to> through the cluster; counts the acknowledged
+create_files()
+{
+  for i in $(seq "$1" "$2"); do
+    local cmds=(raft-test "CREATE f$i.txt" EXIT)
+    if printf '%s\n' "${cmds[@]}" | (cd "$WORK" && NM_PEERS=$PEERS timeout 30 "$ROOT/cli" 2>&1) |
+       grep -q '"msg":"file created"'; then
+      CREATED=$i
+    fi
+  done
+}
+
+# How many of f1..f$CREATED NM $1 routes, waiting up to 5 s for it to catch up
+routed()
+{
+  local deadline=$(($(now_ms) + 5000)) n=0
+  while :; do
+    n=0
+    for i in $(seq "$CREATED"); do
+      nm_send "$1" "{\"op\":\"READ_ROUTE\",\"file\":\"f$i.txt\",\"user\":\"raft-test\"}" | grep -q '"status":0' && n=$((n + 1))
+    done
+    [ "$n" -eq "$CREATED" ] || [ "$(now_ms)" -ge "$deadline" ] && break
+    sleep 0.2
+  done
+  echo "$n"
+}
+
+check_routes()
+{
+  for i in 1 2 3; do
+    alive "$i" || continue
+    local n
+    n=$(routed "$i")
+    if [ "$n" -eq "$CREATED" ]; then
+      pass "nm$i routes all $CREATED files $1"
+    else
+      fail "nm$i routes $n of $CREATED files $1"
+    fi
+  done
+}
+
+[ -x "$ROOT/nm" ] && [ -x "$ROOT/ss" ] && [ -x "$ROOT/cli" ] || { echo "build nm, ss and cli first (make)"; exit 1; }
+
+for i in 1 2 3; do start_nm "$i"; done
+LEADER=$(wait_leader 10000)
+[ "$LEADER" -gt 0 ] || { fail "no leader elected"; exit 1; }
+start_ss
+wait_for "SS_REGISTER .*User:ss-1 " "$WORK/nm$LEADER.out" 5000 || { fail "storage server did not register"; exit 1; }
+
+# 1. Writes reach every NM
+create_files 1 "$FILES"
+[ "$CREATED" -eq "$FILES" ] || fail "only $CREATED of $FILES creates acknowledged"
+check_routes "after writes through nm$LEADER"
+
+# 2. Leader crash
+old=$LEADER
+t0=$(now_ms)
+kill -KILL "${PID[nm$old]}"
+wait "${PID[nm$old]}" 2>/dev/null
+LEADER=$(wait_leader $((BOUND_MS * 5)))
+elapsed=$(($(now_ms) - t0))
+if [ "$LEADER" -eq 0 ]; then
+  fail "no leader within $((BOUND_MS * 5)) ms of SIGKILL to nm$old"
+elif [ "$elapsed" -le "$BOUND_MS" ]; then
+  pass "nm$LEADER elected $elapsed ms after SIGKILL to leader nm$old (bound $BOUND_MS ms)"
+else
+  fail "nm$LEADER elected $elapsed ms after SIGKILL to leader nm$old (bound $BOUND_MS ms)"
+fi
+check_routes "with nm$old down"
+create_files $((FILES + 1)) $((FILES * 2))
+[ "$CREATED" -eq $((FILES * 2)) ] || fail "creates after the election: $CREATED of $((FILES * 2)) acknowledged"
+start_nm "$old"
+check_routes "after nm$old restarted"
+
+# 3. A leader without a majority acknowledges nothing
+LEADER=$(wait_leader 10000)
+followers=()
+for i in 1 2 3; do [ "$i" -ne "$LEADER" ] && followers+=("${PID[nm$i]}"); done
+kill -STOP "${followers[@]}"
+reply=$(nm_send "$LEADER" '{"op":"CREATE","file":"minority.txt","user":"raft-test"}')
+kill -CONT "${followers[@]}"
+case "$reply" in
+  *'"status":0'*) fail "nm$LEADER acknowledged a CREATE with both followers stopped: $reply" ;;
+  *) pass "nm$LEADER refused a CREATE with both followers stopped: ${reply:-no reply}" ;;
+esac
+
+# 4. Whole cluster restart
+LEADER=$(wait_leader 10000)
+for i in 1 2 3; do kill -KILL "${PID[nm$i]}"; wait "${PID[nm$i]}" 2>/dev/null; done
+for i in 1 2 3; do start_nm "$i"; done
+LEADER=$(wait_leader 10000)
+if [ "$LEADER" -gt 0 ]; then
+  pass "nm$LEADER elected after a whole cluster restart"
+  check_routes "after a whole cluster restart"
+else
+  fail "no leader after a whole cluster restart"
+fi
+
+[ "$FAILED" -eq 0 ] && echo "raft test passed" || echo "raft test FAILED"
+exit "$FAILED"